@@ -0,0 +1,504 @@
+/**
+ * Copyright (C) 2013 Netronome Systems, Inc.  All rights reserved.
+ *
+ * File:        nfm_sample_capfilt.h
+ * Description: Capture filter for the recording samples. A tcpdump-like
+ *              expression is compiled once into a short program of field
+ *              tests, each with a jump for true and one for false (as in
+ *              BPF), laid out so every jump goes forward. Running it walks
+ *              the packet headers once (nfm_sample_pktparse.h) and then
+ *              executes one test per step until it reaches accept or
+ *              reject; 'and', 'or' and 'not' cost nothing at run time.
+ *
+ *              Expression:  expr := term { or term }
+ *                           term := factor { and factor }
+ *                           factor := not factor | ( expr ) | primitive
+ *              'and', 'or' and 'not' may be written &&, || and !.
+ *              Primitives:  [src|dst] host A       IPv4 or IPv6 address
+ *                           [src|dst] net A/len
+ *                           [src|dst] port N
+ *                           [src|dst] portrange N-M
+ *                           ip, ip6, arp, tcp, udp, sctp, icmp, icmp6
+ *                           proto N                IP protocol
+ *                           ether proto N          ethertype after VLAN tags
+ *                           vlan [N]               (outer) VLAN tag
+ *                           less N, greater N      packet length <= N, >= N
+ */
+
+#ifndef NFM_SAMPLE_CAPFILT_H
+#define NFM_SAMPLE_CAPFILT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "nfm_sample_pktparse.h"
+
+#define NFM_CAPFILT_MAX_INSNS    256
+#define NFM_CAPFILT_MAX_NODES    512
+#define NFM_CAPFILT_MAX_TOKENS   512
+#define NFM_CAPFILT_ACCEPT       0xfffe  // jump targets while compiling
+#define NFM_CAPFILT_REJECT       0xffff
+
+enum {
+  NFM_CAPFILT_ETHERTYPE,       // ethertype == k
+  NFM_CAPFILT_IPVER,           // ip_version == k
+  NFM_CAPFILT_PROTO,           // IP with protocol k
+  NFM_CAPFILT_VLAN,            // tagged
+  NFM_CAPFILT_VLAN_ID,         // outer tag == k
+  NFM_CAPFILT_SRC4,            // IPv4 source & k2 == k
+  NFM_CAPFILT_DST4,
+  NFM_CAPFILT_SRC6,            // IPv6 source & m == a
+  NFM_CAPFILT_DST6,
+  NFM_CAPFILT_SPORT,           // k <= source port <= k2
+  NFM_CAPFILT_DPORT,
+  NFM_CAPFILT_LEN_LE,          // length <= k
+  NFM_CAPFILT_LEN_GE           // length >= k
+};
+
+typedef struct {
+  uint8_t op;
+  uint16_t jt;                 // next instruction if the test holds
+  uint16_t jf;                 // and if it does not
+  uint32_t k;
+  uint32_t k2;
+  unsigned char a[16];
+  unsigned char m[16];
+} nfm_capfilt_insn_t;
+
+// Parse tree node: a test, or 'and'/'or'/'not' of other nodes
+typedef struct {
+  int type;                    // 0 test, '&', '|', '!'
+  int left;
+  int right;
+  nfm_capfilt_insn_t test;
+} nfm_capfilt_node_t;
+
+typedef struct {
+  nfm_capfilt_insn_t prog[NFM_CAPFILT_MAX_INSNS];
+  unsigned int len;
+  uint64_t seen;
+  uint64_t rejected;
+  char error[128];
+} nfm_capfilt_t;
+
+// Compiler state
+typedef struct {
+  nfm_capfilt_t* f;
+  char* toks[NFM_CAPFILT_MAX_TOKENS];
+  unsigned int num_toks;
+  unsigned int pos;
+  nfm_capfilt_node_t nodes[NFM_CAPFILT_MAX_NODES];
+  unsigned int num_nodes;
+  nfm_capfilt_insn_t code[NFM_CAPFILT_MAX_INSNS];
+  unsigned int code_pos;       // code is built backwards from the end
+} nfm_capfilt_cc_t;
+
+static inline int nfm_capfilt_fail(nfm_capfilt_cc_t* cc, const char* what, const char* tok)
+{
+  if (cc->f->error[0] == 0)
+    snprintf(cc->f->error, sizeof(cc->f->error), "%s%s%s", what, tok ? ": " : "", tok ? tok : "");
+  return -1;
+}
+
+static inline const char* nfm_capfilt_peek(const nfm_capfilt_cc_t* cc)
+{
+  return (cc->pos < cc->num_toks) ? cc->toks[cc->pos] : NULL;
+}
+
+static inline int nfm_capfilt_accept(nfm_capfilt_cc_t* cc, const char* a, const char* b)
+{
+  const char* t = nfm_capfilt_peek(cc);
+  if (t && (strcmp(t, a) == 0 || (b && strcmp(t, b) == 0))) {
+    cc->pos++;
+    return 1;
+  }
+  return 0;
+}
+
+// A new node over 'left' and 'right' (the same node if there is only
+// one); fails if either of them did
+static inline int nfm_capfilt_node(nfm_capfilt_cc_t* cc, int type, int left, int right)
+{
+  nfm_capfilt_node_t* n;
+  if (left < 0 || right < 0)
+    return -1;
+  if (cc->num_nodes >= NFM_CAPFILT_MAX_NODES)
+    return nfm_capfilt_fail(cc, "Filter is too long", NULL);
+  n = &cc->nodes[cc->num_nodes];
+  memset(n, 0, sizeof(*n));
+  n->type = type;
+  n->left = left;
+  n->right = right;
+  return (int)cc->num_nodes++;
+}
+
+static inline int nfm_capfilt_test(nfm_capfilt_cc_t* cc, uint8_t op, uint32_t k, uint32_t k2)
+{
+  int n = nfm_capfilt_node(cc, 0, 0, 0);
+  if (n >= 0) {
+    cc->nodes[n].test.op = op;
+    cc->nodes[n].test.k = k;
+    cc->nodes[n].test.k2 = k2;
+  }
+  return n;
+}
+
+// A test on the source, the destination, or either
+static inline int nfm_capfilt_dir(nfm_capfilt_cc_t* cc, int dir, uint8_t src_op, uint8_t dst_op, const nfm_capfilt_insn_t* t)
+{
+  int s = -1, d = -1;
+  if (dir != 'd') {
+    s = nfm_capfilt_test(cc, src_op, t->k, t->k2);
+    if (s >= 0) {
+      memcpy(cc->nodes[s].test.a, t->a, 16);
+      memcpy(cc->nodes[s].test.m, t->m, 16);
+    }
+    if (dir == 's')
+      return s;
+  }
+  d = nfm_capfilt_test(cc, dst_op, t->k, t->k2);
+  if (d >= 0) {
+    memcpy(cc->nodes[d].test.a, t->a, 16);
+    memcpy(cc->nodes[d].test.m, t->m, 16);
+  }
+  return (dir == 'd') ? d : nfm_capfilt_node(cc, '|', s, d);
+}
+
+static inline int nfm_capfilt_number(nfm_capfilt_cc_t* cc, uint32_t max, uint32_t* v)
+{
+  const char* t = nfm_capfilt_peek(cc);
+  char* end;
+  unsigned long n;
+  if (!t)
+    return nfm_capfilt_fail(cc, "Number missing at end of filter", NULL);
+  n = strtoul(t, &end, 0);
+  if (end == t || *end || n > max)
+    return nfm_capfilt_fail(cc, "Bad number", t);
+  cc->pos++;
+  *v = (uint32_t)n;
+  return 0;
+}
+
+// "A" or "A/len" into t->k, t->k2 (IPv4) or t->a, t->m (IPv6)
+static inline int nfm_capfilt_addr(nfm_capfilt_cc_t* cc, nfm_capfilt_insn_t* t, int net)
+{
+  const char* tok = nfm_capfilt_peek(cc);
+  char buf[64], *slash, *end;
+  unsigned long bits;
+  unsigned int i;
+  int v6;
+  if (!tok || strlen(tok) >= sizeof(buf))
+    return nfm_capfilt_fail(cc, "Bad address", tok);
+  strcpy(buf, tok);
+  slash = strchr(buf, '/');
+  if (slash)
+    *slash = 0;
+  if (slash && !net)
+    return nfm_capfilt_fail(cc, "Use 'net' for a prefix", tok);
+  v6 = strchr(buf, ':') != NULL;
+  if (inet_pton(v6 ? AF_INET6 : AF_INET, buf, t->a) != 1)
+    return nfm_capfilt_fail(cc, "Bad address", tok);
+  bits = v6 ? 128 : 32;
+  if (slash) {
+    bits = strtoul(slash+1, &end, 10);
+    if (end == slash+1 || *end || bits > (v6 ? 128UL : 32UL))
+      return nfm_capfilt_fail(cc, "Bad prefix length", tok);
+  }
+  memset(t->m, 0, 16);
+  for (i = 0; i < bits; i++)
+    t->m[i/8] |= (unsigned char)(0x80 >> (i%8));
+  for (i = 0; i < 16; i++)
+    t->a[i] &= t->m[i];
+  if (!v6) {
+    t->k2 = nfm_pkt_be32(t->m);
+    t->k = nfm_pkt_be32(t->a);
+  }
+  cc->pos++;
+  return v6;
+}
+
+static inline int nfm_capfilt_expr(nfm_capfilt_cc_t* cc);
+
+static inline int nfm_capfilt_primitive(nfm_capfilt_cc_t* cc)
+{
+  static const struct { const char* name; uint8_t op; uint32_t k; } simple[] = {
+    { "ip",    NFM_CAPFILT_IPVER,     4 },
+    { "ip6",   NFM_CAPFILT_IPVER,     6 },
+    { "arp",   NFM_CAPFILT_ETHERTYPE, 0x0806 },
+    { "tcp",   NFM_CAPFILT_PROTO,     6 },
+    { "udp",   NFM_CAPFILT_PROTO,     17 },
+    { "sctp",  NFM_CAPFILT_PROTO,     132 },
+    { "icmp",  NFM_CAPFILT_PROTO,     1 },
+    { "icmp6", NFM_CAPFILT_PROTO,     58 },
+  };
+  const char* tok = nfm_capfilt_peek(cc);
+  nfm_capfilt_insn_t t;
+  char* end;
+  unsigned int i;
+  int dir = 0, v6;
+
+  if (!tok)
+    return nfm_capfilt_fail(cc, "Filter ends too early", NULL);
+  memset(&t, 0, sizeof(t));
+  for (i = 0; i < sizeof(simple)/sizeof(simple[0]); i++) {
+    if (nfm_capfilt_accept(cc, simple[i].name, NULL))
+      return nfm_capfilt_test(cc, simple[i].op, simple[i].k, 0);
+  }
+  if (nfm_capfilt_accept(cc, "proto", NULL))
+    return (nfm_capfilt_number(cc, 255, &t.k) != 0) ? -1 : nfm_capfilt_test(cc, NFM_CAPFILT_PROTO, t.k, 0);
+  if (nfm_capfilt_accept(cc, "ether", NULL)) {
+    if (!nfm_capfilt_accept(cc, "proto", NULL))
+      return nfm_capfilt_fail(cc, "Expected 'proto' after 'ether'", nfm_capfilt_peek(cc));
+    return (nfm_capfilt_number(cc, 0xffff, &t.k) != 0) ? -1 : nfm_capfilt_test(cc, NFM_CAPFILT_ETHERTYPE, t.k, 0);
+  }
+  if (nfm_capfilt_accept(cc, "vlan", NULL)) {
+    tok = nfm_capfilt_peek(cc);
+    if (tok && *tok >= '0' && *tok <= '9')
+      return (nfm_capfilt_number(cc, 4095, &t.k) != 0) ? -1 : nfm_capfilt_test(cc, NFM_CAPFILT_VLAN_ID, t.k, 0);
+    return nfm_capfilt_test(cc, NFM_CAPFILT_VLAN, 0, 0);
+  }
+  if (nfm_capfilt_accept(cc, "less", NULL))
+    return (nfm_capfilt_number(cc, 0xffffffff, &t.k) != 0) ? -1 : nfm_capfilt_test(cc, NFM_CAPFILT_LEN_LE, t.k, 0);
+  if (nfm_capfilt_accept(cc, "greater", NULL))
+    return (nfm_capfilt_number(cc, 0xffffffff, &t.k) != 0) ? -1 : nfm_capfilt_test(cc, NFM_CAPFILT_LEN_GE, t.k, 0);
+
+  if (nfm_capfilt_accept(cc, "src", NULL))
+    dir = 's';
+  else if (nfm_capfilt_accept(cc, "dst", NULL))
+    dir = 'd';
+  if (nfm_capfilt_accept(cc, "host", NULL) || nfm_capfilt_accept(cc, "net", NULL)) {
+    v6 = nfm_capfilt_addr(cc, &t, strcmp(cc->toks[cc->pos-1], "net") == 0);
+    if (v6 < 0)
+      return -1;
+    return v6 ? nfm_capfilt_dir(cc, dir, NFM_CAPFILT_SRC6, NFM_CAPFILT_DST6, &t)
+              : nfm_capfilt_dir(cc, dir, NFM_CAPFILT_SRC4, NFM_CAPFILT_DST4, &t);
+  }
+  if (nfm_capfilt_accept(cc, "port", NULL)) {
+    if (nfm_capfilt_number(cc, 65535, &t.k) != 0)
+      return -1;
+    t.k2 = t.k;
+    return nfm_capfilt_dir(cc, dir, NFM_CAPFILT_SPORT, NFM_CAPFILT_DPORT, &t);
+  }
+  if (nfm_capfilt_accept(cc, "portrange", NULL)) {
+    tok = nfm_capfilt_peek(cc);
+    if (!tok)
+      return nfm_capfilt_fail(cc, "Port range missing at end of filter", NULL);
+    t.k = (uint32_t)strtoul(tok, &end, 10);
+    if (end == tok || *end != '-')
+      return nfm_capfilt_fail(cc, "Bad port range", tok);
+    t.k2 = (uint32_t)strtoul(end+1, &end, 10);
+    if (*end || t.k > t.k2 || t.k2 > 65535)
+      return nfm_capfilt_fail(cc, "Bad port range", tok);
+    cc->pos++;
+    return nfm_capfilt_dir(cc, dir, NFM_CAPFILT_SPORT, NFM_CAPFILT_DPORT, &t);
+  }
+  return nfm_capfilt_fail(cc, "Unknown filter term", nfm_capfilt_peek(cc));
+}
+
+static inline int nfm_capfilt_factor(nfm_capfilt_cc_t* cc)
+{
+  int n;
+  if (nfm_capfilt_accept(cc, "not", "!")) {
+    n = nfm_capfilt_factor(cc);
+    return nfm_capfilt_node(cc, '!', n, n);
+  }
+  if (nfm_capfilt_accept(cc, "(", NULL)) {
+    n = nfm_capfilt_expr(cc);
+    if (n >= 0 && !nfm_capfilt_accept(cc, ")", NULL))
+      return nfm_capfilt_fail(cc, "Expected ')'", nfm_capfilt_peek(cc));
+    return n;
+  }
+  return nfm_capfilt_primitive(cc);
+}
+
+static inline int nfm_capfilt_term(nfm_capfilt_cc_t* cc)
+{
+  int n = nfm_capfilt_factor(cc);
+  while (n >= 0 && nfm_capfilt_accept(cc, "and", "&&"))
+    n = nfm_capfilt_node(cc, '&', n, nfm_capfilt_factor(cc));
+  return n;
+}
+
+static inline int nfm_capfilt_expr(nfm_capfilt_cc_t* cc)
+{
+  int n = nfm_capfilt_term(cc);
+  while (n >= 0 && nfm_capfilt_accept(cc, "or", "||"))
+    n = nfm_capfilt_node(cc, '|', n, nfm_capfilt_term(cc));
+  return n;
+}
+
+// Emit node 'n' in front of the code built so far, jumping to 't' if it
+// holds and 'f' if not; returns its first instruction
+static inline int nfm_capfilt_gen(nfm_capfilt_cc_t* cc, int n, int t, int f)
+{
+  const nfm_capfilt_node_t* node = &cc->nodes[n];
+  int r;
+  switch (node->type) {
+  case '&':
+    r = nfm_capfilt_gen(cc, node->right, t, f);
+    return (r < 0) ? -1 : nfm_capfilt_gen(cc, node->left, r, f);
+  case '|':
+    r = nfm_capfilt_gen(cc, node->right, t, f);
+    return (r < 0) ? -1 : nfm_capfilt_gen(cc, node->left, t, r);
+  case '!':
+    return nfm_capfilt_gen(cc, node->left, f, t);
+  }
+  if (cc->code_pos == 0)
+    return nfm_capfilt_fail(cc, "Filter is too long", NULL);
+  cc->code_pos--;
+  cc->code[cc->code_pos] = node->test;
+  cc->code[cc->code_pos].jt = (uint16_t)t;
+  cc->code[cc->code_pos].jf = (uint16_t)f;
+  return (int)cc->code_pos;
+}
+
+static inline uint16_t nfm_capfilt_target(const nfm_capfilt_cc_t* cc, uint16_t t)
+{
+  if (t == NFM_CAPFILT_ACCEPT)
+    return (uint16_t)cc->f->len;
+  if (t == NFM_CAPFILT_REJECT)
+    return (uint16_t)(cc->f->len + 1);
+  return (uint16_t)(t - cc->code_pos);
+}
+
+// Compile 'expr'; on failure f->error says why
+static inline int nfm_capfilt_compile(nfm_capfilt_t* f, const char* expr)
+{
+  nfm_capfilt_cc_t* cc;
+  char* buf;
+  char* p;
+  unsigned int i;
+  int root, r = -1;
+
+  memset(f, 0, sizeof(*f));
+  cc = (nfm_capfilt_cc_t*)calloc(1, sizeof(*cc));
+  // Room to split "(", ")" and "!" off their neighbours
+  buf = (char*)malloc(strlen(expr)*3 + 1);
+  if (!cc || !buf) {
+    snprintf(f->error, sizeof(f->error), "Out of memory");
+    goto done;
+  }
+  cc->f = f;
+  for (p = buf; *expr; expr++) {
+    if (*expr == '(' || *expr == ')' || *expr == '!') {
+      *p++ = ' ';
+      *p++ = *expr;
+      *p++ = ' ';
+    } else {
+      *p++ = *expr;
+    }
+  }
+  *p = 0;
+  for (p = strtok(buf, " \t\n"); p; p = strtok(NULL, " \t\n")) {
+    if (cc->num_toks >= NFM_CAPFILT_MAX_TOKENS) {
+      nfm_capfilt_fail(cc, "Filter is too long", NULL);
+      goto done;
+    }
+    cc->toks[cc->num_toks++] = p;
+  }
+  if (cc->num_toks == 0) {
+    nfm_capfilt_fail(cc, "Empty filter", NULL);
+    goto done;
+  }
+  root = nfm_capfilt_expr(cc);
+  if (root >= 0 && cc->pos != cc->num_toks)
+    root = nfm_capfilt_fail(cc, "Unexpected", nfm_capfilt_peek(cc));
+  if (root < 0)
+    goto done;
+  cc->code_pos = NFM_CAPFILT_MAX_INSNS;
+  if (nfm_capfilt_gen(cc, root, NFM_CAPFILT_ACCEPT, NFM_CAPFILT_REJECT) < 0)
+    goto done;
+  f->len = NFM_CAPFILT_MAX_INSNS - cc->code_pos;
+  for (i = 0; i < f->len; i++) {
+    f->prog[i] = cc->code[cc->code_pos + i];
+    f->prog[i].jt = nfm_capfilt_target(cc, f->prog[i].jt);
+    f->prog[i].jf = nfm_capfilt_target(cc, f->prog[i].jf);
+  }
+  r = 0;
+
+done:
+  free(buf);
+  free(cc);
+  return r;
+}
+
+static inline int nfm_capfilt_v6_match(const unsigned char* p, const nfm_capfilt_insn_t* i)
+{
+  uint64_t a, b, m0, m1, a0, a1;
+  memcpy(&a, p, 8);
+  memcpy(&b, p+8, 8);
+  memcpy(&m0, i->m, 8);
+  memcpy(&m1, i->m+8, 8);
+  memcpy(&a0, i->a, 8);
+  memcpy(&a1, i->a+8, 8);
+  return ((a & m0) == a0) & ((b & m1) == a1);
+}
+
+// Receive thread: 1 if the packet passes the filter
+static inline int nfm_capfilt_match(nfm_capfilt_t* f, const unsigned char* d, uint32_t len)
+{
+  const nfm_capfilt_insn_t* i;
+  const unsigned char* ip;
+  unsigned int pc = 0;
+  nfm_pkt_t p;
+  uint32_t v;
+  int r = 0;
+
+  nfm_pkt_parse(&p, d, len);
+  ip = d + p.l3_off;
+  f->seen++;
+  while (pc < f->len) {
+    i = &f->prog[pc];
+    switch (i->op) {
+    case NFM_CAPFILT_ETHERTYPE:
+      r = p.ethertype == i->k;
+      break;
+    case NFM_CAPFILT_IPVER:
+      r = p.ip_version == i->k;
+      break;
+    case NFM_CAPFILT_PROTO:
+      r = p.ip_version && p.proto == i->k;
+      break;
+    case NFM_CAPFILT_VLAN:
+      r = p.vlans != 0;
+      break;
+    case NFM_CAPFILT_VLAN_ID:
+      r = p.vlans && p.vlan_id == i->k;
+      break;
+    case NFM_CAPFILT_SRC4:
+    case NFM_CAPFILT_DST4:
+      r = p.ip_version == 4 && (nfm_pkt_be32(ip + ((i->op == NFM_CAPFILT_SRC4) ? 12 : 16)) & i->k2) == i->k;
+      break;
+    case NFM_CAPFILT_SRC6:
+    case NFM_CAPFILT_DST6:
+      r = p.ip_version == 6 && nfm_capfilt_v6_match(ip + ((i->op == NFM_CAPFILT_SRC6) ? 8 : 24), i);
+      break;
+    case NFM_CAPFILT_SPORT:
+    case NFM_CAPFILT_DPORT:
+      v = p.has_ports ? nfm_pkt_be16(d + p.l4_off + ((i->op == NFM_CAPFILT_SPORT) ? 0 : 2)) : 0x10000;
+      r = v - i->k <= i->k2 - i->k;
+      break;
+    case NFM_CAPFILT_LEN_LE:
+      r = len <= i->k;
+      break;
+    case NFM_CAPFILT_LEN_GE:
+      r = len >= i->k;
+      break;
+    }
+    pc = r ? i->jt : i->jf;
+  }
+  if (pc != f->len)
+    f->rejected++;
+  return pc == f->len;
+}
+
+static inline void nfm_capfilt_report(const nfm_capfilt_t* f, FILE* out)
+{
+  fprintf(out, "Capture filter: %llu packets seen, %llu rejected (%u instructions)\n",
+          (unsigned long long)f->seen, (unsigned long long)f->rejected, f->len);
+}
+
+#endif
@@ -0,0 +1,107 @@
+/**
+ * Copyright (C) 2013 Netronome Systems, Inc.  All rights reserved.
+ *
+ * File:        nfm_sample_capsel.h
+ * Description: Capture selection for the recording samples, applied on the
+ *              receive thread before any packet data is copied: keep 1 in
+ *              N packets, or 1 in N flows by a 5-tuple hash that is the same
+ *              in both directions (so a sampled flow is recorded whole), and
+ *              cut each packet to a snap length and/or to its L2-L4 headers.
+ *              The wire length is always kept with the record.
+ */
+
+#ifndef NFM_SAMPLE_CAPSEL_H
+#define NFM_SAMPLE_CAPSEL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nfm_sample_pktparse.h"
+
+typedef struct {
+  uint32_t snaplen;        // 0 for no limit
+  uint32_t sample;         // keep 1 in 'sample', 0 or 1 for all
+  int by_flow;             // sample flows rather than packets
+  int headers;             // keep only the L2-L4 headers
+} nfm_capsel_cfg_t;
+
+#define NFM_CAPSEL_DEFAULT_CFG { 0, 0, 0, 0 }
+
+typedef struct {
+  nfm_capsel_cfg_t cfg;
+  uint32_t skip;           // packets left until the next sampled one
+  uint32_t threshold;      // flows hashing above this are not sampled
+  uint64_t seen;
+  uint64_t sampled_out;
+  uint64_t cut;            // packets recorded short
+  uint64_t cut_bytes;      // packet bytes left out
+} nfm_capsel_t;
+
+// Parse "N[:flow]"; returns 0 on success
+static inline int nfm_capsel_parse_sample(nfm_capsel_cfg_t* cfg, const char* spec)
+{
+  char* end;
+  cfg->sample = (uint32_t)strtoul(spec, &end, 0);
+  cfg->by_flow = 0;
+  if (strcmp(end, ":flow") == 0)
+    cfg->by_flow = 1;
+  else if (*end != 0)
+    return -1;
+  return cfg->sample ? 0 : -1;
+}
+
+static inline int nfm_capsel_active(const nfm_capsel_cfg_t* cfg)
+{
+  return cfg->snaplen || cfg->sample > 1 || cfg->headers;
+}
+
+static inline void nfm_capsel_init(nfm_capsel_t* s, const nfm_capsel_cfg_t* cfg)
+{
+  memset(s, 0, sizeof(*s));
+  s->cfg = *cfg;
+  s->threshold = (cfg->sample > 1) ? 0xffffffffU / cfg->sample : 0xffffffffU;
+}
+
+// Receive thread: bytes of the packet to record, 0 to skip it
+static inline uint32_t nfm_capsel_packet(nfm_capsel_t* s, const unsigned char* data, uint32_t len)
+{
+  nfm_pkt_t p;
+  uint32_t caplen = len;
+
+  s->seen++;
+  if (s->cfg.sample > 1 && !s->cfg.by_flow) {
+    if (s->skip) {
+      s->skip--;
+      s->sampled_out++;
+      return 0;
+    }
+    s->skip = s->cfg.sample-1;
+  }
+  if (s->cfg.by_flow || s->cfg.headers) {
+    nfm_pkt_parse(&p, data, len);
+    if (s->cfg.by_flow && nfm_pkt_flow_hash(&p, data) > s->threshold) {
+      s->sampled_out++;
+      return 0;
+    }
+    if (s->cfg.headers)
+      caplen = p.end;
+  }
+  if (s->cfg.snaplen && caplen > s->cfg.snaplen)
+    caplen = s->cfg.snaplen;
+  if (caplen < len) {
+    s->cut++;
+    s->cut_bytes += len - caplen;
+  }
+  return caplen;
+}
+
+static inline void nfm_capsel_report(const nfm_capsel_t* s, FILE* f)
+{
+  fprintf(f, "Capture selection: %llu packets seen, %llu sampled out, %llu recorded short (%llu bytes left out)\n",
+          (unsigned long long)s->seen, (unsigned long long)s->sampled_out,
+          (unsigned long long)s->cut, (unsigned long long)s->cut_bytes);
+}
+
+#endif
@@ -0,0 +1,296 @@
+/**
+ * Copyright (C) 2013 Netronome Systems, Inc.  All rights reserved.
+ *
+ * File:        nfm_sample_flowmod.h
+ * Description: Deferred flow modifier queue. The start of flow callback
+ *              only copies a small descriptor into a single-producer/
+ *              single-consumer ring; a worker thread drains the ring in
+ *              batches, folds requests for the same flow within a batch
+ *              into one, and creates/applies the modifiers.
+ *
+ *              The worker keeps its own queue depth and enqueue-to-applied
+ *              latency figures and prints them on request.
+ */
+
+#ifndef NFM_SAMPLE_FLOWMOD_H
+#define NFM_SAMPLE_FLOWMOD_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "ns_packet.h"
+#include "ns_flow.h"
+#include "nfm_sample_hist.h"
+
+#define NFM_FLOWMOD_RING_SIZE  16384  // descriptors, power of two
+#define NFM_FLOWMOD_BATCH      256    // descriptors taken per drain
+#define NFM_FLOWMOD_IDLE_US    100    // worker sleep when the ring is empty
+
+// Descriptor flags
+#define NFM_FLOWMOD_EOF        0x1    // set end of flow statistics to 'eof'
+#define NFM_FLOWMOD_CONTEXT    0x2    // set the user context to 'context'
+
+// Everything needed to address a flow and the changes to make to it.
+// Addresses and ports in network byte order, as in the start of flow.
+typedef struct {
+  uint8_t flow_type;       // 0 IPv4, otherwise IPv6
+  uint8_t protocol;
+  uint8_t flags;
+  uint8_t eof;
+  uint16_t addr_space_id;
+  uint16_t src_port;
+  uint16_t dst_port;
+  uint32_t context;
+  uint8_t src[16];
+  uint8_t dst[16];
+  uint64_t enqueue_ns;
+} nfm_flowmod_desc_t;
+
+typedef struct {
+  ns_packet_device_h dev;
+  nfm_flowmod_desc_t* ring;
+  // Producer (callback thread)
+  volatile uint32_t head __attribute__((aligned(64)));
+  uint64_t enqueued;
+  uint64_t ring_full;
+  // Consumer (worker thread)
+  volatile uint32_t tail __attribute__((aligned(64)));
+  uint64_t applied;
+  uint64_t coalesced;
+  uint64_t failed;
+  uint64_t batches;
+  uint32_t depth_max;
+  uint64_t depth_sum;      // depth seen at each batch, for the mean
+  nfm_hist_t latency;      // enqueue to applied, ns
+  unsigned int report_s;
+  uint64_t report_ns;
+  volatile sig_atomic_t report_requested;
+  pthread_t thread;
+  volatile int running;
+} nfm_flowmod_t;
+
+static inline uint64_t nfm_flowmod_now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+// 'report_s' > 0 prints the worker figures every report_s seconds
+static inline int nfm_flowmod_init(nfm_flowmod_t* q, ns_packet_device_h dev, unsigned int report_s)
+{
+  memset(q, 0, sizeof(*q));
+  if (posix_memalign((void**)&q->ring, 64, NFM_FLOWMOD_RING_SIZE*sizeof(nfm_flowmod_desc_t)) != 0)
+    return -1;
+  memset(q->ring, 0, NFM_FLOWMOD_RING_SIZE*sizeof(nfm_flowmod_desc_t));
+  q->dev = dev;
+  q->report_s = report_s;
+  return 0;
+}
+
+// Producer: returns the descriptor to fill, or NULL if the ring is full.
+// A non-NULL descriptor must be committed.
+static inline nfm_flowmod_desc_t* nfm_flowmod_reserve(nfm_flowmod_t* q)
+{
+  uint32_t head = q->head;
+  if (head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) >= NFM_FLOWMOD_RING_SIZE) {
+    __atomic_store_n(&q->ring_full, q->ring_full+1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+  return &q->ring[head&(NFM_FLOWMOD_RING_SIZE-1)];
+}
+
+static inline void nfm_flowmod_commit(nfm_flowmod_t* q)
+{
+  q->ring[q->head&(NFM_FLOWMOD_RING_SIZE-1)].enqueue_ns = nfm_flowmod_now_ns();
+  __atomic_store_n(&q->enqueued, q->enqueued+1, __ATOMIC_RELAXED);
+  __atomic_store_n(&q->head, q->head+1, __ATOMIC_RELEASE);
+}
+
+// Async-signal-safe
+static inline void nfm_flowmod_request_report(nfm_flowmod_t* q)
+{
+  q->report_requested = 1;
+}
+
+static inline int nfm_flowmod_same_flow(const nfm_flowmod_desc_t* a, const nfm_flowmod_desc_t* b)
+{
+  return a->flow_type == b->flow_type && a->protocol == b->protocol &&
+         a->addr_space_id == b->addr_space_id &&
+         a->src_port == b->src_port && a->dst_port == b->dst_port &&
+         memcmp(a->src, b->src, a->flow_type?16:4) == 0 &&
+         memcmp(a->dst, b->dst, a->flow_type?16:4) == 0;
+}
+
+static inline uint32_t nfm_flowmod_hash(const nfm_flowmod_desc_t* d)
+{
+  // FNV-1a over the tuple
+  const uint8_t* p;
+  uint32_t h = 2166136261U;
+  unsigned int i, n = d->flow_type?16:4;
+  for (i = 0, p = d->src; i < n; i++)
+    h = (h ^ p[i]) * 16777619U;
+  for (i = 0, p = d->dst; i < n; i++)
+    h = (h ^ p[i]) * 16777619U;
+  h = (h ^ d->protocol) * 16777619U;
+  h = (h ^ d->src_port) * 16777619U;
+  h = (h ^ d->dst_port) * 16777619U;
+  h = (h ^ d->addr_space_id) * 16777619U;
+  return h;
+}
+
+static inline void nfm_flowmod_apply(nfm_flowmod_t* q, const nfm_flowmod_desc_t* d)
+{
+  ns_flow_modifier_h fm;
+  ns_nfm_ret_t r;
+  uint32_t src, dst;
+  if (d->flow_type == 0) {
+    memcpy(&src, d->src, 4);
+    memcpy(&dst, d->dst, 4);
+    r = ns_flow_create_ntuple_modifier(q->dev, src, dst, d->src_port, d->dst_port, d->protocol, d->addr_space_id, &fm);
+  } else {
+    r = ns_flow_create_ipv6_ntuple_modifier(q->dev, (const char*)d->src, (const char*)d->dst, d->src_port, d->dst_port, d->protocol, d->addr_space_id, &fm);
+  }
+  if (r != NS_NFM_SUCCESS) {
+    q->failed++;
+    return;
+  }
+  if (d->flags & NFM_FLOWMOD_EOF)
+    ns_flow_set_eof_statistics(fm, d->eof);
+  if (d->flags & NFM_FLOWMOD_CONTEXT)
+    ns_flow_set_user_context(fm, d->context);
+  if (ns_flow_apply_modifier(fm) != NS_NFM_SUCCESS)
+    q->failed++;
+  else
+    q->applied++;
+}
+
+static inline void nfm_flowmod_report(nfm_flowmod_t* q, FILE* f)
+{
+  uint64_t total = nfm_hist_total(&q->latency);
+  uint32_t depth = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) - q->tail;
+  fprintf(f, "Flow modifiers: %llu queued, %llu applied, %llu coalesced, %llu failed, %llu ring full; "
+             "depth now %u max %u mean %.1f over %llu batches\n",
+          (unsigned long long)__atomic_load_n(&q->enqueued, __ATOMIC_RELAXED), (unsigned long long)q->applied,
+          (unsigned long long)q->coalesced, (unsigned long long)q->failed,
+          (unsigned long long)__atomic_load_n(&q->ring_full, __ATOMIC_RELAXED),
+          depth, q->depth_max, q->batches?(double)q->depth_sum/q->batches:0.0, (unsigned long long)q->batches);
+  if (total) {
+    fprintf(f, "Flow modifiers: queued to applied p50 %.1fus p99 %.1fus p99.9 %.1fus max %.1fus\n",
+            nfm_hist_percentile(&q->latency, total, 50.0)/1000.0,
+            nfm_hist_percentile(&q->latency, total, 99.0)/1000.0,
+            nfm_hist_percentile(&q->latency, total, 99.9)/1000.0,
+            nfm_hist_max(&q->latency)/1000.0);
+  }
+  fflush(f);
+}
+
+// Take up to NFM_FLOWMOD_BATCH descriptors, fold duplicates (later requests
+// win field by field) and apply what is left
+static inline unsigned int nfm_flowmod_drain(nfm_flowmod_t* q)
+{
+  nfm_flowmod_desc_t batch[NFM_FLOWMOD_BATCH];
+  uint64_t first_ns[NFM_FLOWMOD_BATCH];
+  int16_t index[2*NFM_FLOWMOD_BATCH];
+  uint32_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+  uint32_t tail = q->tail;
+  uint32_t depth = head - tail;
+  unsigned int i, n = 0, taken;
+  uint64_t now;
+
+  if (depth == 0)
+    return 0;
+  taken = (depth > NFM_FLOWMOD_BATCH)?NFM_FLOWMOD_BATCH:depth;
+  if (depth > q->depth_max)
+    q->depth_max = depth;
+  q->depth_sum += depth;
+  q->batches++;
+
+  memset(index, 0xff, sizeof(index));
+  for (i = 0; i < taken; i++) {
+    const nfm_flowmod_desc_t* d = &q->ring[(tail+i)&(NFM_FLOWMOD_RING_SIZE-1)];
+    uint32_t h = nfm_flowmod_hash(d) & (2*NFM_FLOWMOD_BATCH-1);
+    while (index[h] >= 0 && !nfm_flowmod_same_flow(&batch[index[h]], d))
+      h = (h+1) & (2*NFM_FLOWMOD_BATCH-1);
+    if (index[h] >= 0) {
+      nfm_flowmod_desc_t* b = &batch[index[h]];
+      if (d->flags & NFM_FLOWMOD_EOF)
+        b->eof = d->eof;
+      if (d->flags & NFM_FLOWMOD_CONTEXT)
+        b->context = d->context;
+      b->flags |= d->flags;
+      q->coalesced++;
+    } else {
+      index[h] = (int16_t)n;
+      batch[n] = *d;
+      first_ns[n] = d->enqueue_ns;
+      n++;
+    }
+  }
+  // Slots are copied out; hand them back before the slow part
+  __atomic_store_n(&q->tail, tail+taken, __ATOMIC_RELEASE);
+
+  for (i = 0; i < n; i++)
+    nfm_flowmod_apply(q, &batch[i]);
+  now = nfm_flowmod_now_ns();
+  for (i = 0; i < n; i++)
+    nfm_hist_record(&q->latency, now - first_ns[i], 1);
+  return taken;
+}
+
+static void* nfm_flowmod_worker(void* arg)
+{
+  nfm_flowmod_t* q = (nfm_flowmod_t*)arg;
+  struct timespec idle = { 0, NFM_FLOWMOD_IDLE_US*1000L };
+  sigset_t sigs;
+
+  sigfillset(&sigs);
+  pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+  q->report_ns = nfm_flowmod_now_ns();
+  while (q->running) {
+    if (nfm_flowmod_drain(q) == 0)
+      nanosleep(&idle, NULL);
+    if (q->report_requested ||
+        (q->report_s && nfm_flowmod_now_ns() - q->report_ns >= q->report_s*1000000000ULL)) {
+      q->report_requested = 0;
+      q->report_ns = nfm_flowmod_now_ns();
+      nfm_flowmod_report(q, stdout);
+    }
+  }
+  while (nfm_flowmod_drain(q))
+    ;
+  return NULL;
+}
+
+static inline int nfm_flowmod_start(nfm_flowmod_t* q)
+{
+  q->running = 1;
+  if (pthread_create(&q->thread, NULL, nfm_flowmod_worker, q) != 0) {
+    q->running = 0;
+    return -1;
+  }
+  return 0;
+}
+
+// Stop the worker once it has applied what is queued
+static inline void nfm_flowmod_stop(nfm_flowmod_t* q)
+{
+  if (q->running) {
+    q->running = 0;
+    pthread_join(q->thread, NULL);
+  }
+}
+
+static inline void nfm_flowmod_free(nfm_flowmod_t* q)
+{
+  free(q->ring);
+  q->ring = NULL;
+}
+
+#endif
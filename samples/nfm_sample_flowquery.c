@@ -0,0 +1,291 @@
+/**
+ * Copyright (C) 2013 Netronome Systems, Inc.  All rights reserved.
+ *
+ * File:        nfm_sample_flowquery.c
+ * Description: Offline query tool for the flow journal written by
+ *              nfm_sample_flowstats -J. Uses the segment headers and block
+ *              index to read only the parts of the journal that can match.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "nfm_sample_journal.h"
+
+static nfm_journal_query_t query;
+static int count_only=0;
+static unsigned long long limit=0;
+
+// What the index saved us
+static unsigned long long segments=0;
+static unsigned long long segments_read=0;
+static unsigned long long blocks=0;
+static unsigned long long blocks_read=0;
+static unsigned long long records_read=0;
+static unsigned long long matched=0;
+
+static void print_usage(const char* argv0)
+{
+  fprintf(stderr, "USAGE: %s [options] journal-dir|segment...\n"
+                  "\n"
+                  "Print the flows in a flow journal (nfm_sample_flowstats -J) that match all of:\n"
+                  " -f --from T     Active at or after T\n"
+                  " -t --to T       Active at or before T\n"
+                  "                 T is seconds[.fraction] of NFE time, or YYYY-MM-DD[THH:MM[:SS]] (UTC)\n"
+                  " -a --addr A     IPv4 or IPv6 source or destination address A\n"
+                  " -p --port n     Source or destination port n\n"
+                  " -r --proto p    IP protocol: tcp, udp, icmp, icmp6 or a number\n"
+                  "Output:\n"
+                  " -n --limit n    Stop after n matching flows\n"
+                  " -c --count      Print only the number of matching flows\n"
+          ,argv0);
+  exit(1);
+}
+
+static const struct option __long_options[] = {
+  {"from",      1, 0, 'f'},
+  {"to",        1, 0, 't'},
+  {"addr",      1, 0, 'a'},
+  {"port",      1, 0, 'p'},
+  {"proto",     1, 0, 'r'},
+  {"limit",     1, 0, 'n'},
+  {"count",     0, 0, 'c'},
+  {"help",      0, 0, 'h'},
+  {0, 0, 0, 0}
+};
+
+static int parse_time(const char* s, uint64_t* us)
+{
+  struct tm tm;
+  char* end;
+  double t;
+  if (strchr(s, '-')) {
+    memset(&tm, 0, sizeof(tm));
+    end=strptime(s, "%Y-%m-%d", &tm);
+    if (end && *end=='T')
+      end=strptime(end+1, "%H:%M", &tm);
+    if (end && *end==':')
+      end=strptime(end+1, "%S", &tm);
+    if (!end || *end)
+      return -1;
+    *us=(uint64_t)timegm(&tm)*1000000ULL;
+    return 0;
+  }
+  errno=0;
+  t=strtod(s, &end);
+  if (errno || end==s || *end || t<0)
+    return -1;
+  *us=(uint64_t)(t*1000000.0+0.5);
+  return 0;
+}
+
+static int parse_proto(const char* s, uint8_t* proto)
+{
+  char* end;
+  unsigned long v;
+  if (strcmp(s, "tcp")==0) {
+    *proto=IPPROTO_TCP;
+  } else if (strcmp(s, "udp")==0) {
+    *proto=IPPROTO_UDP;
+  } else if (strcmp(s, "icmp")==0) {
+    *proto=IPPROTO_ICMP;
+  } else if (strcmp(s, "icmp6")==0) {
+    *proto=IPPROTO_ICMPV6;
+  } else {
+    v=strtoul(s, &end, 0);
+    if (end==s || *end || v>255)
+      return -1;
+    *proto=(uint8_t)v;
+  }
+  return 0;
+}
+
+static void print_flow(const nfm_flow_rec_t* r)
+{
+  char src[INET6_ADDRSTRLEN], dst[INET6_ADDRSTRLEN];
+  int af=(r->flow_type==0)?AF_INET:AF_INET6;
+  inet_ntop(af, r->src, src, sizeof(src));
+  inet_ntop(af, r->dst, dst, sizeof(dst));
+  printf("%llu.%06llu %llu.%06llu proto %u %s%s%s:%u -> %s%s%s:%u packets %llu/%llu bytes %llu/%llu"
+         " flow ID %u context %u as %u ingress %u egress %u%s\n",
+         (unsigned long long)(r->start_us/1000000), (unsigned long long)(r->start_us%1000000),
+         (unsigned long long)(r->end_us/1000000), (unsigned long long)(r->end_us%1000000),
+         r->protocol,
+         (af==AF_INET6)?"[":"", src, (af==AF_INET6)?"]":"", ntohs(r->src_port),
+         (af==AF_INET6)?"[":"", dst, (af==AF_INET6)?"]":"", ntohs(r->dst_port),
+         (unsigned long long)r->pkts[0], (unsigned long long)r->pkts[1],
+         (unsigned long long)r->bytes[0], (unsigned long long)r->bytes[1],
+         r->flow_id, r->ctx, r->addr_space_id, r->ingress_interface, r->egress_interface,
+         (r->flags&NFM_FLOW_F_SOF)?"":" (no start of flow recorded)");
+}
+
+static int limit_reached(void)
+{
+  return limit && matched>=limit;
+}
+
+static void query_segment(const char* path)
+{
+  nfm_journal_seg_t seg;
+  uint32_t b, i, nblocks, end;
+
+  segments++;
+  if (nfm_journal_open_read(&seg, path) != 0) {
+    fprintf(stderr, "%s: not a flow journal segment (%s)\n", path, strerror(errno));
+    return;
+  }
+  // A segment still being written can gain later flows than its header shows
+  if (seg.hdr.count==0 ||
+      (seg.hdr.closed && !nfm_journal_span_match(&query, seg.hdr.min_start_us, seg.hdr.max_end_us))) {
+    nfm_journal_close_read(&seg);
+    return;
+  }
+  if (nfm_journal_map(&seg) != 0) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    nfm_journal_close_read(&seg);
+    return;
+  }
+  segments_read++;
+  nblocks=(seg.hdr.count+NFM_JOURNAL_BLOCK_RECS-1)/NFM_JOURNAL_BLOCK_RECS;
+  blocks+=nblocks;
+  for (b=0; b<nblocks && !limit_reached(); b++) {
+    if (!nfm_journal_block_match(&query, &seg.blocks[b]))
+      continue;
+    blocks_read++;
+    end=(b+1)*NFM_JOURNAL_BLOCK_RECS;
+    if (end>seg.hdr.count)
+      end=seg.hdr.count;
+    for (i=b*NFM_JOURNAL_BLOCK_RECS; i<end && !limit_reached(); i++) {
+      records_read++;
+      if (nfm_journal_rec_match(&query, &seg.recs[i])) {
+        matched++;
+        if (!count_only)
+          print_flow(&seg.recs[i]);
+      }
+    }
+  }
+  nfm_journal_close_read(&seg);
+}
+
+static int is_segment(const struct dirent* e)
+{
+  unsigned int seq;
+  int len=0;
+  return sscanf(e->d_name, NFM_JOURNAL_PREFIX "%u" NFM_JOURNAL_SUFFIX "%n", &seq, &len)==1 &&
+         len>0 && e->d_name[len]==0;
+}
+
+static void query_path(const char* path)
+{
+  struct stat st;
+  struct dirent** list;
+  char name[4096];
+  int i, n;
+
+  if (stat(path, &st) != 0) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return;
+  }
+  if (!S_ISDIR(st.st_mode)) {
+    query_segment(path);
+    return;
+  }
+  // Segment names are zero padded, so name order is write order
+  n=scandir(path, &list, is_segment, alphasort);
+  if (n<0) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return;
+  }
+  for (i=0; i<n; i++) {
+    if (!limit_reached()) {
+      snprintf(name, sizeof(name), "%s/%s", path, list[i]->d_name);
+      query_segment(name);
+    }
+    free(list[i]);
+  }
+  free(list);
+}
+
+int main(int argc, char **argv)
+{
+  char* end;
+  unsigned long port;
+  int i, c;
+
+  nfm_journal_query_init(&query);
+  while ((c = getopt_long(argc, argv, "hf:t:a:p:r:n:c", __long_options, NULL)) != -1) {
+    switch (c) {
+    case 'f':
+      if (parse_time(optarg, &query.from_us) != 0) {
+        fprintf(stderr, "Cannot parse time %s\n", optarg);
+        exit(1);
+      }
+      break;
+    case 't':
+      if (parse_time(optarg, &query.to_us) != 0) {
+        fprintf(stderr, "Cannot parse time %s\n", optarg);
+        exit(1);
+      }
+      break;
+    case 'a':
+      if (inet_pton(AF_INET, optarg, query.addr)==1) {
+        query.addr_type=0;
+      } else if (inet_pton(AF_INET6, optarg, query.addr)==1) {
+        query.addr_type=1;
+      } else {
+        fprintf(stderr, "Cannot parse address %s\n", optarg);
+        exit(1);
+      }
+      query.has_addr=1;
+      break;
+    case 'p':
+      port=strtoul(optarg, &end, 0);
+      if (end==optarg || *end || port>65535) {
+        fprintf(stderr, "Port %s is out of range (0-65535)\n", optarg);
+        exit(1);
+      }
+      query.port=htons((uint16_t)port);
+      query.has_port=1;
+      break;
+    case 'r':
+      if (parse_proto(optarg, &query.proto) != 0) {
+        fprintf(stderr, "Unknown protocol %s\n", optarg);
+        exit(1);
+      }
+      query.has_proto=1;
+      break;
+    case 'n':
+      limit=strtoull(optarg, 0, 0);
+      break;
+    case 'c':
+      count_only=1;
+      break;
+    case 'h':
+    default:
+      print_usage(argv[0]);
+    }
+  }
+
+  if (optind == argc)
+    print_usage(argv[0]);
+  nfm_journal_query_prepare(&query);
+
+  for (i=optind; i<argc && !limit_reached(); i++)
+    query_path(argv[i]);
+
+  if (count_only)
+    printf("%llu\n", matched);
+  fprintf(stderr, "Read %llu of %llu segments, %llu of %llu blocks, %llu records, %llu matched\n",
+          segments_read, segments, blocks_read, blocks, records_read, matched);
+  return 0;
+}
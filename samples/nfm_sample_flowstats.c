@@ -14,8 +14,15 @@
 #include <getopt.h>
 #include <sys/time.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "ns_flow.h"
+#include "nfm_sample_flowtab.h"
+#include "nfm_sample_ipfix.h"
+#include "nfm_sample_flowmod.h"
+#include "nfm_sample_sketch.h"
+#include "nfm_sample_policy.h"
+#include "nfm_sample_journal.h"
 
 
 #define print_error(r, prefix)  fprintf(stderr, "%s: %s: %s. (subcode=%d).\n", prefix, ns_nfm_module_string(r), ns_nfm_error_string(r), NS_NFM_ERROR_SUBCODE(r))
@@ -25,13 +32,51 @@ static int change_context=0;
 static int context=0;
 static int enable_eof=0;
 static int change_eof=0;
+static int verbose=0;
 ns_packet_device_h dev;
 
+// Written by the flow callbacks, drained by the flow table consumer thread
+static nfm_flowtab_t flowtab;
+
+// Per-flow context/end of flow policy (-P); -c/-x apply to unmatched flows
+static nfm_policy_ref_t policy;
+static const char* policy_path=0;
+
+// Flow modifiers requested by -c/-x or the policy, applied by the flow modifier worker
+static nfm_flowmod_t flowmod;
+
+// Flow export (-X), fed from the flow table consumer thread
+static nfm_ipfix_t exporter;
+static const char* export_dest=0;
+static int export_v9=0;
+
+// Binary flow journal (-J), appended to from the flow table consumer
+static nfm_journal_t journal;
+static const char* journal_dir=0;
+
+// Top-K and distinct count sketches (-s), fed from the flow table consumer
+static nfm_sketch_t* sketch=0;
+
+// Consumer thread totals over completed flows
+static unsigned long long total_flows=0;
+static unsigned long long total_packets=0;
+static unsigned long long total_bytes=0;
+
 void sig_term(int __attribute__((unused)) dummy)
 {
   running = 0;
 }
 
+void sig_usr1(int __attribute__((unused)) dummy)
+{
+  nfm_flowmod_request_report(&flowmod);
+}
+
+void sig_hup(int __attribute__((unused)) dummy)
+{
+  nfm_policy_request_reload(&policy);
+}
+
 static void print_usage(const char* argv0)
 {
   fprintf(stderr, "USAGE: %s [options]\n"
@@ -43,7 +88,23 @@ static void print_usage(const char* argv0)
                   " -m --multi d.e.i[:d.e.i]... Receive from multiple device.endpoint.id tuples (ignore -d, -e and -i options)\n"
                   " -c --context n  Change the flow opaque context (in start of flow callback) to n\n"
                   " -x --eof n      Modify the flow (in start of flow callback) to enable/disable end of flow message from NPU\n"
-          ,argv0);
+                  "                 (-c and -x modifiers are queued and applied in batches by a worker thread)\n"
+                  " -P --policy f   Pick the context and end of flow setting per flow from the first matching rule in f\n"
+                  "                 (src=/dst=prefix proto= sport=/dport=N[-M] as= context= eof=0|1, one rule per line);\n"
+                  "                 -c and -x apply to flows no rule matches. Reloaded on SIGHUP or when f changes\n"
+                  " -q --modq S     Print flow modifier queue depth and apply latency every S seconds\n"
+                  "                 (also on SIGUSR1 and at exit)\n"
+                  " -F --flows n    Size the flow table for n concurrent flows (default %u, max %u)\n"
+                  " -v --verbose    Print every start of flow and completed flow record (debugging only)\n"
+                  " -X --export D   Export completed flows as IPFIX to D: udp:host:port, or a file name\n"
+                  " -9 --netflow9   Export NetFlow v9 instead of IPFIX\n"
+                  " -J --journal D[:M] Append completed flows to indexed M MB segment files (default %u) in directory D,\n"
+                  "                 for nfm_sample_flowquery\n"
+                  " -s --sketch S[:K] Every S seconds print the top K (default %u, max %u) flows and /%u (IPv6 /%u) source\n"
+                  "                 and destination prefixes by bytes, and distinct sources, destinations and\n"
+                  "                 destination ports per address space\n"
+          ,argv0, NFM_FLOW_DEFAULT_FLOWS, NFM_FLOW_MAX_FLOWS, NFM_JOURNAL_DEFAULT_MB,
+          NFM_SKETCH_DEFAULT_TOP, NFM_SKETCH_MAX_TOP, NFM_SKETCH_V4_PREFIX, NFM_SKETCH_V6_PREFIX);
   exit(1);
 }
 
@@ -54,6 +115,14 @@ static const struct option __long_options[] = {
   {"multi",     1, 0, 'm'},
   {"context",   1, 0, 'c'},
   {"eof",       1, 0, 'x'},
+  {"flows",     1, 0, 'F'},
+  {"verbose",   0, 0, 'v'},
+  {"export",    1, 0, 'X'},
+  {"netflow9",  0, 0, '9'},
+  {"journal",   1, 0, 'J'},
+  {"modq",      1, 0, 'q'},
+  {"sketch",    1, 0, 's'},
+  {"policy",    1, 0, 'P'},
   {"help",      0, 0, 'h'},
   {0, 0, 0, 0}
 };
@@ -64,7 +133,7 @@ static const struct option __long_options[] = {
 #define ipv6_printf_format "%02x%02x:%02x%02x:%02x%02x:%02x%02x:%02x%02x:%02x%02x:%02x%02x:%02x%02x"
 #define ipv6_printf(x) x[0],x[1],x[2],x[3],x[4],x[5],x[6],x[7],x[8],x[9],x[10],x[11],x[12],x[13],x[14],x[15]
 
-void sof_callback(const ns_packet_flow_start_stats_t* sof_stats, uint64_t cb_context __attribute__((unused))) {
+static void print_sof(const ns_packet_flow_start_stats_t* sof_stats) {
   printf("Start of flow: flow ID=%u, context=%u, ingress %s interface=%u, egress %s interface=%u\n",
       sof_stats->flow_id, sof_stats->ctx,
       (sof_stats->ingress_if_type==0)?"physical":"logical", sof_stats->ingress_interface,
@@ -91,55 +160,93 @@ void sof_callback(const ns_packet_flow_start_stats_t* sof_stats, uint64_t cb_con
     }
   };
   printf("flow start time: %u.%06us\n", sof_stats->flow_sof_timestamp_s, sof_stats->flow_sof_timestamp_us);
+}
 
-  if (change_eof || change_context) {
-    ns_flow_modifier_h fm;
-    if (sof_stats->flow_type==0) {
-      if (ns_flow_create_ntuple_modifier(dev, sof_stats->IPv4.src, sof_stats->IPv4.dst, sof_stats->IPv4.L4_srcport, sof_stats->IPv4.L4_dstport, sof_stats->IPv4.protocol, sof_stats->IPv4.addr_space_id, &fm)==NS_NFM_SUCCESS) {
-        if (change_eof) ns_flow_set_eof_statistics(fm, (enable_eof>0)?1:0);
-        if (change_context) ns_flow_set_user_context(fm, context);
-        ns_flow_apply_modifier(fm);
-      }
-    } else {
-      if (ns_flow_create_ipv6_ntuple_modifier(dev, (const char*)sof_stats->IPv6.src, (const char*)sof_stats->IPv6.dst, sof_stats->IPv6.L4_srcport, sof_stats->IPv6.L4_dstport, sof_stats->IPv6.protocol, sof_stats->IPv6.addr_space_id, &fm)==NS_NFM_SUCCESS) {
-        if (change_eof) ns_flow_set_eof_statistics(fm, (enable_eof>0)?1:0);
-        if (change_context) ns_flow_set_user_context(fm, context);
-        ns_flow_apply_modifier(fm);
+void sof_callback(const ns_packet_flow_start_stats_t* sof_stats, uint64_t cb_context __attribute__((unused))) {
+  nfm_flowtab_sof(&flowtab, sof_stats);
+  if (verbose)
+    print_sof(sof_stats);
+
+  nfm_policy_action_t action;
+  action.set_context=change_context;
+  action.context=context;
+  action.set_eof=change_eof;
+  action.eof=(enable_eof>0)?1:0;
+  if (policy_path)
+    nfm_policy_match(&policy, sof_stats, &action);
+
+  if (action.set_eof || action.set_context) {
+    nfm_flowmod_desc_t* d=nfm_flowmod_reserve(&flowmod);
+    if (d) {
+      if (sof_stats->flow_type==0) {
+        memcpy(d->src, &sof_stats->IPv4.src, 4);
+        memcpy(d->dst, &sof_stats->IPv4.dst, 4);
+        d->src_port=sof_stats->IPv4.L4_srcport;
+        d->dst_port=sof_stats->IPv4.L4_dstport;
+        d->protocol=sof_stats->IPv4.protocol;
+        d->addr_space_id=sof_stats->IPv4.addr_space_id;
+      } else {
+        memcpy(d->src, sof_stats->IPv6.src, 16);
+        memcpy(d->dst, sof_stats->IPv6.dst, 16);
+        d->src_port=sof_stats->IPv6.L4_srcport;
+        d->dst_port=sof_stats->IPv6.L4_dstport;
+        d->protocol=sof_stats->IPv6.protocol;
+        d->addr_space_id=sof_stats->IPv6.addr_space_id;
       }
+      d->flow_type=sof_stats->flow_type;
+      d->flags=(action.set_eof?NFM_FLOWMOD_EOF:0) | (action.set_context?NFM_FLOWMOD_CONTEXT:0);
+      d->eof=action.eof;
+      d->context=action.context;
+      nfm_flowmod_commit(&flowmod);
     }
   }
 }
 
 void eof_callback(const ns_packet_flow_end_stats_t* eof_stats, uint64_t cb_context __attribute__((unused))) {
+  nfm_flowtab_eof(&flowtab, eof_stats);
+}
+
+// Flow table consumers, run on the consumer thread
+static void tally_flow(const nfm_flow_rec_t* rec, void __attribute__((unused)) *ctx) {
+  total_flows++;
+  total_packets+=rec->pkts[0]+rec->pkts[1];
+  total_bytes+=rec->bytes[0]+rec->bytes[1];
+}
+
+static void print_flow(const nfm_flow_rec_t* rec, void __attribute__((unused)) *ctx) {
+  uint32_t src, dst;
   printf("End of flow: flow ID=%u, context=%u, rule_id=%hu, ingress %s interface=%u, egress %s interface=%u, total packets=%llu, total bytes=%llu\n",
-      eof_stats->flow_id, eof_stats->ctx, eof_stats->rule_id,
-      (eof_stats->ingress_if_type==0)?"physical":"logical", eof_stats->ingress_interface,
-      (eof_stats->egress_if_type==0)?"physical":"logical", eof_stats->egress_interface,
-      (unsigned long long)(eof_stats->packet_count[0]+eof_stats->packet_count[1]),
-      (unsigned long long)(eof_stats->byte_count[0]+eof_stats->byte_count[1]));
-  if (eof_stats->flow_type==0) {
+      rec->flow_id, rec->ctx, rec->rule_id,
+      (rec->ingress_if_type==0)?"physical":"logical", rec->ingress_interface,
+      (rec->egress_if_type==0)?"physical":"logical", rec->egress_interface,
+      (unsigned long long)(rec->pkts[0]+rec->pkts[1]),
+      (unsigned long long)(rec->bytes[0]+rec->bytes[1]));
+  if (rec->flow_type==0) {
     // IPv4
+    memcpy(&src, rec->src, 4);
+    memcpy(&dst, rec->dst, 4);
     printf("src IP "ipv4_printf_format", dst IP "ipv4_printf_format", protocol %hhu, %cVLAN %u, addr space id %u",
-        ipv4_printf_be(eof_stats->IPv4.src), ipv4_printf_be(eof_stats->IPv4.dst),
-        eof_stats->IPv4.protocol, (eof_stats->IPv4.vlan_c_not_s)?'c':'s', eof_stats->IPv4.vlan_id, eof_stats->IPv4.addr_space_id);
-    if (eof_stats->IPv4.protocol==IPPROTO_UDP || eof_stats->IPv4.protocol==IPPROTO_TCP) {
-      printf(", src port %hu, dst port %hu\n", ntohs(eof_stats->IPv4.L4_srcport), ntohs(eof_stats->IPv4.L4_dstport));
-    } else {
-      printf("\n");
-    }
+        ipv4_printf_be(src), ipv4_printf_be(dst),
+        rec->protocol, (rec->vlan_c_not_s)?'c':'s', rec->vlan_id, rec->addr_space_id);
   } else {
     // IPv6
     printf("src IP "ipv6_printf_format", dst IP "ipv6_printf_format", protocol %hhu, %cVLAN %u, addr space id %u",
-        ipv6_printf(eof_stats->IPv6.src), ipv6_printf(eof_stats->IPv6.dst),
-        eof_stats->IPv6.protocol, (eof_stats->IPv6.vlan_c_not_s)?'c':'s', eof_stats->IPv6.vlan_id, eof_stats->IPv6.addr_space_id);
-    if (eof_stats->IPv6.protocol==IPPROTO_UDP || eof_stats->IPv6.protocol==IPPROTO_TCP) {
-      printf(", src port %hu, dst port %hu\n", ntohs(eof_stats->IPv6.L4_srcport), ntohs(eof_stats->IPv6.L4_dstport));
-    } else {
-      printf("\n");
-    }
-  };
-  printf("flow start time: %u.%06us\n", eof_stats->flow_sof_timestamp_s, eof_stats->flow_sof_timestamp_us);
-  printf("flow end time: %u.%06us\n", eof_stats->flow_eof_timestamp_s, eof_stats->flow_eof_timestamp_us);
+        ipv6_printf(rec->src), ipv6_printf(rec->dst),
+        rec->protocol, (rec->vlan_c_not_s)?'c':'s', rec->vlan_id, rec->addr_space_id);
+  }
+  if (rec->protocol==IPPROTO_UDP || rec->protocol==IPPROTO_TCP) {
+    printf(", src port %hu, dst port %hu\n", ntohs(rec->src_port), ntohs(rec->dst_port));
+  } else {
+    printf("\n");
+  }
+  printf("flow start time: %llu.%06llus\n", (unsigned long long)(rec->start_us/1000000), (unsigned long long)(rec->start_us%1000000));
+  printf("flow end time: %llu.%06llus\n", (unsigned long long)(rec->end_us/1000000), (unsigned long long)(rec->end_us%1000000));
+  if (!(rec->flags&NFM_FLOW_F_SOF))
+    printf("(no start of flow recorded)\n");
+}
+
+static void flush_stdout(void __attribute__((unused)) *ctx) {
+  fflush(stdout);
 }
 
 int main(int argc, char **argv)
@@ -155,9 +262,14 @@ int main(int argc, char **argv)
   unsigned int index;
   char* opt=0;
   char* tok=0;
+  unsigned int max_flows=NFM_FLOW_DEFAULT_FLOWS;
+  unsigned int modq_report=0;
+  unsigned int sketch_interval=0;
+  unsigned int sketch_top=NFM_SKETCH_DEFAULT_TOP;
+  unsigned int journal_mb=NFM_JOURNAL_DEFAULT_MB;
 
   int c;
-  while ((c = getopt_long(argc, argv, "hi:d:e:m:c:x:", __long_options, NULL)) != -1) {
+  while ((c = getopt_long(argc, argv, "hi:d:e:m:c:x:F:vX:9q:s:P:J:", __long_options, NULL)) != -1) {
     switch (c) {
     case 'i':
       host_id = (unsigned int)strtoul(optarg,0,0);
@@ -236,6 +348,51 @@ int main(int argc, char **argv)
       context=(unsigned int)strtoul(optarg,0,0);
       change_context=1;
       break;
+    case 'F':
+      max_flows=(unsigned int)strtoul(optarg,0,0);
+      if (max_flows == 0 || max_flows > NFM_FLOW_MAX_FLOWS) {
+        fprintf(stderr, "Flow table size %u is out of range (1-%u)\n", max_flows, NFM_FLOW_MAX_FLOWS);
+        exit(1);
+      }
+      break;
+    case 'v':
+      verbose=1;
+      break;
+    case 'X':
+      export_dest=optarg;
+      break;
+    case '9':
+      export_v9=1;
+      break;
+    case 'J':
+      journal_dir=optarg;
+      tok=strrchr(optarg, ':');
+      if (tok) {
+        journal_mb=(unsigned int)strtoul(tok+1,0,0);
+        if (journal_mb == 0 || journal_mb > NFM_JOURNAL_MAX_MB) {
+          fprintf(stderr, "Journal segment size %s is out of range (1-%u MB)\n", tok+1, NFM_JOURNAL_MAX_MB);
+          exit(1);
+        }
+        *tok=0;
+      }
+      tok=0;
+      break;
+    case 'q':
+      modq_report=(unsigned int)strtoul(optarg,0,0);
+      break;
+    case 'P':
+      policy_path=optarg;
+      break;
+    case 's':
+      sketch_interval=(unsigned int)strtoul(optarg,&tok,0);
+      if (*tok==':')
+        sketch_top=(unsigned int)strtoul(tok+1,0,0);
+      if (sketch_interval == 0 || sketch_top == 0 || sketch_top > NFM_SKETCH_MAX_TOP) {
+        fprintf(stderr, "Use a sensible sketch setting, (not %s)\n", optarg);
+        exit(1);
+      }
+      tok=0;
+      break;
     case 'h':
     default:
       print_usage(argv[0]);
@@ -254,6 +411,69 @@ int main(int argc, char **argv)
   action.sa_handler = sig_term;
   sigaction(SIGINT, &action, NULL);
   sigaction(SIGTERM, &action, NULL);
+  action.sa_handler = sig_usr1;
+  sigaction(SIGUSR1, &action, NULL);
+  action.sa_handler = sig_hup;
+  sigaction(SIGHUP, &action, NULL);
+
+  if (policy_path) {
+    if (nfm_policy_start(&policy, policy_path) != 0) {
+      fprintf(stderr, "Could not load policy %s\n", policy_path);
+      return -1;
+    }
+    printf("Policy: loaded %u rules from %s\n", policy.cur->num_rules, policy_path);
+  }
+
+  // The device handle is filled in once open, before the worker starts
+  if (nfm_flowmod_init(&flowmod, 0, modq_report) != 0) {
+    fprintf(stderr, "Could not allocate flow modifier queue\n");
+    return -1;
+  }
+
+  if (nfm_flowtab_init(&flowtab, max_flows) != 0) {
+    fprintf(stderr, "Could not allocate a flow table for %u flows\n", max_flows);
+    return -1;
+  }
+  nfm_flowtab_add_consumer(&flowtab, tally_flow, NULL, NULL);
+  if (verbose) {
+    nfm_flowtab_add_consumer(&flowtab, print_flow, flush_stdout, NULL);
+  }
+  if (export_dest) {
+    r=(num_multi==0)?NFM_CARD_ENDPOINT_ID(device, endpoint, host_id):multi[0];
+    if (nfm_ipfix_init(&exporter, export_v9, (uint32_t)r) != 0) {
+      fprintf(stderr, "Could not allocate flow exporter\n");
+      return -1;
+    }
+    if (strncmp(export_dest, "udp:", 4)==0) {
+      r=nfm_ipfix_open_udp(&exporter, export_dest+4);
+    } else {
+      r=nfm_ipfix_open_file(&exporter, export_dest);
+    }
+    if (r != 0) {
+      fprintf(stderr, "Could not open flow export destination %s\n", export_dest);
+      return -1;
+    }
+    nfm_flowtab_add_consumer(&flowtab, nfm_ipfix_record, nfm_ipfix_idle, &exporter);
+  }
+  if (journal_dir) {
+    if (nfm_journal_init(&journal, journal_dir, journal_mb) != 0) {
+      fprintf(stderr, "Could not use flow journal directory %s: %s\n", journal_dir, strerror(errno));
+      return -1;
+    }
+    nfm_flowtab_add_consumer(&flowtab, nfm_journal_record, NULL, &journal);
+  }
+  if (sketch_interval) {
+    sketch=nfm_sketch_create(sketch_interval, sketch_top, stdout);
+    if (!sketch) {
+      fprintf(stderr, "Could not allocate flow sketches\n");
+      return -1;
+    }
+    nfm_flowtab_add_consumer(&flowtab, nfm_sketch_record, nfm_sketch_idle, sketch);
+  }
+  if (nfm_flowtab_start(&flowtab) != 0) {
+    fprintf(stderr, "Could not start flow table consumer\n");
+    return -1;
+  }
 
   if (num_multi==0) {
     ns_packet_extra_options_t opt;
@@ -284,6 +504,12 @@ int main(int argc, char **argv)
     free(multi);
   }
 
+  flowmod.dev=dev;
+  if (nfm_flowmod_start(&flowmod) != 0) {
+    fprintf(stderr, "Could not start flow modifier worker\n");
+    return -1;
+  }
+
   while (running) {
     if (NS_NFM_SUCCESS != (r = ns_packet_receive(dev, &pckt, flags))) {
       if (running)
@@ -294,7 +520,36 @@ int main(int argc, char **argv)
     ns_packet_transmit(dev, &pckt, 0);
   }
 
+  // The worker applies what is still queued through 'dev'; the ring itself
+  // stays until the close, as SOF callbacks keep reserving from it
+  nfm_flowmod_stop(&flowmod);
+
   ns_packet_close_device(dev);
 
+  if (policy_path) {
+    nfm_policy_stop(&policy);
+  }
+  if (change_eof || change_context || policy_path) {
+    nfm_flowmod_report(&flowmod, stdout);
+  }
+  nfm_flowmod_free(&flowmod);
+
+  nfm_flowtab_stop(&flowtab);
+  nfm_flowtab_report(&flowtab, stdout);
+  if (export_dest) {
+    nfm_ipfix_close(&exporter);
+    nfm_ipfix_report(&exporter, stdout);
+  }
+  if (journal_dir) {
+    nfm_journal_close(&journal);
+    nfm_journal_report(&journal, stdout);
+  }
+  if (sketch) {
+    nfm_sketch_flush(sketch);
+    free(sketch);
+  }
+  printf("Completed flows: %llu, total packets=%llu, total bytes=%llu\n", total_flows, total_packets, total_bytes);
+  nfm_flowtab_free(&flowtab);
+
   return 0;
 }
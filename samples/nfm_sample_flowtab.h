@@ -0,0 +1,381 @@
+/**
+ * Copyright (C) 2013 Netronome Systems, Inc.  All rights reserved.
+ *
+ * File:        nfm_sample_flowtab.h
+ * Description: In-memory flow record table for the start/end of flow
+ *              callbacks. Records are keyed by flow ID in an open
+ *              addressing table (linear probing, backward shift delete)
+ *              whose slots are all allocated and touched at startup.
+ *
+ *              Start of flow inserts a record; end of flow completes it
+ *              with the packet/byte counts and end time, frees the slot and
+ *              queues the record on a single-producer/single-consumer ring.
+ *              A consumer thread hands completed records to the registered
+ *              consumers. The table is owned by the callback thread; a full
+ *              table or ring never blocks it, the event is counted instead.
+ */
+
+#ifndef NFM_SAMPLE_FLOWTAB_H
+#define NFM_SAMPLE_FLOWTAB_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "ns_packet.h"
+
+#define NFM_FLOW_DEFAULT_FLOWS  262144
+#define NFM_FLOW_MAX_FLOWS      (1U<<24)
+#define NFM_FLOW_RING_SIZE      65536  // completed records in flight, power of two
+#define NFM_FLOW_MAX_CONSUMERS  4
+#define NFM_FLOW_IDLE_US        1000   // consumer sleep when the ring is empty
+#define NFM_FLOW_TICK_MS        100    // idle hooks run at least this often under load
+
+// Record flags
+#define NFM_FLOW_F_SOF          0x1    // start of flow seen
+#define NFM_FLOW_F_EOF          0x2    // end of flow seen
+
+// A flow record. Addresses and ports are in network byte order as reported
+// by the NFE; IPv4 addresses use the first 4 bytes of src/dst.
+typedef struct {
+  uint32_t flow_id;
+  uint32_t ctx;
+  uint32_t ingress_interface;
+  uint32_t egress_interface;
+  uint8_t ingress_if_type;
+  uint8_t egress_if_type;
+  uint8_t flow_type;       // 0 IPv4, otherwise IPv6
+  uint8_t protocol;
+  uint8_t vlan_c_not_s;
+  uint8_t flags;
+  uint16_t vlan_id;
+  uint16_t addr_space_id;
+  uint16_t rule_id;
+  uint16_t src_port;
+  uint16_t dst_port;
+  uint8_t src[16];
+  uint8_t dst[16];
+  uint64_t start_us;       // NFE time, microseconds
+  uint64_t end_us;
+  uint64_t pkts[2];        // per direction
+  uint64_t bytes[2];
+} nfm_flow_rec_t;
+
+// Consumer thread callbacks: 'rec' for every completed record, 'idle' (may
+// be NULL) whenever the ring has been drained, and every NFM_FLOW_TICK_MS
+// while it never is, e.g. to flush buffered output or run timers
+typedef void (*nfm_flow_rec_fn)(const nfm_flow_rec_t* rec, void* ctx);
+typedef void (*nfm_flow_idle_fn)(void* ctx);
+
+typedef struct {
+  nfm_flow_rec_fn rec;
+  nfm_flow_idle_fn idle;
+  void* ctx;
+} nfm_flow_consumer_t;
+
+typedef struct {
+  uint32_t used;
+  nfm_flow_rec_t rec;
+} nfm_flow_slot_t;
+
+typedef struct {
+  // Callback thread
+  nfm_flow_slot_t* slots;
+  uint32_t mask;
+  uint32_t active;
+  uint32_t max_active;
+  uint64_t inserted;
+  uint64_t replaced;       // start of flow for an ID already in the table
+  uint64_t table_full;
+  uint64_t eof_only;       // end of flow without a stored start of flow
+  uint64_t completed;
+  uint64_t ring_drops;
+  volatile uint32_t head __attribute__((aligned(64)));
+  // Consumer thread
+  volatile uint32_t tail __attribute__((aligned(64)));
+  uint64_t consumed;
+  nfm_flow_consumer_t consumers[NFM_FLOW_MAX_CONSUMERS];
+  unsigned int num_consumers;
+  pthread_t thread;
+  volatile int running;
+  nfm_flow_rec_t* ring;
+} nfm_flowtab_t;
+
+static inline uint32_t nfm_flow_hash(uint32_t flow_id)
+{
+  return flow_id*0x9e3779b1U;
+}
+
+// Size the table for 'max_flows' concurrent flows at no more than 50% load
+static inline int nfm_flowtab_init(nfm_flowtab_t* ft, uint32_t max_flows)
+{
+  uint32_t size = 2;
+  memset(ft, 0, sizeof(*ft));
+  if (max_flows == 0 || max_flows > NFM_FLOW_MAX_FLOWS)
+    return -1;
+  while (size < 2*max_flows)
+    size <<= 1;
+  if (posix_memalign((void**)&ft->slots, 64, size*sizeof(nfm_flow_slot_t)) != 0)
+    return -1;
+  if (posix_memalign((void**)&ft->ring, 64, NFM_FLOW_RING_SIZE*sizeof(nfm_flow_rec_t)) != 0) {
+    free(ft->slots);
+    ft->slots = NULL;
+    return -1;
+  }
+  // Touch everything now rather than on the first million flows
+  memset(ft->slots, 0, size*sizeof(nfm_flow_slot_t));
+  memset(ft->ring, 0, NFM_FLOW_RING_SIZE*sizeof(nfm_flow_rec_t));
+  ft->mask = size-1;
+  ft->max_active = max_flows;
+  return 0;
+}
+
+// Register a consumer; call before nfm_flowtab_start
+static inline int nfm_flowtab_add_consumer(nfm_flowtab_t* ft, nfm_flow_rec_fn rec, nfm_flow_idle_fn idle, void* ctx)
+{
+  if (ft->num_consumers == NFM_FLOW_MAX_CONSUMERS)
+    return -1;
+  ft->consumers[ft->num_consumers].rec = rec;
+  ft->consumers[ft->num_consumers].idle = idle;
+  ft->consumers[ft->num_consumers].ctx = ctx;
+  ft->num_consumers++;
+  return 0;
+}
+
+static inline nfm_flow_slot_t* nfm_flowtab_find(nfm_flowtab_t* ft, uint32_t flow_id)
+{
+  uint32_t i = nfm_flow_hash(flow_id) & ft->mask;
+  while (ft->slots[i].used) {
+    if (ft->slots[i].rec.flow_id == flow_id)
+      return &ft->slots[i];
+    i = (i+1) & ft->mask;
+  }
+  return NULL;
+}
+
+// Free a slot, shifting later entries of the probe run back so no
+// tombstones are needed
+static inline void nfm_flowtab_remove(nfm_flowtab_t* ft, nfm_flow_slot_t* slot)
+{
+  uint32_t hole = (uint32_t)(slot - ft->slots);
+  uint32_t i = hole;
+  for (;;) {
+    uint32_t home;
+    i = (i+1) & ft->mask;
+    if (!ft->slots[i].used)
+      break;
+    home = nfm_flow_hash(ft->slots[i].rec.flow_id) & ft->mask;
+    // Move the entry into the hole unless its home lies cyclically in (hole, i]
+    if (((i-home) & ft->mask) >= ((i-hole) & ft->mask)) {
+      ft->slots[hole] = ft->slots[i];
+      hole = i;
+    }
+  }
+  ft->slots[hole].used = 0;
+  ft->active--;
+}
+
+// Queue a completed record for the consumer thread
+static inline void nfm_flowtab_emit(nfm_flowtab_t* ft, const nfm_flow_rec_t* rec)
+{
+  uint32_t head = ft->head;
+  ft->completed++;
+  if (head - __atomic_load_n(&ft->tail, __ATOMIC_ACQUIRE) >= NFM_FLOW_RING_SIZE) {
+    ft->ring_drops++;
+    return;
+  }
+  ft->ring[head&(NFM_FLOW_RING_SIZE-1)] = *rec;
+  __atomic_store_n(&ft->head, head+1, __ATOMIC_RELEASE);
+}
+
+#define NFM_FLOW_COPY_TUPLE(rec, stats)                                   \
+  do {                                                                    \
+    (rec)->flow_id = (stats)->flow_id;                                    \
+    (rec)->ctx = (stats)->ctx;                                            \
+    (rec)->ingress_interface = (stats)->ingress_interface;                \
+    (rec)->egress_interface = (stats)->egress_interface;                  \
+    (rec)->ingress_if_type = (stats)->ingress_if_type;                    \
+    (rec)->egress_if_type = (stats)->egress_if_type;                      \
+    (rec)->flow_type = (stats)->flow_type;                                \
+    if ((stats)->flow_type == 0) {                                        \
+      memcpy((rec)->src, &(stats)->IPv4.src, 4);                          \
+      memcpy((rec)->dst, &(stats)->IPv4.dst, 4);                          \
+      (rec)->protocol = (stats)->IPv4.protocol;                           \
+      (rec)->vlan_c_not_s = (stats)->IPv4.vlan_c_not_s;                   \
+      (rec)->vlan_id = (stats)->IPv4.vlan_id;                             \
+      (rec)->addr_space_id = (stats)->IPv4.addr_space_id;                 \
+      (rec)->src_port = (stats)->IPv4.L4_srcport;                         \
+      (rec)->dst_port = (stats)->IPv4.L4_dstport;                         \
+    } else {                                                              \
+      memcpy((rec)->src, (stats)->IPv6.src, 16);                          \
+      memcpy((rec)->dst, (stats)->IPv6.dst, 16);                          \
+      (rec)->protocol = (stats)->IPv6.protocol;                           \
+      (rec)->vlan_c_not_s = (stats)->IPv6.vlan_c_not_s;                   \
+      (rec)->vlan_id = (stats)->IPv6.vlan_id;                             \
+      (rec)->addr_space_id = (stats)->IPv6.addr_space_id;                 \
+      (rec)->src_port = (stats)->IPv6.L4_srcport;                         \
+      (rec)->dst_port = (stats)->IPv6.L4_dstport;                         \
+    }                                                                     \
+  } while (0)
+
+// Callback thread: start of flow. Returns the stored record, or NULL when
+// the table is full.
+static inline nfm_flow_rec_t* nfm_flowtab_sof(nfm_flowtab_t* ft, const ns_packet_flow_start_stats_t* s)
+{
+  nfm_flow_slot_t* slot = nfm_flowtab_find(ft, s->flow_id);
+  uint32_t i;
+  if (slot) {
+    // Flow ID reused before its end of flow arrived: start over
+    ft->replaced++;
+  } else {
+    if (ft->active >= ft->max_active) {
+      ft->table_full++;
+      return NULL;
+    }
+    i = nfm_flow_hash(s->flow_id) & ft->mask;
+    while (ft->slots[i].used)
+      i = (i+1) & ft->mask;
+    slot = &ft->slots[i];
+    slot->used = 1;
+    ft->active++;
+  }
+  memset(&slot->rec, 0, sizeof(slot->rec));
+  NFM_FLOW_COPY_TUPLE(&slot->rec, s);
+  slot->rec.start_us = (uint64_t)s->flow_sof_timestamp_s*1000000ULL + s->flow_sof_timestamp_us;
+  slot->rec.flags = NFM_FLOW_F_SOF;
+  ft->inserted++;
+  return &slot->rec;
+}
+
+// Callback thread: end of flow. Completes the stored record (or builds one
+// from the end of flow alone) and queues it for the consumers.
+static inline void nfm_flowtab_eof(nfm_flowtab_t* ft, const ns_packet_flow_end_stats_t* s)
+{
+  nfm_flow_slot_t* slot = nfm_flowtab_find(ft, s->flow_id);
+  nfm_flow_rec_t local;
+  nfm_flow_rec_t* rec;
+  if (slot) {
+    rec = &slot->rec;
+  } else {
+    ft->eof_only++;
+    rec = &local;
+    memset(rec, 0, sizeof(*rec));
+    NFM_FLOW_COPY_TUPLE(rec, s);
+  }
+  // The end of flow carries the final context and the start time as well
+  rec->ctx = s->ctx;
+  rec->rule_id = s->rule_id;
+  rec->egress_interface = s->egress_interface;
+  rec->egress_if_type = s->egress_if_type;
+  rec->start_us = (uint64_t)s->flow_sof_timestamp_s*1000000ULL + s->flow_sof_timestamp_us;
+  rec->end_us = (uint64_t)s->flow_eof_timestamp_s*1000000ULL + s->flow_eof_timestamp_us;
+  rec->pkts[0] = s->packet_count[0];
+  rec->pkts[1] = s->packet_count[1];
+  rec->bytes[0] = s->byte_count[0];
+  rec->bytes[1] = s->byte_count[1];
+  rec->flags |= NFM_FLOW_F_EOF;
+  nfm_flowtab_emit(ft, rec);
+  if (slot)
+    nfm_flowtab_remove(ft, slot);
+}
+
+static inline unsigned int nfm_flowtab_drain(nfm_flowtab_t* ft)
+{
+  uint32_t head = __atomic_load_n(&ft->head, __ATOMIC_ACQUIRE);
+  uint32_t tail = ft->tail;
+  unsigned int i, done = 0;
+  while (tail != head) {
+    const nfm_flow_rec_t* rec = &ft->ring[tail&(NFM_FLOW_RING_SIZE-1)];
+    for (i = 0; i < ft->num_consumers; i++)
+      ft->consumers[i].rec(rec, ft->consumers[i].ctx);
+    tail++;
+    done++;
+    // Hand back slots as we go so a long drain does not starve the producer
+    if ((done & 255) == 0)
+      __atomic_store_n(&ft->tail, tail, __ATOMIC_RELEASE);
+  }
+  __atomic_store_n(&ft->tail, tail, __ATOMIC_RELEASE);
+  ft->consumed += done;
+  return done;
+}
+
+static inline void nfm_flowtab_idle(nfm_flowtab_t* ft)
+{
+  unsigned int i;
+  for (i = 0; i < ft->num_consumers; i++) {
+    if (ft->consumers[i].idle)
+      ft->consumers[i].idle(ft->consumers[i].ctx);
+  }
+}
+
+static void* nfm_flowtab_consumer(void* arg)
+{
+  nfm_flowtab_t* ft = (nfm_flowtab_t*)arg;
+  struct timespec idle = { 0, NFM_FLOW_IDLE_US*1000L };
+  struct timespec now;
+  uint64_t now_ms, tick_ms = 0;
+  sigset_t sigs;
+
+  sigfillset(&sigs);
+  pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+  while (ft->running) {
+    unsigned int done = nfm_flowtab_drain(ft);
+    // Under sustained churn the ring is never empty, so timers in the idle
+    // hooks (flush and template refresh deadlines) also run on a clock
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    now_ms = (uint64_t)now.tv_sec*1000 + now.tv_nsec/1000000;
+    if (done == 0 || now_ms - tick_ms >= NFM_FLOW_TICK_MS) {
+      nfm_flowtab_idle(ft);
+      tick_ms = now_ms;
+    }
+    if (done == 0)
+      nanosleep(&idle, NULL);
+  }
+  nfm_flowtab_drain(ft);
+  nfm_flowtab_idle(ft);
+  return NULL;
+}
+
+static inline int nfm_flowtab_start(nfm_flowtab_t* ft)
+{
+  ft->running = 1;
+  if (pthread_create(&ft->thread, NULL, nfm_flowtab_consumer, ft) != 0) {
+    ft->running = 0;
+    return -1;
+  }
+  return 0;
+}
+
+// Stop the consumer once it has handed over what is queued
+static inline void nfm_flowtab_stop(nfm_flowtab_t* ft)
+{
+  if (ft->running) {
+    ft->running = 0;
+    pthread_join(ft->thread, NULL);
+  }
+}
+
+static inline void nfm_flowtab_report(nfm_flowtab_t* ft, FILE* f)
+{
+  fprintf(f, "Flow table: %u active (max %u, %u slots), %llu started, %llu completed, %llu consumed\n",
+          ft->active, ft->max_active, ft->mask+1, (unsigned long long)ft->inserted,
+          (unsigned long long)ft->completed, (unsigned long long)ft->consumed);
+  fprintf(f, "Flow table: %llu table full, %llu restarted, %llu end without start, %llu dropped on ring overflow\n",
+          (unsigned long long)ft->table_full, (unsigned long long)ft->replaced,
+          (unsigned long long)ft->eof_only, (unsigned long long)ft->ring_drops);
+}
+
+static inline void nfm_flowtab_free(nfm_flowtab_t* ft)
+{
+  free(ft->slots);
+  free(ft->ring);
+  ft->slots = NULL;
+  ft->ring = NULL;
+}
+
+#endif
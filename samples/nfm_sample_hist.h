@@ -0,0 +1,110 @@
+/**
+ * Copyright (C) 2013 Netronome Systems, Inc.  All rights reserved.
+ *
+ * File:        nfm_sample_hist.h
+ * Description: Log-linear (HDR style) latency histogram for the packet
+ *              samples. Values below 2^NFM_HIST_SUB_BITS get a bucket each;
+ *              above that every power of two is split into 2^(SUB_BITS-1)
+ *              linear buckets, giving ~3% relative precision.
+ *
+ *              Each histogram has a single writer and only ever counts up.
+ *              The reporter derives per-interval figures by diffing against
+ *              its own snapshot, so no locks are taken on either side.
+ */
+
+#ifndef NFM_SAMPLE_HIST_H
+#define NFM_SAMPLE_HIST_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define NFM_HIST_SUB_BITS   6
+#define NFM_HIST_SUB_COUNT  (1U<<NFM_HIST_SUB_BITS)
+#define NFM_HIST_SUB_HALF   (NFM_HIST_SUB_COUNT/2)
+// Values are clamped to 2^NFM_HIST_MAX_BITS-1 (ns: ~18 minutes)
+#define NFM_HIST_MAX_BITS   40
+#define NFM_HIST_BUCKETS    (NFM_HIST_SUB_COUNT + (NFM_HIST_MAX_BITS-NFM_HIST_SUB_BITS)*NFM_HIST_SUB_HALF)
+
+typedef struct {
+  uint64_t counts[NFM_HIST_BUCKETS];
+} __attribute__((aligned(64))) nfm_hist_t;
+
+static inline unsigned int nfm_hist_index(uint64_t v)
+{
+  unsigned int msb, shift;
+  if (v < NFM_HIST_SUB_COUNT)
+    return (unsigned int)v;
+  msb = 63 - __builtin_clzll(v);
+  if (msb >= NFM_HIST_MAX_BITS)
+    return NFM_HIST_BUCKETS-1;
+  shift = msb - (NFM_HIST_SUB_BITS-1);
+  return NFM_HIST_SUB_COUNT + (shift-1)*NFM_HIST_SUB_HALF + (unsigned int)(v>>shift) - NFM_HIST_SUB_HALF;
+}
+
+// Highest value that maps to bucket 'index'
+static inline uint64_t nfm_hist_value(unsigned int index)
+{
+  unsigned int shift;
+  uint64_t sub;
+  if (index < NFM_HIST_SUB_COUNT)
+    return index;
+  shift = (index-NFM_HIST_SUB_COUNT)/NFM_HIST_SUB_HALF + 1;
+  sub = (index-NFM_HIST_SUB_COUNT)%NFM_HIST_SUB_HALF + NFM_HIST_SUB_HALF;
+  return ((sub+1)<<shift) - 1;
+}
+
+// Owning thread only
+static inline void nfm_hist_record(nfm_hist_t* h, uint64_t v, uint64_t n)
+{
+  uint64_t* c = &h->counts[nfm_hist_index(v)];
+  __atomic_store_n(c, *c+n, __ATOMIC_RELAXED);
+}
+
+// Reporter side: add what 'cur' gained since 'prev' into 'sum', then
+// remember 'cur' in 'prev' for the next interval
+static inline void nfm_hist_collect(nfm_hist_t* sum, const nfm_hist_t* cur, nfm_hist_t* prev)
+{
+  unsigned int i;
+  for (i = 0; i < NFM_HIST_BUCKETS; i++) {
+    uint64_t c = __atomic_load_n(&cur->counts[i], __ATOMIC_RELAXED);
+    sum->counts[i] += c - prev->counts[i];
+    prev->counts[i] = c;
+  }
+}
+
+static inline uint64_t nfm_hist_total(const nfm_hist_t* h)
+{
+  uint64_t total = 0;
+  unsigned int i;
+  for (i = 0; i < NFM_HIST_BUCKETS; i++)
+    total += h->counts[i];
+  return total;
+}
+
+// Value at percentile 'pct' (0-100) of 'total' samples
+static inline uint64_t nfm_hist_percentile(const nfm_hist_t* h, uint64_t total, double pct)
+{
+  uint64_t rank = (uint64_t)(total*pct/100.0 + 0.5);
+  uint64_t seen = 0;
+  unsigned int i;
+  if (rank == 0)
+    rank = 1;
+  for (i = 0; i < NFM_HIST_BUCKETS; i++) {
+    seen += h->counts[i];
+    if (seen >= rank)
+      return nfm_hist_value(i);
+  }
+  return nfm_hist_value(NFM_HIST_BUCKETS-1);
+}
+
+static inline uint64_t nfm_hist_max(const nfm_hist_t* h)
+{
+  unsigned int i = NFM_HIST_BUCKETS;
+  while (i--) {
+    if (h->counts[i])
+      return nfm_hist_value(i);
+  }
+  return 0;
+}
+
+#endif
@@ -0,0 +1,450 @@
+/**
+ * Copyright (C) 2013 Netronome Systems, Inc.  All rights reserved.
+ *
+ * File:        nfm_sample_ipfix.h
+ * Description: IPFIX (RFC 7011) and NetFlow v9 (RFC 3954) exporter for the
+ *              flow record table. Runs as a flow table consumer, so all
+ *              encoding and I/O happens on the consumer thread.
+ *
+ *              One template each for IPv4 and IPv6 flows is built once and
+ *              cached in wire format. Records are packed into data sets,
+ *              many per message, and a message goes out when the next
+ *              record would not fit, when it has waited long enough, or on
+ *              close. Over UDP the templates are resent periodically; in a
+ *              file they are written once at the start.
+ */
+
+#ifndef NFM_SAMPLE_IPFIX_H
+#define NFM_SAMPLE_IPFIX_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <endian.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+
+#include "nfm_sample_flowtab.h"
+
+#define NFM_IPFIX_VERSION       10
+#define NFM_IPFIX_V9_VERSION    9
+#define NFM_IPFIX_DEFAULT_MTU   1400  // message size limit over UDP
+#define NFM_IPFIX_FILE_MTU      65535 // and in a file
+#define NFM_IPFIX_TEMPLATE_S    60    // UDP template refresh interval
+#define NFM_IPFIX_FLUSH_MS      1000  // longest a record waits in a partial message
+#define NFM_IPFIX_TEMPLATE_V4   256
+#define NFM_IPFIX_TEMPLATE_V6   257
+#define NFM_IPFIX_MAX_FIELDS    20
+#define NFM_IPFIX_REVERSE_PEN   29305 // RFC 5103 reverse information elements
+
+// What a template field is filled from
+enum {
+  NFM_IPFIX_SRC4, NFM_IPFIX_DST4, NFM_IPFIX_SRC6, NFM_IPFIX_DST6,
+  NFM_IPFIX_SRC_PORT, NFM_IPFIX_DST_PORT, NFM_IPFIX_PROTOCOL, NFM_IPFIX_VLAN,
+  NFM_IPFIX_IN_IF, NFM_IPFIX_OUT_IF, NFM_IPFIX_VRF, NFM_IPFIX_FLOW_ID,
+  NFM_IPFIX_PKTS, NFM_IPFIX_BYTES, NFM_IPFIX_REV_PKTS, NFM_IPFIX_REV_BYTES,
+  NFM_IPFIX_START_MS, NFM_IPFIX_END_MS, NFM_IPFIX_FIRST_UP, NFM_IPFIX_LAST_UP
+};
+
+typedef struct {
+  uint16_t id;
+  uint16_t len;
+  uint32_t pen;    // enterprise number, 0 for IANA elements
+  uint8_t src;     // NFM_IPFIX_*
+} nfm_ipfix_field_t;
+
+static const nfm_ipfix_field_t nfm_ipfix_fields_v4[] = {
+  { 8, 4, 0, NFM_IPFIX_SRC4 }, { 12, 4, 0, NFM_IPFIX_DST4 },
+  { 7, 2, 0, NFM_IPFIX_SRC_PORT }, { 11, 2, 0, NFM_IPFIX_DST_PORT },
+  { 4, 1, 0, NFM_IPFIX_PROTOCOL }, { 58, 2, 0, NFM_IPFIX_VLAN },
+  { 10, 4, 0, NFM_IPFIX_IN_IF }, { 14, 4, 0, NFM_IPFIX_OUT_IF },
+  { 234, 4, 0, NFM_IPFIX_VRF }, { 148, 8, 0, NFM_IPFIX_FLOW_ID },
+  { 2, 8, 0, NFM_IPFIX_PKTS }, { 1, 8, 0, NFM_IPFIX_BYTES },
+  { 2, 8, NFM_IPFIX_REVERSE_PEN, NFM_IPFIX_REV_PKTS }, { 1, 8, NFM_IPFIX_REVERSE_PEN, NFM_IPFIX_REV_BYTES },
+  { 152, 8, 0, NFM_IPFIX_START_MS }, { 153, 8, 0, NFM_IPFIX_END_MS }
+};
+
+static const nfm_ipfix_field_t nfm_ipfix_fields_v6[] = {
+  { 27, 16, 0, NFM_IPFIX_SRC6 }, { 28, 16, 0, NFM_IPFIX_DST6 },
+  { 7, 2, 0, NFM_IPFIX_SRC_PORT }, { 11, 2, 0, NFM_IPFIX_DST_PORT },
+  { 4, 1, 0, NFM_IPFIX_PROTOCOL }, { 58, 2, 0, NFM_IPFIX_VLAN },
+  { 10, 4, 0, NFM_IPFIX_IN_IF }, { 14, 4, 0, NFM_IPFIX_OUT_IF },
+  { 234, 4, 0, NFM_IPFIX_VRF }, { 148, 8, 0, NFM_IPFIX_FLOW_ID },
+  { 2, 8, 0, NFM_IPFIX_PKTS }, { 1, 8, 0, NFM_IPFIX_BYTES },
+  { 2, 8, NFM_IPFIX_REVERSE_PEN, NFM_IPFIX_REV_PKTS }, { 1, 8, NFM_IPFIX_REVERSE_PEN, NFM_IPFIX_REV_BYTES },
+  { 152, 8, 0, NFM_IPFIX_START_MS }, { 153, 8, 0, NFM_IPFIX_END_MS }
+};
+
+// NetFlow v9 has no enterprise elements or absolute times: the reverse
+// direction goes in OUT_PKTS/OUT_BYTES and times are sysUptime based
+static const nfm_ipfix_field_t nfm_ipfix_fields_v9_v4[] = {
+  { 8, 4, 0, NFM_IPFIX_SRC4 }, { 12, 4, 0, NFM_IPFIX_DST4 },
+  { 7, 2, 0, NFM_IPFIX_SRC_PORT }, { 11, 2, 0, NFM_IPFIX_DST_PORT },
+  { 4, 1, 0, NFM_IPFIX_PROTOCOL }, { 58, 2, 0, NFM_IPFIX_VLAN },
+  { 10, 4, 0, NFM_IPFIX_IN_IF }, { 14, 4, 0, NFM_IPFIX_OUT_IF },
+  { 2, 8, 0, NFM_IPFIX_PKTS }, { 1, 8, 0, NFM_IPFIX_BYTES },
+  { 24, 8, 0, NFM_IPFIX_REV_PKTS }, { 23, 8, 0, NFM_IPFIX_REV_BYTES },
+  { 22, 4, 0, NFM_IPFIX_FIRST_UP }, { 21, 4, 0, NFM_IPFIX_LAST_UP }
+};
+
+static const nfm_ipfix_field_t nfm_ipfix_fields_v9_v6[] = {
+  { 27, 16, 0, NFM_IPFIX_SRC6 }, { 28, 16, 0, NFM_IPFIX_DST6 },
+  { 7, 2, 0, NFM_IPFIX_SRC_PORT }, { 11, 2, 0, NFM_IPFIX_DST_PORT },
+  { 4, 1, 0, NFM_IPFIX_PROTOCOL }, { 58, 2, 0, NFM_IPFIX_VLAN },
+  { 10, 4, 0, NFM_IPFIX_IN_IF }, { 14, 4, 0, NFM_IPFIX_OUT_IF },
+  { 2, 8, 0, NFM_IPFIX_PKTS }, { 1, 8, 0, NFM_IPFIX_BYTES },
+  { 24, 8, 0, NFM_IPFIX_REV_PKTS }, { 23, 8, 0, NFM_IPFIX_REV_BYTES },
+  { 22, 4, 0, NFM_IPFIX_FIRST_UP }, { 21, 4, 0, NFM_IPFIX_LAST_UP }
+};
+
+#define NFM_IPFIX_NFIELDS(a) (sizeof(a)/sizeof((a)[0]))
+
+typedef struct {
+  const nfm_ipfix_field_t* fields;
+  unsigned int num_fields;
+  uint16_t id;
+  uint16_t rec_len;
+} nfm_ipfix_template_t;
+
+typedef struct {
+  int v9;
+  int fd;                  // UDP socket, or -1
+  FILE* file;              // file output, or NULL
+  uint32_t domain;         // observation domain / source ID
+  unsigned int mtu;
+  nfm_ipfix_template_t tmpl[2];  // [0] IPv4, [1] IPv6
+  // Cached template set/flowset, wire format
+  unsigned char tmpl_wire[512];
+  unsigned int tmpl_len;
+  unsigned int tmpl_interval_s;
+  uint64_t tmpl_sent_ns;
+  int tmpl_pending;
+  // Message being built
+  unsigned char* buf;
+  unsigned int len;
+  unsigned int set_off;    // offset of the open data set header, 0 if none
+  int set_tmpl;            // template index of the open data set
+  unsigned int msg_recs;   // data records in this message
+  unsigned int msg_count;  // v9 header count: records plus templates
+  uint64_t msg_start_ns;
+  // Sequence numbers: IPFIX counts data records, v9 counts messages
+  uint32_t sequence;
+  uint64_t boot_ms;        // v9 sysUptime origin, CLOCK_REALTIME
+  uint64_t boot_mono_ns;
+  // Counters
+  uint64_t records;
+  uint64_t messages;
+  uint64_t bytes;
+  uint64_t errors;
+} nfm_ipfix_t;
+
+static inline uint64_t nfm_ipfix_mono_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static inline void nfm_ipfix_put16(unsigned char* p, uint16_t v)
+{
+  v = htobe16(v);
+  memcpy(p, &v, 2);
+}
+
+static inline void nfm_ipfix_put32(unsigned char* p, uint32_t v)
+{
+  v = htobe32(v);
+  memcpy(p, &v, 4);
+}
+
+static inline void nfm_ipfix_put64(unsigned char* p, uint64_t v)
+{
+  v = htobe64(v);
+  memcpy(p, &v, 8);
+}
+
+// Build the template set (IPFIX) or template flowset (v9) once
+static inline void nfm_ipfix_build_templates(nfm_ipfix_t* x)
+{
+  unsigned char* p = x->tmpl_wire;
+  unsigned int t, f, off = 4;
+  for (t = 0; t < 2; t++) {
+    const nfm_ipfix_template_t* tm = &x->tmpl[t];
+    nfm_ipfix_put16(p+off, tm->id);
+    nfm_ipfix_put16(p+off+2, (uint16_t)tm->num_fields);
+    off += 4;
+    for (f = 0; f < tm->num_fields; f++) {
+      const nfm_ipfix_field_t* fl = &tm->fields[f];
+      nfm_ipfix_put16(p+off, (uint16_t)(fl->id | (fl->pen?0x8000:0)));
+      nfm_ipfix_put16(p+off+2, fl->len);
+      off += 4;
+      if (fl->pen) {
+        nfm_ipfix_put32(p+off, fl->pen);
+        off += 4;
+      }
+    }
+  }
+  // Set ID 2 is the IPFIX template set, flowset ID 0 the v9 template flowset
+  nfm_ipfix_put16(p, x->v9?0:2);
+  nfm_ipfix_put16(p+2, (uint16_t)off);
+  x->tmpl_len = off;
+}
+
+static inline void nfm_ipfix_init_template(nfm_ipfix_template_t* tm, uint16_t id, const nfm_ipfix_field_t* fields, unsigned int num_fields)
+{
+  unsigned int f;
+  tm->id = id;
+  tm->fields = fields;
+  tm->num_fields = num_fields;
+  tm->rec_len = 0;
+  for (f = 0; f < num_fields; f++)
+    tm->rec_len += fields[f].len;
+}
+
+static inline unsigned int nfm_ipfix_hdr_len(const nfm_ipfix_t* x)
+{
+  return x->v9?20:16;
+}
+
+static inline int nfm_ipfix_init(nfm_ipfix_t* x, int v9, uint32_t domain)
+{
+  struct timespec ts;
+  memset(x, 0, sizeof(*x));
+  x->v9 = v9;
+  x->fd = -1;
+  x->domain = domain;
+  if (v9) {
+    nfm_ipfix_init_template(&x->tmpl[0], NFM_IPFIX_TEMPLATE_V4, nfm_ipfix_fields_v9_v4, NFM_IPFIX_NFIELDS(nfm_ipfix_fields_v9_v4));
+    nfm_ipfix_init_template(&x->tmpl[1], NFM_IPFIX_TEMPLATE_V6, nfm_ipfix_fields_v9_v6, NFM_IPFIX_NFIELDS(nfm_ipfix_fields_v9_v6));
+  } else {
+    nfm_ipfix_init_template(&x->tmpl[0], NFM_IPFIX_TEMPLATE_V4, nfm_ipfix_fields_v4, NFM_IPFIX_NFIELDS(nfm_ipfix_fields_v4));
+    nfm_ipfix_init_template(&x->tmpl[1], NFM_IPFIX_TEMPLATE_V6, nfm_ipfix_fields_v6, NFM_IPFIX_NFIELDS(nfm_ipfix_fields_v6));
+  }
+  nfm_ipfix_build_templates(x);
+  x->buf = (unsigned char*)malloc(NFM_IPFIX_FILE_MTU);
+  if (!x->buf)
+    return -1;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  x->boot_ms = (uint64_t)ts.tv_sec*1000ULL + ts.tv_nsec/1000000;
+  x->boot_mono_ns = nfm_ipfix_mono_ns();
+  x->tmpl_pending = 1;
+  return 0;
+}
+
+// "host:port" over UDP; templates are refreshed every NFM_IPFIX_TEMPLATE_S
+static inline int nfm_ipfix_open_udp(nfm_ipfix_t* x, const char* dest)
+{
+  char host[256];
+  const char* port = strrchr(dest, ':');
+  struct addrinfo hints, *res, *ai;
+  if (!port || port == dest || (size_t)(port-dest) >= sizeof(host))
+    return -1;
+  memcpy(host, dest, port-dest);
+  host[port-dest] = 0;
+  // Allow [v6addr]:port
+  if (host[0] == '[' && host[port-dest-1] == ']') {
+    memmove(host, host+1, port-dest-2);
+    host[port-dest-2] = 0;
+  }
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+  if (getaddrinfo(host, port+1, &hints, &res) != 0)
+    return -1;
+  for (ai = res; ai; ai = ai->ai_next) {
+    x->fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (x->fd < 0)
+      continue;
+    if (connect(x->fd, ai->ai_addr, ai->ai_addrlen) == 0)
+      break;
+    close(x->fd);
+    x->fd = -1;
+  }
+  freeaddrinfo(res);
+  if (x->fd < 0)
+    return -1;
+  x->mtu = NFM_IPFIX_DEFAULT_MTU;
+  x->tmpl_interval_s = NFM_IPFIX_TEMPLATE_S;
+  return 0;
+}
+
+static inline int nfm_ipfix_open_file(nfm_ipfix_t* x, const char* path)
+{
+  x->file = fopen(path, "wb");
+  if (!x->file)
+    return -1;
+  x->mtu = NFM_IPFIX_FILE_MTU;
+  x->tmpl_interval_s = 0;
+  return 0;
+}
+
+static inline void nfm_ipfix_close_set(nfm_ipfix_t* x)
+{
+  if (x->set_off) {
+    unsigned int set_len = x->len - x->set_off;
+    // v9 flowsets are padded to 4 bytes; IPFIX sets need no padding
+    if (x->v9) {
+      while (set_len & 3) {
+        x->buf[x->len++] = 0;
+        set_len++;
+      }
+    }
+    nfm_ipfix_put16(x->buf+x->set_off+2, (uint16_t)set_len);
+    x->set_off = 0;
+  }
+}
+
+// Finish and send the current message, if it holds anything
+static inline void nfm_ipfix_flush(nfm_ipfix_t* x)
+{
+  unsigned char* h = x->buf;
+  uint32_t now_s = (uint32_t)time(NULL);
+  if (x->len <= nfm_ipfix_hdr_len(x))
+    return;
+  nfm_ipfix_close_set(x);
+  if (x->v9) {
+    nfm_ipfix_put16(h, NFM_IPFIX_V9_VERSION);
+    nfm_ipfix_put16(h+2, (uint16_t)x->msg_count);
+    nfm_ipfix_put32(h+4, (uint32_t)((nfm_ipfix_mono_ns()-x->boot_mono_ns)/1000000));
+    nfm_ipfix_put32(h+8, now_s);
+    nfm_ipfix_put32(h+12, x->sequence++);
+    nfm_ipfix_put32(h+16, x->domain);
+  } else {
+    nfm_ipfix_put16(h, NFM_IPFIX_VERSION);
+    nfm_ipfix_put16(h+2, (uint16_t)x->len);
+    nfm_ipfix_put32(h+4, now_s);
+    nfm_ipfix_put32(h+8, x->sequence);
+    nfm_ipfix_put32(h+12, x->domain);
+    x->sequence += x->msg_recs;
+  }
+  if (x->fd >= 0) {
+    if (send(x->fd, x->buf, x->len, 0) != (ssize_t)x->len)
+      x->errors++;
+  } else if (x->file) {
+    if (fwrite(x->buf, 1, x->len, x->file) != x->len)
+      x->errors++;
+  }
+  x->messages++;
+  x->bytes += x->len;
+  x->len = 0;
+  x->msg_recs = 0;
+  x->msg_count = 0;
+}
+
+static inline void nfm_ipfix_start_msg(nfm_ipfix_t* x)
+{
+  x->len = nfm_ipfix_hdr_len(x);
+  x->msg_start_ns = nfm_ipfix_mono_ns();
+  if (x->tmpl_pending) {
+    memcpy(x->buf+x->len, x->tmpl_wire, x->tmpl_len);
+    x->len += x->tmpl_len;
+    x->msg_count += 2;
+    x->tmpl_pending = 0;
+    x->tmpl_sent_ns = x->msg_start_ns;
+  }
+}
+
+static inline uint32_t nfm_ipfix_uptime(const nfm_ipfix_t* x, uint64_t us)
+{
+  uint64_t ms = us/1000;
+  return (ms > x->boot_ms)?(uint32_t)(ms - x->boot_ms):0;
+}
+
+static inline void nfm_ipfix_encode(const nfm_ipfix_t* x, const nfm_ipfix_template_t* tm, const nfm_flow_rec_t* r, unsigned char* p)
+{
+  unsigned int f;
+  for (f = 0; f < tm->num_fields; f++) {
+    const nfm_ipfix_field_t* fl = &tm->fields[f];
+    switch (fl->src) {
+    case NFM_IPFIX_SRC4:      memcpy(p, r->src, 4); break;
+    case NFM_IPFIX_DST4:      memcpy(p, r->dst, 4); break;
+    case NFM_IPFIX_SRC6:      memcpy(p, r->src, 16); break;
+    case NFM_IPFIX_DST6:      memcpy(p, r->dst, 16); break;
+    case NFM_IPFIX_SRC_PORT:  memcpy(p, &r->src_port, 2); break;
+    case NFM_IPFIX_DST_PORT:  memcpy(p, &r->dst_port, 2); break;
+    case NFM_IPFIX_PROTOCOL:  *p = r->protocol; break;
+    case NFM_IPFIX_VLAN:      nfm_ipfix_put16(p, r->vlan_id); break;
+    case NFM_IPFIX_IN_IF:     nfm_ipfix_put32(p, r->ingress_interface); break;
+    case NFM_IPFIX_OUT_IF:    nfm_ipfix_put32(p, r->egress_interface); break;
+    case NFM_IPFIX_VRF:       nfm_ipfix_put32(p, r->addr_space_id); break;
+    case NFM_IPFIX_FLOW_ID:   nfm_ipfix_put64(p, r->flow_id); break;
+    case NFM_IPFIX_PKTS:      nfm_ipfix_put64(p, r->pkts[0]); break;
+    case NFM_IPFIX_BYTES:     nfm_ipfix_put64(p, r->bytes[0]); break;
+    case NFM_IPFIX_REV_PKTS:  nfm_ipfix_put64(p, r->pkts[1]); break;
+    case NFM_IPFIX_REV_BYTES: nfm_ipfix_put64(p, r->bytes[1]); break;
+    case NFM_IPFIX_START_MS:  nfm_ipfix_put64(p, r->start_us/1000); break;
+    case NFM_IPFIX_END_MS:    nfm_ipfix_put64(p, r->end_us/1000); break;
+    case NFM_IPFIX_FIRST_UP:  nfm_ipfix_put32(p, nfm_ipfix_uptime(x, r->start_us)); break;
+    case NFM_IPFIX_LAST_UP:   nfm_ipfix_put32(p, nfm_ipfix_uptime(x, r->end_us)); break;
+    }
+    p += fl->len;
+  }
+}
+
+// Flow table consumer: append one completed record
+static void nfm_ipfix_record(const nfm_flow_rec_t* rec, void* ctx)
+{
+  nfm_ipfix_t* x = (nfm_ipfix_t*)ctx;
+  int t = (rec->flow_type == 0)?0:1;
+  const nfm_ipfix_template_t* tm = &x->tmpl[t];
+  // Worst case: a new set header plus v9 padding
+  unsigned int need = tm->rec_len + ((x->set_off && x->set_tmpl == t)?0:4) + 3;
+
+  if (x->len && x->len + need > x->mtu)
+    nfm_ipfix_flush(x);
+  if (x->len == 0)
+    nfm_ipfix_start_msg(x);
+  if (!x->set_off || x->set_tmpl != t) {
+    nfm_ipfix_close_set(x);
+    x->set_off = x->len;
+    x->set_tmpl = t;
+    nfm_ipfix_put16(x->buf+x->len, tm->id);
+    x->len += 4;
+  }
+  nfm_ipfix_encode(x, tm, rec, x->buf+x->len);
+  x->len += tm->rec_len;
+  x->msg_recs++;
+  x->msg_count++;
+  x->records++;
+}
+
+// Flow table idle hook: push out a partial message that has waited long
+// enough, and schedule the UDP template refresh
+static void nfm_ipfix_idle(void* ctx)
+{
+  nfm_ipfix_t* x = (nfm_ipfix_t*)ctx;
+  uint64_t now = nfm_ipfix_mono_ns();
+  if (x->len && now - x->msg_start_ns >= NFM_IPFIX_FLUSH_MS*1000000ULL)
+    nfm_ipfix_flush(x);
+  if (x->tmpl_interval_s && !x->tmpl_pending &&
+      now - x->tmpl_sent_ns >= x->tmpl_interval_s*1000000000ULL)
+    x->tmpl_pending = 1;
+}
+
+// Flush what is left; call once the flow table consumer has stopped
+static inline void nfm_ipfix_close(nfm_ipfix_t* x)
+{
+  nfm_ipfix_flush(x);
+  if (x->fd >= 0)
+    close(x->fd);
+  if (x->file)
+    fclose(x->file);
+  x->fd = -1;
+  x->file = NULL;
+  free(x->buf);
+  x->buf = NULL;
+}
+
+static inline void nfm_ipfix_report(const nfm_ipfix_t* x, FILE* f)
+{
+  fprintf(f, "%s export: %llu records in %llu messages (%llu bytes), %llu write errors\n",
+          x->v9?"NetFlow v9":"IPFIX", (unsigned long long)x->records, (unsigned long long)x->messages,
+          (unsigned long long)x->bytes, (unsigned long long)x->errors);
+}
+
+#endif
@@ -0,0 +1,450 @@
+/**
+ * Copyright (C) 2013 Netronome Systems, Inc.  All rights reserved.
+ *
+ * File:        nfm_sample_journal.h
+ * Description: Binary flow journal for the flow record table. Runs as a flow
+ *              table consumer and appends each completed record, unchanged,
+ *              to a segment file in a journal directory.
+ *
+ *              A segment is preallocated at its full size and memory mapped,
+ *              so appending a record is a copy into the page cache. It holds
+ *              a header page, an index with one entry per block of records,
+ *              then the records themselves. An index entry keeps the time
+ *              span of its block, the protocols seen and a Bloom filter over
+ *              the addresses and ports, so a reader can skip whole segments
+ *              and blocks that cannot match a query. When a segment is full
+ *              it is trimmed to the records written and the next one is
+ *              started; segments are never overwritten.
+ *
+ *              The record count in the header is updated after each record,
+ *              so a segment that is still being written can be read.
+ *              Records are in host byte order apart from addresses and
+ *              ports, which stay in network byte order as in the flow table.
+ */
+
+#ifndef NFM_SAMPLE_JOURNAL_H
+#define NFM_SAMPLE_JOURNAL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "nfm_sample_flowtab.h"
+
+#define NFM_JOURNAL_MAGIC        "NFJ1"
+#define NFM_JOURNAL_VERSION      1
+#define NFM_JOURNAL_PAGE         4096
+#define NFM_JOURNAL_BLOCK_RECS   256     // records per index entry
+#define NFM_JOURNAL_BLOOM_BITS   8192    // per block, ~3% false positives when full
+#define NFM_JOURNAL_BLOOM_K      3
+#define NFM_JOURNAL_DEFAULT_MB   64      // segment size
+#define NFM_JOURNAL_MAX_MB       4096
+#define NFM_JOURNAL_RETRY_S      1       // wait after failing to start a segment
+#define NFM_JOURNAL_PREFIX       "flows-"
+#define NFM_JOURNAL_SUFFIX       ".nfj"
+
+// Segment header, at offset 0 of the first page
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t rec_size;       // sizeof(nfm_flow_rec_t) of the writer
+  uint32_t block_recs;
+  uint32_t capacity;       // records
+  volatile uint32_t count; // records written
+  uint32_t closed;         // set once the segment is complete
+  uint32_t seq;
+  uint64_t index_off;
+  uint64_t rec_off;
+  uint64_t min_start_us;   // span of the records, NFE time
+  uint64_t max_end_us;
+  uint64_t created_s;      // wall clock
+} nfm_journal_hdr_t;
+
+typedef struct {
+  uint64_t min_start_us;
+  uint64_t max_end_us;
+  uint8_t proto[32];       // bitmap of IP protocols
+  uint8_t bloom[NFM_JOURNAL_BLOOM_BITS/8];
+} nfm_journal_block_t;
+
+typedef struct {
+  char* dir;
+  uint32_t capacity;
+  uint64_t index_off;
+  uint64_t rec_off;
+  uint64_t seg_len;
+  // Segment being written
+  uint32_t seq;
+  int fd;
+  unsigned char* map;
+  nfm_journal_hdr_t* hdr;
+  nfm_journal_block_t* blocks;
+  nfm_flow_rec_t* recs;
+  time_t retry_s;
+  // Counters
+  uint64_t records;
+  uint64_t segments;
+  uint64_t drops;          // records lost while no segment could be opened
+  uint64_t errors;
+} nfm_journal_t;
+
+// Records and index entries that fit a segment of 'seg_bytes'
+static inline int nfm_journal_geometry(uint64_t seg_bytes, uint32_t* capacity, uint64_t* index_off, uint64_t* rec_off)
+{
+  uint64_t blocks = 0;
+  uint64_t per_block = sizeof(nfm_journal_block_t) + NFM_JOURNAL_BLOCK_RECS*sizeof(nfm_flow_rec_t);
+  if (seg_bytes > 2*NFM_JOURNAL_PAGE)
+    blocks = (seg_bytes - 2*NFM_JOURNAL_PAGE) / per_block;
+  if (blocks == 0)
+    return -1;
+  *capacity = (uint32_t)(blocks*NFM_JOURNAL_BLOCK_RECS);
+  *index_off = NFM_JOURNAL_PAGE;
+  *rec_off = (NFM_JOURNAL_PAGE + blocks*sizeof(nfm_journal_block_t) + NFM_JOURNAL_PAGE-1) & ~(uint64_t)(NFM_JOURNAL_PAGE-1);
+  return 0;
+}
+
+// Bloom filter keys: addresses tagged with their family, and L4 ports
+static inline uint64_t nfm_journal_hash(uint8_t tag, const void* key, unsigned int len)
+{
+  const uint8_t* p = (const uint8_t*)key;
+  uint64_t h = 0xcbf29ce484222325ULL ^ tag;
+  unsigned int i;
+  for (i = 0; i < len; i++)
+    h = (h ^ p[i]) * 0x100000001b3ULL;
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return h;
+}
+
+static inline uint64_t nfm_journal_addr_hash(uint8_t flow_type, const uint8_t* addr)
+{
+  return (flow_type == 0) ? nfm_journal_hash(4, addr, 4) : nfm_journal_hash(6, addr, 16);
+}
+
+static inline uint64_t nfm_journal_port_hash(uint16_t port)
+{
+  return nfm_journal_hash('p', &port, 2);
+}
+
+static inline void nfm_journal_bloom_add(uint8_t* bloom, uint64_t h)
+{
+  uint32_t a = (uint32_t)h, b = (uint32_t)(h >> 32) | 1;
+  unsigned int i;
+  for (i = 0; i < NFM_JOURNAL_BLOOM_K; i++, a += b)
+    bloom[(a % NFM_JOURNAL_BLOOM_BITS) >> 3] |= 1 << (a & 7);
+}
+
+static inline int nfm_journal_bloom_test(const uint8_t* bloom, uint64_t h)
+{
+  uint32_t a = (uint32_t)h, b = (uint32_t)(h >> 32) | 1;
+  unsigned int i;
+  for (i = 0; i < NFM_JOURNAL_BLOOM_K; i++, a += b) {
+    if (!(bloom[(a % NFM_JOURNAL_BLOOM_BITS) >> 3] & (1 << (a & 7))))
+      return 0;
+  }
+  return 1;
+}
+
+// Continue after the highest segment number already in 'dir'
+static inline int nfm_journal_init(nfm_journal_t* j, const char* dir, unsigned int seg_mb)
+{
+  DIR* d;
+  struct dirent* e;
+  unsigned int seq;
+  memset(j, 0, sizeof(*j));
+  j->fd = -1;
+  if (nfm_journal_geometry((uint64_t)seg_mb << 20, &j->capacity, &j->index_off, &j->rec_off) != 0)
+    return -1;
+  j->seg_len = j->rec_off + (uint64_t)j->capacity*sizeof(nfm_flow_rec_t);
+  if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+    return -1;
+  d = opendir(dir);
+  if (!d)
+    return -1;
+  while ((e = readdir(d)) != NULL) {
+    if (sscanf(e->d_name, NFM_JOURNAL_PREFIX "%u" NFM_JOURNAL_SUFFIX, &seq) == 1 && seq >= j->seq)
+      j->seq = seq+1;
+  }
+  closedir(d);
+  j->dir = strdup(dir);
+  return j->dir ? 0 : -1;
+}
+
+static inline void nfm_journal_seg_name(char* buf, size_t len, const char* dir, uint32_t seq)
+{
+  snprintf(buf, len, "%s/" NFM_JOURNAL_PREFIX "%08u" NFM_JOURNAL_SUFFIX, dir, seq);
+}
+
+// Trim the segment to what was written and unmap it
+static inline void nfm_journal_close_seg(nfm_journal_t* j)
+{
+  uint64_t used;
+  if (!j->map)
+    return;
+  j->hdr->closed = 1;
+  used = j->rec_off + (uint64_t)j->hdr->count*sizeof(nfm_flow_rec_t);
+  munmap(j->map, j->seg_len);
+  if (ftruncate(j->fd, (off_t)used) != 0)
+    j->errors++;
+  close(j->fd);
+  j->fd = -1;
+  j->map = NULL;
+  j->hdr = NULL;
+}
+
+static inline int nfm_journal_open_seg(nfm_journal_t* j)
+{
+  char path[4096];
+  int err;
+  nfm_journal_seg_name(path, sizeof(path), j->dir, j->seq);
+  j->fd = open(path, O_RDWR|O_CREAT|O_EXCL, 0644);
+  if (j->fd < 0) {
+    // Created behind our back: never overwrite, try the next number later
+    if (errno == EEXIST)
+      j->seq++;
+    return -1;
+  }
+  // Allocate the blocks now so appends never extend the file
+  err = posix_fallocate(j->fd, 0, (off_t)j->seg_len);
+  if (err == 0) {
+    j->map = (unsigned char*)mmap(NULL, j->seg_len, PROT_READ|PROT_WRITE, MAP_SHARED, j->fd, 0);
+    if (j->map == (unsigned char*)MAP_FAILED)
+      j->map = NULL;
+  }
+  if (!j->map) {
+    close(j->fd);
+    unlink(path);
+    j->fd = -1;
+    return -1;
+  }
+  madvise(j->map + j->rec_off, j->seg_len - j->rec_off, MADV_SEQUENTIAL);
+  j->hdr = (nfm_journal_hdr_t*)j->map;
+  j->blocks = (nfm_journal_block_t*)(j->map + j->index_off);
+  j->recs = (nfm_flow_rec_t*)(j->map + j->rec_off);
+  memcpy(j->hdr->magic, NFM_JOURNAL_MAGIC, 4);
+  j->hdr->version = NFM_JOURNAL_VERSION;
+  j->hdr->rec_size = sizeof(nfm_flow_rec_t);
+  j->hdr->block_recs = NFM_JOURNAL_BLOCK_RECS;
+  j->hdr->capacity = j->capacity;
+  j->hdr->seq = j->seq;
+  j->hdr->index_off = j->index_off;
+  j->hdr->rec_off = j->rec_off;
+  j->hdr->created_s = (uint64_t)time(NULL);
+  j->seq++;
+  j->segments++;
+  return 0;
+}
+
+// Flow table consumer: append one record
+static inline void nfm_journal_record(const nfm_flow_rec_t* rec, void* ctx)
+{
+  nfm_journal_t* j = (nfm_journal_t*)ctx;
+  nfm_journal_block_t* blk;
+  uint32_t n;
+
+  if (j->map && j->hdr->count == j->capacity)
+    nfm_journal_close_seg(j);
+  if (!j->map) {
+    if (time(NULL) < j->retry_s || nfm_journal_open_seg(j) != 0) {
+      if (j->retry_s == 0 || time(NULL) >= j->retry_s) {
+        j->errors++;
+        j->retry_s = time(NULL) + NFM_JOURNAL_RETRY_S;
+      }
+      j->drops++;
+      return;
+    }
+    j->retry_s = 0;
+  }
+
+  n = j->hdr->count;
+  j->recs[n] = *rec;
+  blk = &j->blocks[n / NFM_JOURNAL_BLOCK_RECS];
+  if (n % NFM_JOURNAL_BLOCK_RECS == 0) {
+    blk->min_start_us = rec->start_us;
+    blk->max_end_us = rec->end_us;
+  } else {
+    if (rec->start_us < blk->min_start_us)
+      blk->min_start_us = rec->start_us;
+    if (rec->end_us > blk->max_end_us)
+      blk->max_end_us = rec->end_us;
+  }
+  blk->proto[rec->protocol >> 3] |= 1 << (rec->protocol & 7);
+  nfm_journal_bloom_add(blk->bloom, nfm_journal_addr_hash(rec->flow_type, rec->src));
+  nfm_journal_bloom_add(blk->bloom, nfm_journal_addr_hash(rec->flow_type, rec->dst));
+  nfm_journal_bloom_add(blk->bloom, nfm_journal_port_hash(rec->src_port));
+  nfm_journal_bloom_add(blk->bloom, nfm_journal_port_hash(rec->dst_port));
+  if (n == 0 || rec->start_us < j->hdr->min_start_us)
+    j->hdr->min_start_us = rec->start_us;
+  if (rec->end_us > j->hdr->max_end_us)
+    j->hdr->max_end_us = rec->end_us;
+  // Publish the record and its index entry to concurrent readers
+  __atomic_store_n(&j->hdr->count, n+1, __ATOMIC_RELEASE);
+  j->records++;
+}
+
+// Close the open segment; call once the flow table consumer has stopped
+static inline void nfm_journal_close(nfm_journal_t* j)
+{
+  nfm_journal_close_seg(j);
+  free(j->dir);
+  j->dir = NULL;
+}
+
+static inline void nfm_journal_report(const nfm_journal_t* j, FILE* f)
+{
+  fprintf(f, "Flow journal: %llu records in %llu segments of %u records, %llu dropped, %llu errors\n",
+          (unsigned long long)j->records, (unsigned long long)j->segments, j->capacity,
+          (unsigned long long)j->drops, (unsigned long long)j->errors);
+}
+
+// Reader side
+
+// Which records a query selects; unset fields match everything. A flow
+// matches a time range when it was active at some point within it.
+typedef struct {
+  uint64_t from_us;
+  uint64_t to_us;
+  int has_addr;
+  uint8_t addr_type;       // flow_type of 'addr'
+  uint8_t addr[16];
+  uint64_t addr_hash;
+  int has_port;
+  uint16_t port;           // network byte order
+  uint64_t port_hash;
+  int has_proto;
+  uint8_t proto;
+} nfm_journal_query_t;
+
+typedef struct {
+  int fd;
+  unsigned char* map;
+  size_t len;
+  nfm_journal_hdr_t hdr;   // header as read; 'count' refreshed by the caller if live
+  const nfm_journal_hdr_t* live;
+  const nfm_journal_block_t* blocks;
+  const nfm_flow_rec_t* recs;
+} nfm_journal_seg_t;
+
+static inline void nfm_journal_query_init(nfm_journal_query_t* q)
+{
+  memset(q, 0, sizeof(*q));
+  q->to_us = ~0ULL;
+}
+
+// Call after setting addr/port, before matching
+static inline void nfm_journal_query_prepare(nfm_journal_query_t* q)
+{
+  if (q->has_addr)
+    q->addr_hash = nfm_journal_addr_hash(q->addr_type, q->addr);
+  if (q->has_port)
+    q->port_hash = nfm_journal_port_hash(q->port);
+}
+
+static inline int nfm_journal_span_match(const nfm_journal_query_t* q, uint64_t start_us, uint64_t end_us)
+{
+  return start_us <= q->to_us && end_us >= q->from_us;
+}
+
+static inline int nfm_journal_block_match(const nfm_journal_query_t* q, const nfm_journal_block_t* b)
+{
+  if (!nfm_journal_span_match(q, b->min_start_us, b->max_end_us))
+    return 0;
+  if (q->has_proto && !(b->proto[q->proto >> 3] & (1 << (q->proto & 7))))
+    return 0;
+  if (q->has_addr && !nfm_journal_bloom_test(b->bloom, q->addr_hash))
+    return 0;
+  if (q->has_port && !nfm_journal_bloom_test(b->bloom, q->port_hash))
+    return 0;
+  return 1;
+}
+
+static inline int nfm_journal_rec_match(const nfm_journal_query_t* q, const nfm_flow_rec_t* r)
+{
+  unsigned int alen = (q->addr_type == 0) ? 4 : 16;
+  if (!nfm_journal_span_match(q, r->start_us, r->end_us))
+    return 0;
+  if (q->has_proto && r->protocol != q->proto)
+    return 0;
+  if (q->has_addr && ((r->flow_type == 0) != (q->addr_type == 0) ||
+                      (memcmp(r->src, q->addr, alen) != 0 && memcmp(r->dst, q->addr, alen) != 0)))
+    return 0;
+  if (q->has_port && r->src_port != q->port && r->dst_port != q->port)
+    return 0;
+  return 1;
+}
+
+// Read and check a segment header without mapping the segment
+static inline int nfm_journal_read_hdr(int fd, nfm_journal_hdr_t* h, uint64_t* file_len)
+{
+  struct stat st;
+  if (pread(fd, h, sizeof(*h), 0) != (ssize_t)sizeof(*h) || fstat(fd, &st) != 0)
+    return -1;
+  if (memcmp(h->magic, NFM_JOURNAL_MAGIC, 4) != 0 || h->version != NFM_JOURNAL_VERSION ||
+      h->rec_size != sizeof(nfm_flow_rec_t) || h->block_recs != NFM_JOURNAL_BLOCK_RECS)
+    return -1;
+  if (h->count > h->capacity ||
+      h->index_off + ((uint64_t)h->capacity/NFM_JOURNAL_BLOCK_RECS)*sizeof(nfm_journal_block_t) > h->rec_off ||
+      h->rec_off + (uint64_t)h->count*h->rec_size > (uint64_t)st.st_size)
+    return -1;
+  *file_len = (uint64_t)st.st_size;
+  return 0;
+}
+
+static inline int nfm_journal_open_read(nfm_journal_seg_t* s, const char* path)
+{
+  uint64_t len;
+  memset(s, 0, sizeof(*s));
+  s->fd = open(path, O_RDONLY);
+  if (s->fd < 0)
+    return -1;
+  if (nfm_journal_read_hdr(s->fd, &s->hdr, &len) != 0) {
+    close(s->fd);
+    s->fd = -1;
+    errno = EINVAL;
+    return -1;
+  }
+  s->len = (size_t)len;
+  return 0;
+}
+
+// Map the segment once its header says it may hold matches
+static inline int nfm_journal_map(nfm_journal_seg_t* s)
+{
+  s->map = (unsigned char*)mmap(NULL, s->len, PROT_READ, MAP_SHARED, s->fd, 0);
+  if (s->map == (unsigned char*)MAP_FAILED) {
+    s->map = NULL;
+    return -1;
+  }
+  s->live = (const nfm_journal_hdr_t*)s->map;
+  s->blocks = (const nfm_journal_block_t*)(s->map + s->hdr.index_off);
+  s->recs = (const nfm_flow_rec_t*)(s->map + s->hdr.rec_off);
+  // A segment still being written may have grown since the header was read
+  if (!s->hdr.closed) {
+    uint32_t count = __atomic_load_n(&s->live->count, __ATOMIC_ACQUIRE);
+    if (count <= s->hdr.capacity && s->hdr.rec_off + (uint64_t)count*s->hdr.rec_size <= s->len)
+      s->hdr.count = count;
+  }
+  return 0;
+}
+
+static inline void nfm_journal_close_read(nfm_journal_seg_t* s)
+{
+  if (s->map)
+    munmap(s->map, s->len);
+  if (s->fd >= 0)
+    close(s->fd);
+  s->map = NULL;
+  s->fd = -1;
+}
+
+#endif
@@ -0,0 +1,194 @@
+/**
+ * Copyright (C) 2013 Netronome Systems, Inc.  All rights reserved.
+ *
+ * File:        nfm_sample_lifmatrix.h
+ * Description: Dense ingress x egress logical interface packet/byte matrix
+ *              for the packet samples. Each receive thread counts into its
+ *              own matrix; the reporter thread folds what they gained into
+ *              a merged matrix once a second and writes it out on request,
+ *              as CSV or as a compact binary image.
+ *
+ *              Lifs at or above the configured count share the last row
+ *              and column ("other"), so the matrix never grows at run time.
+ */
+
+#ifndef NFM_SAMPLE_LIFMATRIX_H
+#define NFM_SAMPLE_LIFMATRIX_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define NFM_LIFM_DEFAULT_LIFS  64
+#define NFM_LIFM_MAX_LIFS      1024
+#define NFM_LIFM_MAGIC         0x4d46494cU  // "LIFM" little endian
+#define NFM_LIFM_VERSION       1
+
+typedef struct {
+  uint64_t pkts;
+  uint64_t bytes;
+} nfm_lifm_cell_t;
+
+// Binary dump: this header, then dim*dim cells row by row (ingress major),
+// all fields in host byte order
+typedef struct {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t dim;
+  uint64_t ts_ns;      // CLOCK_REALTIME of the last merge
+} nfm_lifm_file_hdr_t;
+
+typedef struct {
+  unsigned int dim;          // lifs tracked + 1 for "other"
+  unsigned int num_threads;
+  size_t stride;             // cells per thread matrix, padded to a cache line
+  nfm_lifm_cell_t* cells;    // num_threads matrices, one writer each
+  // Reporter thread only
+  nfm_lifm_cell_t* prev;
+  nfm_lifm_cell_t* sum;
+  uint64_t merged_ns;
+} nfm_lifm_t;
+
+static inline int nfm_lifm_init(nfm_lifm_t* m, unsigned int num_threads, unsigned int num_lifs)
+{
+  size_t cells, bytes;
+  memset(m, 0, sizeof(*m));
+  if (num_lifs == 0 || num_lifs > NFM_LIFM_MAX_LIFS)
+    return -1;
+  m->dim = num_lifs+1;
+  m->num_threads = num_threads;
+  cells = (size_t)m->dim*m->dim;
+  m->stride = (cells*sizeof(nfm_lifm_cell_t)+63)/64*64/sizeof(nfm_lifm_cell_t);
+  bytes = m->stride*num_threads*sizeof(nfm_lifm_cell_t);
+  if (posix_memalign((void**)&m->cells, 64, bytes) != 0)
+    return -1;
+  if (posix_memalign((void**)&m->prev, 64, bytes) != 0 ||
+      posix_memalign((void**)&m->sum, 64, cells*sizeof(nfm_lifm_cell_t)) != 0) {
+    free(m->cells);
+    free(m->prev);
+    m->cells = NULL;
+    m->prev = NULL;
+    return -1;
+  }
+  memset(m->cells, 0, bytes);
+  memset(m->prev, 0, bytes);
+  memset(m->sum, 0, cells*sizeof(nfm_lifm_cell_t));
+  return 0;
+}
+
+static inline void nfm_lifm_free(nfm_lifm_t* m)
+{
+  free(m->cells);
+  free(m->prev);
+  free(m->sum);
+  m->cells = m->prev = m->sum = NULL;
+}
+
+static inline nfm_lifm_cell_t* nfm_lifm_thread(nfm_lifm_t* m, unsigned int thread)
+{
+  return &m->cells[m->stride*thread];
+}
+
+// Owning thread only; 'tm' is the thread's matrix from nfm_lifm_thread
+static inline void nfm_lifm_add(const nfm_lifm_t* m, nfm_lifm_cell_t* tm, uint32_t ingress, uint32_t egress, uint64_t bytes)
+{
+  unsigned int last = m->dim-1;
+  nfm_lifm_cell_t* c = &tm[(ingress<last?ingress:last)*m->dim + (egress<last?egress:last)];
+  __atomic_store_n(&c->pkts, c->pkts+1, __ATOMIC_RELAXED);
+  __atomic_store_n(&c->bytes, c->bytes+bytes, __ATOMIC_RELAXED);
+}
+
+// Reporter side: fold what every thread counted since the last merge into 'sum'
+static inline void nfm_lifm_merge(nfm_lifm_t* m)
+{
+  size_t cells = (size_t)m->dim*m->dim, i;
+  unsigned int t;
+  struct timespec ts;
+  for (t = 0; t < m->num_threads; t++) {
+    const nfm_lifm_cell_t* cur = &m->cells[m->stride*t];
+    nfm_lifm_cell_t* prev = &m->prev[m->stride*t];
+    for (i = 0; i < cells; i++) {
+      uint64_t pkts = __atomic_load_n(&cur[i].pkts, __ATOMIC_RELAXED);
+      uint64_t bytes = __atomic_load_n(&cur[i].bytes, __ATOMIC_RELAXED);
+      m->sum[i].pkts += pkts - prev[i].pkts;
+      m->sum[i].bytes += bytes - prev[i].bytes;
+      prev[i].pkts = pkts;
+      prev[i].bytes = bytes;
+    }
+  }
+  clock_gettime(CLOCK_REALTIME, &ts);
+  m->merged_ns = (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static inline void nfm_lifm_lif_name(const nfm_lifm_t* m, unsigned int lif, char* buf, size_t len)
+{
+  if (lif == m->dim-1)
+    snprintf(buf, len, "other");
+  else
+    snprintf(buf, len, "%u", lif);
+}
+
+// CSV lists the non-zero cells only
+static inline int nfm_lifm_write_csv(const nfm_lifm_t* m, FILE* f)
+{
+  char in[16], out[16];
+  unsigned int i, e;
+  fprintf(f, "# ts_ns=%llu\ningress_lif,egress_lif,packets,bytes\n", (unsigned long long)m->merged_ns);
+  for (i = 0; i < m->dim; i++) {
+    for (e = 0; e < m->dim; e++) {
+      const nfm_lifm_cell_t* c = &m->sum[i*m->dim+e];
+      if (!c->pkts)
+        continue;
+      nfm_lifm_lif_name(m, i, in, sizeof(in));
+      nfm_lifm_lif_name(m, e, out, sizeof(out));
+      fprintf(f, "%s,%s,%llu,%llu\n", in, out, (unsigned long long)c->pkts, (unsigned long long)c->bytes);
+    }
+  }
+  return ferror(f)?-1:0;
+}
+
+static inline int nfm_lifm_write_bin(const nfm_lifm_t* m, FILE* f)
+{
+  nfm_lifm_file_hdr_t hdr;
+  size_t cells = (size_t)m->dim*m->dim;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = NFM_LIFM_MAGIC;
+  hdr.version = NFM_LIFM_VERSION;
+  hdr.dim = (uint16_t)m->dim;
+  hdr.ts_ns = m->merged_ns;
+  if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+      fwrite(m->sum, sizeof(nfm_lifm_cell_t), cells, f) != cells)
+    return -1;
+  return 0;
+}
+
+// Write the merged matrix to 'path' (CSV if it ends in ".csv", binary
+// otherwise). A temporary file is renamed over 'path' so readers never see
+// a partial dump.
+static inline int nfm_lifm_dump(const nfm_lifm_t* m, const char* path)
+{
+  char tmp[4096];
+  size_t len = strlen(path);
+  FILE* f;
+  int r;
+  if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+    return -1;
+  f = fopen(tmp, "wb");
+  if (!f)
+    return -1;
+  if (len >= 4 && strcmp(path+len-4, ".csv") == 0)
+    r = nfm_lifm_write_csv(m, f);
+  else
+    r = nfm_lifm_write_bin(m, f);
+  if (fclose(f) != 0)
+    r = -1;
+  if (r == 0)
+    r = rename(tmp, path);
+  if (r != 0)
+    remove(tmp);
+  return r;
+}
+
+#endif
@@ -0,0 +1,459 @@
+/**
+ * Copyright (C) 2013 Netronome Systems, Inc.  All rights reserved.
+ *
+ * File:        nfm_sample_load.h
+ * Description: Synthetic per-packet workload kernels for the -L option of
+ *              the packet samples. Each kernel has a scalar version and,
+ *              where the instruction set helps, SSE4.2 and AVX2 versions.
+ *              The best one the CPU supports is picked at run time.
+ *
+ *              csum     - 16-bit ones' complement checksum of the whole packet
+ *              crc32c   - CRC32C (Castagnoli) of the whole packet
+ *              toeplitz - RSS Toeplitz hash of up to 36 bytes after the L2 header
+ *              scan     - count occurrences of a small set of byte patterns
+ *              swap     - byte swap the first 64 bytes twice (the original load)
+ */
+
+#ifndef NFM_SAMPLE_LOAD_H
+#define NFM_SAMPLE_LOAD_H
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define NFM_LOAD_X86 1
+#include <immintrin.h>
+#include <x86intrin.h>
+#endif
+
+enum {
+  NFM_LOAD_ISA_SCALAR,
+  NFM_LOAD_ISA_SSE42,
+  NFM_LOAD_ISA_AVX2,
+  NFM_LOAD_ISA_COUNT
+};
+
+static const char* const nfm_load_isa_names[NFM_LOAD_ISA_COUNT] = { "scalar", "sse4.2", "avx2" };
+
+typedef uint32_t (*nfm_load_fn)(unsigned char* data, unsigned int len);
+
+typedef struct {
+  const char* name;
+  nfm_load_fn fn[NFM_LOAD_ISA_COUNT];  // NULL: fall back to the next lower ISA
+  const char* label[NFM_LOAD_ISA_COUNT];  // what fn[i] is, if not code for ISA i
+} nfm_load_kernel_t;
+
+// Cost accounting: TSC cycles on x86, nanoseconds elsewhere
+static inline uint64_t nfm_load_ticks(void)
+{
+#ifdef NFM_LOAD_X86
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+#ifdef NFM_LOAD_X86
+#define NFM_LOAD_TICK_UNIT "cycles"
+#else
+#define NFM_LOAD_TICK_UNIT "ns"
+#endif
+
+// swap
+
+static uint32_t nfm_load_swap_scalar(unsigned char* data, unsigned int len)
+{
+  unsigned int* pc=(unsigned int*)data;
+  unsigned int count=(len>=64)?16:(len>>2);
+  unsigned int i;
+  for (i=0; i<count; i++)
+    pc[i]=ntohl(pc[i]);
+  for (i=0; i<count; i++)
+    pc[i]=htonl(pc[i]);
+  return count;
+}
+
+// csum
+
+static inline uint32_t nfm_load_csum_fold(uint64_t sum)
+{
+  while (sum>>16)
+    sum = (sum&0xffff) + (sum>>16);
+  return (uint32_t)sum;
+}
+
+static uint32_t nfm_load_csum_scalar(unsigned char* data, unsigned int len)
+{
+  uint64_t sum = 0;
+  const unsigned char* p = data;
+  while (len >= 2) {
+    sum += ((uint32_t)p[0]<<8) | p[1];
+    p += 2;
+    len -= 2;
+  }
+  if (len)
+    sum += (uint32_t)p[0]<<8;
+  return ~nfm_load_csum_fold(sum) & 0xffff;
+}
+
+// The vector versions add little-endian words; the ones' complement sum is
+// byte order independent, so swapping the folded result gives the same value
+static inline uint32_t nfm_load_csum_finish_le(uint64_t sum, const unsigned char* p, unsigned int len)
+{
+  uint32_t folded;
+  while (len >= 2) {
+    sum += p[0] | ((uint32_t)p[1]<<8);
+    p += 2;
+    len -= 2;
+  }
+  if (len)
+    sum += p[0];
+  folded = nfm_load_csum_fold(sum);
+  folded = ((folded&0xff)<<8) | (folded>>8);
+  return ~folded & 0xffff;
+}
+
+#ifdef NFM_LOAD_X86
+// 32-bit lanes cannot overflow for packets below 512KB
+__attribute__((target("sse4.2")))
+static uint32_t nfm_load_csum_sse42(unsigned char* data, unsigned int len)
+{
+  const unsigned char* p = data;
+  __m128i zero = _mm_setzero_si128();
+  __m128i acc = zero;
+  uint32_t lanes[4];
+  uint64_t sum;
+  while (len >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)p);
+    acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(v, zero));
+    acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(v, zero));
+    p += 16;
+    len -= 16;
+  }
+  _mm_storeu_si128((__m128i*)lanes, acc);
+  sum = (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  return nfm_load_csum_finish_le(sum, p, len);
+}
+
+__attribute__((target("avx2")))
+static uint32_t nfm_load_csum_avx2(unsigned char* data, unsigned int len)
+{
+  const unsigned char* p = data;
+  __m256i zero = _mm256_setzero_si256();
+  __m256i acc = zero;
+  uint32_t lanes[8];
+  uint64_t sum = 0;
+  unsigned int i;
+  while (len >= 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i*)p);
+    acc = _mm256_add_epi32(acc, _mm256_unpacklo_epi16(v, zero));
+    acc = _mm256_add_epi32(acc, _mm256_unpackhi_epi16(v, zero));
+    p += 32;
+    len -= 32;
+  }
+  _mm256_storeu_si256((__m256i*)lanes, acc);
+  for (i = 0; i < 8; i++)
+    sum += lanes[i];
+  return nfm_load_csum_finish_le(sum, p, len);
+}
+#endif
+
+// crc32c
+
+static uint32_t nfm_load_crc32c_table[256];
+
+static void nfm_load_crc32c_init(void)
+{
+  uint32_t i, j, c;
+  for (i = 0; i < 256; i++) {
+    c = i;
+    for (j = 0; j < 8; j++)
+      c = (c>>1) ^ ((c&1) ? 0x82f63b78 : 0);
+    nfm_load_crc32c_table[i] = c;
+  }
+}
+
+static uint32_t nfm_load_crc32c_scalar(unsigned char* data, unsigned int len)
+{
+  uint32_t crc = ~0U;
+  while (len--)
+    crc = nfm_load_crc32c_table[(crc^*data++)&0xff] ^ (crc>>8);
+  return ~crc;
+}
+
+#ifdef NFM_LOAD_X86
+// There is no wider CRC instruction, so the AVX2 level uses this as well
+__attribute__((target("sse4.2")))
+static uint32_t nfm_load_crc32c_sse42(unsigned char* data, unsigned int len)
+{
+#ifdef __x86_64__
+  uint64_t crc = ~0U;
+  while (len >= 8) {
+    uint64_t v;
+    memcpy(&v, data, 8);
+    crc = _mm_crc32_u64(crc, v);
+    data += 8;
+    len -= 8;
+  }
+#else
+  uint32_t crc = ~0U;
+  while (len >= 4) {
+    uint32_t v;
+    memcpy(&v, data, 4);
+    crc = _mm_crc32_u32(crc, v);
+    data += 4;
+    len -= 4;
+  }
+#endif
+  while (len--)
+    crc = _mm_crc32_u8((uint32_t)crc, *data++);
+  return ~(uint32_t)crc;
+}
+#endif
+
+// toeplitz
+
+#define NFM_LOAD_TOEPLITZ_OFFSET 14  // skip the Ethernet header
+#define NFM_LOAD_TOEPLITZ_MAX    36  // IPv6 addresses + L4 ports
+
+static const uint8_t nfm_load_rss_key[NFM_LOAD_TOEPLITZ_MAX+4] = {
+  0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2, 0x41, 0x67,
+  0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0, 0xd0, 0xca, 0x2b, 0xcb,
+  0xae, 0x7b, 0x30, 0xb4, 0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30,
+  0xf2, 0x0c, 0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa
+};
+
+// Contribution of each byte value at each input position
+static uint32_t nfm_load_toeplitz_table[NFM_LOAD_TOEPLITZ_MAX][256];
+
+static inline void nfm_load_toeplitz_range(unsigned char** data, unsigned int* len)
+{
+  if (*len > NFM_LOAD_TOEPLITZ_OFFSET) {
+    *data += NFM_LOAD_TOEPLITZ_OFFSET;
+    *len -= NFM_LOAD_TOEPLITZ_OFFSET;
+  }
+  if (*len > NFM_LOAD_TOEPLITZ_MAX)
+    *len = NFM_LOAD_TOEPLITZ_MAX;
+}
+
+static uint32_t nfm_load_toeplitz_scalar(unsigned char* data, unsigned int len)
+{
+  uint32_t hash = 0;
+  uint32_t v;
+  unsigned int i;
+  int bit;
+  nfm_load_toeplitz_range(&data, &len);
+  v = ((uint32_t)nfm_load_rss_key[0]<<24) | (nfm_load_rss_key[1]<<16) | (nfm_load_rss_key[2]<<8) | nfm_load_rss_key[3];
+  for (i = 0; i < len; i++) {
+    for (bit = 7; bit >= 0; bit--) {
+      if (data[i] & (1<<bit))
+        hash ^= v;
+      v = (v<<1) | ((nfm_load_rss_key[i+4]>>bit)&1);
+    }
+  }
+  return hash;
+}
+
+static void nfm_load_toeplitz_init(void)
+{
+  unsigned int i, b;
+  unsigned char in[NFM_LOAD_TOEPLITZ_MAX+NFM_LOAD_TOEPLITZ_OFFSET];
+  // Hash a single set byte at position i to get that byte's contribution
+  for (i = 0; i < NFM_LOAD_TOEPLITZ_MAX; i++) {
+    for (b = 0; b < 256; b++) {
+      memset(in, 0, sizeof(in));
+      in[NFM_LOAD_TOEPLITZ_OFFSET+i] = (unsigned char)b;
+      nfm_load_toeplitz_table[i][b] = nfm_load_toeplitz_scalar(in, sizeof(in));
+    }
+  }
+}
+
+// Without carry-less multiply support in the sample build, the fast version
+// replaces the bit loop with one table lookup per byte. It is plain scalar
+// code, offered from the sse4.2 level up and reported as "table".
+static uint32_t nfm_load_toeplitz_table_fn(unsigned char* data, unsigned int len)
+{
+  uint32_t hash = 0;
+  unsigned int i;
+  nfm_load_toeplitz_range(&data, &len);
+  for (i = 0; i < len; i++)
+    hash ^= nfm_load_toeplitz_table[i][data[i]];
+  return hash;
+}
+
+// scan
+
+#define NFM_LOAD_SCAN_PATTERNS 6
+#define NFM_LOAD_SCAN_MAXLEN   4
+
+static const char* const nfm_load_scan_patterns[NFM_LOAD_SCAN_PATTERNS] = {
+  "GET ", "POST", "HTTP", "\r\n\r\n", "USER", "PASS"
+};
+
+static uint8_t nfm_load_scan_first[256];
+
+static void nfm_load_scan_init(void)
+{
+  unsigned int k;
+  memset(nfm_load_scan_first, 0, sizeof(nfm_load_scan_first));
+  for (k = 0; k < NFM_LOAD_SCAN_PATTERNS; k++)
+    nfm_load_scan_first[(uint8_t)nfm_load_scan_patterns[k][0]] = 1;
+}
+
+static inline uint32_t nfm_load_scan_at(const unsigned char* p, unsigned int left)
+{
+  uint32_t matches = 0;
+  unsigned int k;
+  for (k = 0; k < NFM_LOAD_SCAN_PATTERNS; k++) {
+    size_t plen = strlen(nfm_load_scan_patterns[k]);
+    if (plen <= left && memcmp(p, nfm_load_scan_patterns[k], plen) == 0)
+      matches++;
+  }
+  return matches;
+}
+
+static uint32_t nfm_load_scan_scalar(unsigned char* data, unsigned int len)
+{
+  uint32_t matches = 0;
+  unsigned int i;
+  for (i = 0; i < len; i++) {
+    if (nfm_load_scan_first[data[i]])
+      matches += nfm_load_scan_at(data+i, len-i);
+  }
+  return matches;
+}
+
+#ifdef NFM_LOAD_X86
+// Candidates are positions matching the first two bytes of any pattern;
+// blocks stop early enough that every candidate can be verified in place
+__attribute__((target("sse4.2")))
+static uint32_t nfm_load_scan_sse42(unsigned char* data, unsigned int len)
+{
+  uint32_t matches = 0;
+  unsigned int i = 0, k;
+  while (i+16+NFM_LOAD_SCAN_MAXLEN-1 <= len) {
+    __m128i b0 = _mm_loadu_si128((const __m128i*)(data+i));
+    __m128i b1 = _mm_loadu_si128((const __m128i*)(data+i+1));
+    __m128i hit = _mm_setzero_si128();
+    unsigned int mask;
+    for (k = 0; k < NFM_LOAD_SCAN_PATTERNS; k++) {
+      __m128i c0 = _mm_cmpeq_epi8(b0, _mm_set1_epi8(nfm_load_scan_patterns[k][0]));
+      __m128i c1 = _mm_cmpeq_epi8(b1, _mm_set1_epi8(nfm_load_scan_patterns[k][1]));
+      hit = _mm_or_si128(hit, _mm_and_si128(c0, c1));
+    }
+    mask = (unsigned int)_mm_movemask_epi8(hit);
+    while (mask) {
+      unsigned int j = __builtin_ctz(mask);
+      matches += nfm_load_scan_at(data+i+j, len-i-j);
+      mask &= mask-1;
+    }
+    i += 16;
+  }
+  return matches + nfm_load_scan_scalar(data+i, len-i);
+}
+
+__attribute__((target("avx2")))
+static uint32_t nfm_load_scan_avx2(unsigned char* data, unsigned int len)
+{
+  uint32_t matches = 0;
+  unsigned int i = 0, k;
+  while (i+32+NFM_LOAD_SCAN_MAXLEN-1 <= len) {
+    __m256i b0 = _mm256_loadu_si256((const __m256i*)(data+i));
+    __m256i b1 = _mm256_loadu_si256((const __m256i*)(data+i+1));
+    __m256i hit = _mm256_setzero_si256();
+    unsigned int mask;
+    for (k = 0; k < NFM_LOAD_SCAN_PATTERNS; k++) {
+      __m256i c0 = _mm256_cmpeq_epi8(b0, _mm256_set1_epi8(nfm_load_scan_patterns[k][0]));
+      __m256i c1 = _mm256_cmpeq_epi8(b1, _mm256_set1_epi8(nfm_load_scan_patterns[k][1]));
+      hit = _mm256_or_si256(hit, _mm256_and_si256(c0, c1));
+    }
+    mask = (unsigned int)_mm256_movemask_epi8(hit);
+    while (mask) {
+      unsigned int j = __builtin_ctz(mask);
+      matches += nfm_load_scan_at(data+i+j, len-i-j);
+      mask &= mask-1;
+    }
+    i += 32;
+  }
+  return matches + nfm_load_scan_scalar(data+i, len-i);
+}
+#endif
+
+#ifdef NFM_LOAD_X86
+#define NFM_LOAD_SIMD(sse42, avx2) sse42, avx2
+#else
+#define NFM_LOAD_SIMD(sse42, avx2) NULL, NULL
+#endif
+
+static const nfm_load_kernel_t nfm_load_kernels[] = {
+  { "csum",     { nfm_load_csum_scalar,     NFM_LOAD_SIMD(nfm_load_csum_sse42, nfm_load_csum_avx2) }, { NULL, NULL, NULL } },
+  { "crc32c",   { nfm_load_crc32c_scalar,   NFM_LOAD_SIMD(nfm_load_crc32c_sse42, NULL) }, { NULL, NULL, NULL } },
+  { "toeplitz", { nfm_load_toeplitz_scalar, NFM_LOAD_SIMD(nfm_load_toeplitz_table_fn, NULL) }, { NULL, "table", NULL } },
+  { "scan",     { nfm_load_scan_scalar,     NFM_LOAD_SIMD(nfm_load_scan_sse42, nfm_load_scan_avx2) }, { NULL, NULL, NULL } },
+  { "swap",     { nfm_load_swap_scalar,     NFM_LOAD_SIMD(NULL, NULL) }, { NULL, NULL, NULL } },
+  { NULL,       { NULL, NULL, NULL }, { NULL, NULL, NULL } }
+};
+
+static inline int nfm_load_cpu_isa(void)
+{
+#ifdef NFM_LOAD_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return NFM_LOAD_ISA_AVX2;
+  if (__builtin_cpu_supports("sse4.2"))
+    return NFM_LOAD_ISA_SSE42;
+#endif
+  return NFM_LOAD_ISA_SCALAR;
+}
+
+// How to report version 'isa' of 'k'
+static inline const char* nfm_load_label(const nfm_load_kernel_t* k, int isa)
+{
+  return k->label[isa] ? k->label[isa] : nfm_load_isa_names[isa];
+}
+
+static inline int nfm_load_isa_from_name(const char* name)
+{
+  int i;
+  for (i = 0; i < NFM_LOAD_ISA_COUNT; i++) {
+    if (strcmp(name, nfm_load_isa_names[i]) == 0)
+      return i;
+  }
+  return -1;
+}
+
+static inline const nfm_load_kernel_t* nfm_load_find(const char* name)
+{
+  const nfm_load_kernel_t* k;
+  for (k = nfm_load_kernels; k->name; k++) {
+    if (strcmp(name, k->name) == 0)
+      return k;
+  }
+  return NULL;
+}
+
+// Pick the version of 'k' for the highest ISA not above 'max_isa' that the
+// CPU supports; '*isa' receives the one chosen
+static inline nfm_load_fn nfm_load_select(const nfm_load_kernel_t* k, int max_isa, int* isa)
+{
+  static int tables_ready = 0;
+  int i = nfm_load_cpu_isa();
+  if (!tables_ready) {
+    nfm_load_crc32c_init();
+    nfm_load_toeplitz_init();
+    nfm_load_scan_init();
+    tables_ready = 1;
+  }
+  if (max_isa >= 0 && max_isa < i)
+    i = max_isa;
+  while (i > NFM_LOAD_ISA_SCALAR && !k->fn[i])
+    i--;
+  *isa = i;
+  return k->fn[i];
+}
+
+#endif
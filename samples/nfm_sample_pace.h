@@ -0,0 +1,220 @@
+/**
+ * Copyright (C) 2013 Netronome Systems, Inc.  All rights reserved.
+ *
+ * File:        nfm_sample_pace.h
+ * Description: Transmit pacing for the replay samples. Every packet gets an
+ *              absolute CLOCK_MONOTONIC deadline, from its capture time
+ *              (with the gaps scaled by a multiplier) or from a fixed packet
+ *              or bit rate. The sender sleeps until shortly before the
+ *              deadline and spins the rest of the way, so gaps far below
+ *              the timer slack are kept. Because deadlines are absolute, a
+ *              packet sent late does not push back the ones after it.
+ *
+ *              How late each packet was handed to the transmit call is kept
+ *              in a histogram for the report. Scheduling and waiting can be
+ *              done by different threads: one nfm_pace_t decides every
+ *              deadline, and the senders each wait in their own.
+ */
+
+#ifndef NFM_SAMPLE_PACE_H
+#define NFM_SAMPLE_PACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "nfm_sample_hist.h"
+
+#define NFM_PACE_NONE            0     // as fast as possible
+#define NFM_PACE_CAPTURE         1     // capture timing, gaps times 'multiplier'
+#define NFM_PACE_PPS             2
+#define NFM_PACE_BPS             3
+
+// Sleep only for gaps longer than this: a sleep overshoots by the timer
+// slack (50 us by default) plus the wakeup latency
+#define NFM_PACE_DEFAULT_SPIN_NS 200000
+
+typedef struct {
+  int mode;
+  double multiplier;
+  double rate;             // packets or bits per second
+  uint64_t spin_ns;
+} nfm_pace_cfg_t;
+
+#define NFM_PACE_DEFAULT_CFG { NFM_PACE_NONE, 1.0, 0.0, NFM_PACE_DEFAULT_SPIN_NS }
+
+typedef struct {
+  nfm_pace_cfg_t cfg;
+  int started;
+  uint64_t start_ns;       // deadline of the first packet
+  uint64_t first_ts;       // capture time of the first packet
+  uint64_t prev_ts;        // capture time of the last packet, loops included
+  uint64_t last_gap;
+  uint64_t loop_offset;    // capture time added by the loops before this one
+  uint64_t sched_packets;
+  uint64_t sched_bits;
+  uint64_t packets;        // sent
+  uint64_t bits;
+  uint64_t last_deadline;
+  uint64_t last_sent_ns;
+  uint64_t sleeps;
+  nfm_hist_t late;         // ns past each deadline
+} nfm_pace_t;
+
+static inline uint64_t nfm_pace_now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static inline void nfm_pace_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#else
+  __asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+// Parse a rate: "N" or "Npps", "Nkpps", "NMpps", "NMbps", "NGbps";
+// returns 0 on success
+static inline int nfm_pace_parse_rate(nfm_pace_cfg_t* cfg, const char* spec)
+{
+  char* end;
+  double v;
+  errno = 0;
+  v = strtod(spec, &end);
+  if (errno || end == spec || v <= 0)
+    return -1;
+  if (*end == 0 || strcmp(end, "pps") == 0) {
+    cfg->mode = NFM_PACE_PPS;
+  } else if (strcmp(end, "kpps") == 0) {
+    cfg->mode = NFM_PACE_PPS;
+    v *= 1e3;
+  } else if (strcmp(end, "Mpps") == 0) {
+    cfg->mode = NFM_PACE_PPS;
+    v *= 1e6;
+  } else if (strcmp(end, "Mbps") == 0) {
+    cfg->mode = NFM_PACE_BPS;
+    v *= 1e6;
+  } else if (strcmp(end, "Gbps") == 0) {
+    cfg->mode = NFM_PACE_BPS;
+    v *= 1e9;
+  } else {
+    return -1;
+  }
+  cfg->rate = v;
+  return 0;
+}
+
+static inline void nfm_pace_init(nfm_pace_t* p, const nfm_pace_cfg_t* cfg)
+{
+  memset(p, 0, sizeof(*p));
+  p->cfg = *cfg;
+}
+
+// The next pass over the capture follows the last packet by the last gap
+static inline void nfm_pace_next_loop(nfm_pace_t* p)
+{
+  if (p->started)
+    p->loop_offset = p->prev_ts + p->last_gap - p->first_ts;
+}
+
+// Scheduler: the deadline of the next packet, 'len' bytes captured at 'ts_ns'
+static inline uint64_t nfm_pace_schedule(nfm_pace_t* p, uint64_t ts_ns, uint32_t len)
+{
+  uint64_t ts, n = p->sched_packets, bits = p->sched_bits;
+  if (!p->started) {
+    p->started = 1;
+    p->start_ns = nfm_pace_now_ns();
+    p->first_ts = p->prev_ts = ts_ns;
+  }
+  p->sched_packets++;
+  p->sched_bits += (uint64_t)len * 8;
+  switch (p->cfg.mode) {
+  case NFM_PACE_CAPTURE:
+    // Capture time never runs backwards here: a step back is a zero gap
+    ts = ts_ns + p->loop_offset;
+    if (ts < p->prev_ts)
+      ts = p->prev_ts;
+    p->last_gap = ts - p->prev_ts;
+    p->prev_ts = ts;
+    return p->start_ns + (uint64_t)((double)(ts - p->first_ts) * p->cfg.multiplier);
+  case NFM_PACE_PPS:
+    return p->start_ns + (uint64_t)((double)n * 1e9 / p->cfg.rate);
+  case NFM_PACE_BPS:
+    return p->start_ns + (uint64_t)((double)bits * 1e9 / p->cfg.rate);
+  }
+  return p->start_ns;
+}
+
+// Sender: wait for the 'deadline' of a 'len' byte packet
+static inline void nfm_pace_wait(nfm_pace_t* p, uint64_t deadline, uint32_t len)
+{
+  uint64_t now = nfm_pace_now_ns();
+  struct timespec ts;
+
+  if (deadline > now + p->cfg.spin_ns) {
+    ts.tv_sec = (time_t)((deadline - p->cfg.spin_ns) / 1000000000ULL);
+    ts.tv_nsec = (long)((deadline - p->cfg.spin_ns) % 1000000000ULL);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+      ;
+    p->sleeps++;
+    now = nfm_pace_now_ns();
+  }
+  while (now < deadline) {
+    nfm_pace_cpu_relax();
+    now = nfm_pace_now_ns();
+  }
+  nfm_hist_record(&p->late, now - deadline, 1);
+  p->packets++;
+  p->bits += (uint64_t)len * 8;
+  p->last_deadline = deadline;
+  if (now > p->last_sent_ns)
+    p->last_sent_ns = now;
+}
+
+// Schedule and wait in one thread
+static inline void nfm_pace_packet(nfm_pace_t* p, uint64_t ts_ns, uint32_t len)
+{
+  nfm_pace_wait(p, nfm_pace_schedule(p, ts_ns, len), len);
+}
+
+// Fold a sender's figures into the scheduler's, for the report
+static inline void nfm_pace_merge(nfm_pace_t* p, const nfm_pace_t* sender)
+{
+  unsigned int i;
+  for (i = 0; i < NFM_HIST_BUCKETS; i++)
+    p->late.counts[i] += sender->late.counts[i];
+  p->packets += sender->packets;
+  p->bits += sender->bits;
+  p->sleeps += sender->sleeps;
+  if (sender->last_deadline > p->last_deadline)
+    p->last_deadline = sender->last_deadline;
+  if (sender->last_sent_ns > p->last_sent_ns)
+    p->last_sent_ns = sender->last_sent_ns;
+}
+
+static inline void nfm_pace_report(const nfm_pace_t* p, FILE* f)
+{
+  uint64_t total = nfm_hist_total(&p->late);
+  double sched = (double)(p->last_deadline - p->start_ns) / 1e9;
+  double took = (double)(p->last_sent_ns - p->start_ns) / 1e9;
+
+  if (p->packets < 2)
+    return;
+  fprintf(f, "Pacing: scheduled %.0f pps, %.1f Mbps; achieved %.0f pps, %.1f Mbps; %llu sleeps\n",
+          sched > 0 ? (p->packets-1) / sched : 0.0, sched > 0 ? p->bits / sched / 1e6 : 0.0,
+          took > 0 ? (p->packets-1) / took : 0.0, took > 0 ? p->bits / took / 1e6 : 0.0,
+          (unsigned long long)p->sleeps);
+  fprintf(f, "Pacing: sent after the deadline by p50 %.2f us, p90 %.2f us, p99 %.2f us, p99.9 %.2f us, max %.2f us\n",
+          nfm_hist_percentile(&p->late, total, 50) / 1e3, nfm_hist_percentile(&p->late, total, 90) / 1e3,
+          nfm_hist_percentile(&p->late, total, 99) / 1e3, nfm_hist_percentile(&p->late, total, 99.9) / 1e3,
+          nfm_hist_max(&p->late) / 1e3);
+}
+
+#endif
@@ -5,6 +5,8 @@
  * Description: Sample wire application using the packet API.
  */
 
+#define _GNU_SOURCE
+
 #include "ns_packet.h"
 
 #include <stdio.h>
@@ -14,24 +16,141 @@
 #include <getopt.h>
 #include <sys/time.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include "ns_log.h"
+#include "nfm_sample_stats.h"
+#include "nfm_sample_hist.h"
+#include "nfm_sample_load.h"
+#include "nfm_sample_trace.h"
+#include "nfm_sample_rxsched.h"
+#include "nfm_sample_lifmatrix.h"
+
+// Upper bound for --burst; the batch lives on the stack of the receive loop
+#define MAX_BURST 256
+// One worker per device.endpoint.id tuple
+#define MAX_WORKERS NFM_STATS_MAX_THREADS
+
+// Per worker state. Each worker only writes its own counters in 'stats';
+// they are summed by the reporter thread.
+typedef struct {
+  pthread_t thread;
+  ns_packet_device_h dev;
+  unsigned int index;
+  int cpu;
+  nfm_stats_counter_t* stats;
+  struct latency_s* lat;
+  uint64_t load_ticks;  // time spent in the -L stage
+  uint64_t load_pkts;
+  uint32_t load_sink;   // keeps kernel results live
+  nfm_rxsched_t rxsched;
+  nfm_lifm_cell_t* lifm;  // this worker's lif matrix, or 0
+} worker_t;
+
+// Latency histograms (-H), in ns: NFE timestamp to host receive, and host
+// receive to transmit. One per worker, written only by that worker.
+typedef struct latency_s {
+  nfm_hist_t nfe_to_rx;
+  nfm_hist_t rx_to_tx;
+} latency_t;
+
+static latency_t* latency = 0;
+static latency_t* latency_prev = 0;  // reporter thread snapshots
+static unsigned int latency_interval = 0;
+
+static worker_t workers[MAX_WORKERS];
+static unsigned int num_workers = 0;
+
+// Settings shared read-only by all workers
+static unsigned int burst = 1;
+static unsigned int flags = 0;
+static int drop_all = 0;
+static unsigned int enable_load = 0;
+static const nfm_load_kernel_t* load_kernel = 0;
+static nfm_load_fn load_fn = 0;
+static int load_isa = -1;
+static int rxsched = 0;
+static nfm_rxsched_cfg_t rxsched_cfg = NFM_RXSCHED_DEFAULT_CFG;
+static unsigned int print_packets = 300000;
+static ns_log_lvl_e loglevel;
+
+static nfm_stats_t stats;
 
-unsigned long long numbytes = 0;
-unsigned long long numpkts = 0;
-pid_t pid = 0;
+// Packet tracing (-t, or VERBOSE log level); one ring per worker
+static nfm_trace_t trace;
+static int tracing = 0;
 
-static void dump(unsigned char *data, unsigned int len)
+// Ingress x egress lif matrix (-M), written to lifm_path on SIGUSR1 and exit
+static nfm_lifm_t lifm;
+static const char* lifm_path = 0;
+
+static inline uint64_t realtime_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static void print_latency(const char* what, const nfm_hist_t* h)
+{
+  uint64_t total = nfm_hist_total(h);
+  if (total == 0)
+    return;
+  printf("latency %-9s n=%llu p50 %.1fus p99 %.1fus p99.9 %.1fus max %.1fus\n", what,
+         (unsigned long long)total,
+         nfm_hist_percentile(h, total, 50.0)/1000.0,
+         nfm_hist_percentile(h, total, 99.0)/1000.0,
+         nfm_hist_percentile(h, total, 99.9)/1000.0,
+         nfm_hist_max(h)/1000.0);
+}
+
+static void dump_lifm(FILE* f)
 {
+  if (nfm_lifm_dump(&lifm, lifm_path) != 0) {
+    fprintf(stderr, "Could not write lif matrix to %s: %s\n", lifm_path, strerror(errno));
+  } else {
+    fprintf(f, "lif matrix written to %s\n", lifm_path);
+  }
+}
+
+// SIGUSR1 extra output: receive scheduler state residency per worker, and
+// the lif matrix as of the last merge
+static void report_extra(FILE* f, void __attribute__((unused)) *ctx)
+{
+  char prefix[32];
   unsigned int i;
-  for (i = 0; i < len; i++) {
-    if (i%16 == 0)
-      printf("\n");
-    else if (i%2 == 0)
-      printf(" ");
-    printf("%02x", data[i]);
+  if (rxsched) {
+    for (i = 0; i < num_workers; i++) {
+      snprintf(prefix, sizeof(prefix), "worker %u ", i);
+      nfm_rxsched_report(f, prefix, &workers[i].rxsched);
+    }
+  }
+  if (lifm_path) {
+    dump_lifm(f);
   }
-  printf("\n\n");
+}
+
+// Stats reporter sample callback: fold the workers' lif matrices together
+static void merge_lifm(void __attribute__((unused)) *ctx)
+{
+  nfm_lifm_merge(&lifm);
+}
+
+// Stats reporter interval callback: merge what every worker recorded since
+// the previous interval and print it
+static void report_latency(void __attribute__((unused)) *ctx)
+{
+  static latency_t sum;
+  unsigned int i;
+  memset(&sum, 0, sizeof(sum));
+  for (i = 0; i < num_workers; i++) {
+    nfm_hist_collect(&sum.nfe_to_rx, &latency[i].nfe_to_rx, &latency_prev[i].nfe_to_rx);
+    nfm_hist_collect(&sum.rx_to_tx, &latency[i].rx_to_tx, &latency_prev[i].rx_to_tx);
+  }
+  print_latency("nfe->host", &sum.nfe_to_rx);
+  print_latency("rx->tx", &sum.rx_to_tx);
+  fflush(stdout);
 }
 
 #define print_error(r, prefix)  fprintf(stderr, "%s: %s: %s. (subcode=%d).\n", prefix, ns_nfm_module_string(r), ns_nfm_error_string(r), NS_NFM_ERROR_SUBCODE(r))
@@ -43,10 +162,113 @@ void sig_term(int __attribute__((unused)) dummy)
   running = 0;
 }
 
+// Sent to each worker at shutdown to interrupt a blocked ns_packet_receive
+void sig_wake(int __attribute__((unused)) dummy)
+{
+}
+
 void sig_usr1(int __attribute__((unused)) dummy)
 {
-  printf("%8d  %16llu  %16llu\n", pid, numpkts, numbytes);
-  fflush(stdout);
+  nfm_stats_request_report(&stats);
+}
+
+static void* worker_loop(void* arg)
+{
+  worker_t* w = (worker_t*)arg;
+  ns_nfm_ret_t r;
+  ns_packet_t pckts[MAX_BURST];
+  uint64_t rx_ns = 0;
+
+  if (w->cpu >= 0) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(w->cpu, &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+      fprintf(stderr, "Worker %u: could not pin to CPU %d\n", w->index, w->cpu);
+    }
+  }
+
+  while (running) {
+    unsigned int n, i;
+    unsigned long long batch_bytes = 0;
+
+    if (rxsched) {
+      if (NS_NFM_SUCCESS != (r = ns_packet_receive(w->dev, &pckts[0], flags | NS_PACKET_RECEIVE_NONBLOCK))) {
+        if (NS_NFM_ERROR_CODE(r) == NS_NFM_RETRY_LATER) {
+          nfm_rxsched_idle(&w->rxsched, &rxsched_cfg);
+          continue;
+        }
+        if (running)
+          print_error(r, "ns_packet_receive");
+        break;
+      }
+      nfm_rxsched_active(&w->rxsched);
+    } else if (NS_NFM_SUCCESS != (r = ns_packet_receive(w->dev, &pckts[0], flags))) {
+      if (running)
+        print_error(r, "ns_packet_receive");
+      continue;
+    }
+
+    // Top up the batch with whatever is already queued, without waiting for more
+    n = 1;
+    while (n < burst && NS_NFM_SUCCESS == ns_packet_receive(w->dev, &pckts[n], flags | NS_PACKET_RECEIVE_NONBLOCK)) {
+      n++;
+    }
+
+    if (w->lat) {
+      // One clock read per batch; NFE stamps behind the host clock count as 0
+      rx_ns = realtime_ns();
+      for (i = 0; i < n; i++) {
+        uint64_t nfe_ns = (uint64_t)pckts[i].timestamp_s*1000000000ULL + (uint64_t)pckts[i].timestamp_us*1000ULL;
+        nfm_hist_record(&w->lat->nfe_to_rx, (rx_ns > nfe_ns) ? rx_ns-nfe_ns : 0, 1);
+      }
+    }
+
+    for (i = 0; i < n; i++) {
+      if (tracing) {
+        nfm_trace_packet(&trace, w->index, &pckts[i]);
+      }
+      if (w->lifm) {
+        nfm_lifm_add(&lifm, w->lifm, ns_packet_get_ingress_logical_interface_id(&pckts[i]),
+                     ns_packet_get_egress_logical_interface_id(&pckts[i]), pckts[i].packet_length);
+      }
+      batch_bytes += pckts[i].packet_length;
+    }
+
+    nfm_stats_add(w->stats, n, batch_bytes);
+
+    if (enable_load) {
+      uint64_t t0 = nfm_load_ticks();
+      unsigned int iter;
+      for (i = 0; i < n; i++) {
+        if (!pckts[i].packet_data || pckts[i].packet_length < 4)
+          continue;
+        for (iter = 0; iter < enable_load; ++iter) {
+          w->load_sink ^= load_fn(pckts[i].packet_data, pckts[i].packet_length);
+        }
+      }
+      w->load_ticks += nfm_load_ticks() - t0;
+      w->load_pkts += n;
+    }
+
+    // No batch transmit in the packet API: one call per packet
+    for (i = 0; i < n; i++) {
+      if (drop_all) {
+        ns_packet_destroy(&pckts[i]);
+      } else {
+        if (NS_NFM_SUCCESS != (r = ns_packet_transmit(w->dev, &pckts[i], 0))) {
+          print_error(r, "ns_packet_transmit");
+          ns_packet_destroy(&pckts[i]);
+        }
+      }
+    }
+
+    if (w->lat) {
+      nfm_hist_record(&w->lat->rx_to_tx, realtime_ns()-rx_ns, n);
+    }
+  }
+
+  return NULL;
 }
 
 static void print_usage(const char* argv0)
@@ -63,9 +285,25 @@ static void print_usage(const char* argv0)
                   " -m --multi d.e.i[:d.e.i]... Receive from multiple device.endpoint.id tuples (ignore -d, -e and -i options)\n"
                   " -# --counters   Show packet counters at program exit\n"
                   " -A --adaptive   Use adaptive polling (decrease latency at the cost of some CPU while no traffic)\n"
-                  " -L --load       Enable artificial processing of packet contents to generate memory/CPU load\n"
-                  " -p --print N    Print stats at every N packets (N >= 1: default 300000) at EXTRA log level (-l 6)\n",
-          argv0);
+                  " -L --load N     Run the load kernel N times on every packet to generate memory/CPU load\n"
+                  " -R --rxsched B:P:Y[:W] Poll without blocking; after B empty polls add a CPU pause, after P more\n"
+                  "                 sched_yield, after Y more sleep W us between polls (default 2000:2000:200:50)\n"
+                  " -t --trace N[:S] Trace 1 in N packets (S bytes each, max %u) from a background thread;\n"
+                  "                 tracing of every packet is on by default at VERBOSE log level (-l 7)\n"
+                  " -K --kernel k[:isa] Load kernel: csum, crc32c, toeplitz, scan or swap (default csum),\n"
+                  "                 optionally capped at isa scalar, sse4.2 or avx2 (default: best the CPU supports);\n"
+                  "                 toeplitz from sse4.2 up is a byte table lookup, reported as 'table'\n"
+                  " -p --print N    Print stats at every N packets (N >= 1: default 300000) at EXTRA log level (-l 6)\n"
+                  "                 (checked once a second; SIGUSR1 prints totals and 1s/10s/60s rates)\n"
+                  " -b --burst N    Receive up to N packets per poll and process them as one batch (1-%u, default 1);\n"
+                  "                 the packet API has no batch transmit, so they still go out one call each\n"
+                  " -T --threads    With -m, open each tuple on its own device handle and serve it from its own thread\n"
+                  " -C --cpus c[,c]... Pin worker n to the n-th listed CPU (default with -T: worker n on CPU n)\n"
+                  " -H --latency S  Print NFE-to-host and receive-to-transmit latency p50/p99/p99.9/max every S seconds\n"
+                  " -M --lifmatrix F[:N] Count packets/bytes per ingress x egress lif (lifs 0 to N-1, default %u, max %u;\n"
+                  "                 higher lifs count as \"other\") and write the matrix to F on SIGUSR1 and at exit,\n"
+                  "                 as CSV if F ends in .csv, binary otherwise\n",
+          argv0, MAX_BURST, NFM_TRACE_SNAP_MAX, NFM_LIFM_DEFAULT_LIFS, NFM_LIFM_MAX_LIFS);
   exit(1);
 }
 
@@ -82,24 +320,44 @@ static const struct option __long_options[] = {
   {"counters",  0, 0, '#'},
   {"adaptive",  0, 0, 'A'},
   {"load",      2, 0, 'L'},
+  {"burst",     1, 0, 'b'},
+  {"threads",   0, 0, 'T'},
+  {"cpus",      1, 0, 'C'},
+  {"latency",   1, 0, 'H'},
+  {"kernel",    1, 0, 'K'},
+  {"trace",     1, 0, 't'},
+  {"rxsched",   1, 0, 'R'},
+  {"lifmatrix", 1, 0, 'M'},
   {0, 0, 0, 0}
 };
 
+static ns_nfm_ret_t open_worker_device(worker_t* w, unsigned int* ids, unsigned int num_ids, int request_arp, unsigned int adaptive_poll)
+{
+  ns_packet_extra_options_t opt;
+  memset(&opt, 0, sizeof(opt));
+  opt.host_inline=1-drop_all;
+  opt.request_arp=request_arp;
+  opt.adaptive_poll_us=adaptive_poll;
+  if (num_ids==1) {
+    return ns_packet_open_device_ex(&w->dev, ids[0], &opt);
+  }
+  return ns_packet_open_multi_device_ex(&w->dev, ids, num_ids, &opt);
+}
+
 int main(int argc, char **argv)
 {
   ns_nfm_ret_t r;
-  ns_packet_device_h dev;
-  ns_packet_t pckt;
   unsigned int host_id = 15;
   unsigned int endpoint = 1;
   unsigned int device = 0;
-  unsigned int flags = 0;
-  int drop_all = 0;
   int request_arp = 0;
-  unsigned int print_packets = 300000;
-  struct timeval start, end;
-  uint64_t start_us, end_us;
-  ns_log_lvl_e loglevel;
+  int threaded = 0;
+  int cpus[MAX_WORKERS];
+  unsigned int num_cpus = 0;
+  unsigned int single_id;
+  unsigned int trace_sample=0;
+  unsigned int trace_snap=0;
+  unsigned int lifm_lifs=NFM_LIFM_DEFAULT_LIFS;
   unsigned int* multi=0;
   unsigned int num_multi=0;
   unsigned int index;
@@ -107,14 +365,12 @@ int main(int argc, char **argv)
   char* tok=0;
   unsigned int show_counters=0;
   unsigned int adaptive_poll=0;
-  unsigned int enable_load=0;
 
-  pid = getpid();
   ns_log_init(NS_LOG_COLOR | NS_LOG_CONSOLE);
   ns_log_lvl_set(NS_LOG_LVL_INFO);
 
   int c;
-  while ((c = getopt_long(argc, argv, "l:hi:d:e:Dp:m:L:a#A::", __long_options, NULL)) != -1) {
+  while ((c = getopt_long(argc, argv, "l:hi:d:e:Dp:m:L:a#A::b:TC:H:K:t:R:M:", __long_options, NULL)) != -1) {
     switch (c) {
     case '#':
       show_counters=1;
@@ -166,6 +422,90 @@ int main(int argc, char **argv)
         exit(1);
       }
       break;
+    case 'b':
+      burst = (unsigned int)strtoul(optarg,0,0);
+      if (burst == 0 || burst > MAX_BURST) {
+        fprintf(stderr, "Burst size %u is out of range (1-%u)\n", burst, MAX_BURST);
+        exit(1);
+      }
+      break;
+    case 'T':
+      threaded = 1;
+      break;
+    case 'R':
+      if (nfm_rxsched_parse(&rxsched_cfg, optarg) != 0) {
+        fprintf(stderr, "Use a sensible receive scheduler setting, (not %s)\n", optarg);
+        exit(1);
+      }
+      rxsched=1;
+      break;
+    case 'M':
+      tok=strrchr(optarg, ':');
+      if (tok && tok[1] && strspn(tok+1, "0123456789")==strlen(tok+1)) {
+        lifm_lifs=(unsigned int)strtoul(tok+1,0,10);
+      } else {
+        tok=0;
+      }
+      if (tok==optarg || *optarg == 0 || lifm_lifs == 0 || lifm_lifs > NFM_LIFM_MAX_LIFS) {
+        fprintf(stderr, "Use a sensible lif matrix setting, (not %s)\n", optarg);
+        exit(1);
+      }
+      if (tok)
+        *tok=0;
+      lifm_path=optarg;
+      tok=0;
+      break;
+    case 't':
+      trace_sample=(unsigned int)strtoul(optarg,&tok,0);
+      if (*tok==':')
+        trace_snap=(unsigned int)strtoul(tok+1,0,0);
+      if (trace_sample == 0 || trace_snap > NFM_TRACE_SNAP_MAX) {
+        fprintf(stderr, "Use a sensible trace setting, (not %s)\n", optarg);
+        exit(1);
+      }
+      tok=0;
+      break;
+    case 'K':
+      tok=strchr(optarg, ':');
+      if (tok) {
+        *tok++=0;
+        load_isa=nfm_load_isa_from_name(tok);
+        if (load_isa < 0) {
+          fprintf(stderr, "Unknown instruction set '%s'\n", tok);
+          exit(1);
+        }
+      }
+      load_kernel=nfm_load_find(optarg);
+      if (!load_kernel) {
+        fprintf(stderr, "Unknown load kernel '%s'\n", optarg);
+        exit(1);
+      }
+      tok=0;
+      break;
+    case 'H':
+      latency_interval = (unsigned int)strtoul(optarg,0,0);
+      if (latency_interval == 0) {
+        fprintf(stderr, "Use a sensible latency report interval, (not %u)\n", latency_interval);
+        exit(1);
+      }
+      break;
+    case 'C':
+      if (strspn(optarg, "0123456789,")!=strlen(optarg)) {
+        print_usage(argv[0]);
+      }
+      num_cpus=0;
+      tok=optarg;
+      while (*tok) {
+        if (num_cpus==MAX_WORKERS) {
+          fprintf(stderr, "Too many CPUs listed (max %u)\n", MAX_WORKERS);
+          exit(1);
+        }
+        cpus[num_cpus++]=(int)strtoul(tok, &tok, 10);
+        if (*tok==',')
+          ++tok;
+      }
+      tok=0;
+      break;
     case 'm':
       if (strspn(optarg, "0123456789x:abcdefABCDEF+nfe.")!=strlen(optarg)) {
         print_usage(argv[0]);
@@ -223,6 +563,14 @@ int main(int argc, char **argv)
   if (optind != argc)
     print_usage(argv[0]);
 
+  if (enable_load) {
+    int isa;
+    if (!load_kernel)
+      load_kernel=nfm_load_find("csum");
+    load_fn=nfm_load_select(load_kernel, load_isa, &isa);
+    printf("Load kernel %s (%s) x%u per packet\n", load_kernel->name, nfm_load_label(load_kernel, isa), enable_load);
+  }
+
   if (opt) {
     free(opt); opt=0;
   }
@@ -234,115 +582,164 @@ int main(int argc, char **argv)
   sigaction(SIGTERM, &action, NULL);
   action.sa_handler = sig_usr1;
   sigaction(SIGUSR1, &action, NULL);
+  action.sa_handler = sig_wake;
+  sigaction(SIGUSR2, &action, NULL);
 
   if (num_multi==0) {
-    ns_packet_extra_options_t opt;
-    printf("Opening device %u endpoint %u ID %u\n", device, endpoint, host_id);
-    memset(&opt, 0, sizeof(opt));
-    opt.host_inline=1-drop_all;
-    opt.request_arp=request_arp;
-    opt.adaptive_poll_us=adaptive_poll;
-    if (NS_NFM_SUCCESS != (r = ns_packet_open_device_ex(&dev, NFM_CARD_ENDPOINT_ID(device, endpoint, host_id), &opt))) {
-      print_error(r, "ns_packet_open_device");
+    single_id=NFM_CARD_ENDPOINT_ID(device, endpoint, host_id);
+    multi=&single_id;
+    num_multi=1;
+  }
+  // Without -T one multi device handle serves every tuple
+  if (threaded && num_multi>MAX_WORKERS) {
+    fprintf(stderr, "Too many tuples for -T (max %u)\n", MAX_WORKERS);
+    return 1;
+  }
+
+  // One worker serving every tuple from the calling thread, or one thread per tuple
+  num_workers=threaded?num_multi:1;
+  nfm_stats_init(&stats, num_workers, print_packets);
+  if (latency_interval) {
+    if (posix_memalign((void**)&latency, 64, num_workers*sizeof(latency_t)) != 0 ||
+        posix_memalign((void**)&latency_prev, 64, num_workers*sizeof(latency_t)) != 0) {
+      fprintf(stderr, "Could not allocate latency histograms\n");
       return -1;
     }
-  } else {
-    ns_packet_extra_options_t opt;
-    memset(&opt, 0, sizeof(opt));
-    opt.host_inline=1-drop_all;
-    opt.request_arp=request_arp;
-    opt.adaptive_poll_us=adaptive_poll;
-    printf("Opening multiple: ");
-    for(index=0; index<num_multi; ++index) {
-      printf("%sdevice=%u endpoint=%u ID=%u", (index==0)?"":",", NFM_CARD_FROM_BITFIELD(multi[index]), NFM_ENDPOINT_FROM_BITFIELD(multi[index]), NFM_HOSTID_FROM_BITFIELD(multi[index]));
+    memset(latency, 0, num_workers*sizeof(latency_t));
+    memset(latency_prev, 0, num_workers*sizeof(latency_t));
+    nfm_stats_set_interval_fn(&stats, latency_interval, report_latency, NULL);
+  }
+  if (lifm_path) {
+    if (nfm_lifm_init(&lifm, num_workers, lifm_lifs) != 0) {
+      fprintf(stderr, "Could not allocate lif matrix\n");
+      return -1;
+    }
+    nfm_stats_set_sample_fn(&stats, merge_lifm, NULL);
+  }
+  for (index=0; index<num_workers; ++index) {
+    worker_t* w=&workers[index];
+    unsigned int i;
+    w->index=index;
+    w->stats=&stats.counters[index];
+    w->lat=latency?&latency[index]:0;
+    w->lifm=lifm_path?nfm_lifm_thread(&lifm, index):0;
+    nfm_rxsched_init(&w->rxsched);
+    w->cpu=(index<num_cpus)?cpus[index]:(threaded?(int)index:-1);
+    if (threaded) {
+      printf("Worker %u (CPU %d) opening device=%u endpoint=%u ID=%u\n", index, w->cpu,
+             NFM_CARD_FROM_BITFIELD(multi[index]), NFM_ENDPOINT_FROM_BITFIELD(multi[index]), NFM_HOSTID_FROM_BITFIELD(multi[index]));
+      r=open_worker_device(w, &multi[index], 1, request_arp, adaptive_poll);
+    } else if (num_multi==1) {
+      printf("Opening device %u endpoint %u ID %u\n", NFM_CARD_FROM_BITFIELD(multi[0]), NFM_ENDPOINT_FROM_BITFIELD(multi[0]), NFM_HOSTID_FROM_BITFIELD(multi[0]));
+      r=open_worker_device(w, multi, 1, request_arp, adaptive_poll);
+    } else {
+      printf("Opening multiple: ");
+      for(i=0; i<num_multi; ++i) {
+        printf("%sdevice=%u endpoint=%u ID=%u", (i==0)?"":",", NFM_CARD_FROM_BITFIELD(multi[i]), NFM_ENDPOINT_FROM_BITFIELD(multi[i]), NFM_HOSTID_FROM_BITFIELD(multi[i]));
+      }
+      printf("\n");
+      r=open_worker_device(w, multi, num_multi, request_arp, adaptive_poll);
     }
-    printf("\n");
-    if (NS_NFM_SUCCESS != (r = ns_packet_open_multi_device_ex(&dev, multi, num_multi, &opt))) {
+    if (NS_NFM_SUCCESS != r) {
       print_error(r, "ns_packet_open_device");
       return -1;
     }
-    free(multi);
+    if (show_counters) {
+      ns_packet_enable_counters(w->dev);
+    }
   }
-  if (show_counters) {
-    ns_packet_enable_counters(dev);
+  if (multi!=&single_id) {
+    free(multi);
   }
 
   ns_log_lvl_get(&loglevel);
 
-  while (running) {
-    if (NS_NFM_SUCCESS != (r = ns_packet_receive(dev, &pckt, flags))) {
-      if (running)
-        print_error(r, "ns_packet_receive");
-      continue;
-    }
+  if (rxsched || lifm_path) {
+    nfm_stats_set_report_fn(&stats, report_extra, NULL);
+  }
 
-    NS_LOG_VERBOSE("Dumping packet data\n");
-    if (loglevel == NS_LOG_LVL_VERBOSE) {
-      dump(pckt.packet_data, pckt.packet_length);
+  tracing = trace_sample || loglevel == NS_LOG_LVL_VERBOSE;
+  if (tracing) {
+    if (nfm_trace_init(&trace, num_workers, trace_sample, trace_snap, stdout) != 0 || nfm_trace_start(&trace) != 0) {
+      fprintf(stderr, "Could not start packet tracing\n");
+      return -1;
     }
+  }
 
-    NS_LOG_VERBOSE("%lu.%6lu Received packet with length %d from lif%d to lif%d\n",
-                   pckt.timestamp_s, pckt.timestamp_us, pckt.packet_length,
-                   (int)ns_packet_get_ingress_logical_interface_id(&pckt),
-                   (int)ns_packet_get_egress_logical_interface_id(&pckt));
+  if (nfm_stats_start(&stats) != 0) {
+    fprintf(stderr, "Could not start statistics reporter\n");
+    return -1;
+  }
 
-    numpkts++;
-    if (numpkts == 1) {
-      gettimeofday(&start, NULL);
-      start_us = start.tv_sec * 1000000 + start.tv_usec;
+  if (threaded) {
+    // Workers inherit a mask blocking the control signals so they are all
+    // handled here; workers are then woken with SIGUSR2 to see running==0
+    sigset_t sigs, oldsigs;
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    sigaddset(&sigs, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &sigs, &oldsigs);
+    for (index=0; index<num_workers; ++index) {
+      if (pthread_create(&workers[index].thread, NULL, worker_loop, &workers[index]) != 0) {
+        fprintf(stderr, "Could not start worker %u\n", index);
+        running = 0;
+        num_workers = index;
+        break;
+      }
     }
-
-    numbytes += pckt.packet_length;
-
-    if (numpkts%print_packets == 0) {
-      gettimeofday(&end, NULL);
-      end_us = end.tv_sec * 1000000 + end.tv_usec;
-      unsigned int us = end_us - start_us;
-      double mbps = (numbytes*8.0)/(1.0*us);
-      NS_LOG_EXTRA("numpkts %llu numbytes %llu Mbps %f", numpkts, numbytes, mbps);
+    while (running) {
+      sigsuspend(&oldsigs);
     }
-
-    if (enable_load && pckt.packet_data && pckt.packet_length>=4) {
-      unsigned int iter;
-      for (iter=0; iter<enable_load; ++iter) {
-        unsigned int* pc=(unsigned int*)pckt.packet_data;
-        unsigned int count=pckt.packet_length>>2;
-        if (pckt.packet_length>=64) {
-          count=16;
+    pthread_sigmask(SIG_SETMASK, &oldsigs, NULL);
+    for (index=0; index<num_workers; ++index) {
+      // A wakeup that lands just before the worker blocks in receive is
+      // lost, so keep waking it until it has gone
+      struct timespec deadline;
+      do {
+        pthread_kill(workers[index].thread, SIGUSR2);
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += 10000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+          deadline.tv_sec++;
+          deadline.tv_nsec -= 1000000000L;
         }
-        while (count--) {
-          *pc=ntohl(*pc);
-        }
-        pc=(unsigned int*)pckt.packet_data;
-        if (pckt.packet_length>=64) {
-          count=16;
-        } else {
-          count=pckt.packet_length>>2;
-        }
-        while (count--) {
-          *pc=htonl(*pc);
-        }
-      }
+      } while (pthread_timedjoin_np(workers[index].thread, NULL, &deadline) == ETIMEDOUT);
     }
+  } else {
+    worker_loop(&workers[0]);
+  }
 
-    if (drop_all) {
-      ns_packet_destroy(&pckt);
-    } else {
-      if (NS_NFM_SUCCESS != (r = ns_packet_transmit(dev, &pckt, 0))) {
-        print_error(r, "ns_packet_transmit");
-        ns_packet_destroy(&pckt);
-      }
-    }
+  nfm_stats_stop(&stats);
+  if (tracing) {
+    nfm_trace_stop(&trace);
+  }
+  free(latency);
+  free(latency_prev);
+  if (lifm_path) {
+    nfm_lifm_merge(&lifm);
+    dump_lifm(stdout);
+    nfm_lifm_free(&lifm);
   }
 
-  if (show_counters) {
-    struct ns_packet_counters_t c;
-    if (ns_packet_get_counters(dev, &c)==NS_NFM_SUCCESS) {
-      printf("Packet counters\nrecv_count=%llu, recv_no_msg=%llu, recv_msg=%llu, recv_block=%llu, send_count=%llu, send_block=%llu, send_no_msg=%llu, free_count=%llu, free_block=%llu, alloc_count=%llu, alloc_syscall=%llu\n", (unsigned long long)c.recv_count, (unsigned long long)c.recv_no_msg, (unsigned long long)c.recv_msg, (unsigned long long)c.recv_block, (unsigned long long)c.send_count, (unsigned long long)c.send_block, (unsigned long long)c.send_no_msg, (unsigned long long)c.free_count, (unsigned long long)c.free_block, (unsigned long long)c.alloc_count, (unsigned long long)c.alloc_syscall);
+  for (index=0; index<num_workers; ++index) {
+    if (enable_load && workers[index].load_pkts) {
+      printf("Worker %u load stage: %.1f " NFM_LOAD_TICK_UNIT "/packet over %llu packets\n", index,
+             (double)workers[index].load_ticks/workers[index].load_pkts, (unsigned long long)workers[index].load_pkts);
     }
+    if (rxsched) {
+      char prefix[32];
+      snprintf(prefix, sizeof(prefix), "Worker %u ", index);
+      nfm_rxsched_report(stdout, prefix, &workers[index].rxsched);
+    }
+    if (show_counters) {
+      struct ns_packet_counters_t c;
+      if (ns_packet_get_counters(workers[index].dev, &c)==NS_NFM_SUCCESS) {
+        printf("Packet counters (worker %u)\nrecv_count=%llu, recv_no_msg=%llu, recv_msg=%llu, recv_block=%llu, send_count=%llu, send_block=%llu, send_no_msg=%llu, free_count=%llu, free_block=%llu, alloc_count=%llu, alloc_syscall=%llu\n", index, (unsigned long long)c.recv_count, (unsigned long long)c.recv_no_msg, (unsigned long long)c.recv_msg, (unsigned long long)c.recv_block, (unsigned long long)c.send_count, (unsigned long long)c.send_block, (unsigned long long)c.send_no_msg, (unsigned long long)c.free_count, (unsigned long long)c.free_block, (unsigned long long)c.alloc_count, (unsigned long long)c.alloc_syscall);
+      }
+    }
+    ns_packet_close_device(workers[index].dev);
   }
 
-  ns_packet_close_device(dev);
-
   return 0;
 }
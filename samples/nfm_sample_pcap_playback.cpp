@@ -1,9 +1,6 @@
 
 #include <pcap.h>
 
-#include <string>
-#include <map>
-
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -16,42 +13,183 @@
 #include <time.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include <getopt.h>
 #include <string.h>
 
 #include "ns_packet.h"
-
-
-//-----------------------------------
-//#define USE_PLAYBACK_TIMING
-//-----------------------------------
+#include "nfm_sample_pcapload.h"
+#include "nfm_sample_pace.h"
+#include "nfm_sample_pktparse.h"
+#include "nfm_sample_txring.h"
 
 int g_drop_pkt;
 
 static pcap_t* pcap;
 static char pcap_errbuf[PCAP_ERRBUF_SIZE];
 
-typedef std::map<std::string, unsigned int> if_map_t;
-static if_map_t if_map;
+// MAC learning: open addressing with linear probing on the 48-bit MAC. A
+// slot holds the MAC with bit 48 set (so 0 marks an empty slot) and the
+// MAC's side above it, so a lookup touches one word.
+#define MAC_TABLE_MIN_SLOTS  65536
+#define MAC_KEY_USED         (1ULL<<48)
+#define MAC_KEY_MASK         ((1ULL<<49)-1)
+#define MAC_SIDE_SHIFT       56
+#define MAC_PREFETCH         8     // packets ahead
+
+typedef struct {
+  uint64_t* slots;
+  uint32_t mask;
+  uint32_t count;
+} mac_table_t;
+
+static mac_table_t if_map;
 
 static ns_packet_device_h dev;
-static unsigned int multiplier = 0;
 
-static unsigned int card=0;
-static unsigned int endpoint=1;
+// -e: card/endpoint/host id tuples to transmit on; workers take them in turn
+#define MAX_WORKERS          64
+static unsigned int ids[MAX_WORKERS];
+static unsigned int num_ids = 0;
+
+// -t: a reader thread hashes each flow to one transmit worker, so a flow's
+// packets keep their order while flows go out in parallel. Each worker owns
+// its device handle and only ever reads its own ring.
+#define TX_RING_SIZE         4096
+#define TX_BURST             32    // jobs taken from the ring at once
+#define TX_SPINS             128   // polls of an empty or full ring before yielding the CPU
+
+typedef struct {
+  pthread_t thread;
+  unsigned int index;
+  unsigned int id;
+  int cpu;
+  ns_packet_device_h dev;
+  nfm_txring_t ring;
+  nfm_pace_t pace;         // this worker's waits, merged for the report
+  unsigned long long packets;
+  unsigned long long bytes;
+  int error;
+} tx_worker_t;
+
+static tx_worker_t workers[MAX_WORKERS];
+static unsigned int num_workers = 0;
+
+// -L: load the whole capture before replay instead of reading it with libpcap
+static int load_mode = -1;
+static nfm_pcapload_t load;
+
+// -m, -r: when each packet goes out; -n: passes over the capture (0: until
+// interrupted)
+static nfm_pace_cfg_t pace_cfg = NFM_PACE_DEFAULT_CFG;
+static nfm_pace_t pace;
+static unsigned int loops = 1;
+static volatile sig_atomic_t stop = 0;
+
+static unsigned long long sent_packets = 0;
+static unsigned long long sent_bytes = 0;
+
+static double now_s()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static void stop_replay(int sig)
+{
+  (void)sig;
+  stop = 1;
+}
+
+static int mac_table_init(mac_table_t* t, uint32_t slots)
+{
+  t->slots = (uint64_t*)calloc(slots, sizeof(uint64_t));
+  t->mask = slots-1;
+  t->count = 0;
+  return t->slots ? 0 : -1;
+}
+
+static inline uint64_t mac_key(const u_char* mac)
+{
+  return MAC_KEY_USED | ((uint64_t)mac[0] << 40) | ((uint64_t)mac[1] << 32) | ((uint64_t)mac[2] << 24) |
+         ((uint64_t)mac[3] << 16) | ((uint64_t)mac[4] << 8) | mac[5];
+}
+
+static inline uint32_t mac_hash(const mac_table_t* t, uint64_t key)
+{
+  return (uint32_t)((key * 0x9e3779b97f4a7c15ULL) >> 32) & t->mask;
+}
+
+// The slot holding 'key', or the empty slot where it would go
+static inline uint32_t mac_slot(const mac_table_t* t, uint64_t key)
+{
+  uint32_t i = mac_hash(t, key);
+  while (t->slots[i] && (t->slots[i] & MAC_KEY_MASK) != key)
+    i = (i+1) & t->mask;
+  return i;
+}
+
+static void mac_set(mac_table_t* t, uint64_t key, uint8_t side)
+{
+  uint32_t i = mac_slot(t, key), j;
+  if (!t->slots[i]) {
+    // Keep the table at most half full
+    if (2*(t->count+1) > t->mask+1) {
+      mac_table_t bigger;
+      if (mac_table_init(&bigger, 2*(t->mask+1)) != 0) {
+        fprintf(stderr, "Out of memory for %u MAC addresses\n", t->count+1);
+        exit(4);
+      }
+      for (j = 0; j <= t->mask; j++) {
+        if (t->slots[j])
+          bigger.slots[mac_slot(&bigger, t->slots[j] & MAC_KEY_MASK)] = t->slots[j];
+      }
+      bigger.count = t->count;
+      free(t->slots);
+      *t = bigger;
+      i = mac_slot(t, key);
+    }
+    t->count++;
+  }
+  t->slots[i] = key | ((uint64_t)side << MAC_SIDE_SHIFT);
+}
 
-#ifdef USE_PLAYBACK_TIMING
-static void _nsleep(time_t sec,long nsec=0)
+// Egress port for a frame: the two ends of a conversation go out of ports 0
+// and 1, the first source MAC seen being side 0
+static unsigned int learn_port(const u_char* buf)
 {
-  struct timespec T2,T1 = {sec,nsec};
-  while (nanosleep(&T1,&T2)!=0 && errno==EINTR) {
-    T1 = T2;
+  uint64_t source = mac_key(buf+6);
+  uint64_t dest = mac_key(buf);
+  uint32_t i = mac_slot(&if_map, source);
+  unsigned int port;
+
+  if (if_map.slots[i])
+    return (unsigned int)(if_map.slots[i] >> MAC_SIDE_SHIFT);
+  // see if dest is in if_map
+  i = mac_slot(&if_map, dest);
+  if (!if_map.slots[i]) {
+    //insert source and dest, choose source to be side "0"
+    mac_set(&if_map, source, 0);
+    mac_set(&if_map, dest, 1);
+    return 0;
   }
+  port = (unsigned int)(if_map.slots[i] >> MAC_SIDE_SHIFT) ^ 1;
+  mac_set(&if_map, source, port);
+  return port;
 }
-#endif
 
-static const void* process_next_packet(ssize_t* _length, unsigned int* _port)
+// Ask for nanosecond stamps, so nanosecond captures keep their sub-us gaps;
+// libpcap scales microsecond captures up
+static pcap_t* open_offline(const char* path)
+{
+  return pcap_open_offline_with_tstamp_precision(path, PCAP_TSTAMP_PRECISION_NANO, pcap_errbuf);
+}
+
+static const void* process_next_packet(ssize_t* _length, unsigned int* _port, uint64_t* _ts_ns)
 {
   unsigned int port;
   ssize_t length;
@@ -72,78 +210,214 @@ static const void* process_next_packet(ssize_t* _length, unsigned int* _port)
     length = h.len-offset;
 
     // determine port number
-    port = 0;
-
-    std::string source((const char*)buf+6, 6);
-    std::string dest((const char*)buf, 6);
-    if_map_t::iterator itr;
-    if ((itr = if_map.find(source)) == if_map.end()) {
-      // see if dest is in if_map
-      if ((itr = if_map.find(dest)) == if_map.end()) {
-        //insert source and dest, choose source to be side "0"
-        if_map[source] = 0;
-        if_map[dest] = 1;
-        port = 0;
-      } else {
-        port = itr->second ^ 1;
-        if_map[source] = port;
-      }
-    } else {
-      port = itr->second;
-    }
+    port = learn_port(buf+offset);
 
+    *_length = length;
+    *_port = port;
+    // Opened with nanosecond precision: tv_usec holds nanoseconds
+    *_ts_ns = (uint64_t)h.ts.tv_sec*1000000000ULL + (uint64_t)h.ts.tv_usec;
+    return buf+offset;
+  }
+  return NULL;
+}
 
-#ifdef USE_PLAYBACK_TIMING
-    // calculate time difference (max 1s)
-    static struct timeval _prev = {0,0};
-    unsigned int usec = 1000000L;
-    if (_prev.tv_sec>0 && h.ts.tv_sec<=(_prev.tv_sec+1)) {
-      // less than 2 seconds difference; calculate usec difference
-      if (_prev.tv_sec == h.ts.tv_sec)
-        usec = h.ts.tv_usec - _prev.tv_usec;
-      else
-        usec = (1000000L-_prev.tv_usec) + h.ts.tv_usec;
+ns_nfm_ret_t open_dev(unsigned int id, ns_packet_device_h* devp)
+{
+  ns_packet_extra_options_t opt;
 
-      if (usec > 1000000L)
-        usec = 1000000L;
+  memset(&opt, 0, sizeof(opt));
+  opt.host_inline=1;
+  return ns_packet_open_device_ex(devp, id, &opt);
+}
+
+// Replay a loaded capture: the ports were assigned while loading, so this
+// only walks the descriptors
+static int replay_loaded()
+{
+  const nfm_pcapload_desc_t* d = load.descs;
+  const nfm_pcapload_desc_t* end = load.descs + load.num_descs;
+  ns_packet_t p;
+
+  for (; d < end && !stop; d++) {
+    if (d+1 < end)
+      __builtin_prefetch(load.base + d[1].off);
+    if (ns_packet_create(dev, d->len, &p) != NS_NFM_SUCCESS) {
+      fprintf(stderr, "Error creating packet\n");
+      return 5;
+    }
+    memcpy(p.packet_data, load.base + d->off, d->len);
+    ns_packet_set_egress_port(&p, d->port);
+    if (pace.cfg.mode != NFM_PACE_NONE)
+      nfm_pace_packet(&pace, d->ts_ns, d->len);
+    if (ns_packet_transmit(dev, &p, 0) != NS_NFM_SUCCESS) {
+      fprintf(stderr, "Error sending packet");
+      return 5;
     }
-    _prev = h.ts;
+    sent_packets++;
+    sent_bytes += d->len;
+  }
+  return 0;
+}
 
-    // wait for previous packets to complete
-    if (usec <= 1000000L) {
-      usec *= multiplier;
-      _nsleep(0, usec > 500L ? (usec*1000L) : 500L);
+static int replay_pcap()
+{
+  const void* pkt;
+  ssize_t length = 0;
+  unsigned int port = 0;
+  uint64_t ts_ns = 0;
+  while (!stop && (pkt = process_next_packet(&length, &port, &ts_ns))) {
+    // inject packet
+    ns_packet_t p;
+    ns_packet_create(dev, length, &p);
+    memcpy(p.packet_data, pkt, length);
+    ns_packet_set_egress_port(&p, port);
+    if (pace.cfg.mode != NFM_PACE_NONE)
+      nfm_pace_packet(&pace, ts_ns, (uint32_t)length);
+    if (ns_packet_transmit(dev, &p, 0) != NS_NFM_SUCCESS) {
+      fprintf(stderr, "Error sending packet");
+      return 5;
     }
-    else {
-      _nsleep(1);
+    sent_packets++;
+    sent_bytes += length;
+  }
+  return 0;
+}
+
+static void* tx_worker_loop(void* arg)
+{
+  tx_worker_t* w = (tx_worker_t*)arg;
+  const nfm_txring_job_t* job;
+  ns_packet_t p;
+  uint32_t n, i, idle = 0;
+
+  if (w->cpu >= 0) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(w->cpu, &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+      fprintf(stderr, "Worker %u: could not pin to CPU %d\n", w->index, w->cpu);
     }
-#endif
+  }
 
-    *_length = length;
-    *_port = port;
-    return buf+offset;
+  while (!stop) {
+    n = nfm_txring_peek(&w->ring);
+    if (n == 0) {
+      if (nfm_txring_drained(&w->ring))
+        break;
+      if (++idle < TX_SPINS)
+        nfm_pace_cpu_relax();
+      else
+        sched_yield();
+      continue;
+    }
+    idle = 0;
+    if (n > TX_BURST)
+      n = TX_BURST;
+    for (i = 0; i < n && !stop; i++) {
+      job = nfm_txring_job(&w->ring, i);
+      if (ns_packet_create(w->dev, job->len, &p) != NS_NFM_SUCCESS) {
+        fprintf(stderr, "Worker %u: error creating packet\n", w->index);
+        w->error = 5;
+        stop = 1;
+        break;
+      }
+      memcpy(p.packet_data, job->data, job->len);
+      ns_packet_set_egress_port(&p, job->port);
+      if (w->pace.cfg.mode != NFM_PACE_NONE)
+        nfm_pace_wait(&w->pace, job->deadline, job->len);
+      if (ns_packet_transmit(w->dev, &p, 0) != NS_NFM_SUCCESS) {
+        fprintf(stderr, "Worker %u: error sending packet\n", w->index);
+        w->error = 5;
+        stop = 1;
+        break;
+      }
+      w->packets++;
+      w->bytes += job->len;
+    }
+    nfm_txring_release(&w->ring, i);
   }
   return NULL;
 }
 
-ns_nfm_ret_t open_dev(unsigned int card, unsigned int endpoint, unsigned int host_id, ns_packet_device_h* devp)
+// Reader for -t: deal the loaded frames out to the workers by addresses and
+// protocol, not ports, so a flow's fragments go with the rest of it and stay
+// in order. The deadlines are all decided here, in capture order.
+static int shard_loaded()
 {
-  ns_packet_extra_options_t opt;
+  const nfm_pcapload_desc_t* d = load.descs;
+  const nfm_pcapload_desc_t* end = load.descs + load.num_descs;
+  nfm_txring_job_t job;
+  nfm_pkt_t pkt;
+  tx_worker_t* w;
+  uint32_t full;
+
+  for (; d < end && !stop; d++) {
+    if (d+1 < end)
+      __builtin_prefetch(load.base + d[1].off);
+    job.data = load.base + d->off;
+    job.len = d->len;
+    job.port = d->port;
+    job.deadline = (pace.cfg.mode != NFM_PACE_NONE) ? nfm_pace_schedule(&pace, d->ts_ns, d->len) : 0;
+    nfm_pkt_parse(&pkt, job.data, d->len);
+    w = &workers[nfm_pkt_addr_hash(&pkt, job.data) % num_workers];
+    for (full = 0; !nfm_txring_push(&w->ring, &job); full++) {
+      if (stop)
+        return 0;
+      if (full < TX_SPINS)
+        nfm_pace_cpu_relax();
+      else
+        sched_yield();
+    }
+  }
+  return 0;
+}
 
-  memset(&opt, 0, sizeof(opt));
-  opt.host_inline=1;
-  return ns_packet_open_device_ex(devp, NFM_CARD_ENDPOINT_ID(card,endpoint,host_id),&opt);
+// One pass over the capture after another; libpcap has no rewind, so later
+// passes reopen the file
+static int replay(const char* path)
+{
+  unsigned int pass;
+  int r;
+  for (pass = 0; (loops == 0 || pass < loops) && !stop; pass++) {
+    if (pass > 0) {
+      nfm_pace_next_loop(&pace);
+      if (load_mode < 0) {
+        pcap_close(pcap);
+        if ((pcap = open_offline(path)) == NULL) {
+          fprintf(stderr, "pcap_open_offline_with_tstamp_precision() failed: %s\n", pcap_errbuf);
+          return 2;
+        }
+      }
+    }
+    if (num_workers)
+      r = shard_loaded();
+    else
+      r = (load_mode >= 0) ? replay_loaded() : replay_pcap();
+    if (r != 0)
+      return r;
+  }
+  return 0;
 }
 
 static void usage(char* argv0)
 {
-  fprintf(stdout, "USAGE: %s <pcapfile>"
-#ifdef USE_PLAYBACK_TIMING
-                  " <options>\n\n"
+  fprintf(stdout, "USAGE: %s <pcapfile> <options>\n\n"
                   "Options:\n"
-                  "       -m,--multiplier[M]          Multiply PCAP time values by 'M' (default: 0)"
-#endif
-                  "\n",argv0);
+                  "       -L,--load[M]                Load the whole capture (PCAP or pcapng) before replaying it:\n"
+                  "                                   'mmap' maps the file, 'copy' copies the packets into huge pages\n"
+                  "                                   (default: read it with libpcap while replaying)\n"
+                  "       -m,--multiplier[M]          Replay with the capture's own timing, the gaps multiplied by 'M'\n"
+                  "                                   (1: as captured, 0.5: twice as fast)\n"
+                  "       -r,--rate[R]                Replay at a fixed rate: packets per second, or 'R' followed by\n"
+                  "                                   kpps, Mpps, Mbps or Gbps (default: as fast as possible)\n"
+                  "       -n,--loops[N]               Replay the capture 'N' times, 0 until interrupted (default: 1)\n"
+                  "       -S,--spin[U]                With -m or -r, sleep only for gaps longer than 'U' us and\n"
+                  "                                   busy-wait the rest (default: %u)\n"
+                  "       -e,--endpoints[C.E[.I]:...] Transmit on card 'C' endpoint 'E' with host id 'I' (default: 0.1)\n"
+                  "       -t,--threads[N]             Shard the flows over 'N' transmit threads (max %u), each with its own\n"
+                  "                                   device handle on the next -e tuple in turn; implies -L mmap\n"
+                  "       -C,--cpus[c,c,...]          With -t, pin thread n to the n-th listed CPU\n"
+                  "\n",argv0,NFM_PACE_DEFAULT_SPIN_NS/1000,MAX_WORKERS);
 }
 
 int main(int argc, char** argv)
@@ -153,36 +427,128 @@ int main(int argc, char** argv)
     return 1;
   }
 
-  if ((pcap = pcap_open_offline(argv[1], pcap_errbuf)) == NULL) {
-    fprintf(stderr, "pcap_open_offline() failed: %s\n", pcap_errbuf);
-    return 2;
-  }
-
-  if (open_dev(card,endpoint,NFM_ANY_ID,&dev)!=NS_NFM_SUCCESS) {
-    fprintf(stderr, "Could not open device\n");
-    return 3;
-  }
-
   int long_argc = argc - 1;
   char** long_argv = argv + 1;
 
   static struct option long_options[] = {
-    {"multiplier",    1, 0, 's'},
+    {"multiplier",    1, 0, 'm'},
+    {"rate",          1, 0, 'r'},
+    {"loops",         1, 0, 'n'},
+    {"spin",          1, 0, 'S'},
+    {"load",          1, 0, 'L'},
+    {"endpoints",     1, 0, 'e'},
+    {"threads",       1, 0, 't'},
+    {"cpus",          1, 0, 'C'},
     {"help",          0, 0, 'h'},
     {0, 0, 0, 0}
   };
 
   int r;
   char* endptr;
+  unsigned long n;
+  unsigned long tuple[3];
+  unsigned int i, j;
+  int cpus[MAX_WORKERS];
+  unsigned int num_cpus = 0;
 
-  while ((r = getopt_long(long_argc, long_argv, "m:h", long_options, NULL)) != -1) {
+  while ((r = getopt_long(long_argc, long_argv, "m:r:n:S:L:e:t:C:h", long_options, NULL)) != -1) {
     switch (r) {
       case 'm':
-        multiplier = strtoul(optarg, &endptr, 0);
-        if (*endptr != '\0') {
+        pace_cfg.multiplier = strtod(optarg, &endptr);
+        if (*endptr != '\0' || endptr == optarg || pace_cfg.multiplier < 0) {
           fprintf(stderr, "Invalid multiplier '%s'\n", optarg);
           return 1;
         }
+        if (pace_cfg.mode == NFM_PACE_PPS || pace_cfg.mode == NFM_PACE_BPS) {
+          fprintf(stderr, "Use either a multiplier or a rate\n");
+          return 1;
+        }
+        pace_cfg.mode = NFM_PACE_CAPTURE;
+        break;
+      case 'r':
+        if (pace_cfg.mode == NFM_PACE_CAPTURE) {
+          fprintf(stderr, "Use either a multiplier or a rate\n");
+          return 1;
+        }
+        if (nfm_pace_parse_rate(&pace_cfg, optarg) != 0) {
+          fprintf(stderr, "Invalid rate '%s'\n", optarg);
+          return 1;
+        }
+        break;
+      case 'n':
+        n = strtoul(optarg, &endptr, 0);
+        if (*endptr != '\0' || endptr == optarg || n > 0xffffffffUL) {
+          fprintf(stderr, "Invalid loop count '%s'\n", optarg);
+          return 1;
+        }
+        loops = (unsigned int)n;
+        break;
+      case 'S':
+        n = strtoul(optarg, &endptr, 0);
+        if (*endptr != '\0' || endptr == optarg || n > 1000000UL) {
+          fprintf(stderr, "Invalid spin time '%s'\n", optarg);
+          return 1;
+        }
+        pace_cfg.spin_ns = (uint64_t)n * 1000;
+        break;
+      case 'L':
+        if (strcmp(optarg, "mmap") == 0) {
+          load_mode = NFM_PCAPLOAD_MMAP;
+        } else if (strcmp(optarg, "copy") == 0) {
+          load_mode = NFM_PCAPLOAD_COPY;
+        } else {
+          fprintf(stderr, "Invalid load mode '%s' (mmap or copy)\n", optarg);
+          return 1;
+        }
+        break;
+      case 'e':
+        num_ids = 0;
+        endptr = optarg;
+        while (*endptr) {
+          if (num_ids == MAX_WORKERS) {
+            fprintf(stderr, "Too many endpoints listed (max %u)\n", MAX_WORKERS);
+            return 1;
+          }
+          tuple[2] = NFM_ANY_ID;
+          for (j = 0; j < 3; j++) {
+            tuple[j] = strtoul(endptr, &endptr, 0);
+            if (*endptr != '.')
+              break;
+            endptr++;
+          }
+          if (j == 0 || (*endptr != ':' && *endptr != '\0') || tuple[0] > 255 || tuple[1] > 255 || tuple[2] > 255) {
+            fprintf(stderr, "Invalid endpoint list '%s' (card.endpoint[.id]:...)\n", optarg);
+            return 1;
+          }
+          ids[num_ids++] = NFM_CARD_ENDPOINT_ID(tuple[0], tuple[1], tuple[2]);
+          if (*endptr == ':')
+            endptr++;
+        }
+        break;
+      case 't':
+        n = strtoul(optarg, &endptr, 0);
+        if (*endptr != '\0' || endptr == optarg || n < 1 || n > MAX_WORKERS) {
+          fprintf(stderr, "Use a sensible number of threads (1-%u, not %s)\n", MAX_WORKERS, optarg);
+          return 1;
+        }
+        num_workers = (unsigned int)n;
+        break;
+      case 'C':
+        if (strspn(optarg, "0123456789,") != strlen(optarg)) {
+          fprintf(stderr, "Invalid CPU list '%s'\n", optarg);
+          return 1;
+        }
+        num_cpus = 0;
+        endptr = optarg;
+        while (*endptr) {
+          if (num_cpus == MAX_WORKERS) {
+            fprintf(stderr, "Too many CPUs listed (max %u)\n", MAX_WORKERS);
+            return 1;
+          }
+          cpus[num_cpus++] = (int)strtoul(endptr, &endptr, 10);
+          if (*endptr == ',')
+            endptr++;
+        }
         break;
       case 'h':
       default:
@@ -190,28 +556,118 @@ int main(int argc, char** argv)
     }
   }
 
-#ifdef USE_PLAYBACK_TIMING
-  if (multiplier!=0)
-    fprintf(stdout, "multiplier = %u\n", multiplier);
-#endif
+  if (num_ids == 0)
+    ids[num_ids++] = NFM_CARD_ENDPOINT_ID(0, 1, NFM_ANY_ID);
+  // The reader deals out frames that stay put until they are sent
+  if (num_workers && load_mode < 0)
+    load_mode = NFM_PCAPLOAD_MMAP;
 
-  const void* pkt;
-  ssize_t length = 0;
-  unsigned int port = 0;
-  while ((pkt = process_next_packet(&length, &port))) {
-    // inject packet
-    ns_packet_t p;
-    ns_packet_create(dev, length, &p);
-    memcpy(p.packet_data, pkt, length);
-    ns_packet_set_egress_port(&p, port);
-    if (ns_packet_transmit(dev, &p, 0) != NS_NFM_SUCCESS) {
-      fprintf(stderr, "Error sending packet");
-      return 5;
+  if (mac_table_init(&if_map, MAC_TABLE_MIN_SLOTS) != 0) {
+    fprintf(stderr, "Out of memory for the MAC table\n");
+    return 4;
+  }
+
+  if (load_mode >= 0) {
+    double t = now_s();
+    if (nfm_pcapload_open(&load, argv[1], load_mode) != 0) {
+      fprintf(stderr, "Could not load %s: %s\n", argv[1], load.error);
+      return 2;
     }
+    fprintf(stdout, "Loaded %llu packets (%llu bytes, %llu on other link types skipped) in %.1f ms, %s\n",
+            (unsigned long long)load.num_descs, (unsigned long long)load.bytes,
+            (unsigned long long)load.skipped, (now_s() - t)*1e3,
+            (load_mode == NFM_PCAPLOAD_MMAP) ? "mapped" :
+            load.huge ? "copied to huge pages" : "copied (no huge pages reserved)");
+    // Every port is decided here, so replay reads it from the descriptor
+    // The source MAC's slot is fetched a few packets ahead
+    t = now_s();
+    for (uint64_t i = 0; i < load.num_descs; i++) {
+      if (i + MAC_PREFETCH < load.num_descs)
+        __builtin_prefetch(&if_map.slots[mac_hash(&if_map, mac_key(load.base + load.descs[i+MAC_PREFETCH].off + 6))]);
+      load.descs[i].port = learn_port(load.base + load.descs[i].off);
+    }
+    t = now_s() - t;
+    fprintf(stdout, "Assigned ports from %u MAC addresses in %.1f ms (%.1f ns per packet)\n",
+            if_map.count, t*1e3, load.num_descs ? t*1e9/load.num_descs : 0.0);
+  } else if ((pcap = open_offline(argv[1])) == NULL) {
+    fprintf(stderr, "pcap_open_offline_with_tstamp_precision() failed: %s\n", pcap_errbuf);
+    return 2;
   }
 
-  ns_packet_close_device(dev);
-  pcap_close(pcap);
+  if (num_workers == 0 && open_dev(ids[0], &dev) != NS_NFM_SUCCESS) {
+    fprintf(stderr, "Could not open device\n");
+    return 3;
+  }
+  for (i = 0; i < num_workers; i++) {
+    tx_worker_t* w = &workers[i];
+    w->index = i;
+    w->id = ids[i % num_ids];
+    w->cpu = (i < num_cpus) ? cpus[i] : -1;
+    nfm_pace_init(&w->pace, &pace_cfg);
+    if (nfm_txring_init(&w->ring, TX_RING_SIZE) != 0) {
+      fprintf(stderr, "Out of memory for the transmit rings\n");
+      return 4;
+    }
+    printf("Worker %u (CPU %d) opening device=%u endpoint=%u ID=%u\n", i, w->cpu,
+           NFM_CARD_FROM_BITFIELD(w->id), NFM_ENDPOINT_FROM_BITFIELD(w->id), NFM_HOSTID_FROM_BITFIELD(w->id));
+    if (open_dev(w->id, &w->dev) != NS_NFM_SUCCESS) {
+      fprintf(stderr, "Could not open device\n");
+      return 3;
+    }
+  }
 
-  printf("\n");
+  nfm_pace_init(&pace, &pace_cfg);
+  signal(SIGINT, stop_replay);
+
+  double t0 = now_s();
+  if (num_workers) {
+    // SIGINT is left to the reader
+    sigset_t sigs, oldsigs;
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &sigs, &oldsigs);
+    for (i = 0; i < num_workers; i++) {
+      if (pthread_create(&workers[i].thread, NULL, tx_worker_loop, &workers[i]) != 0) {
+        fprintf(stderr, "Could not start worker %u\n", i);
+        stop = 1;
+        num_workers = i;
+        break;
+      }
+    }
+    pthread_sigmask(SIG_SETMASK, &oldsigs, NULL);
+  }
+  r = replay(argv[1]);
+  for (i = 0; i < num_workers; i++)
+    nfm_txring_finish(&workers[i].ring);
+  for (i = 0; i < num_workers; i++) {
+    tx_worker_t* w = &workers[i];
+    pthread_join(w->thread, NULL);
+    if (w->error && r == 0)
+      r = w->error;
+  }
+  if (r != 0)
+    return r;
+  double t = now_s() - t0;
+
+  if (num_workers == 0)
+    ns_packet_close_device(dev);
+  for (i = 0; i < num_workers; i++) {
+    tx_worker_t* w = &workers[i];
+    ns_packet_close_device(w->dev);
+    nfm_txring_free(&w->ring);
+    nfm_pace_merge(&pace, &w->pace);
+    sent_packets += w->packets;
+    sent_bytes += w->bytes;
+  }
+  if (load_mode >= 0)
+    nfm_pcapload_free(&load);
+  else
+    pcap_close(pcap);
+
+  printf("\nSent %llu packets (%llu bytes) in %.3f s: %.0f pps, %.1f Mbps\n",
+         sent_packets, sent_bytes, t, t > 0 ? sent_packets/t : 0.0, t > 0 ? sent_bytes*8/t/1e6 : 0.0);
+  for (i = 0; i < num_workers; i++)
+    printf("Worker %u: %llu packets (%llu bytes)\n", i, workers[i].packets, workers[i].bytes);
+  if (pace.cfg.mode != NFM_PACE_NONE)
+    nfm_pace_report(&pace, stdout);
 }
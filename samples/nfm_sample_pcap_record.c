@@ -6,6 +6,8 @@
  *              using the packet API.
  */
 
+#define _GNU_SOURCE
+
 #include "ns_packet.h"
 
 #include <stdio.h>
@@ -17,94 +19,121 @@
 #include <errno.h>
 
 #include "ns_log.h"
-
-unsigned long long numbytes = 0;
-unsigned long long numpkts = 0;
-pid_t pid = 0;
-
-// PCAP file creation functions
-
-static void simple_pcap_write_bytes(FILE **pcapfileptr, void *data, unsigned int len)
+#include "nfm_sample_stats.h"
+#include "nfm_sample_trace.h"
+#include "nfm_sample_rxsched.h"
+#include "nfm_sample_pcapw.h"
+#include "nfm_sample_pcapfmt.h"
+#include "nfm_sample_capsel.h"
+#include "nfm_sample_capfilt.h"
+
+static nfm_stats_t stats;
+
+// Packet tracing (-t, or VERBOSE log level)
+static nfm_trace_t trace;
+static int tracing = 0;
+
+// Receive scheduler (-R)
+static int rxsched = 0;
+static nfm_rxsched_cfg_t rxsched_cfg = NFM_RXSCHED_DEFAULT_CFG;
+static nfm_rxsched_t rxsched_state;
+
+// PCAP recording (-W): the receive loop fills buffers, a writer thread
+// does the disk I/O
+static nfm_pcapw_t pcapw;
+static nfm_pcapfmt_t pcapfmt;
+static int recording = 0;
+static int pcap_format = NFM_PCAP_FMT_US;
+static int nfe_timestamps = 0;
+static unsigned int rotate_mb = 0;
+static unsigned int rotate_s = 0;
+static unsigned int rotate_files = 0;
+static char* rotate_hook = NULL;
+static int pcap_index = 0;
+
+// What to record of each packet (-s, -S, -H), decided before any copy
+static nfm_capsel_cfg_t capsel_cfg = NFM_CAPSEL_DEFAULT_CFG;
+static nfm_capsel_t capsel;
+static int selecting = 0;
+
+// Which packets to record (-f), compiled once
+static nfm_capfilt_t capfilt;
+static int filtering = 0;
+
+static void report_extra(FILE* f, void __attribute__((unused)) *ctx)
 {
-  if ((pcapfileptr != NULL) && (*pcapfileptr != NULL)) {
-    if(fwrite(data, len, 1, *pcapfileptr) != 1) {
-      fclose(*pcapfileptr);
-      *pcapfileptr = NULL;
-    }
+  if (rxsched) {
+    nfm_rxsched_report(f, "", &rxsched_state);
   }
-}
-
-static void simple_pcap_open(FILE **pcapfileptr, char *pcapfilename)
-{
-  if (pcapfileptr != NULL) {
-    FILE *pcapfile=fopen(pcapfilename, "wb");
-    if (pcapfile!=NULL) {
-      struct {
-        uint32_t magic_number;   // magic number = 0xa1b2c3d4 (used to test endianness too)
-        uint16_t version_major;  // major version number = 2
-        uint16_t version_minor;  // minor version number = 4
-        int32_t  thiszone;       // GMT to local correction
-        uint32_t sigfigs;        // accuracy of timestamps
-        uint32_t snaplen;        // max length of captured packets, in octets
-        uint32_t network;        // data link type (= 1 for ethernet)
-      } hdr;
-      hdr.magic_number=0xa1b2c3d4;
-      hdr.version_major=2;
-      hdr.version_minor=4;
-      hdr.thiszone=0;
-      hdr.sigfigs=0;
-      hdr.snaplen=65535;
-      hdr.network=1; // ethernet
-      *pcapfileptr = pcapfile;
-      simple_pcap_write_bytes(pcapfileptr, &hdr, sizeof(hdr));
-    } else {
-      *pcapfileptr = NULL;
-    }
+  if (recording) {
+    nfm_pcapw_report(&pcapw, f);
+  }
+  if (recording && filtering) {
+    nfm_capfilt_report(&capfilt, f);
+  }
+  if (recording && selecting) {
+    nfm_capsel_report(&capsel, f);
   }
 }
 
-static void simple_pcap_write_packet(FILE **pcapfileptr, unsigned char *packetdata, unsigned int packetlen)
+// PCAP file creation functions
+
+static int simple_pcap_open(nfm_pcapw_t *w, nfm_pcapfmt_t *f, char *pcapfilename, unsigned int block_mb, unsigned int num_blocks, int direct, int keep)
 {
-  struct {
-    uint32_t sec;
-    uint32_t usec;
-    uint32_t caplen;
-    uint32_t len;
-  } hdr;
-  struct timeval ts;
-
-  if ((pcapfileptr != NULL) && (*pcapfileptr != NULL)) {
-    gettimeofday(&ts, 0);
-    // hdr sec and usec are always uint32_t, but struct timeval has long, so 64-bit on 64-bit machine
-    hdr.sec=(unsigned)ts.tv_sec;
-    hdr.usec=(unsigned)ts.tv_usec;
-    hdr.caplen=hdr.len=packetlen;
-    simple_pcap_write_bytes(pcapfileptr, &hdr, sizeof(hdr));
-    simple_pcap_write_bytes(pcapfileptr, packetdata, packetlen);
+  if (nfm_pcapw_init(w, pcapfilename, block_mb, num_blocks, direct, keep) != 0)
+    return -1;
+  nfm_pcapw_rotation(w, rotate_mb, rotate_s, rotate_files, rotate_hook);
+  if (pcap_index && nfm_pcapw_index_on(w) != 0) {
+    nfm_pcapw_free(w);
+    return -1;
+  }
+  nfm_capsel_init(&capsel, &capsel_cfg);
+  selecting = nfm_capsel_active(&capsel_cfg);
+  nfm_pcapfmt_init(f, w, pcap_format, "nfm_sample_pcap_record", capsel_cfg.snaplen);
+  if (nfm_pcapfmt_begin(f) != 0 || nfm_pcapw_start(w) != 0) {
+    nfm_pcapw_stop(w);
+    nfm_pcapw_free(w);
+    return -1;
   }
+  return 0;
 }
 
-static void simple_pcap_close(FILE **pcapfileptr)
+static void simple_pcap_write_packet(nfm_pcapfmt_t *f, ns_packet_t *pckt)
 {
-  if ((pcapfileptr != NULL) && (*pcapfileptr != NULL)) {
-    fclose(*pcapfileptr);
-    *pcapfileptr = NULL;
+  struct timespec ts;
+  uint32_t caplen = pckt->packet_length;
+
+  if (filtering && !nfm_capfilt_match(&capfilt, pckt->packet_data, pckt->packet_length))
+    return;
+  if (selecting) {
+    caplen = nfm_capsel_packet(&capsel, pckt->packet_data, pckt->packet_length);
+    if (caplen == 0)
+      return;
+  }
+  if (nfe_timestamps) {
+    // Wire time as stamped by the NFE, microsecond resolution
+    ts.tv_sec=pckt->timestamp_s;
+    ts.tv_nsec=pckt->timestamp_us*1000;
+  } else {
+    clock_gettime(CLOCK_REALTIME, &ts);
   }
+  nfm_pcapfmt_packet(f, (uint32_t)ts.tv_sec, (uint32_t)ts.tv_nsec,
+                     ns_packet_get_ingress_logical_interface_id(pckt), pckt->packet_data, caplen, pckt->packet_length);
 }
 
-// Dump buffer in hex
-
-static void dump(unsigned char *data, unsigned int len)
+static void simple_pcap_close(nfm_pcapw_t *w, char *pcapfilename)
 {
-  unsigned int i;
-  for (i = 0; i < len; i++) {
-    if (i%16 == 0)
-      printf("\n");
-    else if (i%2 == 0)
-      printf(" ");
-    printf("%02x", data[i]);
+  if (nfm_pcapw_stop(w) != 0) {
+    fprintf(stderr, "Could not write %s: %s\n", pcapfilename, strerror(w->error));
+  }
+  nfm_pcapw_report(w, stdout);
+  if (filtering) {
+    nfm_capfilt_report(&capfilt, stdout);
   }
-  printf("\n\n");
+  if (selecting) {
+    nfm_capsel_report(&capsel, stdout);
+  }
+  nfm_pcapw_free(w);
 }
 
 // Sample packet application code
@@ -120,8 +149,7 @@ void sig_term(int __attribute__((unused)) dummy)
 
 void sig_usr1(int __attribute__((unused)) dummy)
 {
-  printf("%8d  %16llu  %16llu\n", pid, numpkts, numbytes);
-  fflush(stdout);
+  nfm_stats_request_report(&stats);
 }
 
 static void print_usage(const char* argv0)
@@ -139,13 +167,53 @@ static void print_usage(const char* argv0)
                   " -# --counters   Show packet counters at program exit\n"
                   " -A --adaptive   Use adaptive polling (decrease latency at the cost of some CPU while no traffic)\n"
                   " -p --print N    Print stats at every N packets (N >= 1: default 300000) at EXTRA log level (-l 6)\n"
-                  " -W --write NAME Write all the received packets to file NAME using the PCAP file format.\n",
-          argv0);
+                  "                 (checked once a second; SIGUSR1 prints totals and 1s/10s/60s rates)\n"
+                  " -W --write NAME Write all the received packets to file NAME using the PCAP file format.\n"
+                  "                 A writer thread writes the file from N buffers of M MB (-B, default %u:%u);\n"
+                  "                 packets that arrive while all are full are dropped and counted\n"
+                  " -B --buffers M[:N] Size of each capture buffer in MB (max %u) and number of buffers (2-%u)\n"
+                  " -F --format F   Capture file format: pcap (microsecond timestamps, default), pcapns (nanosecond)\n"
+                  "                 or pcapng (nanosecond, one interface per ingress logical interface)\n"
+                  " -f --filter E   Record only packets matching expression E, e.g. 'tcp and net 10.1.0.0/16',\n"
+                  "                 using [src|dst] host/net/port/portrange, ip, ip6, arp, tcp, udp, sctp, icmp,\n"
+                  "                 icmp6, proto N, ether proto N, vlan [N], less N, greater N, and, or, not, ( )\n"
+                  " -s --snaplen N  Record at most N bytes of each packet\n"
+                  " -S --sample N[:flow] Record 1 in N packets, or with :flow every packet of 1 in N flows\n"
+                  "                 (chosen by a 5-tuple hash that is the same in both directions)\n"
+                  " -H --headers    Record only the L2-L4 headers of each packet (with -s, whichever is shorter)\n"
+                  " -T --nfe-time   Stamp packets with the NFE receive time instead of the host clock\n"
+                  " -O --direct     Write the capture file with O_DIRECT, bypassing the page cache\n"
+                  " -K --keep P     When the disk falls behind keep the 'old' packets (drop new arrivals, default)\n"
+                  "                 or the 'new' ones (discard the full buffer being filled)\n"
+                  " -C --rotate-size MB Write NAME.000000, NAME.000001... starting a new file before one exceeds MB\n"
+                  " -G --rotate-time S  Write NAME.000000, NAME.000001... starting a new file every S seconds of packets\n"
+                  " -N --files N    With rotation, keep only the last N files\n"
+                  " -z --post-rotate CMD Run shell command CMD with each closed file's name appended (e.g. gzip)\n"
+                  " -I --index      Write an index beside each capture file (NAME.idx) for nfm_sample_pcapextract\n"
+                  " -R --rxsched B:P:Y[:W] Poll without blocking; after B empty polls add a CPU pause, after P more\n"
+                  "                 sched_yield, after Y more sleep W us between polls (default 2000:2000:200:50)\n"
+                  " -t --trace N[:S] Trace 1 in N packets (S bytes each, max %u) from a background thread;\n"
+                  "                 tracing of every packet is on by default at VERBOSE log level (-l 7)\n",
+          argv0, NFM_PCAPW_DEFAULT_MB, NFM_PCAPW_DEFAULT_BLOCKS, NFM_PCAPW_MAX_MB, NFM_PCAPW_MAX_BLOCKS, NFM_TRACE_SNAP_MAX);
   exit(1);
 }
 
 static const struct option __long_options[] = {
   {"write",     1, 0, 'W'},
+  {"buffers",   1, 0, 'B'},
+  {"direct",    0, 0, 'O'},
+  {"format",    1, 0, 'F'},
+  {"nfe-time",  0, 0, 'T'},
+  {"filter",    1, 0, 'f'},
+  {"snaplen",   1, 0, 's'},
+  {"sample",    1, 0, 'S'},
+  {"headers",   0, 0, 'H'},
+  {"keep",      1, 0, 'K'},
+  {"rotate-size", 1, 0, 'C'},
+  {"rotate-time", 1, 0, 'G'},
+  {"files",     1, 0, 'N'},
+  {"post-rotate", 1, 0, 'z'},
+  {"index",     0, 0, 'I'},
   {"loglevel",  1, 0, 'l'},
   {"host_id",   1, 0, 'i'},
   {"endpoint",  1, 0, 'e'},
@@ -157,6 +225,8 @@ static const struct option __long_options[] = {
   {"help",      0, 0, 'h'},
   {"counters",  0, 0, '#'},
   {"adaptive",  0, 0, 'A'},
+  {"trace",     1, 0, 't'},
+  {"rxsched",   1, 0, 'R'},
   {0, 0, 0, 0}
 };
 
@@ -172,8 +242,6 @@ int main(int argc, char **argv)
   int drop_all = 0;
   int request_arp = 0;
   unsigned int print_packets = 300000;
-  struct timeval start, end;
-  uint64_t start_us, end_us;
   ns_log_lvl_e loglevel;
   unsigned int* multi=0;
   unsigned int num_multi=0;
@@ -183,14 +251,18 @@ int main(int argc, char **argv)
   unsigned int show_counters=0;
   unsigned int adaptive_poll=0;
   char *pcapfilename=NULL;
-  FILE *pcapfile=NULL;
+  unsigned int pcap_block_mb=NFM_PCAPW_DEFAULT_MB;
+  unsigned int pcap_blocks=NFM_PCAPW_DEFAULT_BLOCKS;
+  int pcap_direct=0;
+  int pcap_keep=NFM_PCAPW_KEEP_OLD;
+  unsigned int trace_sample=0;
+  unsigned int trace_snap=0;
 
-  pid = getpid();
   ns_log_init(NS_LOG_COLOR | NS_LOG_CONSOLE);
   ns_log_lvl_set(NS_LOG_LVL_INFO);
 
   int c;
-  while ((c = getopt_long(argc, argv, "W:l:hi:d:e:Dp:m:a#A", __long_options, NULL)) != -1) {
+  while ((c = getopt_long(argc, argv, "W:B:OK:F:Tf:s:S:HC:G:N:z:Il:hi:d:e:Dp:m:a#At:R:", __long_options, NULL)) != -1) {
     switch (c) {
     case '#':
       show_counters=1;
@@ -199,9 +271,116 @@ int main(int argc, char **argv)
       adaptive_poll=100; // 100 microseconds
       flags|=NS_PACKET_RECEIVE_ADAPTIVE_POLL;
       break;
+    case 'R':
+      if (nfm_rxsched_parse(&rxsched_cfg, optarg) != 0) {
+        fprintf(stderr, "Use a sensible receive scheduler setting, (not %s)\n", optarg);
+        exit(1);
+      }
+      rxsched=1;
+      break;
+    case 't':
+      trace_sample=(unsigned int)strtoul(optarg,&tok,0);
+      if (*tok==':')
+        trace_snap=(unsigned int)strtoul(tok+1,0,0);
+      if (trace_sample == 0 || trace_snap > NFM_TRACE_SNAP_MAX) {
+        fprintf(stderr, "Use a sensible trace setting, (not %s)\n", optarg);
+        exit(1);
+      }
+      tok=0;
+      break;
     case 'W':
       pcapfilename=strdup(optarg);
       break;
+    case 'B':
+      pcap_block_mb=(unsigned int)strtoul(optarg,&tok,0);
+      if (*tok==':')
+        pcap_blocks=(unsigned int)strtoul(tok+1,0,0);
+      if (pcap_block_mb == 0 || pcap_block_mb > NFM_PCAPW_MAX_MB || pcap_blocks < 2 || pcap_blocks > NFM_PCAPW_MAX_BLOCKS) {
+        fprintf(stderr, "Use a sensible capture buffer setting, (not %s)\n", optarg);
+        exit(1);
+      }
+      tok=0;
+      break;
+    case 'O':
+      pcap_direct=1;
+      break;
+    case 'F':
+      if (strcmp(optarg, "pcap")==0) {
+        pcap_format=NFM_PCAP_FMT_US;
+      } else if (strcmp(optarg, "pcapns")==0) {
+        pcap_format=NFM_PCAP_FMT_NS;
+      } else if (strcmp(optarg, "pcapng")==0) {
+        pcap_format=NFM_PCAP_FMT_NG;
+      } else {
+        print_usage(argv[0]);
+      }
+      break;
+    case 'T':
+      nfe_timestamps=1;
+      break;
+    case 'K':
+      if (strcmp(optarg, "old")==0) {
+        pcap_keep=NFM_PCAPW_KEEP_OLD;
+      } else if (strcmp(optarg, "new")==0) {
+        pcap_keep=NFM_PCAPW_KEEP_NEW;
+      } else {
+        print_usage(argv[0]);
+      }
+      break;
+    case 'f':
+      if (nfm_capfilt_compile(&capfilt, optarg) != 0) {
+        fprintf(stderr, "Cannot compile filter '%s': %s\n", optarg, capfilt.error);
+        exit(1);
+      }
+      filtering=1;
+      break;
+    case 's':
+      capsel_cfg.snaplen=(uint32_t)strtoul(optarg,&tok,0);
+      if (*tok || capsel_cfg.snaplen == 0) {
+        fprintf(stderr, "Use a sensible snap length, (not %s)\n", optarg);
+        exit(1);
+      }
+      tok=0;
+      break;
+    case 'S':
+      if (nfm_capsel_parse_sample(&capsel_cfg, optarg) != 0) {
+        fprintf(stderr, "Use a sensible sampling setting, (not %s)\n", optarg);
+        exit(1);
+      }
+      break;
+    case 'H':
+      capsel_cfg.headers=1;
+      break;
+    case 'C':
+      rotate_mb=(unsigned int)strtoul(optarg,&tok,0);
+      if (*tok || rotate_mb == 0 || rotate_mb > (1U<<20)) {
+        fprintf(stderr, "Use a sensible rotation size, (not %s)\n", optarg);
+        exit(1);
+      }
+      tok=0;
+      break;
+    case 'G':
+      rotate_s=(unsigned int)strtoul(optarg,&tok,0);
+      if (*tok || rotate_s == 0) {
+        fprintf(stderr, "Use a sensible rotation time, (not %s)\n", optarg);
+        exit(1);
+      }
+      tok=0;
+      break;
+    case 'N':
+      rotate_files=(unsigned int)strtoul(optarg,&tok,0);
+      if (*tok || rotate_files == 0) {
+        fprintf(stderr, "Use a sensible number of files, (not %s)\n", optarg);
+        exit(1);
+      }
+      tok=0;
+      break;
+    case 'z':
+      rotate_hook=strdup(optarg);
+      break;
+    case 'I':
+      pcap_index=1;
+      break;
     case 'l':
       ns_log_lvl_set((unsigned int)strtoul(optarg,0,0));
       break;
@@ -296,6 +475,11 @@ int main(int argc, char **argv)
   if (optind != argc)
     print_usage(argv[0]);
 
+  if ((rotate_files || rotate_hook) && !(rotate_mb || rotate_s)) {
+    fprintf(stderr, "-N and -z need rotation (-C or -G)\n");
+    exit(1);
+  }
+
   if (opt) {
     free(opt); opt=0;
   }
@@ -342,44 +526,56 @@ int main(int argc, char **argv)
 
   ns_log_lvl_get(&loglevel);
 
+  tracing = trace_sample || loglevel == NS_LOG_LVL_VERBOSE;
+  if (tracing) {
+    if (nfm_trace_init(&trace, 1, trace_sample, trace_snap, stdout) != 0 || nfm_trace_start(&trace) != 0) {
+      fprintf(stderr, "Could not start packet tracing\n");
+      return -1;
+    }
+  }
+
   if (pcapfilename != NULL) {
-    simple_pcap_open(&pcapfile, pcapfilename);
+    if (simple_pcap_open(&pcapw, &pcapfmt, pcapfilename, pcap_block_mb, pcap_blocks, pcap_direct, pcap_keep) != 0) {
+      fprintf(stderr, "Could not open %s for recording: %s\n", pcapfilename, strerror(errno));
+      return -1;
+    }
+    recording=1;
+  }
+
+  nfm_stats_init(&stats, 1, print_packets);
+  if (rxsched) {
+    nfm_rxsched_init(&rxsched_state);
+  }
+  if (rxsched || recording) {
+    nfm_stats_set_report_fn(&stats, report_extra, NULL);
+  }
+  if (nfm_stats_start(&stats) != 0) {
+    fprintf(stderr, "Could not start statistics reporter\n");
+    return -1;
   }
 
   while (running) {
-    if (NS_NFM_SUCCESS != (r = ns_packet_receive(dev, &pckt, flags))) {
+    if (rxsched) {
+      if (NS_NFM_SUCCESS != ns_packet_receive(dev, &pckt, flags | NS_PACKET_RECEIVE_NONBLOCK)) {
+        nfm_rxsched_idle(&rxsched_state, &rxsched_cfg);
+        continue;
+      }
+      nfm_rxsched_active(&rxsched_state);
+    } else if (NS_NFM_SUCCESS != (r = ns_packet_receive(dev, &pckt, flags))) {
       if (running)
         print_error(r, "ns_packet_receive");
       continue;
     }
 
-    NS_LOG_VERBOSE("Dumping packet data\n");
-    if (loglevel == NS_LOG_LVL_VERBOSE) {
-      dump(pckt.packet_data, pckt.packet_length);
+    if (tracing) {
+      nfm_trace_packet(&trace, 0, &pckt);
     }
 
-    if (pcapfile!= NULL) {
-      simple_pcap_write_packet(&pcapfile, pckt.packet_data, pckt.packet_length);
+    if (recording) {
+      simple_pcap_write_packet(&pcapfmt, &pckt);
     }
 
-    NS_LOG_VERBOSE("%lu.%6lu Received packet with length %d\n",
-                   pckt.timestamp_s, pckt.timestamp_us, pckt.packet_length);
-
-    numpkts++;
-    if (numpkts == 1) {
-      gettimeofday(&start, NULL);
-      start_us = start.tv_sec * 1000000 + start.tv_usec;
-    }
-
-    numbytes += pckt.packet_length;
-
-    if (numpkts%print_packets == 0) {
-      gettimeofday(&end, NULL);
-      end_us = end.tv_sec * 1000000 + end.tv_usec;
-      unsigned int us = end_us - start_us;
-      double mbps = (numbytes*8.0)/(1.0*us);
-      NS_LOG_EXTRA("numpkts %llu numbytes %llu Mbps %f", numpkts, numbytes, mbps);
-    }
+    nfm_stats_add(&stats.counters[0], 1, pckt.packet_length);
 
     if (drop_all) {
       ns_packet_destroy(&pckt);
@@ -391,6 +587,10 @@ int main(int argc, char **argv)
     }
   }
 
+  if (rxsched) {
+    nfm_rxsched_report(stdout, "", &rxsched_state);
+  }
+
   if (show_counters) {
     struct ns_packet_counters_t c;
     if (ns_packet_get_counters(dev, &c)==NS_NFM_SUCCESS) {
@@ -398,10 +598,15 @@ int main(int argc, char **argv)
     }
   }
 
+  nfm_stats_stop(&stats);
+  if (tracing) {
+    nfm_trace_stop(&trace);
+  }
+
   ns_packet_close_device(dev);
 
-  if (pcapfile!= NULL) {
-    simple_pcap_close(&pcapfile);
+  if (recording) {
+    simple_pcap_close(&pcapw, pcapfilename);
   }
 
   return 0;
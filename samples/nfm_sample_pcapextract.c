@@ -0,0 +1,627 @@
+/**
+ * Copyright (C) 2013 Netronome Systems, Inc.  All rights reserved.
+ *
+ * File:        nfm_sample_pcapextract.c
+ * Description: Offline extraction tool for captures written by
+ *              nfm_sample_pcap_record -I. Uses the index written beside
+ *              each capture file to read only the records of one flow
+ *              and/or time range, and writes them as a new capture.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "nfm_sample_pcapidx.h"
+#include "nfm_sample_pktparse.h"
+
+#define PCAP_MAGIC_US  0xa1b2c3d4
+#define PCAP_MAGIC_NS  0xa1b23c4d
+#define PCAPNG_SHB     0x0a0d0d0a
+#define PCAPNG_EPB     6
+
+// What to extract
+static uint64_t from_ns=0;
+static uint64_t to_ns=UINT64_MAX;
+static int has_flow=0;
+static uint8_t flow_version;
+static uint8_t flow_proto;
+static int flow_ports;
+static unsigned char flow_addr[2][16];
+static uint16_t flow_port[2];
+static uint32_t flow_hash;
+static uint32_t frag_hash;                 // fragments, with -F P,A,PA,B,PB
+// IP IDs of the first fragments seen, by direction: the later fragments
+// have no ports, so they belong to the flow if their first one did
+static uint64_t frag_ids[2*65536/64];
+
+// Output
+static FILE* out=NULL;
+static const char* out_name=NULL;
+static uint32_t out_magic=0;
+static int count_only=0;
+static unsigned long long limit=0;
+
+// What the index saved us
+static unsigned long long files=0;
+static unsigned long long chunks=0;
+static unsigned long long chunks_read=0;
+static unsigned long long postings=0;
+static unsigned long long records_read=0;
+static unsigned long long matched=0;
+
+static void print_usage(const char* argv0)
+{
+  fprintf(stderr, "USAGE: %s [options] capture...\n"
+                  "\n"
+                  "Extract the packets that match all of the options from captures written by\n"
+                  "nfm_sample_pcap_record -I, using the index NAME.idx beside each capture NAME\n"
+                  "(index files named on the command line are skipped, so NAME.* can be given):\n"
+                  " -f --from T     Captured at or after T\n"
+                  " -t --to T       Captured at or before T\n"
+                  "                 T is seconds[.fraction] of capture time, or YYYY-MM-DD[THH:MM[:SS]] (UTC)\n"
+                  " -F --flow P,A,PA,B,PB  Both directions of the flow between A port PA and B port PB,\n"
+                  "                 protocol P (tcp, udp, sctp or a number); P,A,B for protocols without ports.\n"
+                  "                 A later fragment goes with the flow when the first fragment of its\n"
+                  "                 datagram (same IP ID) came before it and is extracted too\n"
+                  "Output:\n"
+                  " -w --write NAME Write the packets to capture file NAME (default standard output),\n"
+                  "                 in the format of the input\n"
+                  " -n --limit n    Stop after n matching packets\n"
+                  " -c --count      Print only the number of matching packets\n"
+          ,argv0);
+  exit(1);
+}
+
+static const struct option __long_options[] = {
+  {"from",      1, 0, 'f'},
+  {"to",        1, 0, 't'},
+  {"flow",      1, 0, 'F'},
+  {"write",     1, 0, 'w'},
+  {"limit",     1, 0, 'n'},
+  {"count",     0, 0, 'c'},
+  {"help",      0, 0, 'h'},
+  {0, 0, 0, 0}
+};
+
+static int parse_time(const char* s, uint64_t* ns)
+{
+  struct tm tm;
+  char* end;
+  unsigned long long sec;
+  uint64_t frac=0, scale=100000000ULL;
+  if (strchr(s, '-')) {
+    memset(&tm, 0, sizeof(tm));
+    end=strptime(s, "%Y-%m-%d", &tm);
+    if (end && *end=='T')
+      end=strptime(end+1, "%H:%M", &tm);
+    if (end && *end==':')
+      end=strptime(end+1, "%S", &tm);
+    if (!end || *end)
+      return -1;
+    *ns=(uint64_t)timegm(&tm)*1000000000ULL;
+    return 0;
+  }
+  // Seconds and fraction apart: a double cannot hold today's time in ns
+  errno=0;
+  sec=strtoull(s, &end, 10);
+  if (errno || end==s || sec>=18000000000ULL)
+    return -1;
+  if (*end=='.') {
+    for (end++; *end>='0' && *end<='9'; end++) {
+      frac+=(uint64_t)(*end-'0')*scale;
+      scale/=10;
+    }
+  }
+  if (*end)
+    return -1;
+  *ns=(uint64_t)sec*1000000000ULL+frac;
+  return 0;
+}
+
+static int parse_proto(const char* s, uint8_t* proto)
+{
+  char* end;
+  unsigned long v;
+  if (strcmp(s, "tcp")==0) {
+    *proto=IPPROTO_TCP;
+  } else if (strcmp(s, "udp")==0) {
+    *proto=IPPROTO_UDP;
+  } else if (strcmp(s, "sctp")==0) {
+    *proto=IPPROTO_SCTP;
+  } else if (strcmp(s, "icmp")==0) {
+    *proto=IPPROTO_ICMP;
+  } else if (strcmp(s, "icmp6")==0) {
+    *proto=IPPROTO_ICMPV6;
+  } else {
+    v=strtoul(s, &end, 0);
+    if (end==s || *end || v>255)
+      return -1;
+    *proto=(uint8_t)v;
+  }
+  return 0;
+}
+
+static int parse_addr(const char* s, unsigned char* addr, uint8_t* version)
+{
+  if (inet_pton(AF_INET, s, addr)==1) {
+    *version=4;
+    return 0;
+  }
+  if (inet_pton(AF_INET6, s, addr)==1) {
+    *version=6;
+    return 0;
+  }
+  return -1;
+}
+
+static int parse_port(const char* s, uint16_t* port)
+{
+  char* end;
+  unsigned long v=strtoul(s, &end, 0);
+  if (end==s || *end || v>65535)
+    return -1;
+  *port=(uint16_t)v;
+  return 0;
+}
+
+// The flow hashes of the query: the headers of a packet of the flow, hashed
+// as the recorder hashed every packet it indexed, whole or fragmented
+static void query_hash(void)
+{
+  unsigned char pkt[128];
+  nfm_pkt_t p;
+  uint32_t l3=14, l4;
+  memset(pkt, 0, sizeof(pkt));
+  if (flow_version==4) {
+    pkt[12]=0x08;
+    pkt[l3]=0x45;
+    pkt[l3+9]=flow_proto;
+    memcpy(pkt+l3+12, flow_addr[0], 4);
+    memcpy(pkt+l3+16, flow_addr[1], 4);
+    l4=l3+20;
+  } else {
+    pkt[12]=0x86;
+    pkt[13]=0xdd;
+    pkt[l3]=0x60;
+    pkt[l3+6]=flow_proto;
+    memcpy(pkt+l3+8, flow_addr[0], 16);
+    memcpy(pkt+l3+24, flow_addr[1], 16);
+    l4=l3+40;
+  }
+  pkt[l4]=(unsigned char)(flow_port[0]>>8);
+  pkt[l4+1]=(unsigned char)flow_port[0];
+  pkt[l4+2]=(unsigned char)(flow_port[1]>>8);
+  pkt[l4+3]=(unsigned char)flow_port[1];
+  pkt[l4+12]=0x50;                                     // TCP header length
+  nfm_pkt_parse(&p, pkt, l4+20);
+  flow_hash=nfm_pkt_flow_hash(&p, pkt);
+  frag_hash=nfm_pkt_addr_hash(&p, pkt);
+}
+
+static int parse_flow(const char* spec)
+{
+  char* copy=strdup(spec);
+  char* f[6];
+  char* save=NULL;
+  int n=0, r=-1;
+  uint8_t v1=0, v2=0;
+
+  for (f[n]=strtok_r(copy, ",", &save); f[n] && n<5; f[n]=strtok_r(NULL, ",", &save))
+    n++;
+  if (n==5 && f[5]==NULL) {
+    flow_ports=1;
+    if (parse_proto(f[0], &flow_proto)==0 && parse_addr(f[1], flow_addr[0], &v1)==0 &&
+        parse_port(f[2], &flow_port[0])==0 && parse_addr(f[3], flow_addr[1], &v2)==0 &&
+        parse_port(f[4], &flow_port[1])==0)
+      r=0;
+  } else if (n==3) {
+    flow_ports=0;
+    if (parse_proto(f[0], &flow_proto)==0 && parse_addr(f[1], flow_addr[0], &v1)==0 &&
+        parse_addr(f[2], flow_addr[1], &v2)==0)
+      r=0;
+  }
+  // Ports are part of the flow exactly when the recorder hashed them
+  if (r==0 && (v1!=v2 || flow_ports!=(flow_proto==IPPROTO_TCP || flow_proto==IPPROTO_UDP ||
+                                      flow_proto==136 || flow_proto==IPPROTO_SCTP)))
+    r=-1;
+  flow_version=v1;
+  free(copy);
+  return r;
+}
+
+static int flow_match(const unsigned char* d, uint32_t caplen)
+{
+  nfm_pkt_t p;
+  const unsigned char* ip;
+  uint32_t alen=(flow_version==4)?4:16, a=(flow_version==4)?12:8, dir, id;
+  uint16_t sp=0, dp=0;
+  int m;
+  nfm_pkt_parse(&p, d, caplen);
+  if (p.ip_version!=flow_version || p.proto!=flow_proto || p.l4_off==0)
+    return 0;
+  ip=d+p.l3_off;
+  if (memcmp(ip+a, flow_addr[0], alen)==0 && memcmp(ip+a+alen, flow_addr[1], alen)==0)
+    dir=0;
+  else if (memcmp(ip+a, flow_addr[1], alen)==0 && memcmp(ip+a+alen, flow_addr[0], alen)==0)
+    dir=1;
+  else
+    return 0;
+  if (!flow_ports)
+    return 1;
+  // IPv6 IDs are cut to 16 bits; each first fragment sets or clears its slot
+  id=(dir<<16)|(p.frag_id&0xffff);
+  if (p.frag)
+    return (frag_ids[id/64]>>(id%64))&1;
+  // The index hashed the whole packet; the record may hold less of it
+  m=0;
+  if (p.l4_off+4u<=caplen) {
+    sp=nfm_pkt_be16(d+p.l4_off);
+    dp=nfm_pkt_be16(d+p.l4_off+2);
+    m=(dir==0) ? (sp==flow_port[0] && dp==flow_port[1]) : (sp==flow_port[1] && dp==flow_port[0]);
+  }
+  if (p.fragment) {
+    if (m)
+      frag_ids[id/64]|=1ULL<<(id%64);
+    else
+      frag_ids[id/64]&=~(1ULL<<(id%64));
+  }
+  return m;
+}
+
+static int limit_reached(void)
+{
+  return limit && matched>=limit;
+}
+
+static void emit(const void* p, size_t len)
+{
+  if (!count_only && fwrite(p, 1, len, out)!=len) {
+    fprintf(stderr, "%s: %s\n", out_name, strerror(errno));
+    exit(1);
+  }
+}
+
+// A capture file and its index, both mapped
+typedef struct {
+  const char* path;
+  const unsigned char* cap;
+  uint64_t cap_len;
+  const unsigned char* idx;
+  uint64_t idx_len;
+  uint32_t magic;
+  uint32_t hdr_len;        // classic file header, or pcapng section header
+  uint64_t* ifs;           // pcapng interface blocks, in file order
+  uint32_t num_ifs;
+  int started;             // section header and interfaces written
+} capture_t;
+
+// The record at 'off': its length, time and packet data, or 0 if it is not
+// a packet record or not whole
+static uint32_t record_at(const capture_t* c, uint64_t off, uint64_t* ts_ns, const unsigned char** data, uint32_t* caplen)
+{
+  const unsigned char* p=c->cap+off;
+  uint32_t v[7];
+  if (c->magic!=PCAPNG_SHB) {
+    if (off+16>c->cap_len)
+      return 0;
+    memcpy(v, p, 16);
+    if (off+16+v[2]>c->cap_len)
+      return 0;
+    *ts_ns=(uint64_t)v[0]*1000000000ULL+((c->magic==PCAP_MAGIC_NS)?v[1]:(uint64_t)v[1]*1000);
+    *data=p+16;
+    *caplen=v[2];
+    return 16+v[2];
+  }
+  if (off+12>c->cap_len)
+    return 0;
+  memcpy(v, p, 8);
+  if (v[1]<12 || off+v[1]>c->cap_len)
+    return 0;
+  if (v[0]!=PCAPNG_EPB || v[1]<32) {
+    *caplen=0;
+    *data=NULL;
+    return v[1];
+  }
+  memcpy(v, p, 28);
+  if (28+(uint64_t)v[5]>v[1])
+    return 0;
+  *ts_ns=((uint64_t)v[3]<<32)|v[4];
+  *data=p+28;
+  *caplen=v[5];
+  return v[1];
+}
+
+static void put_record(capture_t* c, uint64_t off, uint32_t len)
+{
+  uint32_t i, ilen;
+  if (c->magic==PCAPNG_SHB && !c->started) {
+    // Interface IDs are the order of the interface blocks in the section
+    emit(c->cap, c->hdr_len);
+    for (i=0; i<c->num_ifs; i++) {
+      if (c->ifs[i]+8<=c->cap_len) {
+        memcpy(&ilen, c->cap+c->ifs[i]+4, 4);
+        if (c->ifs[i]+ilen<=c->cap_len)
+          emit(c->cap+c->ifs[i], ilen);
+      }
+    }
+    c->started=1;
+  }
+  emit(c->cap+off, len);
+  matched++;
+}
+
+// Check and, if it matches, write the record at 'off'; returns its length
+static uint32_t check_record(capture_t* c, uint64_t off, int check_flow)
+{
+  const unsigned char* data;
+  uint64_t ts;
+  uint32_t caplen, len=record_at(c, off, &ts, &data, &caplen);
+  if (len==0 || data==NULL)
+    return len;
+  records_read++;
+  // Flow first: a first fragment just outside the range still counts
+  if (check_flow && !flow_match(data, caplen))
+    return len;
+  if (ts<from_ns || ts>to_ns)
+    return len;
+  put_record(c, off, len);
+  return len;
+}
+
+// A flow's postings in the chunk, or none
+static uint32_t flow_postings(const nfm_pcapidx_chunk_t* k, uint32_t hash, const uint64_t** post)
+{
+  const nfm_pcapidx_flow_t* fl=nfm_pcapidx_find(k, hash);
+  if (!fl || (uint64_t)fl->first+fl->count>k->num_recs)
+    return 0;
+  *post=nfm_pcapidx_postings(k)+fl->first;
+  return fl->count;
+}
+
+static void extract_chunk(capture_t* c, const nfm_pcapidx_chunk_t* k)
+{
+  const uint64_t *post=NULL, *fpost=NULL;
+  uint64_t off, end;
+  uint32_t i=0, j=0, n, nf=0, len;
+
+  if (k->num_recs==0 || k->max_ts_ns<from_ns || k->min_ts_ns>to_ns)
+    return;
+  if (has_flow) {
+    // Fragments have postings of their own; merge the two in file order
+    n=flow_postings(k, flow_hash, &post);
+    if (flow_ports && frag_hash!=flow_hash)
+      nf=flow_postings(k, frag_hash, &fpost);
+    if (n+nf==0)
+      return;
+    chunks_read++;
+    postings+=n+nf;
+    while ((i<n || j<nf) && !limit_reached()) {
+      if (j==nf || (i<n && post[i]<fpost[j]))
+        check_record(c, post[i++], 1);
+      else
+        check_record(c, fpost[j++], 1);
+    }
+    return;
+  }
+  // The time table brackets the range, unless the chunk is flagged as out
+  // of time order: then the whole chunk is scanned
+  chunks_read++;
+  off=nfm_pcapidx_seek(k, from_ns);
+  end=nfm_pcapidx_seek_end(k, to_ns);
+  while (off<end && !limit_reached()) {
+    len=check_record(c, off, 0);
+    if (len==0)
+      break;
+    off+=len;
+  }
+}
+
+static void *map_file(const char* path, uint64_t* len)
+{
+  struct stat st;
+  void* p;
+  int fd=open(path, O_RDONLY);
+  if (fd<0)
+    return NULL;
+  if (fstat(fd, &st)!=0) {
+    close(fd);
+    return NULL;
+  }
+  if (st.st_size==0) {
+    close(fd);
+    errno=ENODATA;
+    return NULL;
+  }
+  p=mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p==MAP_FAILED)
+    return NULL;
+  *len=(uint64_t)st.st_size;
+  return p;
+}
+
+static int open_capture(capture_t* c, const char* path)
+{
+  char name[4096];
+  uint32_t v[2];
+  memset(c, 0, sizeof(*c));
+  c->path=path;
+  c->cap=(const unsigned char*)map_file(path, &c->cap_len);
+  if (!c->cap) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  snprintf(name, sizeof(name), "%s" NFM_PCAPIDX_SUFFIX, path);
+  c->idx=(const unsigned char*)map_file(name, &c->idx_len);
+  if (!c->idx) {
+    fprintf(stderr, "%s: no index (%s), record with -I\n", name, strerror(errno));
+    return -1;
+  }
+  if (c->idx_len<sizeof(nfm_pcapidx_hdr_t) || memcmp(c->idx, NFM_PCAPIDX_MAGIC, 4)!=0 ||
+      ((const nfm_pcapidx_hdr_t*)c->idx)->version!=NFM_PCAPIDX_VERSION) {
+    fprintf(stderr, "%s: not a capture index\n", name);
+    return -1;
+  }
+  if (c->cap_len<24) {
+    fprintf(stderr, "%s: not a capture file\n", path);
+    return -1;
+  }
+  memcpy(v, c->cap, 8);
+  c->magic=v[0];
+  if (c->magic==PCAP_MAGIC_US || c->magic==PCAP_MAGIC_NS) {
+    c->hdr_len=24;
+  } else if (c->magic==PCAPNG_SHB && v[1]>=28 && v[1]<=c->cap_len) {
+    c->hdr_len=v[1];
+  } else {
+    fprintf(stderr, "%s: not a capture file written by nfm_sample_pcap_record\n", path);
+    return -1;
+  }
+  if (out_magic && c->magic!=out_magic) {
+    fprintf(stderr, "%s: not in the same format as the captures before it\n", path);
+    return -1;
+  }
+  return 0;
+}
+
+static void close_capture(capture_t* c)
+{
+  if (c->cap)
+    munmap((void*)c->cap, c->cap_len);
+  if (c->idx)
+    munmap((void*)c->idx, c->idx_len);
+  free(c->ifs);
+}
+
+static void extract_file(const char* path)
+{
+  capture_t c;
+  const nfm_pcapidx_chunk_t* k;
+  uint64_t off, *ifs;
+  uint32_t i, n;
+
+  files++;
+  if (open_capture(&c, path)!=0) {
+    close_capture(&c);
+    return;
+  }
+  if (!out_magic) {
+    out_magic=c.magic;
+    if (c.magic!=PCAPNG_SHB)
+      emit(c.cap, c.hdr_len);
+  }
+  // The interface blocks of every chunk, needed whatever is extracted.
+  // A chunk still being written ends the index.
+  for (off=sizeof(nfm_pcapidx_hdr_t); (k=nfm_pcapidx_chunk(c.idx, c.idx_len, off))!=NULL; off+=k->size) {
+    chunks++;
+    n=k->num_ifs;
+    if (n) {
+      ifs=(uint64_t*)realloc(c.ifs, (c.num_ifs+n)*sizeof(uint64_t));
+      if (!ifs) {
+        fprintf(stderr, "%s: out of memory\n", path);
+        close_capture(&c);
+        return;
+      }
+      c.ifs=ifs;
+      for (i=0; i<n; i++)
+        c.ifs[c.num_ifs++]=nfm_pcapidx_ifs(k)[i];
+    }
+  }
+  for (off=sizeof(nfm_pcapidx_hdr_t); (k=nfm_pcapidx_chunk(c.idx, c.idx_len, off))!=NULL && !limit_reached(); off+=k->size)
+    extract_chunk(&c, k);
+  close_capture(&c);
+}
+
+static int is_index(const char* path)
+{
+  size_t n=strlen(path), s=strlen(NFM_PCAPIDX_SUFFIX);
+  return n>s && strcmp(path+n-s, NFM_PCAPIDX_SUFFIX)==0;
+}
+
+int main(int argc, char **argv)
+{
+  struct timespec t0, t1;
+  int i, c;
+
+  while ((c = getopt_long(argc, argv, "hf:t:F:w:n:c", __long_options, NULL)) != -1) {
+    switch (c) {
+    case 'f':
+      if (parse_time(optarg, &from_ns) != 0) {
+        fprintf(stderr, "Cannot parse time %s\n", optarg);
+        exit(1);
+      }
+      break;
+    case 't':
+      if (parse_time(optarg, &to_ns) != 0) {
+        fprintf(stderr, "Cannot parse time %s\n", optarg);
+        exit(1);
+      }
+      break;
+    case 'F':
+      if (parse_flow(optarg) != 0) {
+        fprintf(stderr, "Cannot parse flow %s (P,A,PA,B,PB for tcp, udp and sctp, P,A,B otherwise)\n", optarg);
+        exit(1);
+      }
+      has_flow=1;
+      break;
+    case 'w':
+      out_name=optarg;
+      break;
+    case 'n':
+      limit=strtoull(optarg, 0, 0);
+      break;
+    case 'c':
+      count_only=1;
+      break;
+    case 'h':
+    default:
+      print_usage(argv[0]);
+    }
+  }
+
+  if (optind == argc)
+    print_usage(argv[0]);
+  if (has_flow)
+    query_hash();
+  if (count_only) {
+    out_name=NULL;
+  } else if (out_name && strcmp(out_name, "-")!=0) {
+    out=fopen(out_name, "w");
+    if (!out) {
+      fprintf(stderr, "%s: %s\n", out_name, strerror(errno));
+      exit(1);
+    }
+  } else {
+    out=stdout;
+    out_name="standard output";
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (i=optind; i<argc && !limit_reached(); i++) {
+    if (!is_index(argv[i]))
+      extract_file(argv[i]);
+  }
+  if (out && fclose(out) != 0) {
+    fprintf(stderr, "%s: %s\n", out_name, strerror(errno));
+    exit(1);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+
+  if (count_only)
+    printf("%llu\n", matched);
+  fprintf(stderr, "Read %llu of %llu chunks in %llu files, %llu flow postings, %llu records, %llu matched in %.1f ms\n",
+          chunks_read, chunks, files, postings, records_read, matched,
+          (double)(t1.tv_sec-t0.tv_sec)*1e3+(double)(t1.tv_nsec-t0.tv_nsec)/1e6);
+  return 0;
+}
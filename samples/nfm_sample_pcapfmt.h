@@ -0,0 +1,285 @@
+/**
+ * Copyright (C) 2013 Netronome Systems, Inc.  All rights reserved.
+ *
+ * File:        nfm_sample_pcapfmt.h
+ * Description: Capture file formats for the background PCAP writer:
+ *              classic PCAP with microsecond or nanosecond timestamps
+ *              (magic 0xa1b2c3d4 / 0xa1b23c4d), and pcapng with one
+ *              interface per ingress logical interface.
+ *
+ *              pcapng interface IDs are the order of the interface blocks
+ *              in the file, so an interface block is written just before
+ *              the first packet seen on a new lif. If the writer discards
+ *              the buffer holding interface blocks, the interfaces they
+ *              described are forgotten and described again when next seen.
+ *
+ *              When the writer rotates files, each new file gets its own
+ *              header and, for pcapng, its own interface blocks.
+ *
+ *              When the writer is indexing, each record is entered in the
+ *              index with its time and the flow hash of the whole packet.
+ */
+
+#ifndef NFM_SAMPLE_PCAPFMT_H
+#define NFM_SAMPLE_PCAPFMT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "nfm_sample_pcapw.h"
+#include "nfm_sample_pktparse.h"
+
+#define NFM_PCAP_FMT_US          0     // classic, microsecond timestamps
+#define NFM_PCAP_FMT_NS          1     // classic, nanosecond timestamps
+#define NFM_PCAP_FMT_NG          2     // pcapng
+
+#define NFM_PCAP_MAGIC_US        0xa1b2c3d4
+#define NFM_PCAP_MAGIC_NS        0xa1b23c4d
+#define NFM_PCAP_SNAPLEN         65535
+#define NFM_PCAP_LINKTYPE        1     // Ethernet
+
+#define NFM_PCAPNG_SHB           0x0a0d0d0a
+#define NFM_PCAPNG_IDB           1
+#define NFM_PCAPNG_EPB           6
+#define NFM_PCAPNG_BOM           0x1a2b3c4d
+#define NFM_PCAPNG_MAX_IFS       1024  // lifs beyond this share one interface
+#define NFM_PCAPNG_IF_SLOTS      2048  // lif lookup table, power of two
+#define NFM_PCAPNG_IDB_MAX       64
+
+typedef struct {
+  nfm_pcapw_t* w;
+  int format;
+  const char* appl;        // pcapng section header user application
+  uint32_t snaplen;        // 0 if packets are recorded whole
+  // pcapng interfaces: slot holds interface ID + 1, 0 if empty
+  uint16_t slots[NFM_PCAPNG_IF_SLOTS];
+  uint32_t lif[NFM_PCAPNG_MAX_IFS+1];
+  uint32_t seq[NFM_PCAPNG_MAX_IFS+1];  // writer block holding the interface block
+  unsigned int num_ifs;
+  int other_if;            // shared interface for lifs over the limit, or -1
+  uint64_t discarded;      // writer discards already accounted for
+} nfm_pcapfmt_t;
+
+static inline void nfm_pcapfmt_put16(unsigned char* p, uint16_t v)
+{
+  memcpy(p, &v, 2);
+}
+
+static inline void nfm_pcapfmt_put32(unsigned char* p, uint32_t v)
+{
+  memcpy(p, &v, 4);
+}
+
+static inline void nfm_pcapfmt_reset_ifs(nfm_pcapfmt_t* f)
+{
+  memset(f->slots, 0, sizeof(f->slots));
+  f->num_ifs = 0;
+  f->other_if = -1;
+  f->discarded = f->w->discarded;
+}
+
+static inline void nfm_pcapfmt_init(nfm_pcapfmt_t* f, nfm_pcapw_t* w, int format, const char* appl, uint32_t snaplen)
+{
+  memset(f, 0, sizeof(*f));
+  f->w = w;
+  f->format = format;
+  f->appl = appl;
+  f->snaplen = snaplen;
+  nfm_pcapfmt_reset_ifs(f);
+}
+
+// The file header: PCAP global header, or pcapng section header
+static inline int nfm_pcapfmt_begin(nfm_pcapfmt_t* f)
+{
+  unsigned char hdr[128];
+  uint32_t len = 0, alen;
+  nfm_pcapfmt_reset_ifs(f);
+  if (f->format != NFM_PCAP_FMT_NG) {
+    nfm_pcapfmt_put32(hdr, (f->format == NFM_PCAP_FMT_NS) ? NFM_PCAP_MAGIC_NS : NFM_PCAP_MAGIC_US);
+    nfm_pcapfmt_put16(hdr+4, 2);                       // version 2.4
+    nfm_pcapfmt_put16(hdr+6, 4);
+    nfm_pcapfmt_put32(hdr+8, 0);                       // GMT to local correction
+    nfm_pcapfmt_put32(hdr+12, 0);                      // accuracy of timestamps
+    nfm_pcapfmt_put32(hdr+16, (f->snaplen && f->snaplen < NFM_PCAP_SNAPLEN) ? f->snaplen : NFM_PCAP_SNAPLEN);
+    nfm_pcapfmt_put32(hdr+20, NFM_PCAP_LINKTYPE);
+    return nfm_pcapw_header(f->w, hdr, 24);
+  }
+  alen = f->appl ? (uint32_t)strlen(f->appl) : 0;
+  if (alen > 64)
+    alen = 64;
+  memset(hdr, 0, sizeof(hdr));
+  nfm_pcapfmt_put32(hdr, NFM_PCAPNG_SHB);
+  nfm_pcapfmt_put32(hdr+8, NFM_PCAPNG_BOM);
+  nfm_pcapfmt_put16(hdr+12, 1);                        // version 1.0
+  nfm_pcapfmt_put16(hdr+14, 0);
+  memset(hdr+16, 0xff, 8);                             // section length not known
+  len = 24;
+  if (alen) {
+    nfm_pcapfmt_put16(hdr+len, 4);                     // shb_userappl
+    nfm_pcapfmt_put16(hdr+len+2, (uint16_t)alen);
+    memcpy(hdr+len+4, f->appl, alen);
+    len += 4 + ((alen+3) & ~3U);
+    len += 4;                                          // opt_endofopt
+  }
+  len += 4;
+  nfm_pcapfmt_put32(hdr+4, len);
+  nfm_pcapfmt_put32(hdr+len-4, len);
+  return nfm_pcapw_header(f->w, hdr, len);
+}
+
+// Interface description block for 'lif' (or the shared one) at 'p'
+static inline uint32_t nfm_pcapfmt_idb(unsigned char* p, uint32_t lif, int other, uint32_t snaplen)
+{
+  char name[32];
+  uint32_t nlen, len;
+  nlen = (uint32_t)(other ? snprintf(name, sizeof(name), "lif other") : snprintf(name, sizeof(name), "lif%u", lif));
+  memset(p, 0, NFM_PCAPNG_IDB_MAX);
+  nfm_pcapfmt_put32(p, NFM_PCAPNG_IDB);
+  nfm_pcapfmt_put16(p+8, NFM_PCAP_LINKTYPE);
+  nfm_pcapfmt_put32(p+12, snaplen);                    // 0: no snap length limit
+  len = 16;
+  nfm_pcapfmt_put16(p+len, 2);                         // if_name
+  nfm_pcapfmt_put16(p+len+2, (uint16_t)nlen);
+  memcpy(p+len+4, name, nlen);
+  len += 4 + ((nlen+3) & ~3U);
+  nfm_pcapfmt_put16(p+len, 9);                         // if_tsresol: 10^-9 s
+  nfm_pcapfmt_put16(p+len+2, 1);
+  p[len+4] = 9;
+  len += 8;
+  len += 4;                                            // opt_endofopt
+  len += 4;
+  nfm_pcapfmt_put32(p+4, len);
+  nfm_pcapfmt_put32(p+len-4, len);
+  return len;
+}
+
+// Interface ID for 'lif', or -1 if it has no interface block yet
+static inline int nfm_pcapfmt_find_if(const nfm_pcapfmt_t* f, uint32_t lif)
+{
+  uint32_t i = (lif*0x9e3779b1U) & (NFM_PCAPNG_IF_SLOTS-1);
+  while (f->slots[i]) {
+    if (f->lif[f->slots[i]-1] == lif)
+      return f->slots[i]-1;
+    i = (i+1) & (NFM_PCAPNG_IF_SLOTS-1);
+  }
+  return (f->num_ifs >= NFM_PCAPNG_MAX_IFS) ? f->other_if : -1;
+}
+
+static inline int nfm_pcapfmt_add_if(nfm_pcapfmt_t* f, uint32_t lif, uint32_t seq)
+{
+  uint32_t i;
+  int id = (int)f->num_ifs;
+  f->seq[id] = seq;
+  if (f->num_ifs >= NFM_PCAPNG_MAX_IFS) {
+    f->other_if = id;
+  } else {
+    f->lif[id] = lif;
+    i = (lif*0x9e3779b1U) & (NFM_PCAPNG_IF_SLOTS-1);
+    while (f->slots[i])
+      i = (i+1) & (NFM_PCAPNG_IF_SLOTS-1);
+    f->slots[i] = (uint16_t)(id+1);
+  }
+  f->num_ifs++;
+  return id;
+}
+
+// The writer threw away the buffer being filled: forget the interfaces
+// whose blocks were in it (always the most recently added ones)
+static inline void nfm_pcapfmt_rollback(nfm_pcapfmt_t* f)
+{
+  unsigned int keep = f->num_ifs, i;
+  while (keep && f->seq[keep-1] == f->w->head)
+    keep--;
+  if (keep != f->num_ifs) {
+    nfm_pcapfmt_reset_ifs(f);
+    for (i = 0; i < keep; i++)
+      nfm_pcapfmt_add_if(f, f->lif[i], f->seq[i]);
+  }
+  f->discarded = f->w->discarded;
+}
+
+// Fragments, the first included, are indexed by addresses and protocol: the
+// later ones have no ports, and pcapextract tells the flows apart by IP ID
+static inline uint32_t nfm_pcapfmt_hash(const void* data, uint32_t len)
+{
+  nfm_pkt_t p;
+  nfm_pkt_parse(&p, (const unsigned char*)data, len);
+  if (p.fragment)
+    return nfm_pkt_addr_hash(&p, (const unsigned char*)data);
+  return nfm_pkt_flow_hash(&p, (const unsigned char*)data);
+}
+
+// Receive thread: record the first 'caplen' bytes of a 'len' byte packet
+// seen at sec.nsec on 'lif'
+static inline void nfm_pcapfmt_packet(nfm_pcapfmt_t* f, uint32_t sec, uint32_t nsec, uint32_t lif, const void* data, uint32_t caplen, uint32_t len)
+{
+  nfm_pcapw_t* w = f->w;
+  unsigned char* p;
+  uint32_t need, pad, idb = 0;
+  uint64_t ts;
+  int id;
+
+  if (nfm_pcapw_rotate_due(w, caplen + ((f->format == NFM_PCAP_FMT_NG) ? 35+NFM_PCAPNG_IDB_MAX : 16), sec))
+    nfm_pcapw_rotate(w);
+  if (w->need_header && nfm_pcapfmt_begin(f) != 0) {
+    nfm_pcapw_drop(w, len);
+    return;
+  }
+
+  if (f->format != NFM_PCAP_FMT_NG) {
+    p = nfm_pcapw_reserve(w, 16+caplen, sec);
+    if (!p) {
+      nfm_pcapw_drop(w, len);
+      return;
+    }
+    nfm_pcapfmt_put32(p, sec);
+    nfm_pcapfmt_put32(p+4, (f->format == NFM_PCAP_FMT_NS) ? nsec : nsec/1000);
+    nfm_pcapfmt_put32(p+8, caplen);
+    nfm_pcapfmt_put32(p+12, len);
+    memcpy(p+16, data, caplen);
+    if (w->indexing)
+      nfm_pcapw_index(w, NFM_PCAPIDX_PACKET, (uint64_t)sec*1000000000ULL + nsec, nfm_pcapfmt_hash(data, len), 16+caplen);
+    nfm_pcapw_commit(w, 16+caplen, len);
+    return;
+  }
+
+  pad = (4 - (caplen & 3)) & 3;
+  for (;;) {
+    id = nfm_pcapfmt_find_if(f, lif);
+    need = 32 + caplen + pad + ((id < 0) ? NFM_PCAPNG_IDB_MAX : 0);
+    p = nfm_pcapw_reserve(w, need, sec);
+    if (!p) {
+      nfm_pcapw_drop(w, len);
+      return;
+    }
+    if (w->discarded == f->discarded)
+      break;
+    // Nothing is committed yet, so reserving again returns the same space
+    nfm_pcapfmt_rollback(f);
+  }
+  if (id < 0) {
+    idb = nfm_pcapfmt_idb(p, lif, f->num_ifs >= NFM_PCAPNG_MAX_IFS, f->snaplen);
+    id = nfm_pcapfmt_add_if(f, lif, w->head);
+    if (w->indexing)
+      nfm_pcapw_index(w, NFM_PCAPIDX_IF, 0, 0, idb);
+    nfm_pcapw_append(w, idb);
+    p += idb;
+  }
+  ts = (uint64_t)sec*1000000000ULL + nsec;
+  nfm_pcapfmt_put32(p, NFM_PCAPNG_EPB);
+  nfm_pcapfmt_put32(p+4, 32+caplen+pad);
+  nfm_pcapfmt_put32(p+8, (uint32_t)id);
+  nfm_pcapfmt_put32(p+12, (uint32_t)(ts >> 32));
+  nfm_pcapfmt_put32(p+16, (uint32_t)ts);
+  nfm_pcapfmt_put32(p+20, caplen);
+  nfm_pcapfmt_put32(p+24, len);
+  memcpy(p+28, data, caplen);
+  memset(p+28+caplen, 0, pad);
+  nfm_pcapfmt_put32(p+28+caplen+pad, 32+caplen+pad);
+  if (w->indexing)
+    nfm_pcapw_index(w, NFM_PCAPIDX_PACKET, ts, nfm_pcapfmt_hash(data, len), 32+caplen+pad);
+  nfm_pcapw_commit(w, 32+caplen+pad, len);
+}
+
+#endif
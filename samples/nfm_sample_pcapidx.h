@@ -0,0 +1,364 @@
+/**
+ * Copyright (C) 2013 Netronome Systems, Inc.  All rights reserved.
+ *
+ * File:        nfm_sample_pcapidx.h
+ * Description: Sidecar index for the capture files of the background PCAP
+ *              writer, written as NAME.idx next to each capture file while
+ *              it is captured. The receive thread notes the file offset,
+ *              time and flow hash of each record next to the record in the
+ *              capture buffer; the writer thread adds them to the index once
+ *              the buffer is written, so nothing in the index points at data
+ *              that was dropped.
+ *
+ *              The index is a file header then a run of chunks, each
+ *              covering up to NFM_PCAPIDX_CHUNK_RECS consecutive records:
+ *              a header with the chunk's time span and file range, a sparse
+ *              time table (every NFM_PCAPIDX_TIME_EVERY'th record), the
+ *              offsets of the pcapng interface blocks in the chunk, a flow
+ *              table sorted by flow hash, and the record offsets of each
+ *              flow in file order. The flow hash is the same in both
+ *              directions (nfm_pkt_flow_hash), so a flow's posting list
+ *              holds both sides of the conversation.
+ *
+ *              Records from several cards are not always in time order;
+ *              such a chunk is flagged, and its time table cannot be
+ *              searched.
+ */
+
+#ifndef NFM_SAMPLE_PCAPIDX_H
+#define NFM_SAMPLE_PCAPIDX_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#define NFM_PCAPIDX_MAGIC        "NFPX"
+#define NFM_PCAPIDX_CHUNK_MAGIC  "NFPC"
+#define NFM_PCAPIDX_VERSION      1
+#define NFM_PCAPIDX_SUFFIX       ".idx"
+#define NFM_PCAPIDX_CHUNK_RECS   65536
+#define NFM_PCAPIDX_TIME_EVERY   256
+#define NFM_PCAPIDX_MIN_REC      64    // capture buffer bytes per index entry reserved
+
+#define NFM_PCAPIDX_PACKET       0
+#define NFM_PCAPIDX_IF           1     // pcapng interface description block
+
+// Chunk flags
+#define NFM_PCAPIDX_UNORDERED    1     // a record is older than one before it
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t chunk_recs;
+  uint32_t time_every;
+} nfm_pcapidx_hdr_t;
+
+typedef struct {
+  char magic[4];
+  uint32_t num_recs;
+  uint32_t num_flows;
+  uint32_t num_times;
+  uint32_t num_ifs;
+  uint32_t flags;
+  uint64_t min_ts_ns;
+  uint64_t max_ts_ns;
+  uint64_t first_off;      // first record in the chunk
+  uint64_t end_off;        // end of the last record
+  uint64_t size;           // of the chunk, header included
+} nfm_pcapidx_chunk_t;
+
+typedef struct {
+  uint64_t ts_ns;
+  uint64_t off;
+} nfm_pcapidx_time_t;
+
+typedef struct {
+  uint32_t hash;
+  uint32_t count;
+  uint32_t first;          // index of the flow's first posting
+  uint32_t pad;
+} nfm_pcapidx_flow_t;
+
+// What the receive thread notes for each record
+typedef struct {
+  uint64_t off;
+  uint64_t ts_ns;
+  uint32_t hash;
+  uint32_t kind;
+  uint32_t len;            // of the record
+  uint32_t pad;
+} nfm_pcapidx_ent_t;
+
+// Writer thread: the chunk being built for the current index file
+typedef struct {
+  nfm_pcapidx_ent_t* ents;
+  uint32_t num_ents;
+  uint64_t end_off;
+  // Sort space
+  uint32_t* hash;
+  uint64_t* off;
+  uint32_t* hash2;
+  uint64_t* off2;
+  uint32_t* counts;        // 65536
+  nfm_pcapidx_flow_t* flows;
+  uint64_t* ifs;
+  nfm_pcapidx_time_t* times;
+  uint64_t chunks;
+  uint64_t errors;
+} nfm_pcapidx_t;
+
+static inline void nfm_pcapidx_free(nfm_pcapidx_t* x)
+{
+  free(x->ents);
+  free(x->hash);
+  free(x->off);
+  free(x->hash2);
+  free(x->off2);
+  free(x->counts);
+  free(x->flows);
+  free(x->ifs);
+  free(x->times);
+  memset(x, 0, sizeof(*x));
+}
+
+static inline int nfm_pcapidx_init(nfm_pcapidx_t* x)
+{
+  uint32_t n = NFM_PCAPIDX_CHUNK_RECS;
+  memset(x, 0, sizeof(*x));
+  x->ents = (nfm_pcapidx_ent_t*)malloc(n * sizeof(*x->ents));
+  x->hash = (uint32_t*)malloc(n * sizeof(uint32_t));
+  x->off = (uint64_t*)malloc(n * sizeof(uint64_t));
+  x->hash2 = (uint32_t*)malloc(n * sizeof(uint32_t));
+  x->off2 = (uint64_t*)malloc(n * sizeof(uint64_t));
+  x->counts = (uint32_t*)malloc(65536 * sizeof(uint32_t));
+  x->flows = (nfm_pcapidx_flow_t*)malloc(n * sizeof(*x->flows));
+  x->ifs = (uint64_t*)malloc(n * sizeof(uint64_t));
+  x->times = (nfm_pcapidx_time_t*)malloc((n/NFM_PCAPIDX_TIME_EVERY + 1) * sizeof(*x->times));
+  if (!x->ents || !x->hash || !x->off || !x->hash2 || !x->off2 || !x->counts || !x->flows || !x->ifs || !x->times) {
+    nfm_pcapidx_free(x);
+    return -1;
+  }
+  return 0;
+}
+
+static inline int nfm_pcapidx_write(int fd, const void* p, size_t len)
+{
+  const char* c = (const char*)p;
+  ssize_t n;
+  while (len) {
+    n = write(fd, c, len);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    c += n;
+    len -= (size_t)n;
+  }
+  return 0;
+}
+
+// Start a new index file
+static inline int nfm_pcapidx_begin(int fd)
+{
+  nfm_pcapidx_hdr_t h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, NFM_PCAPIDX_MAGIC, 4);
+  h.version = NFM_PCAPIDX_VERSION;
+  h.chunk_recs = NFM_PCAPIDX_CHUNK_RECS;
+  h.time_every = NFM_PCAPIDX_TIME_EVERY;
+  return nfm_pcapidx_write(fd, &h, sizeof(h));
+}
+
+// One stable radix pass over 16 bits of the hash
+static inline void nfm_pcapidx_radix(nfm_pcapidx_t* x, uint32_t n, const uint32_t* hin, const uint64_t* oin, uint32_t* hout, uint64_t* oout, unsigned int shift)
+{
+  uint32_t i, sum = 0, c;
+  memset(x->counts, 0, 65536 * sizeof(uint32_t));
+  for (i = 0; i < n; i++)
+    x->counts[(hin[i] >> shift) & 0xffff]++;
+  for (i = 0; i < 65536; i++) {
+    c = x->counts[i];
+    x->counts[i] = sum;
+    sum += c;
+  }
+  for (i = 0; i < n; i++) {
+    c = x->counts[(hin[i] >> shift) & 0xffff]++;
+    hout[c] = hin[i];
+    oout[c] = oin[i];
+  }
+}
+
+// Write the chunk built so far to 'fd'
+static inline int nfm_pcapidx_flush(nfm_pcapidx_t* x, int fd)
+{
+  nfm_pcapidx_chunk_t c;
+  uint32_t i, n = 0, num_ifs = 0, num_times = 0, num_flows = 0;
+  uint64_t last_ts = 0;
+  int r = 0;
+
+  if (x->num_ents == 0)
+    return 0;
+  memset(&c, 0, sizeof(c));
+  memcpy(c.magic, NFM_PCAPIDX_CHUNK_MAGIC, 4);
+  c.min_ts_ns = UINT64_MAX;
+  c.first_off = x->ents[0].off;
+  c.end_off = x->end_off;
+  for (i = 0; i < x->num_ents; i++) {
+    const nfm_pcapidx_ent_t* e = &x->ents[i];
+    if (e->kind == NFM_PCAPIDX_IF) {
+      x->ifs[num_ifs++] = e->off;
+      continue;
+    }
+    if (n % NFM_PCAPIDX_TIME_EVERY == 0) {
+      x->times[num_times].ts_ns = e->ts_ns;
+      x->times[num_times].off = e->off;
+      num_times++;
+    }
+    if (e->ts_ns < c.min_ts_ns)
+      c.min_ts_ns = e->ts_ns;
+    if (e->ts_ns > c.max_ts_ns)
+      c.max_ts_ns = e->ts_ns;
+    if (e->ts_ns < last_ts)
+      c.flags |= NFM_PCAPIDX_UNORDERED;
+    last_ts = e->ts_ns;
+    x->hash[n] = e->hash;
+    x->off[n] = e->off;
+    n++;
+  }
+  if (n == 0)
+    c.min_ts_ns = 0;
+  // Group by flow, keeping file order within each flow
+  nfm_pcapidx_radix(x, n, x->hash, x->off, x->hash2, x->off2, 0);
+  nfm_pcapidx_radix(x, n, x->hash2, x->off2, x->hash, x->off, 16);
+  for (i = 0; i < n; i++) {
+    if (i == 0 || x->hash[i] != x->hash[i-1]) {
+      x->flows[num_flows].hash = x->hash[i];
+      x->flows[num_flows].count = 0;
+      x->flows[num_flows].first = i;
+      x->flows[num_flows].pad = 0;
+      num_flows++;
+    }
+    x->flows[num_flows-1].count++;
+  }
+  c.num_recs = n;
+  c.num_flows = num_flows;
+  c.num_times = num_times;
+  c.num_ifs = num_ifs;
+  c.size = sizeof(c) + num_times * sizeof(nfm_pcapidx_time_t) + num_ifs * sizeof(uint64_t) +
+           num_flows * sizeof(nfm_pcapidx_flow_t) + n * sizeof(uint64_t);
+  if (fd >= 0) {
+    if (nfm_pcapidx_write(fd, &c, sizeof(c)) != 0 ||
+        nfm_pcapidx_write(fd, x->times, num_times * sizeof(nfm_pcapidx_time_t)) != 0 ||
+        nfm_pcapidx_write(fd, x->ifs, num_ifs * sizeof(uint64_t)) != 0 ||
+        nfm_pcapidx_write(fd, x->flows, num_flows * sizeof(nfm_pcapidx_flow_t)) != 0 ||
+        nfm_pcapidx_write(fd, x->off, n * sizeof(uint64_t)) != 0) {
+      x->errors++;
+      r = -1;
+    }
+  }
+  x->chunks++;
+  x->num_ents = 0;
+  return r;
+}
+
+// Writer thread: index the entries of a block just written
+static inline void nfm_pcapidx_add(nfm_pcapidx_t* x, int fd, const nfm_pcapidx_ent_t* ents, uint32_t n)
+{
+  uint32_t i;
+  for (i = 0; i < n; i++) {
+    if (x->num_ents == NFM_PCAPIDX_CHUNK_RECS)
+      nfm_pcapidx_flush(x, fd);
+    x->ents[x->num_ents++] = ents[i];
+    x->end_off = ents[i].off + ents[i].len;
+  }
+}
+
+// Reader: the chunk at 'off' of a mapped index, or NULL if it is not whole
+static inline const nfm_pcapidx_chunk_t* nfm_pcapidx_chunk(const unsigned char* map, uint64_t map_len, uint64_t off)
+{
+  const nfm_pcapidx_chunk_t* c = (const nfm_pcapidx_chunk_t*)(map + off);
+  if (off + sizeof(*c) > map_len || memcmp(c->magic, NFM_PCAPIDX_CHUNK_MAGIC, 4) != 0 ||
+      c->size < sizeof(*c) || off + c->size > map_len)
+    return NULL;
+  if (c->size != sizeof(*c) + (uint64_t)c->num_times * sizeof(nfm_pcapidx_time_t) + (uint64_t)c->num_ifs * sizeof(uint64_t) +
+                 (uint64_t)c->num_flows * sizeof(nfm_pcapidx_flow_t) + (uint64_t)c->num_recs * sizeof(uint64_t))
+    return NULL;
+  return c;
+}
+
+static inline const nfm_pcapidx_time_t* nfm_pcapidx_times(const nfm_pcapidx_chunk_t* c)
+{
+  return (const nfm_pcapidx_time_t*)(c + 1);
+}
+
+static inline const uint64_t* nfm_pcapidx_ifs(const nfm_pcapidx_chunk_t* c)
+{
+  return (const uint64_t*)(nfm_pcapidx_times(c) + c->num_times);
+}
+
+static inline const nfm_pcapidx_flow_t* nfm_pcapidx_flows(const nfm_pcapidx_chunk_t* c)
+{
+  return (const nfm_pcapidx_flow_t*)(nfm_pcapidx_ifs(c) + c->num_ifs);
+}
+
+static inline const uint64_t* nfm_pcapidx_postings(const nfm_pcapidx_chunk_t* c)
+{
+  return (const uint64_t*)(nfm_pcapidx_flows(c) + c->num_flows);
+}
+
+// Reader: the flow table entry for 'hash', or NULL
+static inline const nfm_pcapidx_flow_t* nfm_pcapidx_find(const nfm_pcapidx_chunk_t* c, uint32_t hash)
+{
+  const nfm_pcapidx_flow_t* f = nfm_pcapidx_flows(c);
+  uint32_t lo = 0, hi = c->num_flows, mid;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (f[mid].hash < hash)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return (lo < c->num_flows && f[lo].hash == hash) ? &f[lo] : NULL;
+}
+
+// Reader: where to start scanning the chunk for records at or after 'ts_ns'
+static inline uint64_t nfm_pcapidx_seek(const nfm_pcapidx_chunk_t* c, uint64_t ts_ns)
+{
+  const nfm_pcapidx_time_t* t = nfm_pcapidx_times(c);
+  uint32_t lo = 0, hi = c->num_times, mid;
+  if (c->flags & NFM_PCAPIDX_UNORDERED)
+    return c->first_off;
+  // First entry at or after ts_ns; the one before it is the start
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (t[mid].ts_ns < ts_ns)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return (lo == 0) ? c->first_off : t[lo-1].off;
+}
+
+// Reader: where scanning for records at or before 'ts_ns' can stop
+static inline uint64_t nfm_pcapidx_seek_end(const nfm_pcapidx_chunk_t* c, uint64_t ts_ns)
+{
+  const nfm_pcapidx_time_t* t = nfm_pcapidx_times(c);
+  uint32_t lo = 0, hi = c->num_times, mid;
+  if (c->flags & NFM_PCAPIDX_UNORDERED)
+    return c->end_off;
+  // First entry after ts_ns
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (t[mid].ts_ns <= ts_ns)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return (lo == c->num_times) ? c->end_off : t[lo].off;
+}
+
+#endif
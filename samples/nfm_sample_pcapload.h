@@ -0,0 +1,364 @@
+/**
+ * Copyright (C) 2013 Netronome Systems, Inc.  All rights reserved.
+ *
+ * File:        nfm_sample_pcapload.h
+ * Description: Capture loading for the replay samples. Reads a classic PCAP
+ *              file (either byte order, microsecond or nanosecond
+ *              timestamps) or a pcapng file once, before replay starts, and
+ *              builds a compact array of frame descriptors with their
+ *              capture times, so that the transmit loop only walks an array.
+ *
+ *              The frames either stay where they are in a private mapping
+ *              of the file, or are copied back to back into an arena on
+ *              huge pages (transparent huge pages if none are reserved),
+ *              which keeps TLB misses out of the transmit loop.
+ *
+ *              Linux cooked captures get the fake Ethernet header that
+ *              nfm_sample_pcap_playback has always given them. Records on
+ *              other link types are skipped and counted.
+ */
+
+#ifndef NFM_SAMPLE_PCAPLOAD_H
+#define NFM_SAMPLE_PCAPLOAD_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define NFM_PCAPLOAD_MMAP        0     // frames stay in a private map of the file
+#define NFM_PCAPLOAD_COPY        1     // frames are copied into a huge page arena
+
+#define NFM_PCAPLOAD_HUGE        (2U<<20)
+#define NFM_PCAPLOAD_ALIGN       64    // of each frame in the arena
+#define NFM_PCAPLOAD_MAX_IFS     256   // pcapng interfaces per section
+
+#define NFM_PCAPLOAD_LINK_ETH    1
+#define NFM_PCAPLOAD_LINK_SLL    113
+
+typedef struct {
+  uint64_t off;            // of the frame from 'base'
+  uint64_t ts_ns;          // capture time
+  uint32_t len;
+  uint32_t port;           // egress port, filled in by the caller
+} nfm_pcapload_desc_t;
+
+typedef struct {
+  int mode;
+  unsigned char* base;     // the frames
+  uint64_t base_len;
+  int huge;                // the arena is on reserved huge pages
+  nfm_pcapload_desc_t* descs;
+  uint64_t num_descs;
+  uint64_t bytes;          // of all the frames
+  uint64_t skipped;        // records on link types that cannot be replayed
+  char error[128];
+} nfm_pcapload_t;
+
+// Walks the records of a mapped capture file
+typedef struct {
+  const unsigned char* p;
+  uint64_t len;
+  uint64_t off;
+  int ng;
+  int swap;
+  int nsec;                // classic PCAP with nanosecond timestamps
+  uint32_t linktype;       // classic PCAP
+  uint32_t if_link[NFM_PCAPLOAD_MAX_IFS];
+  unsigned char if_tsresol[NFM_PCAPLOAD_MAX_IFS];
+  uint32_t num_ifs;
+  uint64_t ts_ns;          // of the last record
+} nfm_pcapload_walk_t;
+
+static inline uint32_t nfm_pcapload_get32(const nfm_pcapload_walk_t* w, uint64_t off)
+{
+  uint32_t v;
+  memcpy(&v, w->p+off, 4);
+  return w->swap ? __builtin_bswap32(v) : v;
+}
+
+static inline uint16_t nfm_pcapload_get16(const nfm_pcapload_walk_t* w, uint64_t off)
+{
+  uint16_t v;
+  memcpy(&v, w->p+off, 2);
+  return w->swap ? __builtin_bswap16(v) : v;
+}
+
+// A pcapng timestamp in ns, given the if_tsresol of its interface
+static inline uint64_t nfm_pcapload_ts(uint64_t raw, unsigned char tsresol)
+{
+  unsigned int i, e = tsresol & 0x7f;
+  uint64_t div = 1;
+  if (tsresol & 0x80) {                                // 2^-e seconds
+    if (e >= 64)
+      return 0;
+    return (raw >> e) * 1000000000ULL + (uint64_t)((double)(raw & ((1ULL << e)-1)) * 1e9 / (double)(1ULL << e));
+  }
+  if (e > 19)
+    return 0;
+  if (e <= 9) {
+    for (i = e; i < 9; i++)
+      raw *= 10;
+    return raw;
+  }
+  for (i = 9; i < e; i++)
+    div *= 10;
+  return raw / div;
+}
+
+// The if_tsresol option of the interface description at 'off', or 6
+static inline unsigned char nfm_pcapload_tsresol(const nfm_pcapload_walk_t* w, uint64_t off, uint32_t blen)
+{
+  uint64_t o = off + 16, end = off + blen - 4;
+  uint16_t code, len;
+  while (o + 4 <= end) {
+    code = nfm_pcapload_get16(w, o);
+    len = nfm_pcapload_get16(w, o+2);
+    if (code == 0 || o + 4 + len > end)
+      break;
+    if (code == 9 && len >= 1)
+      return w->p[o+4];
+    o += 4 + ((len + 3) & ~3U);
+  }
+  return 6;
+}
+
+// Returns 0, or -1 if 'p' is not a capture file
+static inline int nfm_pcapload_walk_init(nfm_pcapload_walk_t* w, const unsigned char* p, uint64_t len)
+{
+  uint32_t magic;
+  memset(w, 0, sizeof(*w));
+  w->p = p;
+  w->len = len;
+  if (len < 24)
+    return -1;
+  memcpy(&magic, p, 4);
+  if (magic == 0x0a0d0d0a) {
+    w->ng = 1;
+    return 0;
+  }
+  if (magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1)
+    w->swap = 1;
+  else if (magic != 0xa1b2c3d4 && magic != 0xa1b23c4d)
+    return -1;
+  w->nsec = (magic == 0x4d3cb2a1 || magic == 0xa1b23c4d);
+  w->linktype = nfm_pcapload_get32(w, 20);
+  w->off = 24;
+  return 0;
+}
+
+// The next record: its data offset, captured length and link type; its
+// capture time is left in w->ts_ns. Returns 0 at the end of the file or of
+// its last whole record.
+static inline int nfm_pcapload_next(nfm_pcapload_walk_t* w, uint64_t* data, uint32_t* caplen, uint32_t* linktype)
+{
+  uint32_t type, blen, magic, id;
+  int known;
+  if (!w->ng) {
+    if (w->off + 16 > w->len)
+      return 0;
+    *caplen = nfm_pcapload_get32(w, w->off+8);
+    if (w->off + 16 + *caplen > w->len)
+      return 0;
+    *data = w->off + 16;
+    *linktype = w->linktype;
+    w->ts_ns = (uint64_t)nfm_pcapload_get32(w, w->off) * 1000000000ULL +
+               (uint64_t)nfm_pcapload_get32(w, w->off+4) * (w->nsec ? 1 : 1000);
+    w->off += 16 + *caplen;
+    return 1;
+  }
+  for (;;) {
+    if (w->off + 12 > w->len)
+      return 0;
+    memcpy(&type, w->p+w->off, 4);
+    if (type == 0x0a0d0d0a) {
+      // A new section sets the byte order and forgets the interfaces
+      memcpy(&magic, w->p+w->off+8, 4);
+      w->swap = (magic == 0x4d3c2b1a);
+      w->num_ifs = 0;
+    }
+    type = nfm_pcapload_get32(w, w->off);
+    blen = nfm_pcapload_get32(w, w->off+4);
+    if (blen < 12 || (blen & 3) || w->off + blen > w->len)
+      return 0;
+    if (type == 1 && blen >= 20) {            // interface description
+      if (w->num_ifs < NFM_PCAPLOAD_MAX_IFS) {
+        w->if_link[w->num_ifs] = nfm_pcapload_get16(w, w->off+8);
+        w->if_tsresol[w->num_ifs] = nfm_pcapload_tsresol(w, w->off, blen);
+      }
+      w->num_ifs++;
+    } else if (type == 6 && blen >= 32) {     // enhanced packet
+      id = nfm_pcapload_get32(w, w->off+8);
+      *caplen = nfm_pcapload_get32(w, w->off+20);
+      if (28 + (uint64_t)*caplen <= blen) {
+        *data = w->off + 28;
+        known = (id < w->num_ifs && id < NFM_PCAPLOAD_MAX_IFS);
+        *linktype = known ? w->if_link[id] : 0;
+        w->ts_ns = nfm_pcapload_ts(((uint64_t)nfm_pcapload_get32(w, w->off+12) << 32) | nfm_pcapload_get32(w, w->off+16),
+                                   known ? w->if_tsresol[id] : 6);
+        w->off += blen;
+        return 1;
+      }
+    } else if (type == 3 && blen >= 16) {     // simple packet, interface 0, no timestamp
+      *caplen = nfm_pcapload_get32(w, w->off+8);
+      if (*caplen > blen - 16)
+        *caplen = blen - 16;
+      *data = w->off + 12;
+      *linktype = w->num_ifs ? w->if_link[0] : 0;
+      w->off += blen;
+      return 1;
+    }
+    w->off += blen;
+  }
+}
+
+// Where the Ethernet frame of a record starts, or -1 if it has none.
+// Cooked captures give up their first two bytes to a fake Ethernet header.
+static inline int nfm_pcapload_frame(uint32_t linktype, uint32_t caplen)
+{
+  if (linktype == NFM_PCAPLOAD_LINK_ETH && caplen >= 14)
+    return 0;
+  if (linktype == NFM_PCAPLOAD_LINK_SLL && caplen >= 16)
+    return 2;
+  return -1;
+}
+
+static inline void nfm_pcapload_fake_eth(unsigned char* frame)
+{
+  memcpy(frame, "DSTMAC", 6);
+  memcpy(frame+6, "SRCMAC", 6);
+  frame[12] = 0x08;                                    // IPv4
+  frame[13] = 0x00;
+}
+
+static inline unsigned char* nfm_pcapload_arena(nfm_pcapload_t* l, uint64_t len)
+{
+  void* p;
+  len = (len + NFM_PCAPLOAD_HUGE-1) & ~(uint64_t)(NFM_PCAPLOAD_HUGE-1);
+  if (len == 0)
+    len = NFM_PCAPLOAD_HUGE;
+  l->base_len = len;
+  p = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB|MAP_POPULATE, -1, 0);
+  if (p != MAP_FAILED) {
+    l->huge = 1;
+    return (unsigned char*)p;
+  }
+  p = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    return NULL;
+  // Before the first touch, so the copy faults in huge pages
+  madvise(p, len, MADV_HUGEPAGE);
+  return (unsigned char*)p;
+}
+
+static inline void nfm_pcapload_free(nfm_pcapload_t* l)
+{
+  if (l->base)
+    munmap(l->base, l->base_len);
+  free(l->descs);
+  l->base = NULL;
+  l->descs = NULL;
+  l->num_descs = 0;
+}
+
+// Load 'path' for replay. Returns 0, or -1 with the reason in l->error.
+static inline int nfm_pcapload_open(nfm_pcapload_t* l, const char* path, int mode)
+{
+  nfm_pcapload_walk_t w;
+  nfm_pcapload_desc_t* d;
+  struct stat st;
+  unsigned char* file;
+  uint64_t data, n = 0, arena = 0, off = 0;
+  uint32_t caplen, linktype;
+  int fd, skip;
+
+  memset(l, 0, sizeof(*l));
+  l->mode = mode;
+  fd = open(path, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    snprintf(l->error, sizeof(l->error), "%s", strerror(errno));
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+  if (st.st_size == 0) {
+    snprintf(l->error, sizeof(l->error), "empty file");
+    close(fd);
+    return -1;
+  }
+  // Private and writable, so cooked frames can be fixed up in place; only
+  // the pages written to are copied
+  file = (unsigned char*)mmap(NULL, (size_t)st.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (file == MAP_FAILED) {
+    snprintf(l->error, sizeof(l->error), "%s", strerror(errno));
+    return -1;
+  }
+  madvise(file, (size_t)st.st_size, MADV_SEQUENTIAL);
+  madvise(file, (size_t)st.st_size, MADV_WILLNEED);
+  if (nfm_pcapload_walk_init(&w, file, (uint64_t)st.st_size) != 0) {
+    snprintf(l->error, sizeof(l->error), "not a PCAP or pcapng file");
+    munmap(file, (size_t)st.st_size);
+    return -1;
+  }
+
+  // Size everything first
+  while (nfm_pcapload_next(&w, &data, &caplen, &linktype)) {
+    skip = nfm_pcapload_frame(linktype, caplen);
+    if (skip < 0) {
+      l->skipped++;
+      continue;
+    }
+    n++;
+    arena += (caplen - skip + NFM_PCAPLOAD_ALIGN-1) & ~(uint64_t)(NFM_PCAPLOAD_ALIGN-1);
+  }
+  l->descs = (nfm_pcapload_desc_t*)malloc((n ? n : 1) * sizeof(nfm_pcapload_desc_t));
+  if (!l->descs) {
+    snprintf(l->error, sizeof(l->error), "no memory for %llu descriptors", (unsigned long long)n);
+    munmap(file, (size_t)st.st_size);
+    return -1;
+  }
+  if (mode == NFM_PCAPLOAD_COPY) {
+    l->base = nfm_pcapload_arena(l, arena);
+    if (!l->base) {
+      snprintf(l->error, sizeof(l->error), "no memory for a %llu MB arena", (unsigned long long)(arena >> 20));
+      munmap(file, (size_t)st.st_size);
+      nfm_pcapload_free(l);
+      return -1;
+    }
+  } else {
+    l->base = file;
+    l->base_len = (uint64_t)st.st_size;
+  }
+
+  nfm_pcapload_walk_init(&w, file, (uint64_t)st.st_size);
+  while (l->num_descs < n && nfm_pcapload_next(&w, &data, &caplen, &linktype)) {
+    skip = nfm_pcapload_frame(linktype, caplen);
+    if (skip < 0)
+      continue;
+    d = &l->descs[l->num_descs++];
+    d->len = caplen - skip;
+    d->ts_ns = w.ts_ns;
+    d->port = 0;
+    if (mode == NFM_PCAPLOAD_COPY) {
+      memcpy(l->base+off, file+data+skip, d->len);
+      d->off = off;
+      off += (d->len + NFM_PCAPLOAD_ALIGN-1) & ~(uint64_t)(NFM_PCAPLOAD_ALIGN-1);
+    } else {
+      d->off = data + skip;
+    }
+    if (skip)
+      nfm_pcapload_fake_eth(l->base + d->off);
+    l->bytes += d->len;
+  }
+  if (mode == NFM_PCAPLOAD_COPY)
+    munmap(file, (size_t)st.st_size);
+  return 0;
+}
+
+#endif
@@ -0,0 +1,805 @@
+/**
+ * Copyright (C) 2013 Netronome Systems, Inc.  All rights reserved.
+ *
+ * File:        nfm_sample_pcapw.h
+ * Description: Background PCAP file writer for the capture samples.
+ *              The receive thread appends packet records to one of a few
+ *              multi-megabyte, page aligned blocks; a writer thread writes
+ *              each full block with a single large write and hands it back.
+ *              The receive thread never waits for the disk: when every
+ *              block is full or still being written, packets are dropped
+ *              by the configured policy and counted.
+ *
+ *              A block is handed to the writer when the next record does
+ *              not fit, when it has been open longer than a second (by the
+ *              monotonic clock, not packet stamps, which may step back) and
+ *              another packet arrives, or on stop.
+ *
+ *              With O_DIRECT every write must start and end on a page
+ *              boundary. The receive thread therefore starts each block at
+ *              the same page offset as the file position it continues, and
+ *              the writer copies the previous block's unaligned tail (less
+ *              than a page) into that gap before writing.
+ *
+ *              With rotation the capture goes to NAME.000000, NAME.000001...
+ *              The receive thread starts a new file when the next record
+ *              would take the current one past the size limit or the first
+ *              packet in it is older than the time limit; the block that
+ *              follows begins with a fresh file header and is flagged so the
+ *              writer switches files before writing it. A file thread keeps
+ *              the next file created and preallocated, so the switch is only
+ *              a descriptor swap, and finishes closed files off the writer:
+ *              truncate, close, run the post-rotate command on them, and
+ *              delete those older than the last N.
+ *
+ *              With indexing on, each block also carries the index entries
+ *              of its records and every capture file gets a sidecar index
+ *              (nfm_sample_pcapidx.h), opened and finished along with it.
+ */
+
+#ifndef NFM_SAMPLE_PCAPW_H
+#define NFM_SAMPLE_PCAPW_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <glob.h>
+#include <sys/wait.h>
+
+#include "nfm_sample_pcapidx.h"
+
+#define NFM_PCAPW_ALIGN          4096
+#define NFM_PCAPW_DEFAULT_MB     4
+#define NFM_PCAPW_MAX_MB         1024
+#define NFM_PCAPW_DEFAULT_BLOCKS 2
+#define NFM_PCAPW_MAX_BLOCKS     64
+#define NFM_PCAPW_IDLE_US        1000  // writer sleep when no block is queued
+#define NFM_PCAPW_FLUSH_S        1     // longest a block stays open while packets arrive
+#define NFM_PCAPW_MAX_CLOSED     16    // closed files waiting, post-rotate commands running
+#define NFM_PCAPW_NAME_MAX       4096
+
+// What to keep when the disk falls behind
+#define NFM_PCAPW_KEEP_OLD       0     // drop arriving packets until a block is free
+#define NFM_PCAPW_KEEP_NEW       1     // discard the full block being filled and reuse it
+
+typedef struct {
+  unsigned char* buf;
+  uint32_t len;            // bytes used, including 'lead'
+  uint32_t lead;           // O_DIRECT: gap for the previous block's tail
+  uint32_t base;           // bytes a discard keeps: 'lead' and any file header
+  uint64_t pkts;
+  uint64_t bytes;          // packet bytes, as counted in 'bytes' below
+  uint64_t opened_ms;      // CLOCK_MONOTONIC_COARSE time of the first record
+  int new_file;            // rotation: write this block to the next file
+  nfm_pcapidx_ent_t* ix;   // index entries of the records, if indexing
+  uint32_t ix_len;
+} nfm_pcapw_block_t;
+
+typedef struct {
+  int fd;
+  int ix_fd;               // its index, or -1
+  uint32_t seq;
+  uint64_t len;
+} nfm_pcapw_file_t;
+
+typedef struct {
+  pid_t pid;
+  uint32_t seq;
+} nfm_pcapw_hook_t;
+
+typedef struct {
+  int fd;
+  int direct;
+  int keep;
+  uint32_t block_size;
+  unsigned int num_blocks;
+  nfm_pcapw_block_t* blocks;
+  char path[NFM_PCAPW_NAME_MAX];
+  // Rotation, off if both limits are 0
+  int rotating;
+  uint64_t rotate_bytes;
+  uint64_t rotate_s;
+  unsigned int keep_files; // 0 keeps them all
+  const char* hook;        // post-rotate command, run with the file name appended
+  int indexing;
+  uint32_t ix_cap;         // index entries per block
+  // Receive thread
+  nfm_pcapw_block_t* cur;  // block being filled, NULL if none is free
+  uint64_t stream;         // bytes of the current file so far
+  uint64_t file_pkts;
+  uint64_t file_start_s;   // packet time of the first packet in the file
+  int new_file;            // the next block acquired starts a new file
+  int need_header;         // the current file has no header yet
+  uint64_t packets;
+  uint64_t bytes;
+  uint64_t drop_pkts;
+  uint64_t drop_bytes;
+  uint64_t discarded;      // blocks thrown away by NFM_PCAPW_KEEP_NEW
+  uint32_t max_queued;
+  volatile uint32_t head __attribute__((aligned(64)));  // blocks handed to the writer
+  // Writer thread
+  volatile uint32_t tail __attribute__((aligned(64)));  // blocks written and handed back
+  unsigned char* carry;    // O_DIRECT: unaligned end of the last block written
+  uint32_t carry_len;
+  uint64_t written;
+  int ix_fd;
+  nfm_pcapidx_t idx;
+  uint64_t file_written;
+  uint32_t file_seq;
+  uint64_t files;
+  uint64_t late_opens;     // switches that had to wait for the next file
+  uint64_t writes;
+  uint64_t write_ns;
+  uint64_t max_write_ns;
+  volatile int failed;
+  int error;               // errno of the failed write
+  pthread_t thread;
+  volatile int running;
+  // File thread, shared under 'lock'
+  pthread_t fthread;
+  int fthread_running;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int fstop;
+  int next_fd;             // -1 while being opened, -2 if that failed
+  int next_ix_fd;
+  int next_error;
+  uint32_t next_seq;
+  uint64_t prealloc;       // bytes to allocate in the next file
+  nfm_pcapw_file_t closed[NFM_PCAPW_MAX_CLOSED];
+  unsigned int closed_head;
+  unsigned int closed_tail;
+  // File thread only
+  nfm_pcapw_hook_t hooks[NFM_PCAPW_MAX_CLOSED];  // post-rotate commands running
+  unsigned int hooks_head;
+  unsigned int hooks_tail;
+  uint64_t hooks_run;
+  uint64_t hook_failures;
+  uint64_t deleted;
+  uint64_t file_errors;    // failed preallocations and closes
+} nfm_pcapw_t;
+
+// Cheap enough to read per packet, and fine enough for NFM_PCAPW_FLUSH_S
+static inline uint64_t nfm_pcapw_coarse_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return (uint64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+static inline uint64_t nfm_pcapw_now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+// Allocate 'num_blocks' blocks of 'block_mb' megabytes for writing 'path';
+// the file is created by nfm_pcapw_start
+static inline int nfm_pcapw_init(nfm_pcapw_t* w, const char* path, unsigned int block_mb, unsigned int num_blocks, int direct, int keep)
+{
+  unsigned int i;
+  memset(w, 0, sizeof(*w));
+  w->fd = -1;
+  w->ix_fd = -1;
+  w->next_fd = -1;
+  w->next_ix_fd = -1;
+  w->need_header = 1;
+  if (block_mb == 0 || block_mb > NFM_PCAPW_MAX_MB || num_blocks < 2 || num_blocks > NFM_PCAPW_MAX_BLOCKS ||
+      strlen(path) >= sizeof(w->path)) {
+    errno = EINVAL;
+    return -1;
+  }
+  strcpy(w->path, path);
+  w->block_size = block_mb << 20;
+  w->num_blocks = num_blocks;
+  w->direct = direct;
+  w->keep = keep;
+  w->blocks = (nfm_pcapw_block_t*)calloc(num_blocks, sizeof(nfm_pcapw_block_t));
+  if (!w->blocks || posix_memalign((void**)&w->carry, NFM_PCAPW_ALIGN, NFM_PCAPW_ALIGN) != 0)
+    goto fail;
+  for (i = 0; i < num_blocks; i++) {
+    if (posix_memalign((void**)&w->blocks[i].buf, NFM_PCAPW_ALIGN, w->block_size) != 0)
+      goto fail;
+    // Fault the pages in now rather than on the receive path
+    memset(w->blocks[i].buf, 0, w->block_size);
+  }
+  return 0;
+
+fail:
+  if (w->blocks) {
+    for (i = 0; i < num_blocks; i++)
+      free(w->blocks[i].buf);
+  }
+  free(w->blocks);
+  free(w->carry);
+  w->blocks = NULL;
+  w->carry = NULL;
+  return -1;
+}
+
+// Before nfm_pcapw_start: start a new file every 'mb' megabytes and/or
+// every 's' seconds, keep the last 'files' of them and run 'hook' on each
+// one closed
+static inline void nfm_pcapw_rotation(nfm_pcapw_t* w, unsigned int mb, unsigned int s, unsigned int files, const char* hook)
+{
+  w->rotating = mb || s;
+  w->rotate_bytes = (uint64_t)mb << 20;
+  w->rotate_s = s;
+  w->keep_files = files;
+  w->hook = hook;
+}
+
+// Before nfm_pcapw_start: write an index next to each capture file
+static inline int nfm_pcapw_index_on(nfm_pcapw_t* w)
+{
+  unsigned int i;
+  w->ix_cap = w->block_size / NFM_PCAPIDX_MIN_REC;
+  if (nfm_pcapidx_init(&w->idx) != 0)
+    return -1;
+  for (i = 0; i < w->num_blocks; i++) {
+    w->blocks[i].ix = (nfm_pcapidx_ent_t*)malloc(w->ix_cap * sizeof(nfm_pcapidx_ent_t));
+    if (!w->blocks[i].ix)
+      return -1;
+    memset(w->blocks[i].ix, 0, w->ix_cap * sizeof(nfm_pcapidx_ent_t));
+  }
+  w->indexing = 1;
+  return 0;
+}
+
+// Receive thread: take the next free block, if any
+static inline nfm_pcapw_block_t* nfm_pcapw_acquire(nfm_pcapw_t* w)
+{
+  nfm_pcapw_block_t* b;
+  if (w->head - __atomic_load_n(&w->tail, __ATOMIC_ACQUIRE) >= w->num_blocks || w->failed)
+    return NULL;
+  b = &w->blocks[w->head % w->num_blocks];
+  b->lead = w->direct ? (uint32_t)(w->stream & (NFM_PCAPW_ALIGN-1)) : 0;
+  b->len = b->lead;
+  b->base = b->lead;
+  b->pkts = 0;
+  b->bytes = 0;
+  b->opened_ms = 0;
+  b->new_file = w->new_file;
+  b->ix_len = 0;
+  w->new_file = 0;
+  w->cur = b;
+  return b;
+}
+
+// Receive thread: queue the current block for the writer
+static inline void nfm_pcapw_handover(nfm_pcapw_t* w)
+{
+  uint32_t queued = w->head + 1 - __atomic_load_n(&w->tail, __ATOMIC_RELAXED);
+  if (queued > w->max_queued)
+    w->max_queued = queued;
+  w->cur = NULL;
+  __atomic_store_n(&w->head, w->head+1, __ATOMIC_RELEASE);
+}
+
+// Whether a 'need' byte record (and up to two index entries) fit in 'b'
+static inline int nfm_pcapw_fits(const nfm_pcapw_t* w, const nfm_pcapw_block_t* b, uint32_t need)
+{
+  return b->len + need <= w->block_size && (!w->indexing || b->ix_len + 2 <= w->ix_cap);
+}
+
+// Receive thread: room for a 'need' byte record stamped 'ts_s', or NULL if
+// it has to be dropped. A non-NULL pointer must be committed.
+static inline unsigned char* nfm_pcapw_reserve(nfm_pcapw_t* w, uint32_t need, uint64_t ts_s)
+{
+  nfm_pcapw_block_t* b = w->cur;
+  uint64_t now_ms = nfm_pcapw_coarse_ms();
+  if (b && (!nfm_pcapw_fits(w, b, need) || (b->pkts && now_ms - b->opened_ms >= NFM_PCAPW_FLUSH_S*1000))) {
+    if (w->keep == NFM_PCAPW_KEEP_NEW && !nfm_pcapw_fits(w, b, need) &&
+        w->head + 1 - __atomic_load_n(&w->tail, __ATOMIC_ACQUIRE) >= w->num_blocks) {
+      // No block to move on to: lose this one rather than what follows
+      w->packets -= b->pkts;
+      w->bytes -= b->bytes;
+      w->drop_pkts += b->pkts;
+      w->drop_bytes += b->bytes;
+      w->file_pkts -= b->pkts;
+      w->stream -= b->len - b->base;
+      w->discarded++;
+      b->len = b->base;
+      b->pkts = 0;
+      b->bytes = 0;
+      b->ix_len = 0;
+    } else {
+      nfm_pcapw_handover(w);
+      b = NULL;
+    }
+  }
+  if (!b)
+    b = nfm_pcapw_acquire(w);
+  if (!b || !nfm_pcapw_fits(w, b, need))
+    return NULL;
+  if (b->pkts == 0)
+    b->opened_ms = now_ms;
+  if (w->file_pkts == 0)
+    w->file_start_s = ts_s;
+  return b->buf + b->len;
+}
+
+// Receive thread: whether a 'need' byte record stamped 'ts_s' belongs in
+// a new file. An empty file is never rotated.
+static inline int nfm_pcapw_rotate_due(const nfm_pcapw_t* w, uint32_t need, uint64_t ts_s)
+{
+  return w->rotating && w->file_pkts &&
+         ((w->rotate_bytes && w->stream + need > w->rotate_bytes) ||
+          (w->rotate_s && ts_s >= w->file_start_s + w->rotate_s));
+}
+
+// Receive thread: end the current file. The caller writes the header of
+// the next one before any packet.
+static inline void nfm_pcapw_rotate(nfm_pcapw_t* w)
+{
+  if (w->cur)
+    nfm_pcapw_handover(w);
+  w->new_file = 1;
+  w->need_header = 1;
+  w->stream = 0;
+  w->file_pkts = 0;
+}
+
+// Receive thread, before committing a record of 'len' bytes: note it in
+// the index
+static inline void nfm_pcapw_index(nfm_pcapw_t* w, uint32_t kind, uint64_t ts_ns, uint32_t hash, uint32_t len)
+{
+  nfm_pcapidx_ent_t* e = &w->cur->ix[w->cur->ix_len++];
+  e->off = w->stream;
+  e->ts_ns = ts_ns;
+  e->hash = hash;
+  e->kind = kind;
+  e->len = len;
+}
+
+// Commit a record of 'len' bytes holding a packet of 'pkt_len' bytes
+static inline void nfm_pcapw_commit(nfm_pcapw_t* w, uint32_t len, uint32_t pkt_len)
+{
+  w->cur->len += len;
+  w->cur->pkts++;
+  w->cur->bytes += pkt_len;
+  w->stream += len;
+  w->file_pkts++;
+  w->packets++;
+  w->bytes += pkt_len;
+}
+
+// Commit 'len' bytes that are not a packet, e.g. a pcapng interface block
+static inline void nfm_pcapw_append(nfm_pcapw_t* w, uint32_t len)
+{
+  w->cur->len += len;
+  w->stream += len;
+}
+
+// Receive thread: count a packet that could not be recorded
+static inline void nfm_pcapw_drop(nfm_pcapw_t* w, uint32_t len)
+{
+  w->drop_pkts++;
+  w->drop_bytes += len;
+}
+
+// The file header, before the writer starts or after a rotation; a
+// discard never drops it
+static inline int nfm_pcapw_header(nfm_pcapw_t* w, const void* hdr, uint32_t len)
+{
+  unsigned char* p = nfm_pcapw_reserve(w, len, 0);
+  if (!p)
+    return -1;
+  memcpy(p, hdr, len);
+  nfm_pcapw_append(w, len);
+  w->cur->base = w->cur->len;
+  w->need_header = 0;
+  return 0;
+}
+
+static inline void nfm_pcapw_write(nfm_pcapw_t* w, const unsigned char* p, uint32_t len)
+{
+  uint64_t t0 = nfm_pcapw_now_ns(), t;
+  ssize_t n;
+  while (len && !w->failed) {
+    n = write(w->fd, p, len);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      w->error = errno;
+      __atomic_store_n(&w->failed, 1, __ATOMIC_RELAXED);
+      break;
+    }
+    p += n;
+    len -= (uint32_t)n;
+    w->written += (uint64_t)n;
+    w->file_written += (uint64_t)n;
+  }
+  t = nfm_pcapw_now_ns() - t0;
+  w->writes++;
+  w->write_ns += t;
+  if (t > w->max_write_ns)
+    w->max_write_ns = t;
+}
+
+static inline void nfm_pcapw_file_name(const nfm_pcapw_t* w, uint32_t seq, char* name, size_t size)
+{
+  if (w->rotating)
+    snprintf(name, size, "%s.%06u", w->path, seq);
+  else
+    snprintf(name, size, "%s", w->path);
+}
+
+// Create file 'seq', allocating its expected size up front, and its
+// index if indexing. A missing index is counted, not fatal.
+static inline int nfm_pcapw_open_file(nfm_pcapw_t* w, uint32_t seq, uint64_t prealloc, int* ix_fd)
+{
+  char name[NFM_PCAPW_NAME_MAX+16];
+  int fd;
+  nfm_pcapw_file_name(w, seq, name, sizeof(name));
+  *ix_fd = -1;
+  fd = open(name, O_WRONLY|O_CREAT|O_TRUNC|(w->direct?O_DIRECT:0), 0644);
+  if (fd < 0)
+    return -1;
+  if (prealloc && fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, (off_t)prealloc) != 0)
+    w->file_errors++;
+  if (w->indexing) {
+    strcat(name, NFM_PCAPIDX_SUFFIX);
+    *ix_fd = open(name, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (*ix_fd >= 0 && nfm_pcapidx_begin(*ix_fd) != 0) {
+      close(*ix_fd);
+      *ix_fd = -1;
+    }
+    if (*ix_fd < 0)
+      w->file_errors++;
+  }
+  return fd;
+}
+
+// File thread: collect finished post-rotate commands, oldest first,
+// waiting until at most 'left' are still running
+static inline void nfm_pcapw_reap_hooks(nfm_pcapw_t* w, unsigned int left)
+{
+  int status;
+  pid_t r;
+  while (w->hooks_head != w->hooks_tail) {
+    r = waitpid(w->hooks[w->hooks_tail % NFM_PCAPW_MAX_CLOSED].pid, &status,
+                (w->hooks_head - w->hooks_tail > left) ? 0 : WNOHANG);
+    if (r == 0)
+      break;
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      w->hook_failures++;
+    w->hooks_tail++;
+  }
+}
+
+// File thread: start the post-rotate command on file 'seq' without
+// waiting, so a slow compressor never holds up the next file
+static inline void nfm_pcapw_run_hook(nfm_pcapw_t* w, uint32_t seq)
+{
+  extern char** environ;
+  char cmd[NFM_PCAPW_NAME_MAX+16];
+  char name[NFM_PCAPW_NAME_MAX+16];
+  char* argv[] = { (char*)"sh", (char*)"-c", cmd, (char*)"sh", name, NULL };
+  pid_t pid;
+  snprintf(cmd, sizeof(cmd), "%s \"$1\"", w->hook);
+  nfm_pcapw_file_name(w, seq, name, sizeof(name));
+  nfm_pcapw_reap_hooks(w, NFM_PCAPW_MAX_CLOSED-1);
+  w->hooks_run++;
+  if (posix_spawn(&pid, "/bin/sh", NULL, NULL, argv, environ) != 0) {
+    w->hook_failures++;
+    return;
+  }
+  w->hooks[w->hooks_head % NFM_PCAPW_MAX_CLOSED].pid = pid;
+  w->hooks[w->hooks_head % NFM_PCAPW_MAX_CLOSED].seq = seq;
+  w->hooks_head++;
+}
+
+// File thread: delete file 'seq' once its post-rotate command is done,
+// along with anything the command made of it, e.g. NAME.000001.gz
+static inline void nfm_pcapw_delete_file(nfm_pcapw_t* w, uint32_t seq)
+{
+  char name[NFM_PCAPW_NAME_MAX+32];
+  glob_t g;
+  size_t i;
+  int n = 0;
+  while (w->hooks_head != w->hooks_tail && w->hooks[w->hooks_tail % NFM_PCAPW_MAX_CLOSED].seq <= seq)
+    nfm_pcapw_reap_hooks(w, w->hooks_head - w->hooks_tail - 1);
+  nfm_pcapw_file_name(w, seq, name, sizeof(name));
+  if (unlink(name) == 0)
+    n++;
+  // What the post-rotate command made of it, and its index
+  strcat(name, ".*");
+  if (glob(name, GLOB_NOSORT, NULL, &g) == 0) {
+    for (i = 0; i < g.gl_pathc; i++) {
+      if (unlink(g.gl_pathv[i]) == 0)
+        n++;
+    }
+  }
+  globfree(&g);
+  if (n)
+    w->deleted++;
+}
+
+// Cut a closed file back to what was written (O_DIRECT pads the last
+// page, preallocation reserves more), close it, start the post-rotate
+// command and, if a later file was started, delete the one that falls out
+// of the last N. Returns 0 or the errno of the failed truncate or close.
+static inline int nfm_pcapw_finish_file(nfm_pcapw_t* w, const nfm_pcapw_file_t* file, int rotated)
+{
+  int r = 0;
+  if (ftruncate(file->fd, (off_t)file->len) != 0)
+    r = errno;
+  if (close(file->fd) != 0 && r == 0)
+    r = errno;
+  if (file->ix_fd >= 0 && close(file->ix_fd) != 0 && r == 0)
+    r = errno;
+  if (r != 0)
+    w->file_errors++;
+  if (w->hook)
+    nfm_pcapw_run_hook(w, file->seq);
+  if (rotated && w->keep_files && file->seq + 1 >= w->keep_files)
+    nfm_pcapw_delete_file(w, file->seq + 1 - w->keep_files);
+  return r;
+}
+
+static void* nfm_pcapw_files(void* arg)
+{
+  nfm_pcapw_t* w = (nfm_pcapw_t*)arg;
+  nfm_pcapw_file_t file;
+  uint64_t prealloc;
+  uint32_t seq;
+  sigset_t sigs;
+  int fd, ix_fd;
+
+  sigfillset(&sigs);
+  pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+  pthread_mutex_lock(&w->lock);
+  for (;;) {
+    // The writer may be waiting for the next file, so that comes first
+    if (w->next_fd == -1 && !w->fstop) {
+      seq = w->next_seq;
+      prealloc = w->prealloc;
+      pthread_mutex_unlock(&w->lock);
+      fd = nfm_pcapw_open_file(w, seq, prealloc, &ix_fd);
+      pthread_mutex_lock(&w->lock);
+      w->next_error = errno;
+      w->next_ix_fd = ix_fd;
+      w->next_fd = (fd >= 0) ? fd : -2;
+      pthread_cond_broadcast(&w->cond);
+    } else if (w->closed_tail != w->closed_head) {
+      file = w->closed[w->closed_tail % NFM_PCAPW_MAX_CLOSED];
+      w->closed_tail++;
+      pthread_cond_broadcast(&w->cond);
+      pthread_mutex_unlock(&w->lock);
+      nfm_pcapw_finish_file(w, &file, 1);
+      nfm_pcapw_reap_hooks(w, NFM_PCAPW_MAX_CLOSED);
+      pthread_mutex_lock(&w->lock);
+    } else if (w->fstop) {
+      break;
+    } else {
+      pthread_cond_wait(&w->cond, &w->lock);
+    }
+  }
+  pthread_mutex_unlock(&w->lock);
+  return NULL;
+}
+
+// Writer thread: pad out the O_DIRECT tail of the current file
+static inline void nfm_pcapw_flush_carry(nfm_pcapw_t* w)
+{
+  if (w->direct && w->carry_len && !w->failed) {
+    memset(w->carry+w->carry_len, 0, NFM_PCAPW_ALIGN-w->carry_len);
+    nfm_pcapw_write(w, w->carry, NFM_PCAPW_ALIGN);
+    w->written -= NFM_PCAPW_ALIGN - w->carry_len;
+    w->file_written -= NFM_PCAPW_ALIGN - w->carry_len;
+  }
+  w->carry_len = 0;
+}
+
+// Writer thread: hand the current file to the file thread and carry on
+// with the one it has ready
+static inline void nfm_pcapw_next_file(nfm_pcapw_t* w)
+{
+  nfm_pcapw_file_t file;
+  int late = 0;
+  nfm_pcapw_flush_carry(w);
+  if (w->indexing)
+    nfm_pcapidx_flush(&w->idx, w->ix_fd);
+  file.fd = w->fd;
+  file.ix_fd = w->ix_fd;
+  file.seq = w->file_seq;
+  file.len = w->file_written;
+  pthread_mutex_lock(&w->lock);
+  while (w->closed_head - w->closed_tail >= NFM_PCAPW_MAX_CLOSED)
+    pthread_cond_wait(&w->cond, &w->lock);
+  w->closed[w->closed_head % NFM_PCAPW_MAX_CLOSED] = file;
+  w->closed_head++;
+  while (w->next_fd == -1) {
+    late = 1;
+    pthread_cond_wait(&w->cond, &w->lock);
+  }
+  w->fd = w->next_fd;
+  w->ix_fd = w->next_ix_fd;
+  w->next_ix_fd = -1;
+  if (w->fd < 0) {
+    w->error = w->next_error;
+    __atomic_store_n(&w->failed, 1, __ATOMIC_RELAXED);
+  } else {
+    // Without a size limit the last file is the best guess at the next
+    if (!w->rotate_bytes)
+      w->prealloc = file.len;
+    w->file_seq = w->next_seq++;
+    w->next_fd = -1;
+  }
+  pthread_cond_broadcast(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+  w->late_opens += late;
+  w->files++;
+  w->file_written = 0;
+}
+
+// Writer thread: write every queued block
+static inline unsigned int nfm_pcapw_drain(nfm_pcapw_t* w)
+{
+  uint32_t head = __atomic_load_n(&w->head, __ATOMIC_ACQUIRE);
+  uint32_t tail = w->tail;
+  unsigned int done = 0;
+  while (tail != head) {
+    nfm_pcapw_block_t* b = &w->blocks[tail % w->num_blocks];
+    if (b->new_file && !w->failed)
+      nfm_pcapw_next_file(w);
+    if (!w->direct) {
+      nfm_pcapw_write(w, b->buf, b->len);
+    } else {
+      uint32_t end = b->len & ~(uint32_t)(NFM_PCAPW_ALIGN-1);
+      memcpy(b->buf, w->carry, b->lead);
+      if (end)
+        nfm_pcapw_write(w, b->buf, end);
+      w->carry_len = b->len - end;
+      memcpy(w->carry, b->buf+end, w->carry_len);
+    }
+    if (w->indexing && !w->failed)
+      nfm_pcapidx_add(&w->idx, w->ix_fd, b->ix, b->ix_len);
+    tail++;
+    done++;
+    __atomic_store_n(&w->tail, tail, __ATOMIC_RELEASE);
+  }
+  return done;
+}
+
+static void* nfm_pcapw_writer(void* arg)
+{
+  nfm_pcapw_t* w = (nfm_pcapw_t*)arg;
+  struct timespec idle = { 0, NFM_PCAPW_IDLE_US*1000L };
+  sigset_t sigs;
+
+  sigfillset(&sigs);
+  pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+  while (w->running) {
+    if (nfm_pcapw_drain(w) == 0)
+      nanosleep(&idle, NULL);
+  }
+  nfm_pcapw_drain(w);
+  return NULL;
+}
+
+// Create the first file, and with rotation have the next one made ready
+static inline int nfm_pcapw_start(nfm_pcapw_t* w)
+{
+  w->fd = nfm_pcapw_open_file(w, 0, w->rotate_bytes, &w->ix_fd);
+  if (w->fd < 0)
+    return -1;
+  w->files = 1;
+  if (w->rotating) {
+    w->next_seq = 1;
+    w->prealloc = w->rotate_bytes;
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    if (pthread_create(&w->fthread, NULL, nfm_pcapw_files, w) != 0)
+      return -1;
+    w->fthread_running = 1;
+  }
+  w->running = 1;
+  if (pthread_create(&w->thread, NULL, nfm_pcapw_writer, w) != 0) {
+    w->running = 0;
+    return -1;
+  }
+  return 0;
+}
+
+// Receive thread, once done: queue the partial block, let the writer
+// finish and close the file. Returns 0 if everything queued reached it.
+static inline int nfm_pcapw_stop(nfm_pcapw_t* w)
+{
+  if (w->cur && w->cur->len > w->cur->lead)
+    nfm_pcapw_handover(w);
+  if (w->running) {
+    w->running = 0;
+    pthread_join(w->thread, NULL);
+  } else if (w->fd >= 0) {
+    nfm_pcapw_drain(w);
+  }
+  nfm_pcapw_flush_carry(w);
+  if (w->indexing)
+    nfm_pcapidx_flush(&w->idx, w->ix_fd);
+  if (w->fthread_running) {
+    // The file thread finishes every closed file, then the spare is removed
+    pthread_mutex_lock(&w->lock);
+    w->fstop = 1;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->fthread, NULL);
+    w->fthread_running = 0;
+    if (w->next_fd >= 0) {
+      char name[NFM_PCAPW_NAME_MAX+16];
+      close(w->next_fd);
+      nfm_pcapw_file_name(w, w->next_seq, name, sizeof(name));
+      unlink(name);
+      if (w->next_ix_fd >= 0) {
+        close(w->next_ix_fd);
+        strcat(name, NFM_PCAPIDX_SUFFIX);
+        unlink(name);
+      }
+    }
+    w->next_fd = -1;
+    w->next_ix_fd = -1;
+  }
+  if (w->fd >= 0) {
+    nfm_pcapw_file_t file = { w->fd, w->ix_fd, w->file_seq, w->file_written };
+    int r = nfm_pcapw_finish_file(w, &file, 0);
+    if (r != 0 && !w->failed) {
+      w->error = r;
+      w->failed = 1;
+    }
+  }
+  nfm_pcapw_reap_hooks(w, 0);
+  w->fd = -1;
+  w->ix_fd = -1;
+  return w->failed ? -1 : 0;
+}
+
+static inline void nfm_pcapw_report(const nfm_pcapw_t* w, FILE* f)
+{
+  uint64_t writes = w->writes ? w->writes : 1;
+  fprintf(f, "PCAP writer: %llu packets (%llu bytes) recorded, %llu packets (%llu bytes) dropped, %llu blocks discarded\n",
+          (unsigned long long)w->packets, (unsigned long long)w->bytes,
+          (unsigned long long)w->drop_pkts, (unsigned long long)w->drop_bytes, (unsigned long long)w->discarded);
+  fprintf(f, "PCAP writer: %llu bytes in %llu writes, mean %llu us, max %llu us, up to %u of %u blocks queued%s%s\n",
+          (unsigned long long)w->written, (unsigned long long)w->writes,
+          (unsigned long long)(w->write_ns/writes/1000), (unsigned long long)(w->max_write_ns/1000),
+          w->max_queued, w->num_blocks, w->failed?", write failed: ":"", w->failed?strerror(w->error):"");
+  if (w->rotating || w->file_errors)
+    fprintf(f, "PCAP writer: %llu files, %llu opened late, %llu deleted, %llu post-rotate commands (%llu failed), %llu file errors\n",
+            (unsigned long long)w->files, (unsigned long long)w->late_opens, (unsigned long long)w->deleted,
+            (unsigned long long)w->hooks_run, (unsigned long long)w->hook_failures, (unsigned long long)w->file_errors);
+  if (w->indexing)
+    fprintf(f, "PCAP writer: %llu index chunks written, %llu index write errors\n",
+            (unsigned long long)w->idx.chunks, (unsigned long long)w->idx.errors);
+}
+
+static inline void nfm_pcapw_free(nfm_pcapw_t* w)
+{
+  unsigned int i;
+  if (w->blocks) {
+    for (i = 0; i < w->num_blocks; i++) {
+      free(w->blocks[i].buf);
+      free(w->blocks[i].ix);
+    }
+  }
+  free(w->blocks);
+  free(w->carry);
+  w->blocks = NULL;
+  w->carry = NULL;
+  nfm_pcapidx_free(&w->idx);
+}
+
+#endif
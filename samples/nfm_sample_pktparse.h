@@ -0,0 +1,199 @@
+/**
+ * Copyright (C) 2013 Netronome Systems, Inc.  All rights reserved.
+ *
+ * File:        nfm_sample_pktparse.h
+ * Description: Minimal L2-L4 header walk for the packet samples: up to two
+ *              VLAN tags, IPv4 or IPv6 (with its extension headers), and
+ *              the TCP, UDP, SCTP, ICMP or GRE header after it. Finds the
+ *              header offsets and the end of the headers; it never reads
+ *              past 'len' and stops at whatever it does not understand.
+ */
+
+#ifndef NFM_SAMPLE_PKTPARSE_H
+#define NFM_SAMPLE_PKTPARSE_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define NFM_PKT_MAX_VLANS     2
+#define NFM_PKT_MAX_EXT_HDRS  8
+
+typedef struct {
+  uint16_t ethertype;      // after any VLAN tags
+  uint16_t vlan_id;        // outer tag, if vlans
+  uint8_t vlans;
+  uint8_t ip_version;      // 4, 6 or 0 if not IP
+  uint8_t proto;           // IP protocol after any IPv6 extension headers
+  uint8_t frag;            // a fragment other than the first: no L4 header
+  uint8_t fragment;        // any fragment of a datagram, the first included
+  uint32_t frag_id;        // IP identification, if fragment
+  uint16_t l3_off;
+  uint16_t l4_off;         // 0 if there is no complete IP header
+  uint16_t end;            // end of the last header understood
+  uint8_t has_ports;       // TCP, UDP or SCTP ports at l4_off
+} nfm_pkt_t;
+
+static inline uint16_t nfm_pkt_be16(const unsigned char* p)
+{
+  return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static inline uint32_t nfm_pkt_be32(const unsigned char* p)
+{
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline void nfm_pkt_parse_l4(nfm_pkt_t* p, const unsigned char* d, uint32_t len, uint32_t off)
+{
+  uint32_t hlen;
+  p->l4_off = (uint16_t)off;
+  p->end = (uint16_t)off;
+  if (p->frag)
+    return;
+  switch (p->proto) {
+  case 6:    // TCP
+    if (off + 20 > len)
+      return;
+    hlen = (uint32_t)(d[off+12] >> 4) * 4;
+    if (hlen < 20)
+      return;
+    break;
+  case 17:   // UDP
+  case 136:  // UDP-Lite
+    hlen = 8;
+    break;
+  case 132:  // SCTP common header
+    hlen = 12;
+    break;
+  case 1:    // ICMP
+  case 58:   // ICMPv6
+    hlen = 8;
+    break;
+  case 47:   // GRE base header
+    hlen = 4;
+    break;
+  default:
+    return;
+  }
+  p->has_ports = (p->proto == 6 || p->proto == 17 || p->proto == 136 || p->proto == 132) && off + 4 <= len;
+  p->end = (uint16_t)((off + hlen < len) ? off + hlen : len);
+}
+
+static inline void nfm_pkt_parse(nfm_pkt_t* p, const unsigned char* d, uint32_t len)
+{
+  uint32_t off = 14, hlen, n;
+  uint8_t nh;
+
+  memset(p, 0, sizeof(*p));
+  if (len > 0xffff)
+    len = 0xffff;
+  if (len < 14) {
+    p->end = (uint16_t)len;
+    return;
+  }
+  p->ethertype = nfm_pkt_be16(d+12);
+  while ((p->ethertype == 0x8100 || p->ethertype == 0x88a8 || p->ethertype == 0x9100) &&
+         p->vlans < NFM_PKT_MAX_VLANS && off + 4 <= len) {
+    if (p->vlans == 0)
+      p->vlan_id = nfm_pkt_be16(d+off) & 0xfff;
+    p->ethertype = nfm_pkt_be16(d+off+2);
+    p->vlans++;
+    off += 4;
+  }
+  p->l3_off = (uint16_t)off;
+  p->end = (uint16_t)off;
+
+  if (p->ethertype == 0x0800) {
+    if (off + 20 > len || (d[off] >> 4) != 4)
+      return;
+    hlen = (uint32_t)(d[off] & 0xf) * 4;
+    if (hlen < 20 || off + hlen > len)
+      return;
+    p->ip_version = 4;
+    p->proto = d[off+9];
+    p->frag = (nfm_pkt_be16(d+off+6) & 0x1fff) != 0;
+    p->fragment = (nfm_pkt_be16(d+off+6) & 0x3fff) != 0;
+    p->frag_id = nfm_pkt_be16(d+off+4);
+    p->end = (uint16_t)(off + hlen);
+    nfm_pkt_parse_l4(p, d, len, off + hlen);
+  } else if (p->ethertype == 0x86dd) {
+    if (off + 40 > len || (d[off] >> 4) != 6)
+      return;
+    p->ip_version = 6;
+    nh = d[off+6];
+    off += 40;
+    p->end = (uint16_t)off;
+    for (n = 0; n < NFM_PKT_MAX_EXT_HDRS && off + 8 <= len; n++) {
+      if (nh == 44) {            // fragment
+        p->frag = (nfm_pkt_be16(d+off+2) & 0xfff8) != 0;
+        p->fragment = (nfm_pkt_be16(d+off+2) & 0xfff9) != 0;   // not an atomic fragment
+        p->frag_id = nfm_pkt_be32(d+off+4);
+        hlen = 8;
+      } else if (nh == 51) {     // authentication header
+        hlen = ((uint32_t)d[off+1] + 2) * 4;
+      } else if (nh == 0 || nh == 43 || nh == 60) {
+        hlen = ((uint32_t)d[off+1] + 1) * 8;
+      } else {
+        break;
+      }
+      if (off + hlen > len)
+        return;
+      nh = d[off];
+      off += hlen;
+      p->end = (uint16_t)off;
+    }
+    p->proto = nh;
+    nfm_pkt_parse_l4(p, d, len, off);
+  } else if (p->ethertype == 0x0806) {
+    p->end = (uint16_t)((off + 28 < len) ? off + 28 : len);
+  }
+}
+
+static inline uint32_t nfm_pkt_mix32(uint32_t h)
+{
+  h ^= h >> 16;
+  h *= 0x85ebca6bU;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35U;
+  h ^= h >> 16;
+  return h;
+}
+
+// Hash of the addresses and protocol that is the same in both directions.
+// Every packet of a flow has it, fragments included. Packets that are not
+// IP hash on their ethertype.
+static inline uint32_t nfm_pkt_addr_sum(const nfm_pkt_t* p, const unsigned char* d)
+{
+  const unsigned char* ip = d + p->l3_off;
+  uint32_t h = 0, i;
+  if (p->ip_version == 4) {
+    h = nfm_pkt_mix32(nfm_pkt_be32(ip+12)) + nfm_pkt_mix32(nfm_pkt_be32(ip+16));
+  } else {
+    for (i = 0; i < 16; i += 4)
+      h += nfm_pkt_mix32(nfm_pkt_be32(ip+8+i) ^ i) + nfm_pkt_mix32(nfm_pkt_be32(ip+24+i) ^ i);
+  }
+  return h;
+}
+
+static inline uint32_t nfm_pkt_addr_hash(const nfm_pkt_t* p, const unsigned char* d)
+{
+  if (p->l4_off == 0)
+    return nfm_pkt_mix32(p->ethertype);
+  return nfm_pkt_mix32(nfm_pkt_addr_sum(p, d) ^ p->proto);
+}
+
+// Hash of the 5-tuple that is the same in both directions of a flow.
+// Without ports (fragments after the first, or other protocols) it is
+// nfm_pkt_addr_hash.
+static inline uint32_t nfm_pkt_flow_hash(const nfm_pkt_t* p, const unsigned char* d)
+{
+  uint32_t h;
+  if (p->l4_off == 0)
+    return nfm_pkt_mix32(p->ethertype);
+  h = nfm_pkt_addr_sum(p, d);
+  if (p->has_ports)
+    h += nfm_pkt_mix32(0x10000U | nfm_pkt_be16(d+p->l4_off)) + nfm_pkt_mix32(0x10000U | nfm_pkt_be16(d+p->l4_off+2));
+  return nfm_pkt_mix32(h ^ p->proto);
+}
+
+#endif
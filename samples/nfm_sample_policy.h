@@ -0,0 +1,654 @@
+/**
+ * Copyright (C) 2013 Netronome Systems, Inc.  All rights reserved.
+ *
+ * File:        nfm_sample_policy.h
+ * Description: Per-flow policy for the start of flow callback. A policy
+ *              file of first-match rules is compiled into a bit vector
+ *              classifier: a binary trie per address field and family,
+ *              elementary interval tables for the L4 ports, and lookup
+ *              tables for protocol and address space, each leading to a
+ *              bitmap of the rules that match on that field. A lookup ANDs
+ *              the six bitmaps; the lowest set bit is the winning rule.
+ *
+ *              The file is recompiled on SIGHUP or when it changes, on a
+ *              watcher thread. The new policy replaces the old one with a
+ *              pointer swap; the old one is freed once the (single) lookup
+ *              thread is seen outside a lookup.
+ *
+ *              Rule syntax, one per line, all fields optional:
+ *                src=PREFIX dst=PREFIX proto=tcp|udp|icmp|N sport=N[-M]
+ *                dport=N[-M] as=N context=N eof=0|1
+ */
+
+#ifndef NFM_SAMPLE_POLICY_H
+#define NFM_SAMPLE_POLICY_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include "ns_packet.h"
+
+#define NFM_POLICY_MAX_RULES  4096
+#define NFM_POLICY_WATCH_MS   1000  // how often the watcher checks the file
+
+typedef struct {
+  uint32_t context;
+  uint8_t set_context;
+  uint8_t set_eof;
+  uint8_t eof;
+} nfm_policy_action_t;
+
+typedef struct {
+  int af[2];               // per address field: 0 any, AF_INET or AF_INET6
+  uint8_t addr[2][16];
+  unsigned int len[2];
+  uint16_t port_lo[2];
+  uint16_t port_hi[2];
+  int proto;               // -1 any
+  int as;                  // -1 any
+  nfm_policy_action_t action;
+} nfm_policy_rule_t;
+
+typedef struct {
+  int32_t child[2];
+  uint32_t bm;             // bitmap of rules matching every address below
+} nfm_policy_node_t;
+
+typedef struct {
+  unsigned int num_intervals;
+  uint16_t* start;         // sorted interval starts, start[0] == 0
+  uint32_t* bm;
+} nfm_policy_ports_t;
+
+typedef struct {
+  unsigned int num_rules;
+  unsigned int words;      // 64 bit words per bitmap
+  nfm_policy_action_t* actions;
+  uint64_t* bitmaps;
+  unsigned int num_bitmaps;
+  unsigned int cap_bitmaps;
+  nfm_policy_node_t* nodes;
+  unsigned int num_nodes;
+  unsigned int cap_nodes;
+  int32_t root[2][2];      // [src/dst][IPv4/IPv6]
+  nfm_policy_ports_t ports[2];
+  uint32_t proto_bm[256];
+  unsigned int num_as;
+  uint16_t* as_vals;       // sorted
+  uint32_t* as_bm;
+  uint32_t as_other_bm;
+} nfm_policy_t;
+
+typedef struct {
+  nfm_policy_t* volatile cur;
+  volatile uint32_t reader_seq;  // odd while the lookup thread is inside
+  const char* path;
+  time_t mtime;
+  volatile sig_atomic_t reload_requested;
+  pthread_t thread;
+  volatile int running;
+  uint64_t reloads;
+  uint64_t reload_errors;
+} nfm_policy_ref_t;
+
+static inline void nfm_policy_free(nfm_policy_t* p)
+{
+  unsigned int i;
+  if (!p)
+    return;
+  free(p->actions);
+  free(p->bitmaps);
+  free(p->nodes);
+  for (i = 0; i < 2; i++) {
+    free(p->ports[i].start);
+    free(p->ports[i].bm);
+  }
+  free(p->as_vals);
+  free(p->as_bm);
+  free(p);
+}
+
+static inline uint64_t* nfm_policy_bm(const nfm_policy_t* p, uint32_t bm)
+{
+  return &p->bitmaps[(size_t)bm*p->words];
+}
+
+// New all-zero bitmap; returns its index or (uint32_t)-1
+static inline uint32_t nfm_policy_new_bm(nfm_policy_t* p)
+{
+  if (p->num_bitmaps == p->cap_bitmaps) {
+    unsigned int cap = p->cap_bitmaps?2*p->cap_bitmaps:64;
+    uint64_t* b = (uint64_t*)realloc(p->bitmaps, (size_t)cap*p->words*sizeof(uint64_t));
+    if (!b)
+      return (uint32_t)-1;
+    p->bitmaps = b;
+    p->cap_bitmaps = cap;
+  }
+  memset(nfm_policy_bm(p, p->num_bitmaps), 0, p->words*sizeof(uint64_t));
+  return p->num_bitmaps++;
+}
+
+static inline void nfm_policy_set(nfm_policy_t* p, uint32_t bm, unsigned int rule)
+{
+  nfm_policy_bm(p, bm)[rule/64] |= 1ULL << (rule%64);
+}
+
+static inline int32_t nfm_policy_new_node(nfm_policy_t* p)
+{
+  if (p->num_nodes == p->cap_nodes) {
+    unsigned int cap = p->cap_nodes?2*p->cap_nodes:256;
+    nfm_policy_node_t* n = (nfm_policy_node_t*)realloc(p->nodes, cap*sizeof(nfm_policy_node_t));
+    if (!n)
+      return -1;
+    p->nodes = n;
+    p->cap_nodes = cap;
+  }
+  p->nodes[p->num_nodes].child[0] = p->nodes[p->num_nodes].child[1] = -1;
+  p->nodes[p->num_nodes].bm = (uint32_t)-1;
+  return (int32_t)p->num_nodes++;
+}
+
+static inline int nfm_policy_bit(const uint8_t* addr, unsigned int i)
+{
+  return (addr[i/8] >> (7-i%8)) & 1;
+}
+
+// Fill in node bitmaps top down: a node matches what its parent matches
+// plus the rules whose prefix ends at it. Nodes with no rules of their own
+// share the parent's bitmap.
+static inline int nfm_policy_fill(nfm_policy_t* p, int32_t n, uint32_t parent_bm)
+{
+  uint32_t own = p->nodes[n].bm;
+  unsigned int c, w;
+  if (own == (uint32_t)-1) {
+    p->nodes[n].bm = parent_bm;
+  } else {
+    for (w = 0; w < p->words; w++)
+      nfm_policy_bm(p, own)[w] |= nfm_policy_bm(p, parent_bm)[w];
+  }
+  for (c = 0; c < 2; c++) {
+    if (p->nodes[n].child[c] >= 0 && nfm_policy_fill(p, p->nodes[n].child[c], p->nodes[n].bm) != 0)
+      return -1;
+  }
+  return 0;
+}
+
+static inline int nfm_policy_build_trie(nfm_policy_t* p, const nfm_policy_rule_t* rules, unsigned int field, unsigned int fam)
+{
+  int af = fam?AF_INET6:AF_INET;
+  uint32_t any = nfm_policy_new_bm(p);
+  int32_t root = nfm_policy_new_node(p);
+  unsigned int r, i;
+  if (any == (uint32_t)-1 || root < 0)
+    return -1;
+  p->root[field][fam] = root;
+  for (r = 0; r < p->num_rules; r++) {
+    int32_t n = root;
+    if (rules[r].af[field] == 0) {
+      nfm_policy_set(p, any, r);
+      continue;
+    }
+    if (rules[r].af[field] != af)
+      continue;
+    for (i = 0; i < rules[r].len[field]; i++) {
+      int b = nfm_policy_bit(rules[r].addr[field], i);
+      if (p->nodes[n].child[b] < 0) {
+        int32_t c = nfm_policy_new_node(p);
+        if (c < 0)
+          return -1;
+        p->nodes[n].child[b] = c;
+      }
+      n = p->nodes[n].child[b];
+    }
+    if (p->nodes[n].bm == (uint32_t)-1 && (p->nodes[n].bm = nfm_policy_new_bm(p)) == (uint32_t)-1)
+      return -1;
+    nfm_policy_set(p, p->nodes[n].bm, r);
+  }
+  // The root bitmap is the wildcard rules (plus any /0 rules)
+  if (p->nodes[root].bm == (uint32_t)-1)
+    p->nodes[root].bm = any;
+  else
+    for (i = 0; i < p->words; i++)
+      nfm_policy_bm(p, p->nodes[root].bm)[i] |= nfm_policy_bm(p, any)[i];
+  for (i = 0; i < 2; i++) {
+    if (p->nodes[root].child[i] >= 0 && nfm_policy_fill(p, p->nodes[root].child[i], p->nodes[root].bm) != 0)
+      return -1;
+  }
+  return 0;
+}
+
+static int nfm_policy_cmp_u16(const void* a, const void* b)
+{
+  return (int)*(const uint16_t*)a - (int)*(const uint16_t*)b;
+}
+
+static inline int nfm_policy_build_ports(nfm_policy_t* p, const nfm_policy_rule_t* rules, unsigned int field)
+{
+  nfm_policy_ports_t* pt = &p->ports[field];
+  unsigned int r, i, n = 1;
+  uint16_t* b = (uint16_t*)malloc((2*p->num_rules+1)*sizeof(uint16_t));
+  if (!b)
+    return -1;
+  b[0] = 0;
+  for (r = 0; r < p->num_rules; r++) {
+    b[n++] = rules[r].port_lo[field];
+    if (rules[r].port_hi[field] < 65535)
+      b[n++] = rules[r].port_hi[field]+1;
+  }
+  qsort(b, n, sizeof(uint16_t), nfm_policy_cmp_u16);
+  for (i = 1, pt->num_intervals = 1; i < n; i++) {
+    if (b[i] != b[pt->num_intervals-1])
+      b[pt->num_intervals++] = b[i];
+  }
+  pt->start = b;
+  pt->bm = (uint32_t*)malloc(pt->num_intervals*sizeof(uint32_t));
+  if (!pt->bm)
+    return -1;
+  for (i = 0; i < pt->num_intervals; i++) {
+    if ((pt->bm[i] = nfm_policy_new_bm(p)) == (uint32_t)-1)
+      return -1;
+    for (r = 0; r < p->num_rules; r++) {
+      if (rules[r].port_lo[field] <= b[i] && b[i] <= rules[r].port_hi[field])
+        nfm_policy_set(p, pt->bm[i], r);
+    }
+  }
+  return 0;
+}
+
+static inline int nfm_policy_build_tables(nfm_policy_t* p, const nfm_policy_rule_t* rules)
+{
+  uint32_t any_proto, any_as;
+  unsigned int r, i;
+  // Protocols: one bitmap per protocol named in a rule, the rest share one
+  if ((any_proto = nfm_policy_new_bm(p)) == (uint32_t)-1)
+    return -1;
+  for (r = 0; r < p->num_rules; r++) {
+    if (rules[r].proto < 0)
+      nfm_policy_set(p, any_proto, r);
+  }
+  for (i = 0; i < 256; i++)
+    p->proto_bm[i] = any_proto;
+  for (r = 0; r < p->num_rules; r++) {
+    int proto = rules[r].proto;
+    if (proto < 0 || p->proto_bm[proto] != any_proto)
+      continue;
+    if ((p->proto_bm[proto] = nfm_policy_new_bm(p)) == (uint32_t)-1)
+      return -1;
+    memcpy(nfm_policy_bm(p, p->proto_bm[proto]), nfm_policy_bm(p, any_proto), p->words*sizeof(uint64_t));
+    for (i = 0; i < p->num_rules; i++) {
+      if (rules[i].proto == proto)
+        nfm_policy_set(p, p->proto_bm[proto], i);
+    }
+  }
+  // Address spaces: sorted list of those named, the rest share one bitmap
+  if ((any_as = nfm_policy_new_bm(p)) == (uint32_t)-1)
+    return -1;
+  p->as_other_bm = any_as;
+  p->as_vals = (uint16_t*)malloc((p->num_rules+1)*sizeof(uint16_t));
+  p->as_bm = (uint32_t*)malloc((p->num_rules+1)*sizeof(uint32_t));
+  if (!p->as_vals || !p->as_bm)
+    return -1;
+  for (r = 0; r < p->num_rules; r++) {
+    if (rules[r].as < 0)
+      nfm_policy_set(p, any_as, r);
+    else
+      p->as_vals[p->num_as++] = (uint16_t)rules[r].as;
+  }
+  qsort(p->as_vals, p->num_as, sizeof(uint16_t), nfm_policy_cmp_u16);
+  for (i = 0, r = 0; i < p->num_as; i++) {
+    if (r == 0 || p->as_vals[i] != p->as_vals[r-1])
+      p->as_vals[r++] = p->as_vals[i];
+  }
+  p->num_as = r;
+  for (i = 0; i < p->num_as; i++) {
+    if ((p->as_bm[i] = nfm_policy_new_bm(p)) == (uint32_t)-1)
+      return -1;
+    for (r = 0; r < p->num_rules; r++) {
+      if (rules[r].as < 0 || rules[r].as == p->as_vals[i])
+        nfm_policy_set(p, p->as_bm[i], r);
+    }
+  }
+  return 0;
+}
+
+static inline int nfm_policy_parse_prefix(const char* s, nfm_policy_rule_t* rule, unsigned int field)
+{
+  char buf[64];
+  const char* slash = strchr(s, '/');
+  size_t n = slash?(size_t)(slash-s):strlen(s);
+  unsigned long len;
+  char* end;
+  if (n >= sizeof(buf))
+    return -1;
+  memcpy(buf, s, n);
+  buf[n] = 0;
+  if (inet_pton(AF_INET, buf, rule->addr[field]) == 1) {
+    rule->af[field] = AF_INET;
+    rule->len[field] = 32;
+  } else if (inet_pton(AF_INET6, buf, rule->addr[field]) == 1) {
+    rule->af[field] = AF_INET6;
+    rule->len[field] = 128;
+  } else {
+    return -1;
+  }
+  if (slash) {
+    len = strtoul(slash+1, &end, 10);
+    if (*end || end == slash+1 || len > rule->len[field])
+      return -1;
+    rule->len[field] = (unsigned int)len;
+  }
+  return 0;
+}
+
+static inline int nfm_policy_parse_range(const char* s, uint16_t* lo, uint16_t* hi)
+{
+  char* end;
+  unsigned long a = strtoul(s, &end, 0), b = a;
+  if (end == s)
+    return -1;
+  if (*end == '-')
+    b = strtoul(end+1, &end, 0);
+  if (*end || a > b || b > 65535)
+    return -1;
+  *lo = (uint16_t)a;
+  *hi = (uint16_t)b;
+  return 0;
+}
+
+static inline int nfm_policy_parse_line(char* line, nfm_policy_rule_t* rule)
+{
+  char* save = NULL;
+  char* tok;
+  memset(rule, 0, sizeof(*rule));
+  rule->port_hi[0] = rule->port_hi[1] = 65535;
+  rule->proto = -1;
+  rule->as = -1;
+  for (tok = strtok_r(line, " \t\r\n", &save); tok; tok = strtok_r(NULL, " \t\r\n", &save)) {
+    char* val = strchr(tok, '=');
+    char* end;
+    if (!val)
+      return -1;
+    *val++ = 0;
+    if (strcmp(tok, "src") == 0 || strcmp(tok, "dst") == 0) {
+      if (nfm_policy_parse_prefix(val, rule, tok[0] == 'd') != 0)
+        return -1;
+    } else if (strcmp(tok, "sport") == 0 || strcmp(tok, "dport") == 0) {
+      unsigned int f = tok[0] == 'd';
+      if (nfm_policy_parse_range(val, &rule->port_lo[f], &rule->port_hi[f]) != 0)
+        return -1;
+    } else if (strcmp(tok, "proto") == 0) {
+      if (strcmp(val, "tcp") == 0)
+        rule->proto = IPPROTO_TCP;
+      else if (strcmp(val, "udp") == 0)
+        rule->proto = IPPROTO_UDP;
+      else if (strcmp(val, "icmp") == 0)
+        rule->proto = IPPROTO_ICMP;
+      else if ((rule->proto = (int)strtoul(val, &end, 0)) > 255 || *end || end == val)
+        return -1;
+    } else if (strcmp(tok, "as") == 0) {
+      if ((rule->as = (int)strtoul(val, &end, 0)) > 65535 || *end || end == val)
+        return -1;
+    } else if (strcmp(tok, "context") == 0) {
+      rule->action.context = (uint32_t)strtoul(val, &end, 0);
+      if (*end || end == val)
+        return -1;
+      rule->action.set_context = 1;
+    } else if (strcmp(tok, "eof") == 0) {
+      if (strcmp(val, "0") != 0 && strcmp(val, "1") != 0)
+        return -1;
+      rule->action.eof = (uint8_t)(val[0] == '1');
+      rule->action.set_eof = 1;
+    } else {
+      return -1;
+    }
+  }
+  // Both addresses, if given, must be of the same family
+  if (rule->af[0] && rule->af[1] && rule->af[0] != rule->af[1])
+    return -1;
+  return 0;
+}
+
+// Compile 'path'; returns NULL (and reports why on stderr) on failure
+static inline nfm_policy_t* nfm_policy_compile(const char* path)
+{
+  nfm_policy_rule_t* rules;
+  nfm_policy_t* p;
+  char line[1024];
+  unsigned int lineno = 0, r, f;
+  FILE* fp = fopen(path, "r");
+  if (!fp) {
+    fprintf(stderr, "Policy: cannot open %s\n", path);
+    return NULL;
+  }
+  p = (nfm_policy_t*)calloc(1, sizeof(*p));
+  rules = (nfm_policy_rule_t*)malloc(NFM_POLICY_MAX_RULES*sizeof(*rules));
+  if (!p || !rules)
+    goto fail;
+  while (fgets(line, sizeof(line), fp)) {
+    char* s = line;
+    lineno++;
+    while (*s == ' ' || *s == '\t')
+      s++;
+    if (*s == '#' || *s == '\n' || *s == '\r' || *s == 0)
+      continue;
+    if (p->num_rules == NFM_POLICY_MAX_RULES) {
+      fprintf(stderr, "Policy: %s:%u: more than %u rules\n", path, lineno, NFM_POLICY_MAX_RULES);
+      goto fail;
+    }
+    if (nfm_policy_parse_line(s, &rules[p->num_rules]) != 0) {
+      fprintf(stderr, "Policy: %s:%u: cannot parse rule\n", path, lineno);
+      goto fail;
+    }
+    p->num_rules++;
+  }
+  fclose(fp);
+  fp = NULL;
+
+  p->words = (p->num_rules+63)/64;
+  if (p->words == 0)
+    p->words = 1;
+  p->actions = (nfm_policy_action_t*)malloc((p->num_rules+1)*sizeof(nfm_policy_action_t));
+  if (!p->actions)
+    goto fail;
+  for (r = 0; r < p->num_rules; r++)
+    p->actions[r] = rules[r].action;
+  for (f = 0; f < 2; f++) {
+    if (nfm_policy_build_trie(p, rules, f, 0) != 0 || nfm_policy_build_trie(p, rules, f, 1) != 0 ||
+        nfm_policy_build_ports(p, rules, f) != 0)
+      goto fail;
+  }
+  if (nfm_policy_build_tables(p, rules) != 0)
+    goto fail;
+  free(rules);
+  return p;
+
+fail:
+  if (fp)
+    fclose(fp);
+  free(rules);
+  nfm_policy_free(p);
+  return NULL;
+}
+
+static inline uint32_t nfm_policy_trie_lookup(const nfm_policy_t* p, int32_t n, const uint8_t* addr, unsigned int bits)
+{
+  uint32_t bm = p->nodes[n].bm;
+  unsigned int i;
+  for (i = 0; i < bits; i++) {
+    n = p->nodes[n].child[nfm_policy_bit(addr, i)];
+    if (n < 0)
+      break;
+    bm = p->nodes[n].bm;
+  }
+  return bm;
+}
+
+static inline uint32_t nfm_policy_port_lookup(const nfm_policy_ports_t* pt, uint16_t port)
+{
+  unsigned int lo = 0, hi = pt->num_intervals;
+  while (hi - lo > 1) {
+    unsigned int mid = (lo+hi)/2;
+    if (pt->start[mid] <= port)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return pt->bm[lo];
+}
+
+static inline uint32_t nfm_policy_as_lookup(const nfm_policy_t* p, uint16_t as)
+{
+  unsigned int lo = 0, hi = p->num_as;
+  while (lo < hi) {
+    unsigned int mid = (lo+hi)/2;
+    if (p->as_vals[mid] < as)
+      lo = mid+1;
+    else
+      hi = mid;
+  }
+  return (lo < p->num_as && p->as_vals[lo] == as)?p->as_bm[lo]:p->as_other_bm;
+}
+
+// First matching rule for a flow (ports in host byte order), or -1
+static inline int nfm_policy_classify(const nfm_policy_t* p, unsigned int v6, const uint8_t* src, const uint8_t* dst,
+                                      uint8_t proto, uint16_t sport, uint16_t dport, uint16_t as)
+{
+  const uint64_t *a, *b, *c, *d, *e, *f;
+  unsigned int w, bits = v6?128:32;
+  a = nfm_policy_bm(p, nfm_policy_trie_lookup(p, p->root[0][v6], src, bits));
+  b = nfm_policy_bm(p, nfm_policy_trie_lookup(p, p->root[1][v6], dst, bits));
+  c = nfm_policy_bm(p, nfm_policy_port_lookup(&p->ports[0], sport));
+  d = nfm_policy_bm(p, nfm_policy_port_lookup(&p->ports[1], dport));
+  e = nfm_policy_bm(p, p->proto_bm[proto]);
+  f = nfm_policy_bm(p, nfm_policy_as_lookup(p, as));
+  for (w = 0; w < p->words; w++) {
+    uint64_t m = a[w] & b[w] & c[w] & d[w] & e[w] & f[w];
+    if (m) {
+      int r = (int)(w*64 + __builtin_ctzll(m));
+      return (r < (int)p->num_rules)?r:-1;
+    }
+  }
+  return -1;
+}
+
+// Lookup thread: classify a start of flow against the current policy and
+// copy out the action. Returns the matching rule or -1.
+static inline int nfm_policy_match(nfm_policy_ref_t* ref, const ns_packet_flow_start_stats_t* s, nfm_policy_action_t* action)
+{
+  const nfm_policy_t* p;
+  int r = -1;
+  __atomic_add_fetch(&ref->reader_seq, 1, __ATOMIC_SEQ_CST);
+  p = __atomic_load_n(&ref->cur, __ATOMIC_SEQ_CST);
+  if (p) {
+    if (s->flow_type == 0)
+      r = nfm_policy_classify(p, 0, (const uint8_t*)&s->IPv4.src, (const uint8_t*)&s->IPv4.dst, s->IPv4.protocol,
+                              ntohs(s->IPv4.L4_srcport), ntohs(s->IPv4.L4_dstport), s->IPv4.addr_space_id);
+    else
+      r = nfm_policy_classify(p, 1, s->IPv6.src, s->IPv6.dst, s->IPv6.protocol,
+                              ntohs(s->IPv6.L4_srcport), ntohs(s->IPv6.L4_dstport), s->IPv6.addr_space_id);
+    if (r >= 0)
+      *action = p->actions[r];
+  }
+  __atomic_add_fetch(&ref->reader_seq, 1, __ATOMIC_RELEASE);
+  return r;
+}
+
+// Install 'p' and free the policy it replaces once no lookup can be using it
+static inline void nfm_policy_install(nfm_policy_ref_t* ref, nfm_policy_t* p)
+{
+  struct timespec pause = { 0, 10000 };
+  nfm_policy_t* old = __atomic_exchange_n(&ref->cur, p, __ATOMIC_SEQ_CST);
+  uint32_t seq = __atomic_load_n(&ref->reader_seq, __ATOMIC_SEQ_CST);
+  if (seq & 1) {
+    while (__atomic_load_n(&ref->reader_seq, __ATOMIC_ACQUIRE) == seq)
+      nanosleep(&pause, NULL);
+  }
+  nfm_policy_free(old);
+}
+
+// Async-signal-safe: call from the SIGHUP handler
+static inline void nfm_policy_request_reload(nfm_policy_ref_t* ref)
+{
+  ref->reload_requested = 1;
+}
+
+static inline int nfm_policy_load(nfm_policy_ref_t* ref)
+{
+  struct stat st;
+  nfm_policy_t* p;
+  if (stat(ref->path, &st) == 0)
+    ref->mtime = st.st_mtime;
+  p = nfm_policy_compile(ref->path);
+  if (!p) {
+    ref->reload_errors++;
+    return -1;
+  }
+  nfm_policy_install(ref, p);
+  ref->reloads++;
+  return 0;
+}
+
+static void* nfm_policy_watcher(void* arg)
+{
+  nfm_policy_ref_t* ref = (nfm_policy_ref_t*)arg;
+  struct timespec tick = { 0, 100*1000000L };
+  unsigned int ticks = 0;
+  sigset_t sigs;
+
+  sigfillset(&sigs);
+  pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+  while (ref->running) {
+    struct stat st;
+    int reload = 0;
+    nanosleep(&tick, NULL);
+    if (ref->reload_requested) {
+      ref->reload_requested = 0;
+      reload = 1;
+    } else if (++ticks*100 >= NFM_POLICY_WATCH_MS) {
+      ticks = 0;
+      reload = stat(ref->path, &st) == 0 && st.st_mtime != ref->mtime;
+    }
+    if (reload) {
+      if (nfm_policy_load(ref) == 0)
+        fprintf(stderr, "Policy: loaded %u rules from %s\n", ref->cur->num_rules, ref->path);
+      else
+        fprintf(stderr, "Policy: keeping the previous policy\n");
+    }
+  }
+  return NULL;
+}
+
+// Compile 'path' now and start watching it for changes
+static inline int nfm_policy_start(nfm_policy_ref_t* ref, const char* path)
+{
+  memset(ref, 0, sizeof(*ref));
+  ref->path = path;
+  if (nfm_policy_load(ref) != 0)
+    return -1;
+  ref->running = 1;
+  if (pthread_create(&ref->thread, NULL, nfm_policy_watcher, ref) != 0) {
+    ref->running = 0;
+    return -1;
+  }
+  return 0;
+}
+
+static inline void nfm_policy_stop(nfm_policy_ref_t* ref)
+{
+  if (ref->running) {
+    ref->running = 0;
+    pthread_join(ref->thread, NULL);
+  }
+  // Lookups may still be running in callbacks: retire it like a reload
+  nfm_policy_install(ref, NULL);
+}
+
+#endif
@@ -0,0 +1,158 @@
+/**
+ * Copyright (C) 2013 Netronome Systems, Inc.  All rights reserved.
+ *
+ * File:        nfm_sample_rxsched.h
+ * Description: Hybrid busy-poll/sleep receive scheduler for the packet
+ *              samples. A receive thread polls without blocking and, as
+ *              consecutive polls come back empty, steps down from busy
+ *              polling to polling with a CPU pause, then with sched_yield,
+ *              then with a timed sleep between polls. Any packet brings it
+ *              straight back to busy polling.
+ *
+ *              Time spent in each state is accounted on state changes only,
+ *              so a thread that stays busy under load reads no clocks.
+ */
+
+#ifndef NFM_SAMPLE_RXSCHED_H
+#define NFM_SAMPLE_RXSCHED_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+
+enum {
+  NFM_RXSCHED_BUSY,
+  NFM_RXSCHED_PAUSE,
+  NFM_RXSCHED_YIELD,
+  NFM_RXSCHED_WAIT,
+  NFM_RXSCHED_STATES
+};
+
+static const char* const nfm_rxsched_names[NFM_RXSCHED_STATES] = { "busy", "pause", "yield", "wait" };
+
+// Empty polls spent in each state before stepping down, and the sleep used
+// in the final state
+typedef struct {
+  unsigned int busy_polls;
+  unsigned int pause_polls;
+  unsigned int yield_polls;
+  unsigned int wait_us;
+} nfm_rxsched_cfg_t;
+
+#define NFM_RXSCHED_DEFAULT_CFG { 2000, 2000, 200, 50 }
+
+// One per receive thread, written only by that thread
+typedef struct {
+  unsigned int state;
+  unsigned int empty;
+  uint64_t since_ns;
+  uint64_t ns[NFM_RXSCHED_STATES];
+} __attribute__((aligned(64))) nfm_rxsched_t;
+
+static inline uint64_t nfm_rxsched_now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static inline void nfm_rxsched_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#else
+  __asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+// Parse "busy:pause:yield[:wait_us]"; returns 0 on success
+static inline int nfm_rxsched_parse(nfm_rxsched_cfg_t* cfg, const char* spec)
+{
+  char* end;
+  cfg->busy_polls = (unsigned int)strtoul(spec, &end, 0);
+  if (*end != ':')
+    return -1;
+  cfg->pause_polls = (unsigned int)strtoul(end+1, &end, 0);
+  if (*end != ':')
+    return -1;
+  cfg->yield_polls = (unsigned int)strtoul(end+1, &end, 0);
+  if (*end == ':')
+    cfg->wait_us = (unsigned int)strtoul(end+1, &end, 0);
+  if (*end != 0 || cfg->wait_us == 0)
+    return -1;
+  return 0;
+}
+
+static inline void nfm_rxsched_init(nfm_rxsched_t* s)
+{
+  memset(s, 0, sizeof(*s));
+  s->state = NFM_RXSCHED_BUSY;
+  s->since_ns = nfm_rxsched_now_ns();
+}
+
+static inline void nfm_rxsched_enter(nfm_rxsched_t* s, unsigned int state)
+{
+  uint64_t now = nfm_rxsched_now_ns();
+  __atomic_store_n(&s->ns[s->state], s->ns[s->state] + (now - s->since_ns), __ATOMIC_RELAXED);
+  s->since_ns = now;
+  s->state = state;
+}
+
+// A poll returned a packet
+static inline void nfm_rxsched_active(nfm_rxsched_t* s)
+{
+  s->empty = 0;
+  if (s->state != NFM_RXSCHED_BUSY)
+    nfm_rxsched_enter(s, NFM_RXSCHED_BUSY);
+}
+
+// A poll came back empty: back off according to the current state
+static inline void nfm_rxsched_idle(nfm_rxsched_t* s, const nfm_rxsched_cfg_t* cfg)
+{
+  s->empty++;
+  switch (s->state) {
+  case NFM_RXSCHED_BUSY:
+    if (s->empty >= cfg->busy_polls)
+      nfm_rxsched_enter(s, NFM_RXSCHED_PAUSE);
+    break;
+  case NFM_RXSCHED_PAUSE:
+    nfm_rxsched_cpu_relax();
+    if (s->empty >= cfg->busy_polls + cfg->pause_polls)
+      nfm_rxsched_enter(s, NFM_RXSCHED_YIELD);
+    break;
+  case NFM_RXSCHED_YIELD:
+    sched_yield();
+    if (s->empty >= cfg->busy_polls + cfg->pause_polls + cfg->yield_polls)
+      nfm_rxsched_enter(s, NFM_RXSCHED_WAIT);
+    break;
+  default:
+    {
+      struct timespec wait = { cfg->wait_us/1000000, (cfg->wait_us%1000000)*1000L };
+      nanosleep(&wait, NULL);
+    }
+    break;
+  }
+}
+
+// Print the time 's' spent in each state; safe from another thread, where
+// the figures are a close approximation
+static inline void nfm_rxsched_report(FILE* f, const char* prefix, const nfm_rxsched_t* s)
+{
+  uint64_t ns[NFM_RXSCHED_STATES];
+  uint64_t total = 0;
+  unsigned int i, state = s->state;
+  for (i = 0; i < NFM_RXSCHED_STATES; i++)
+    ns[i] = __atomic_load_n(&s->ns[i], __ATOMIC_RELAXED);
+  ns[state] += nfm_rxsched_now_ns() - s->since_ns;
+  for (i = 0; i < NFM_RXSCHED_STATES; i++)
+    total += ns[i];
+  fprintf(f, "%srx scheduler (now %s):", prefix, nfm_rxsched_names[state]);
+  for (i = 0; i < NFM_RXSCHED_STATES; i++)
+    fprintf(f, " %s %.3fs (%.1f%%)", nfm_rxsched_names[i], ns[i]/1e9, total ? ns[i]*100.0/total : 0.0);
+  fprintf(f, "\n");
+}
+
+#endif
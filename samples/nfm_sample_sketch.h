@@ -0,0 +1,447 @@
+/**
+ * Copyright (C) 2013 Netronome Systems, Inc.  All rights reserved.
+ *
+ * File:        nfm_sample_sketch.h
+ * Description: Fixed memory streaming analytics over completed flow
+ *              records: weighted Space-Saving top-K by bytes of flows and
+ *              of source/destination prefixes, and HyperLogLog counts of
+ *              distinct sources, destinations and destination ports per
+ *              address space. Runs as a flow table consumer; every record
+ *              costs a bounded amount of work whatever the flow count, and
+ *              results are printed and reset once per interval.
+ */
+
+#ifndef NFM_SAMPLE_SKETCH_H
+#define NFM_SAMPLE_SKETCH_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "nfm_sample_flowtab.h"
+
+#define NFM_SS_CAPACITY        1024  // counters per Space-Saving table
+#define NFM_SKETCH_DEFAULT_TOP 10
+#define NFM_SKETCH_MAX_TOP     100
+#define NFM_HLL_BITS           12    // 4096 registers, ~1.6% standard error
+#define NFM_HLL_REGS           (1U<<NFM_HLL_BITS)
+#define NFM_SKETCH_MAX_AS      64    // address spaces tracked individually
+#define NFM_SKETCH_V4_PREFIX   24
+#define NFM_SKETCH_V6_PREFIX   64
+
+// Flow or prefix key; unused bytes are zero so keys compare with memcmp
+typedef struct {
+  uint8_t flow_type;
+  uint8_t protocol;
+  uint8_t prefix_len;      // 0 for a flow key
+  uint8_t pad;
+  uint16_t addr_space_id;
+  uint16_t src_port;
+  uint16_t dst_port;
+  uint8_t src[16];
+  uint8_t dst[16];
+} nfm_sketch_key_t;
+
+typedef struct {
+  nfm_sketch_key_t key;
+  uint64_t count;
+  uint64_t err;            // overestimate bound inherited on eviction
+  uint32_t heap_pos;
+} nfm_ss_entry_t;
+
+// Weighted Space-Saving: the NFM_SS_CAPACITY heaviest candidates in a
+// min-heap on count, plus a linear probing index from key to entry. An
+// update is a hash lookup and one sift over a heap of fixed depth.
+typedef struct {
+  nfm_ss_entry_t entries[NFM_SS_CAPACITY];
+  uint32_t heap[NFM_SS_CAPACITY];
+  int32_t index[2*NFM_SS_CAPACITY];
+  uint32_t num;
+  uint64_t total;
+} nfm_ss_t;
+
+typedef struct {
+  uint8_t src[NFM_HLL_REGS];
+  uint8_t dst[NFM_HLL_REGS];
+  uint8_t port[NFM_HLL_REGS];
+  uint16_t addr_space_id;
+  uint64_t flows;
+} nfm_sketch_as_t;
+
+typedef struct {
+  unsigned int interval_s;
+  unsigned int top;
+  uint64_t start_ns;
+  unsigned int check;
+  uint64_t flows;
+  uint64_t bytes;
+  nfm_ss_t top_flows;
+  nfm_ss_t top_src;
+  nfm_ss_t top_dst;
+  // Address space to slot+1; slots run out into the last one ("other")
+  uint8_t as_slot[65536];
+  unsigned int num_as;
+  nfm_sketch_as_t as[NFM_SKETCH_MAX_AS];
+  FILE* out;
+} nfm_sketch_t;
+
+static inline uint64_t nfm_sketch_fmix64(uint64_t k)
+{
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return k;
+}
+
+static inline uint64_t nfm_sketch_hash(const void* data, size_t len, uint64_t seed)
+{
+  const uint8_t* p = (const uint8_t*)data;
+  uint64_t h = seed ^ (len*0x9e3779b97f4a7c15ULL), w;
+  while (len >= 8) {
+    memcpy(&w, p, 8);
+    h = (h ^ nfm_sketch_fmix64(w)) * 0x9e3779b97f4a7c15ULL;
+    p += 8;
+    len -= 8;
+  }
+  if (len) {
+    w = 0;
+    memcpy(&w, p, len);
+    h = (h ^ nfm_sketch_fmix64(w)) * 0x9e3779b97f4a7c15ULL;
+  }
+  return nfm_sketch_fmix64(h);
+}
+
+static inline void nfm_ss_reset(nfm_ss_t* ss)
+{
+  ss->num = 0;
+  ss->total = 0;
+  memset(ss->index, 0xff, sizeof(ss->index));
+}
+
+static inline void nfm_ss_swap(nfm_ss_t* ss, uint32_t a, uint32_t b)
+{
+  uint32_t t = ss->heap[a];
+  ss->heap[a] = ss->heap[b];
+  ss->heap[b] = t;
+  ss->entries[ss->heap[a]].heap_pos = a;
+  ss->entries[ss->heap[b]].heap_pos = b;
+}
+
+static inline void nfm_ss_sift_down(nfm_ss_t* ss, uint32_t i)
+{
+  for (;;) {
+    uint32_t l = 2*i+1, r = l+1, m = i;
+    if (l < ss->num && ss->entries[ss->heap[l]].count < ss->entries[ss->heap[m]].count)
+      m = l;
+    if (r < ss->num && ss->entries[ss->heap[r]].count < ss->entries[ss->heap[m]].count)
+      m = r;
+    if (m == i)
+      return;
+    nfm_ss_swap(ss, i, m);
+    i = m;
+  }
+}
+
+static inline void nfm_ss_sift_up(nfm_ss_t* ss, uint32_t i)
+{
+  while (i > 0 && ss->entries[ss->heap[(i-1)/2]].count > ss->entries[ss->heap[i]].count) {
+    nfm_ss_swap(ss, i, (i-1)/2);
+    i = (i-1)/2;
+  }
+}
+
+static inline uint32_t nfm_ss_slot(const nfm_sketch_key_t* key)
+{
+  return (uint32_t)nfm_sketch_hash(key, sizeof(*key), 0) & (2*NFM_SS_CAPACITY-1);
+}
+
+static inline void nfm_ss_index_remove(nfm_ss_t* ss, const nfm_sketch_key_t* key)
+{
+  const uint32_t mask = 2*NFM_SS_CAPACITY-1;
+  uint32_t hole = nfm_ss_slot(key), i;
+  while (memcmp(&ss->entries[ss->index[hole]].key, key, sizeof(*key)) != 0)
+    hole = (hole+1) & mask;
+  // Backward shift delete, as in the flow table
+  i = hole;
+  for (;;) {
+    uint32_t home;
+    i = (i+1) & mask;
+    if (ss->index[i] < 0)
+      break;
+    home = nfm_ss_slot(&ss->entries[ss->index[i]].key);
+    if (((i-home) & mask) >= ((i-hole) & mask)) {
+      ss->index[hole] = ss->index[i];
+      hole = i;
+    }
+  }
+  ss->index[hole] = -1;
+}
+
+static inline void nfm_ss_update(nfm_ss_t* ss, const nfm_sketch_key_t* key, uint64_t w)
+{
+  const uint32_t mask = 2*NFM_SS_CAPACITY-1;
+  uint32_t i = nfm_ss_slot(key), e;
+  ss->total += w;
+  while (ss->index[i] >= 0) {
+    nfm_ss_entry_t* en = &ss->entries[ss->index[i]];
+    if (memcmp(&en->key, key, sizeof(*key)) == 0) {
+      en->count += w;
+      nfm_ss_sift_down(ss, en->heap_pos);
+      return;
+    }
+    i = (i+1) & mask;
+  }
+  if (ss->num < NFM_SS_CAPACITY) {
+    e = ss->num;
+    ss->entries[e].key = *key;
+    ss->entries[e].count = w;
+    ss->entries[e].err = 0;
+    ss->entries[e].heap_pos = ss->num;
+    ss->heap[ss->num++] = e;
+    ss->index[i] = (int32_t)e;
+    nfm_ss_sift_up(ss, ss->num-1);
+    return;
+  }
+  // Replace the smallest counter: the newcomer inherits its count as error
+  e = ss->heap[0];
+  nfm_ss_index_remove(ss, &ss->entries[e].key);
+  ss->entries[e].key = *key;
+  ss->entries[e].err = ss->entries[e].count;
+  ss->entries[e].count += w;
+  i = nfm_ss_slot(key);
+  while (ss->index[i] >= 0)
+    i = (i+1) & mask;
+  ss->index[i] = (int32_t)e;
+  nfm_ss_sift_down(ss, 0);
+}
+
+static inline void nfm_hll_add(uint8_t* regs, uint64_t h)
+{
+  uint32_t r = (uint32_t)(h >> (64-NFM_HLL_BITS));
+  uint64_t rest = (h << NFM_HLL_BITS) | (1ULL << (NFM_HLL_BITS-1));
+  uint8_t rank = (uint8_t)(__builtin_clzll(rest) + 1);
+  if (rank > regs[r])
+    regs[r] = rank;
+}
+
+static inline double nfm_hll_count(const uint8_t* regs)
+{
+  double m = NFM_HLL_REGS, sum = 0.0, est;
+  unsigned int i, zeros = 0;
+  for (i = 0; i < NFM_HLL_REGS; i++) {
+    sum += ldexp(1.0, -regs[i]);
+    if (regs[i] == 0)
+      zeros++;
+  }
+  est = (0.7213/(1.0 + 1.079/m))*m*m/sum;
+  // Linear counting while the registers are sparse
+  if (est <= 2.5*m && zeros)
+    est = m*log(m/zeros);
+  return est;
+}
+
+static inline void nfm_sketch_reset(nfm_sketch_t* sk)
+{
+  nfm_ss_reset(&sk->top_flows);
+  nfm_ss_reset(&sk->top_src);
+  nfm_ss_reset(&sk->top_dst);
+  memset(sk->as_slot, 0, sizeof(sk->as_slot));
+  memset(sk->as, 0, sizeof(sk->as));
+  sk->num_as = 0;
+  sk->flows = 0;
+  sk->bytes = 0;
+}
+
+// About 1MB: allocate with nfm_sketch_create
+static inline nfm_sketch_t* nfm_sketch_create(unsigned int interval_s, unsigned int top, FILE* out)
+{
+  nfm_sketch_t* sk;
+  struct timespec ts;
+  if (posix_memalign((void**)&sk, 64, sizeof(*sk)) != 0)
+    return NULL;
+  memset(sk, 0, sizeof(*sk));
+  sk->interval_s = interval_s?interval_s:1;
+  sk->top = (top==0 || top>NFM_SKETCH_MAX_TOP)?NFM_SKETCH_DEFAULT_TOP:top;
+  sk->out = out;
+  nfm_sketch_reset(sk);
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  sk->start_ns = (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+  return sk;
+}
+
+static inline void nfm_sketch_prefix(nfm_sketch_key_t* k, const nfm_flow_rec_t* rec, const uint8_t* addr)
+{
+  unsigned int len = rec->flow_type?NFM_SKETCH_V6_PREFIX:NFM_SKETCH_V4_PREFIX;
+  unsigned int i;
+  memset(k, 0, sizeof(*k));
+  k->flow_type = rec->flow_type;
+  k->prefix_len = (uint8_t)len;
+  k->addr_space_id = rec->addr_space_id;
+  for (i = 0; i < len/8; i++)
+    k->src[i] = addr[i];
+  if (len%8)
+    k->src[i] = addr[i] & (uint8_t)(0xff << (8-len%8));
+}
+
+static inline nfm_sketch_as_t* nfm_sketch_as(nfm_sketch_t* sk, uint16_t as_id)
+{
+  unsigned int slot = sk->as_slot[as_id];
+  if (!slot) {
+    if (sk->num_as < NFM_SKETCH_MAX_AS) {
+      sk->as[sk->num_as].addr_space_id = as_id;
+      slot = ++sk->num_as;
+    } else {
+      slot = NFM_SKETCH_MAX_AS;
+    }
+    sk->as_slot[as_id] = (uint8_t)slot;
+  }
+  return &sk->as[slot-1];
+}
+
+static inline void nfm_sketch_print_key(FILE* f, const nfm_sketch_key_t* k)
+{
+  char a[INET6_ADDRSTRLEN], b[INET6_ADDRSTRLEN];
+  int af = k->flow_type?AF_INET6:AF_INET;
+  inet_ntop(af, k->src, a, sizeof(a));
+  if (k->prefix_len) {
+    fprintf(f, "%s/%u as %u", a, k->prefix_len, k->addr_space_id);
+    return;
+  }
+  inet_ntop(af, k->dst, b, sizeof(b));
+  if (k->protocol == IPPROTO_TCP || k->protocol == IPPROTO_UDP)
+    fprintf(f, "%s:%u -> %s:%u proto %u as %u", a, ntohs(k->src_port), b, ntohs(k->dst_port), k->protocol, k->addr_space_id);
+  else
+    fprintf(f, "%s -> %s proto %u as %u", a, b, k->protocol, k->addr_space_id);
+}
+
+static int nfm_ss_cmp_desc(const void* a, const void* b)
+{
+  const nfm_ss_entry_t* x = *(const nfm_ss_entry_t* const*)a;
+  const nfm_ss_entry_t* y = *(const nfm_ss_entry_t* const*)b;
+  return (x->count < y->count) - (x->count > y->count);
+}
+
+static inline void nfm_ss_print(nfm_sketch_t* sk, const char* what, nfm_ss_t* ss)
+{
+  const nfm_ss_entry_t* sorted[NFM_SS_CAPACITY];
+  unsigned int i, n = (ss->num < sk->top)?ss->num:sk->top;
+  for (i = 0; i < ss->num; i++)
+    sorted[i] = &ss->entries[i];
+  qsort(sorted, ss->num, sizeof(sorted[0]), nfm_ss_cmp_desc);
+  fprintf(sk->out, "Top %u %s by bytes:\n", n, what);
+  for (i = 0; i < n; i++) {
+    fprintf(sk->out, "  %2u. ", i+1);
+    nfm_sketch_print_key(sk->out, &sorted[i]->key);
+    fprintf(sk->out, ": %llu bytes (%.1f%%, overestimate <= %llu)\n", (unsigned long long)sorted[i]->count,
+            ss->total?sorted[i]->count*100.0/ss->total:0.0, (unsigned long long)sorted[i]->err);
+  }
+}
+
+static inline void nfm_sketch_report_span(nfm_sketch_t* sk, double secs)
+{
+  unsigned int i;
+  fprintf(sk->out, "Flow sketch, last %gs: %llu flows, %llu bytes\n", secs,
+          (unsigned long long)sk->flows, (unsigned long long)sk->bytes);
+  if (sk->flows) {
+    nfm_ss_print(sk, "flows", &sk->top_flows);
+    nfm_ss_print(sk, "source prefixes", &sk->top_src);
+    nfm_ss_print(sk, "destination prefixes", &sk->top_dst);
+    fprintf(sk->out, "Distinct per address space (approx.):\n");
+    for (i = 0; i < sk->num_as; i++) {
+      const nfm_sketch_as_t* as = &sk->as[i];
+      if (i == NFM_SKETCH_MAX_AS-1 && sk->num_as == NFM_SKETCH_MAX_AS)
+        fprintf(sk->out, "  as %u and others:", as->addr_space_id);
+      else
+        fprintf(sk->out, "  as %u:", as->addr_space_id);
+      fprintf(sk->out, " %llu flows, %.0f sources, %.0f destinations, %.0f destination ports\n",
+              (unsigned long long)as->flows, nfm_hll_count(as->src), nfm_hll_count(as->dst), nfm_hll_count(as->port));
+    }
+  }
+  fflush(sk->out);
+}
+
+static inline void nfm_sketch_report(nfm_sketch_t* sk)
+{
+  nfm_sketch_report_span(sk, sk->interval_s);
+}
+
+// At exit: report the interval cut short, if anything was counted in it
+static inline void nfm_sketch_flush(nfm_sketch_t* sk)
+{
+  struct timespec ts;
+  uint64_t now;
+  if (!sk->flows)
+    return;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  now = (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+  nfm_sketch_report_span(sk, (double)((now - sk->start_ns)/100000000ULL)/10);
+  nfm_sketch_reset(sk);
+  sk->start_ns = now;
+}
+
+// Report and start a new interval if the current one is over
+static inline void nfm_sketch_tick(nfm_sketch_t* sk)
+{
+  struct timespec ts;
+  uint64_t now;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  now = (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+  if (now - sk->start_ns >= sk->interval_s*1000000000ULL) {
+    nfm_sketch_report(sk);
+    nfm_sketch_reset(sk);
+    sk->start_ns = now;
+  }
+}
+
+// Flow table consumer
+static void nfm_sketch_record(const nfm_flow_rec_t* rec, void* ctx)
+{
+  nfm_sketch_t* sk = (nfm_sketch_t*)ctx;
+  nfm_sketch_key_t k;
+  nfm_sketch_as_t* as;
+  unsigned int alen = rec->flow_type?16:4;
+  uint64_t bytes = rec->bytes[0] + rec->bytes[1];
+  uint16_t port[2];
+
+  sk->flows++;
+  sk->bytes += bytes;
+
+  memset(&k, 0, sizeof(k));
+  k.flow_type = rec->flow_type;
+  k.protocol = rec->protocol;
+  k.addr_space_id = rec->addr_space_id;
+  k.src_port = rec->src_port;
+  k.dst_port = rec->dst_port;
+  memcpy(k.src, rec->src, alen);
+  memcpy(k.dst, rec->dst, alen);
+  nfm_ss_update(&sk->top_flows, &k, bytes);
+  nfm_sketch_prefix(&k, rec, rec->src);
+  nfm_ss_update(&sk->top_src, &k, bytes);
+  nfm_sketch_prefix(&k, rec, rec->dst);
+  nfm_ss_update(&sk->top_dst, &k, bytes);
+
+  as = nfm_sketch_as(sk, rec->addr_space_id);
+  as->flows++;
+  nfm_hll_add(as->src, nfm_sketch_hash(rec->src, alen, 1));
+  nfm_hll_add(as->dst, nfm_sketch_hash(rec->dst, alen, 2));
+  port[0] = rec->protocol;
+  port[1] = rec->dst_port;
+  nfm_hll_add(as->port, nfm_sketch_hash(port, sizeof(port), 3));
+
+  if ((++sk->check & 1023) == 0)
+    nfm_sketch_tick(sk);
+}
+
+// Flow table idle hook
+static void nfm_sketch_idle(void* ctx)
+{
+  nfm_sketch_tick((nfm_sketch_t*)ctx);
+}
+
+#endif
@@ -0,0 +1,247 @@
+/**
+ * Copyright (C) 2013 Netronome Systems, Inc.  All rights reserved.
+ *
+ * File:        nfm_sample_stats.h
+ * Description: Live packet/byte statistics for the packet samples.
+ *              Receive threads only add to their own cache-line padded
+ *              counters. A reporter thread samples them once a second
+ *              against CLOCK_MONOTONIC and derives 1s/10s/60s pps and Mbps.
+ */
+
+#ifndef NFM_SAMPLE_STATS_H
+#define NFM_SAMPLE_STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ns_log.h"
+
+#define NFM_STATS_CACHE_LINE  64
+#define NFM_STATS_MAX_THREADS 32
+// One sample per second; enough history for the 60s window
+#define NFM_STATS_HISTORY     61
+// Reporter wakes this often to answer SIGUSR1 promptly
+#define NFM_STATS_POLL_MS     100
+
+typedef struct {
+  uint64_t pkts;
+  uint64_t bytes;
+} __attribute__((aligned(NFM_STATS_CACHE_LINE))) nfm_stats_counter_t;
+
+typedef struct {
+  uint64_t ns;
+  uint64_t pkts;
+  uint64_t bytes;
+} nfm_stats_sample_t;
+
+// Called from the reporter thread every interval_s seconds
+typedef void (*nfm_stats_interval_fn)(void* ctx);
+// Called from the reporter thread after the SIGUSR1 totals line
+typedef void (*nfm_stats_report_fn)(FILE* f, void* ctx);
+// Called from the reporter thread after every once a second sample
+typedef void (*nfm_stats_sample_fn)(void* ctx);
+
+typedef struct {
+  nfm_stats_counter_t counters[NFM_STATS_MAX_THREADS];
+  unsigned int num_counters;
+  unsigned long long print_packets;  // EXTRA log when the total crosses a multiple of this
+  pid_t pid;
+  pthread_t thread;
+  volatile int running;
+  volatile sig_atomic_t report_requested;
+  // Reporter thread only
+  nfm_stats_sample_t history[NFM_STATS_HISTORY];
+  unsigned int num_samples;
+  unsigned int head;
+  unsigned long long last_print;
+  nfm_stats_interval_fn interval_fn;
+  void* interval_ctx;
+  unsigned int interval_s;
+  unsigned int interval_ticks;
+  nfm_stats_report_fn report_fn;
+  void* report_ctx;
+  nfm_stats_sample_fn sample_fn;
+  void* sample_ctx;
+} nfm_stats_t;
+
+static inline uint64_t nfm_stats_now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+// Only the owning thread writes a counter; the relaxed stores keep the
+// reporter's reads untorn without a locked instruction
+static inline void nfm_stats_add(nfm_stats_counter_t* c, uint64_t pkts, uint64_t bytes)
+{
+  __atomic_store_n(&c->pkts, c->pkts+pkts, __ATOMIC_RELAXED);
+  __atomic_store_n(&c->bytes, c->bytes+bytes, __ATOMIC_RELAXED);
+}
+
+// Async-signal-safe: call from the SIGUSR1 handler
+static inline void nfm_stats_request_report(nfm_stats_t* st)
+{
+  st->report_requested = 1;
+}
+
+static inline void nfm_stats_init(nfm_stats_t* st, unsigned int num_counters, unsigned long long print_packets)
+{
+  memset(st, 0, sizeof(*st));
+  st->num_counters = (num_counters>NFM_STATS_MAX_THREADS)?NFM_STATS_MAX_THREADS:num_counters;
+  st->print_packets = print_packets;
+  st->pid = getpid();
+}
+
+// Register a per-interval report; call before nfm_stats_start
+static inline void nfm_stats_set_interval_fn(nfm_stats_t* st, unsigned int interval_s, nfm_stats_interval_fn fn, void* ctx)
+{
+  st->interval_s = interval_s?interval_s:1;
+  st->interval_fn = fn;
+  st->interval_ctx = ctx;
+}
+
+// Register extra SIGUSR1 output; call before nfm_stats_start
+static inline void nfm_stats_set_report_fn(nfm_stats_t* st, nfm_stats_report_fn fn, void* ctx)
+{
+  st->report_fn = fn;
+  st->report_ctx = ctx;
+}
+
+// Register a once a second hook; call before nfm_stats_start
+static inline void nfm_stats_set_sample_fn(nfm_stats_t* st, nfm_stats_sample_fn fn, void* ctx)
+{
+  st->sample_fn = fn;
+  st->sample_ctx = ctx;
+}
+
+static inline void nfm_stats_total(nfm_stats_t* st, uint64_t* pkts, uint64_t* bytes)
+{
+  unsigned int i;
+  *pkts = 0;
+  *bytes = 0;
+  for (i = 0; i < st->num_counters; i++) {
+    *pkts += __atomic_load_n(&st->counters[i].pkts, __ATOMIC_RELAXED);
+    *bytes += __atomic_load_n(&st->counters[i].bytes, __ATOMIC_RELAXED);
+  }
+}
+
+static inline void nfm_stats_sample(nfm_stats_t* st)
+{
+  nfm_stats_sample_t* s;
+  st->head = (st->head+1)%NFM_STATS_HISTORY;
+  s = &st->history[st->head];
+  s->ns = nfm_stats_now_ns();
+  nfm_stats_total(st, &s->pkts, &s->bytes);
+  if (st->num_samples < NFM_STATS_HISTORY)
+    st->num_samples++;
+}
+
+// Rate over the last 'window' seconds (or less while history is filling up)
+static inline void nfm_stats_rate(nfm_stats_t* st, unsigned int window, double* pps, double* mbps)
+{
+  const nfm_stats_sample_t *now, *then;
+  double secs;
+  *pps = 0.0;
+  *mbps = 0.0;
+  if (st->num_samples < 2)
+    return;
+  if (window > st->num_samples-1)
+    window = st->num_samples-1;
+  now = &st->history[st->head];
+  then = &st->history[(st->head+NFM_STATS_HISTORY-window)%NFM_STATS_HISTORY];
+  secs = (now->ns-then->ns)/1e9;
+  if (secs <= 0.0)
+    return;
+  *pps = (now->pkts-then->pkts)/secs;
+  *mbps = (now->bytes-then->bytes)*8.0/(secs*1e6);
+}
+
+// Totals as of now; the history only gives the rates
+static inline void nfm_stats_report(nfm_stats_t* st, FILE* f)
+{
+  uint64_t pkts, bytes;
+  double pps1, mbps1, pps10, mbps10, pps60, mbps60;
+  nfm_stats_total(st, &pkts, &bytes);
+  nfm_stats_rate(st, 1, &pps1, &mbps1);
+  nfm_stats_rate(st, 10, &pps10, &mbps10);
+  nfm_stats_rate(st, 60, &pps60, &mbps60);
+  fprintf(f, "%8d  %16llu  %16llu  1s %.0f pps %.3f Mbps  10s %.0f pps %.3f Mbps  60s %.0f pps %.3f Mbps\n",
+          st->pid, (unsigned long long)pkts, (unsigned long long)bytes,
+          pps1, mbps1, pps10, mbps10, pps60, mbps60);
+  if (st->report_fn)
+    st->report_fn(f, st->report_ctx);
+  fflush(f);
+}
+
+static void* nfm_stats_reporter(void* arg)
+{
+  nfm_stats_t* st = (nfm_stats_t*)arg;
+  struct timespec next;
+  unsigned int ticks = 0;
+  sigset_t sigs;
+
+  // Leave signal delivery to the application threads
+  sigfillset(&sigs);
+  pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+  nfm_stats_sample(st);
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  while (st->running) {
+    next.tv_nsec += NFM_STATS_POLL_MS*1000000L;
+    if (next.tv_nsec >= 1000000000L) {
+      next.tv_nsec -= 1000000000L;
+      next.tv_sec++;
+    }
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+    if (++ticks*NFM_STATS_POLL_MS >= 1000) {
+      const nfm_stats_sample_t* s;
+      ticks = 0;
+      nfm_stats_sample(st);
+      s = &st->history[st->head];
+      if (st->print_packets && s->pkts/st->print_packets != st->last_print/st->print_packets) {
+        double pps, mbps;
+        nfm_stats_rate(st, 1, &pps, &mbps);
+        NS_LOG_EXTRA("numpkts %llu numbytes %llu Mbps %f pps %.0f", (unsigned long long)s->pkts, (unsigned long long)s->bytes, mbps, pps);
+        st->last_print = s->pkts;
+      }
+      if (st->sample_fn)
+        st->sample_fn(st->sample_ctx);
+      if (st->interval_fn && ++st->interval_ticks >= st->interval_s) {
+        st->interval_ticks = 0;
+        st->interval_fn(st->interval_ctx);
+      }
+    }
+    if (st->report_requested) {
+      st->report_requested = 0;
+      nfm_stats_report(st, stdout);
+    }
+  }
+  return NULL;
+}
+
+static inline int nfm_stats_start(nfm_stats_t* st)
+{
+  st->running = 1;
+  if (pthread_create(&st->thread, NULL, nfm_stats_reporter, st) != 0) {
+    st->running = 0;
+    return -1;
+  }
+  return 0;
+}
+
+static inline void nfm_stats_stop(nfm_stats_t* st)
+{
+  if (st->running) {
+    st->running = 0;
+    pthread_join(st->thread, NULL);
+  }
+}
+
+#endif
@@ -0,0 +1,465 @@
+/**
+ * Copyright (C) 2013 Netronome Systems, Inc.  All rights reserved.
+ *
+ * File:        nfm_sample_swio.c
+ * Description: Software stand-in for the packet API, built as
+ *              libnfm_swio.so. It lets the packet samples run and be
+ *              benchmarked on a host without an NFE: received packets come
+ *              from a pcap file or a synthetic generator, and transmitted
+ *              packets are counted and discarded.
+ *
+ *              The library only overrides the ns_packet_* calls. Logging
+ *              and error strings still come from the installed libnfm, so
+ *              the SDK has to be installed but no NFE is needed. Either
+ *              build the samples with 'make SWIO=y', which links this
+ *              library ahead of libnfm, or run an existing binary with
+ *              LD_PRELOAD=./libnfm_swio.so.
+ *
+ *              Configured through the environment:
+ *              NFM_SWIO_PCAP=file    replay packets from a classic pcap file (us or ns);
+ *                                    pcapng is not read: the generator runs instead
+ *              NFM_SWIO_LOOPS=n      pcap passes per device, 0 = forever (default 1)
+ *              NFM_SWIO_GEN=size[:flows]  synthetic IPv4/UDP frames (default 64:1024)
+ *              NFM_SWIO_COUNT=n      synthetic packets per device (default 10000000)
+ *              NFM_SWIO_LIFS=n       spread flows over n ingress lifs (default 1)
+ *              NFM_SWIO_EXIT=0       keep running once every device ran out of packets
+ *                                    (default: send SIGINT to the process)
+ *
+ *              Each device handle keeps its own buffer pool, so a handle must
+ *              only be used from one thread, as the samples do.
+ */
+
+#include "ns_packet.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+
+#define SWIO_MAX_FRAME   16384
+#define SWIO_POOL_SIZE   1024   // buffers preallocated per device
+
+// Hidden in front of every packet_data handed out by this library
+typedef struct swio_buf_s {
+  struct swio_buf_s* next;
+  struct swio_dev_s* dev;
+  uint32_t ingress_lif;
+  uint32_t egress_lif;
+  uint32_t egress_port;
+  uint32_t pad;
+} swio_buf_t;
+
+#define SWIO_BUF_DATA(b)  ((unsigned char*)((b)+1))
+#define SWIO_DATA_BUF(d)  (((swio_buf_t*)(d))-1)
+
+typedef struct swio_dev_s {
+  unsigned int id;
+  swio_buf_t* free_list;
+  // pcap source position
+  unsigned int rec;
+  unsigned int loop;
+  // synthetic source position
+  uint64_t seq;
+  int exhausted;
+  struct ns_packet_counters_t counters;
+  uint64_t rx_bytes;
+  uint64_t tx_bytes;
+  uint64_t first_rx_ns;
+  uint64_t last_rx_ns;
+} swio_dev_t;
+
+typedef struct {
+  uint32_t offset;
+  uint32_t len;
+} swio_rec_t;
+
+// Shared, read-only after swio_setup()
+static pthread_once_t swio_once = PTHREAD_ONCE_INIT;
+static unsigned char* swio_file = NULL;
+static swio_rec_t* swio_recs = NULL;
+static unsigned int swio_num_recs = 0;
+static unsigned int swio_loops = 1;
+static unsigned int swio_gen_size = 64;
+static unsigned int swio_gen_flows = 1024;
+static uint64_t swio_gen_count = 10000000ULL;
+static unsigned int swio_lifs = 1;
+static int swio_exit = 1;
+static unsigned char swio_template[SWIO_MAX_FRAME];
+static int swio_active = 0;
+
+static uint64_t swio_now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static uint32_t swio_swap32(uint32_t v, int swap)
+{
+  return swap ? __builtin_bswap32(v) : v;
+}
+
+static int swio_load_pcap(const char* name)
+{
+  FILE* f = fopen(name, "rb");
+  long size;
+  uint32_t magic;
+  int swap;
+  size_t pos;
+  unsigned int max_recs = 0;
+
+  if (!f) {
+    fprintf(stderr, "nfm_swio: cannot open %s\n", name);
+    return -1;
+  }
+  fseek(f, 0, SEEK_END);
+  size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  swio_file = malloc(size > 0 ? size : 1);
+  if (!swio_file || size < 24 || fread(swio_file, size, 1, f) != 1) {
+    fprintf(stderr, "nfm_swio: cannot read %s\n", name);
+    fclose(f);
+    free(swio_file);
+    swio_file = NULL;
+    return -1;
+  }
+  fclose(f);
+
+  memcpy(&magic, swio_file, 4);
+  if (magic == 0xa1b2c3d4 || magic == 0xa1b23c4d) {
+    swap = 0;
+  } else if (magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1) {
+    swap = 1;
+  } else {
+    fprintf(stderr, "nfm_swio: %s is not a classic pcap file (pcapng is not supported)\n", name);
+    free(swio_file);
+    swio_file = NULL;
+    return -1;
+  }
+
+  pos = 24;
+  while (pos + 16 <= (size_t)size) {
+    uint32_t caplen;
+    memcpy(&caplen, swio_file+pos+8, 4);
+    caplen = swio_swap32(caplen, swap);
+    if (pos + 16 + caplen > (size_t)size)
+      break;
+    if (swio_num_recs == max_recs) {
+      max_recs = max_recs ? max_recs*2 : 65536;
+      swio_recs = realloc(swio_recs, max_recs*sizeof(swio_rec_t));
+    }
+    swio_recs[swio_num_recs].offset = pos+16;
+    swio_recs[swio_num_recs].len = (caplen > SWIO_MAX_FRAME) ? SWIO_MAX_FRAME : caplen;
+    swio_num_recs++;
+    pos += 16 + caplen;
+  }
+  fprintf(stderr, "nfm_swio: loaded %u packets from %s\n", swio_num_recs, name);
+  if (!swio_num_recs) {
+    free(swio_file);
+    swio_file = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+static uint16_t swio_ip_csum(const unsigned char* p, unsigned int len)
+{
+  uint32_t sum = 0;
+  unsigned int i;
+  for (i = 0; i < len; i += 2)
+    sum += (p[i]<<8) | p[i+1];
+  while (sum>>16)
+    sum = (sum&0xffff) + (sum>>16);
+  return (uint16_t)~sum;
+}
+
+// Ethernet/IPv4/UDP frame; per packet only the addresses, ports and IP
+// checksum are patched in swio_generate()
+static void swio_build_template(void)
+{
+  unsigned char* p = swio_template;
+  unsigned int ip_len = swio_gen_size - 14;
+  memset(p, 0, sizeof(swio_template));
+  memcpy(p, "\x00\x15\x4d\x00\x00\x01", 6);
+  memcpy(p+6, "\x00\x15\x4d\x00\x00\x02", 6);
+  p[12] = 0x08;
+  p[13] = 0x00;
+  p += 14;
+  p[0] = 0x45;
+  p[2] = ip_len>>8;
+  p[3] = ip_len&0xff;
+  p[8] = 64;
+  p[9] = IPPROTO_UDP;
+  p += 20;
+  p[4] = (ip_len-20)>>8;
+  p[5] = (ip_len-20)&0xff;
+}
+
+static void swio_generate(swio_dev_t* d, unsigned char* data, uint32_t* flow)
+{
+  unsigned char* ip = data+14;
+  unsigned char* udp = ip+20;
+  uint32_t f = (uint32_t)((d->seq*2654435761ULL) % swio_gen_flows);
+  uint32_t src = htonl(0x0a000000 | (d->id<<16) | (f&0xffff));
+  uint32_t dst = htonl(0x0a800000 | ((f>>16)&0xff));
+  uint16_t sport = htons(1024 + (f&0x7fff));
+  uint16_t dport = htons(53);
+
+  memcpy(data, swio_template, swio_gen_size);
+  memcpy(ip+12, &src, 4);
+  memcpy(ip+16, &dst, 4);
+  memcpy(udp, &sport, 2);
+  memcpy(udp+2, &dport, 2);
+  ip[10] = ip[11] = 0;
+  {
+    uint16_t c = swio_ip_csum(ip, 20);
+    ip[10] = c>>8;
+    ip[11] = c&0xff;
+  }
+  *flow = f;
+}
+
+static void swio_setup(void)
+{
+  const char* v;
+  if ((v = getenv("NFM_SWIO_LOOPS")))
+    swio_loops = (unsigned int)strtoul(v, 0, 0);
+  if ((v = getenv("NFM_SWIO_COUNT")))
+    swio_gen_count = strtoull(v, 0, 0);
+  if ((v = getenv("NFM_SWIO_LIFS")) && strtoul(v, 0, 0) > 0)
+    swio_lifs = (unsigned int)strtoul(v, 0, 0);
+  if ((v = getenv("NFM_SWIO_EXIT")))
+    swio_exit = (int)strtoul(v, 0, 0);
+  if ((v = getenv("NFM_SWIO_GEN"))) {
+    char* end;
+    swio_gen_size = (unsigned int)strtoul(v, &end, 0);
+    if (*end == ':')
+      swio_gen_flows = (unsigned int)strtoul(end+1, 0, 0);
+  }
+  if (swio_gen_size < 60)
+    swio_gen_size = 60;
+  if (swio_gen_size > SWIO_MAX_FRAME)
+    swio_gen_size = SWIO_MAX_FRAME;
+  if (swio_gen_flows == 0)
+    swio_gen_flows = 1;
+  if ((v = getenv("NFM_SWIO_PCAP")) && swio_load_pcap(v) != 0) {
+    fprintf(stderr, "nfm_swio: falling back to the synthetic generator\n");
+    swio_num_recs = 0;
+  }
+  if (!swio_num_recs) {
+    swio_build_template();
+    fprintf(stderr, "nfm_swio: generating %llu packets of %u bytes over %u flows per device\n",
+            (unsigned long long)swio_gen_count, swio_gen_size, swio_gen_flows);
+  }
+}
+
+static swio_buf_t* swio_alloc(swio_dev_t* d)
+{
+  swio_buf_t* b = d->free_list;
+  if (b) {
+    d->free_list = b->next;
+  } else {
+    b = malloc(sizeof(swio_buf_t) + SWIO_MAX_FRAME);
+    if (!b)
+      return NULL;
+    d->counters.alloc_syscall++;
+  }
+  memset(b, 0, sizeof(*b));
+  b->dev = d;
+  d->counters.alloc_count++;
+  return b;
+}
+
+static void swio_free(swio_buf_t* b)
+{
+  swio_dev_t* d = b->dev;
+  b->next = d->free_list;
+  d->free_list = b;
+  d->counters.free_count++;
+}
+
+static void swio_source_done(swio_dev_t* d)
+{
+  d->exhausted = 1;
+  if (__sync_sub_and_fetch(&swio_active, 1) == 0 && swio_exit) {
+    // Process directed, so it reaches whichever thread handles SIGINT
+    kill(getpid(), SIGINT);
+  }
+}
+
+static ns_nfm_ret_t swio_open(ns_packet_device_h* dev, unsigned int id)
+{
+  swio_dev_t* d;
+  unsigned int i;
+  pthread_once(&swio_once, swio_setup);
+  d = calloc(1, sizeof(*d));
+  if (!d)
+    return NS_NFM_FAIL;
+  d->id = id;
+  for (i = 0; i < SWIO_POOL_SIZE; i++) {
+    swio_buf_t* b = malloc(sizeof(swio_buf_t) + SWIO_MAX_FRAME);
+    if (!b)
+      break;
+    b->next = d->free_list;
+    d->free_list = b;
+  }
+  __sync_add_and_fetch(&swio_active, 1);
+  *dev = (ns_packet_device_h)d;
+  return NS_NFM_SUCCESS;
+}
+
+ns_nfm_ret_t ns_packet_open_device_ex(ns_packet_device_h* dev, unsigned int id, ns_packet_extra_options_t* opt __attribute__((unused)))
+{
+  return swio_open(dev, id);
+}
+
+ns_nfm_ret_t ns_packet_open_device(ns_packet_device_h* dev, unsigned int id)
+{
+  return swio_open(dev, id);
+}
+
+// The tuples of a multi device handle share one packet source
+ns_nfm_ret_t ns_packet_open_multi_device_ex(ns_packet_device_h* dev, unsigned int* ids, unsigned int num_ids __attribute__((unused)), ns_packet_extra_options_t* opt __attribute__((unused)))
+{
+  return swio_open(dev, ids[0]);
+}
+
+ns_nfm_ret_t ns_packet_close_device(ns_packet_device_h dev)
+{
+  swio_dev_t* d = (swio_dev_t*)dev;
+  double secs = (d->last_rx_ns - d->first_rx_ns)/1e9;
+  fprintf(stderr, "nfm_swio: device 0x%x: rx %llu pkts %llu bytes, tx %llu pkts %llu bytes, %.3fs, %.0f rx pps\n",
+          d->id, (unsigned long long)d->counters.recv_count, (unsigned long long)d->rx_bytes,
+          (unsigned long long)d->counters.send_count, (unsigned long long)d->tx_bytes,
+          secs, secs > 0 ? d->counters.recv_count/secs : 0.0);
+  if (!d->exhausted)
+    __sync_sub_and_fetch(&swio_active, 1);
+  while (d->free_list) {
+    swio_buf_t* b = d->free_list;
+    d->free_list = b->next;
+    free(b);
+  }
+  free(d);
+  return NS_NFM_SUCCESS;
+}
+
+ns_nfm_ret_t ns_packet_receive(ns_packet_device_h dev, ns_packet_t* pckt, unsigned int flags)
+{
+  swio_dev_t* d = (swio_dev_t*)dev;
+  swio_buf_t* b;
+  uint32_t flow = 0;
+  unsigned int len;
+  struct timeval now;
+
+  if (d->exhausted) {
+    d->counters.recv_no_msg++;
+    if (!(flags & NS_PACKET_RECEIVE_NONBLOCK)) {
+      // Nothing will ever arrive; don't let a blocking caller spin
+      struct timespec idle = { 0, 1000000L };
+      nanosleep(&idle, NULL);
+    }
+    return NS_NFM_RETRY_LATER;
+  }
+  if (!(b = swio_alloc(d)))
+    return NS_NFM_FAIL;
+
+  if (swio_num_recs) {
+    const swio_rec_t* r = &swio_recs[d->rec];
+    len = r->len;
+    memcpy(SWIO_BUF_DATA(b), swio_file+r->offset, len);
+    flow = d->rec;
+    if (++d->rec == swio_num_recs) {
+      d->rec = 0;
+      if (swio_loops && ++d->loop == swio_loops)
+        swio_source_done(d);
+    }
+  } else {
+    len = swio_gen_size;
+    swio_generate(d, SWIO_BUF_DATA(b), &flow);
+    if (++d->seq == swio_gen_count)
+      swio_source_done(d);
+  }
+
+  b->ingress_lif = flow % swio_lifs;
+  b->egress_lif = b->ingress_lif ^ 1;
+  gettimeofday(&now, NULL);
+  memset(pckt, 0, sizeof(*pckt));
+  pckt->packet_data = SWIO_BUF_DATA(b);
+  pckt->packet_length = len;
+  pckt->timestamp_s = now.tv_sec;
+  pckt->timestamp_us = now.tv_usec;
+
+  d->last_rx_ns = swio_now_ns();
+  if (d->counters.recv_count == 0)
+    d->first_rx_ns = d->last_rx_ns;
+  d->counters.recv_count++;
+  d->counters.recv_msg++;
+  d->rx_bytes += len;
+  return NS_NFM_SUCCESS;
+}
+
+ns_nfm_ret_t ns_packet_transmit(ns_packet_device_h dev, ns_packet_t* pckt, unsigned int flags __attribute__((unused)))
+{
+  swio_dev_t* d = (swio_dev_t*)dev;
+  if (!pckt->packet_data)
+    return NS_NFM_FAIL;
+  d->counters.send_count++;
+  d->tx_bytes += pckt->packet_length;
+  swio_free(SWIO_DATA_BUF(pckt->packet_data));
+  pckt->packet_data = NULL;
+  return NS_NFM_SUCCESS;
+}
+
+ns_nfm_ret_t ns_packet_create(ns_packet_device_h dev, unsigned int length, ns_packet_t* pckt)
+{
+  swio_dev_t* d = (swio_dev_t*)dev;
+  swio_buf_t* b;
+  if (length > SWIO_MAX_FRAME || !(b = swio_alloc(d)))
+    return NS_NFM_FAIL;
+  memset(pckt, 0, sizeof(*pckt));
+  pckt->packet_data = SWIO_BUF_DATA(b);
+  pckt->packet_length = length;
+  return NS_NFM_SUCCESS;
+}
+
+ns_nfm_ret_t ns_packet_destroy(ns_packet_t* pckt)
+{
+  if (!pckt->packet_data)
+    return NS_NFM_FAIL;
+  swio_free(SWIO_DATA_BUF(pckt->packet_data));
+  pckt->packet_data = NULL;
+  return NS_NFM_SUCCESS;
+}
+
+ns_nfm_ret_t ns_packet_enable_counters(ns_packet_device_h dev __attribute__((unused)))
+{
+  return NS_NFM_SUCCESS;
+}
+
+ns_nfm_ret_t ns_packet_get_counters(ns_packet_device_h dev, struct ns_packet_counters_t* c)
+{
+  *c = ((swio_dev_t*)dev)->counters;
+  return NS_NFM_SUCCESS;
+}
+
+ns_nfm_ret_t ns_packet_set_egress_port(ns_packet_t* pckt, unsigned int port)
+{
+  SWIO_DATA_BUF(pckt->packet_data)->egress_port = port;
+  return NS_NFM_SUCCESS;
+}
+
+uint32_t ns_packet_get_ingress_logical_interface_id(const ns_packet_t* pckt)
+{
+  return SWIO_DATA_BUF(pckt->packet_data)->ingress_lif;
+}
+
+uint32_t ns_packet_get_egress_logical_interface_id(const ns_packet_t* pckt)
+{
+  return SWIO_DATA_BUF(pckt->packet_data)->egress_lif;
+}
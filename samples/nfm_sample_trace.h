@@ -0,0 +1,215 @@
+/**
+ * Copyright (C) 2013 Netronome Systems, Inc.  All rights reserved.
+ *
+ * File:        nfm_sample_trace.h
+ * Description: Asynchronous packet tracing for the packet samples.
+ *              Receive threads copy a snapped header and the packet
+ *              metadata into their own single-producer/single-consumer
+ *              ring. A background thread formats the records (hex dump as
+ *              before) and writes them out. A full ring never blocks the
+ *              receive thread: the record is dropped and counted instead.
+ */
+
+#ifndef NFM_SAMPLE_TRACE_H
+#define NFM_SAMPLE_TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "ns_packet.h"
+
+#define NFM_TRACE_SNAP_MAX   128
+#define NFM_TRACE_RING_SIZE  4096  // records per ring, power of two
+#define NFM_TRACE_IDLE_US    1000  // consumer sleep when all rings are empty
+
+typedef struct {
+  unsigned long ts_s;
+  unsigned long ts_us;
+  uint32_t len;
+  uint32_t caplen;
+  int32_t ingress_lif;
+  int32_t egress_lif;
+  unsigned char data[NFM_TRACE_SNAP_MAX];
+} nfm_trace_rec_t;
+
+typedef struct {
+  // Producer side
+  volatile uint32_t head __attribute__((aligned(64)));
+  uint32_t skip;          // packets left until the next sampled one
+  uint64_t overflow;
+  // Consumer side
+  volatile uint32_t tail __attribute__((aligned(64)));
+  nfm_trace_rec_t recs[NFM_TRACE_RING_SIZE] __attribute__((aligned(64)));
+} nfm_trace_ring_t;
+
+typedef struct {
+  nfm_trace_ring_t* rings;
+  unsigned int num_rings;
+  unsigned int sample;    // trace 1 in 'sample' packets
+  unsigned int snap;      // bytes of packet data kept
+  FILE* out;
+  pthread_t thread;
+  volatile int running;
+} nfm_trace_t;
+
+static inline int nfm_trace_init(nfm_trace_t* t, unsigned int num_rings, unsigned int sample, unsigned int snap, FILE* out)
+{
+  memset(t, 0, sizeof(*t));
+  if (posix_memalign((void**)&t->rings, 64, num_rings*sizeof(nfm_trace_ring_t)) != 0)
+    return -1;
+  memset(t->rings, 0, num_rings*sizeof(nfm_trace_ring_t));
+  t->num_rings = num_rings;
+  t->sample = sample?sample:1;
+  t->snap = (snap==0 || snap>NFM_TRACE_SNAP_MAX)?NFM_TRACE_SNAP_MAX:snap;
+  t->out = out;
+  return 0;
+}
+
+// Producer: returns the record to fill, or NULL if this packet is not
+// sampled or the ring is full. A non-NULL record must be committed.
+static inline nfm_trace_rec_t* nfm_trace_reserve(nfm_trace_t* t, unsigned int ring)
+{
+  nfm_trace_ring_t* r = &t->rings[ring];
+  uint32_t head;
+  if (r->skip) {
+    r->skip--;
+    return NULL;
+  }
+  r->skip = t->sample-1;
+  head = r->head;
+  if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= NFM_TRACE_RING_SIZE) {
+    r->overflow++;
+    return NULL;
+  }
+  return &r->recs[head&(NFM_TRACE_RING_SIZE-1)];
+}
+
+static inline void nfm_trace_set_data(nfm_trace_t* t, nfm_trace_rec_t* rec, const unsigned char* data, unsigned int len)
+{
+  rec->len = len;
+  rec->caplen = (len<t->snap)?len:t->snap;
+  if (data)
+    memcpy(rec->data, data, rec->caplen);
+  else
+    rec->caplen = 0;
+}
+
+static inline void nfm_trace_commit(nfm_trace_t* t, unsigned int ring)
+{
+  nfm_trace_ring_t* r = &t->rings[ring];
+  __atomic_store_n(&r->head, r->head+1, __ATOMIC_RELEASE);
+}
+
+// Producer convenience: sample, snap and queue one received packet
+static inline void nfm_trace_packet(nfm_trace_t* t, unsigned int ring, ns_packet_t* pckt)
+{
+  nfm_trace_rec_t* rec = nfm_trace_reserve(t, ring);
+  if (rec) {
+    rec->ts_s = pckt->timestamp_s;
+    rec->ts_us = pckt->timestamp_us;
+    rec->ingress_lif = (int32_t)ns_packet_get_ingress_logical_interface_id(pckt);
+    rec->egress_lif = (int32_t)ns_packet_get_egress_logical_interface_id(pckt);
+    nfm_trace_set_data(t, rec, pckt->packet_data, pckt->packet_length);
+    nfm_trace_commit(t, ring);
+  }
+}
+
+static inline void nfm_trace_format(nfm_trace_t* t, unsigned int ring, const nfm_trace_rec_t* rec)
+{
+  // Same layout as the old synchronous dump(), one write per line
+  char line[16*3+2];
+  unsigned int i, n = 0;
+  fprintf(t->out, "[%u] %lu.%06lu Received packet with length %u from lif%d to lif%d\n",
+          ring, rec->ts_s, rec->ts_us, rec->len, rec->ingress_lif, rec->egress_lif);
+  for (i = 0; i < rec->caplen; i++) {
+    if (i%16 == 0) {
+      line[n++] = '\n';
+      line[n] = 0;
+      fputs(line, t->out);
+      n = 0;
+    } else if (i%2 == 0) {
+      line[n++] = ' ';
+    }
+    n += sprintf(line+n, "%02x", rec->data[i]);
+  }
+  line[n] = 0;
+  fputs(line, t->out);
+  fputs(rec->caplen<rec->len?" ...\n\n":"\n\n", t->out);
+}
+
+static inline unsigned int nfm_trace_drain(nfm_trace_t* t)
+{
+  unsigned int i, done = 0;
+  for (i = 0; i < t->num_rings; i++) {
+    nfm_trace_ring_t* r = &t->rings[i];
+    uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    uint32_t tail = r->tail;
+    while (tail != head) {
+      nfm_trace_format(t, i, &r->recs[tail&(NFM_TRACE_RING_SIZE-1)]);
+      tail++;
+      done++;
+    }
+    __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+  }
+  return done;
+}
+
+static void* nfm_trace_writer(void* arg)
+{
+  nfm_trace_t* t = (nfm_trace_t*)arg;
+  struct timespec idle = { 0, NFM_TRACE_IDLE_US*1000L };
+  sigset_t sigs;
+
+  sigfillset(&sigs);
+  pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+  while (t->running) {
+    if (nfm_trace_drain(t) == 0) {
+      fflush(t->out);
+      nanosleep(&idle, NULL);
+    }
+  }
+  nfm_trace_drain(t);
+  fflush(t->out);
+  return NULL;
+}
+
+static inline int nfm_trace_start(nfm_trace_t* t)
+{
+  t->running = 1;
+  if (pthread_create(&t->thread, NULL, nfm_trace_writer, t) != 0) {
+    t->running = 0;
+    return -1;
+  }
+  return 0;
+}
+
+static inline uint64_t nfm_trace_overflow(nfm_trace_t* t)
+{
+  uint64_t total = 0;
+  unsigned int i;
+  for (i = 0; i < t->num_rings; i++)
+    total += t->rings[i].overflow;
+  return total;
+}
+
+// Stop the writer once it has flushed what is queued, and release the rings
+static inline void nfm_trace_stop(nfm_trace_t* t)
+{
+  if (t->running) {
+    t->running = 0;
+    pthread_join(t->thread, NULL);
+  }
+  if (t->rings && nfm_trace_overflow(t)) {
+    fprintf(stderr, "Trace: %llu records dropped on ring overflow\n", (unsigned long long)nfm_trace_overflow(t));
+  }
+  free(t->rings);
+  t->rings = NULL;
+}
+
+#endif
@@ -0,0 +1,102 @@
+/**
+ * Copyright (C) 2013 Netronome Systems, Inc.  All rights reserved.
+ *
+ * File:        nfm_sample_txring.h
+ * Description: Single producer, single consumer ring of transmit jobs, from
+ *              the thread that decides what goes out (and when) to the
+ *              worker that owns the device handle. Each side keeps a copy
+ *              of the other side's index and only reloads it when its copy
+ *              says the ring is full or empty, so the shared cache lines
+ *              move once per batch rather than once per packet.
+ */
+
+#ifndef NFM_SAMPLE_TXRING_H
+#define NFM_SAMPLE_TXRING_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+  const unsigned char* data;
+  uint64_t deadline;       // CLOCK_MONOTONIC ns, 0 if not paced
+  uint32_t len;
+  uint32_t port;
+} nfm_txring_job_t;
+
+typedef struct {
+  nfm_txring_job_t* jobs;
+  uint32_t mask;
+  volatile uint32_t head __attribute__((aligned(64)));  // jobs queued
+  uint32_t tail_seen;                                   // producer's copy of 'tail'
+  volatile uint32_t done;                               // no more jobs will come
+  volatile uint32_t tail __attribute__((aligned(64)));  // jobs taken
+  uint32_t head_seen;                                   // consumer's copy of 'head'
+} nfm_txring_t;
+
+// 'size' is rounded up to a power of two. Returns 0, or -1 without memory.
+static inline int nfm_txring_init(nfm_txring_t* r, uint32_t size)
+{
+  uint32_t n = 1;
+  while (n < size)
+    n <<= 1;
+  memset(r, 0, sizeof(*r));
+  if (posix_memalign((void**)&r->jobs, 64, n*sizeof(nfm_txring_job_t)) != 0)
+    return -1;
+  r->mask = n-1;
+  return 0;
+}
+
+static inline void nfm_txring_free(nfm_txring_t* r)
+{
+  free(r->jobs);
+  r->jobs = NULL;
+}
+
+// Producer: returns 0 if the ring is full
+static inline int nfm_txring_push(nfm_txring_t* r, const nfm_txring_job_t* job)
+{
+  uint32_t head = r->head;
+  if (head - r->tail_seen > r->mask) {
+    r->tail_seen = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    if (head - r->tail_seen > r->mask)
+      return 0;
+  }
+  r->jobs[head & r->mask] = *job;
+  __atomic_store_n(&r->head, head+1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+// Producer: after the last push
+static inline void nfm_txring_finish(nfm_txring_t* r)
+{
+  __atomic_store_n(&r->done, 1, __ATOMIC_RELEASE);
+}
+
+// Consumer: the number of jobs queued, from nfm_txring_job(r, 0) on
+static inline uint32_t nfm_txring_peek(nfm_txring_t* r)
+{
+  uint32_t tail = r->tail;
+  if (r->head_seen == tail)
+    r->head_seen = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+  return r->head_seen - tail;
+}
+
+static inline const nfm_txring_job_t* nfm_txring_job(const nfm_txring_t* r, uint32_t i)
+{
+  return &r->jobs[(r->tail + i) & r->mask];
+}
+
+// Consumer: hand the first 'n' queued jobs' slots back
+static inline void nfm_txring_release(nfm_txring_t* r, uint32_t n)
+{
+  __atomic_store_n(&r->tail, r->tail+n, __ATOMIC_RELEASE);
+}
+
+// Consumer: nothing is queued and nothing more will be
+static inline int nfm_txring_drained(nfm_txring_t* r)
+{
+  return __atomic_load_n(&r->done, __ATOMIC_ACQUIRE) && nfm_txring_peek(r) == 0;
+}
+
+#endif